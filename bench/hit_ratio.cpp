@@ -0,0 +1,283 @@
+// Hit-ratio comparison of the eviction policies on replayed traces. Every
+// request is a GET; a miss is followed by a SET of the key, as a cache-aside
+// client would do after fetching it from the backend. Reports the hit ratio
+// per trace, cache size and policy, as a table or (--json) one JSON
+// document.
+//
+// Built-in traces:
+//   zipf  Zipfian requests over --keys keys (--zipf-theta)
+//   scan  the same Zipfian stream, interrupted every --scan-every requests
+//         by a sequential scan of --scan-length keys never requested before
+// --trace FILE replays a recorded trace instead: one key per line.
+#include "cache.h"
+#include "zipf.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        size_t keys = 100000;
+        size_t requests = 1000000;
+        double zipf_theta = 0.99;
+        size_t scan_every = 50000;
+        size_t scan_length = 0; // default: keys / 10
+        std::vector<size_t> sizes;
+        std::vector<EvictionPolicy> policies;
+        std::string trace_file;
+        bool json = false;
+    };
+
+    struct Trace
+    {
+        std::string name;
+        std::vector<std::string> keys; // distinct keys
+        std::vector<uint32_t> requests; // indexes into keys
+    };
+
+    struct Result
+    {
+        std::string trace;
+        size_t size;
+        EvictionPolicy policy;
+        double hit_ratio;
+    };
+
+    std::string keyName(size_t i)
+    {
+        return "key:" + std::to_string(i);
+    }
+
+    Trace zipfTrace(const Options &opt, bool scans)
+    {
+        Trace t;
+        t.name = scans ? "scan" : "zipf";
+        t.keys.reserve(opt.keys);
+        for (size_t i = 0; i < opt.keys; ++i)
+            t.keys.push_back(keyName(i));
+
+        // Ranks are spread over the key space so that hot keys are not
+        // neighbours in insertion order.
+        std::vector<uint32_t> rank_to_key(opt.keys);
+        for (size_t i = 0; i < opt.keys; ++i)
+            rank_to_key[i] = static_cast<uint32_t>(i);
+        std::mt19937_64 rng(42);
+        std::shuffle(rank_to_key.begin(), rank_to_key.end(), rng);
+
+        ZipfGenerator zipf(opt.keys, opt.zipf_theta);
+        size_t scan_length = opt.scan_length ? opt.scan_length : std::max<size_t>(1, opt.keys / 10);
+        t.requests.reserve(opt.requests);
+        for (size_t i = 0; t.requests.size() < opt.requests; ++i)
+        {
+            if (scans && i > 0 && i % opt.scan_every == 0)
+            {
+                for (size_t j = 0; j < scan_length && t.requests.size() < opt.requests; ++j)
+                {
+                    t.requests.push_back(static_cast<uint32_t>(t.keys.size()));
+                    t.keys.push_back("scan:" + std::to_string(t.keys.size()));
+                }
+            }
+            if (t.requests.size() < opt.requests)
+                t.requests.push_back(rank_to_key[zipf(rng)]);
+        }
+        return t;
+    }
+
+    bool fileTrace(const std::string &path, Trace &t)
+    {
+        std::ifstream in(path);
+        if (!in)
+            return false;
+        t.name = path;
+        std::string line;
+        std::vector<std::string> lines;
+        while (std::getline(in, line))
+        {
+            if (!line.empty())
+                lines.push_back(line);
+        }
+        // Map each distinct key to an index.
+        std::vector<uint32_t> order(lines.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = static_cast<uint32_t>(i);
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+                  { return lines[a] < lines[b]; });
+        t.requests.resize(lines.size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            if (i == 0 || lines[order[i]] != lines[order[i - 1]])
+                t.keys.push_back(lines[order[i]]);
+            t.requests[order[i]] = static_cast<uint32_t>(t.keys.size() - 1);
+        }
+        return true;
+    }
+
+    double replay(const Trace &t, size_t size, EvictionPolicy policy)
+    {
+        LRUCache cache(size, "", "", "1234567890123456", 0, policy);
+        std::string value;
+        size_t hits = 0;
+        for (uint32_t k : t.requests)
+        {
+            const std::string &key = t.keys[k];
+            if (cache.get(key, value))
+                ++hits;
+            else
+                cache.set(key, "v");
+        }
+        return t.requests.empty() ? 0.0 : static_cast<double>(hits) / t.requests.size();
+    }
+
+    bool parseList(const char *s, std::vector<size_t> &out)
+    {
+        out.clear();
+        for (const char *p = s; *p;)
+        {
+            char *end;
+            unsigned long long v = std::strtoull(p, &end, 10);
+            if (end == p || v == 0)
+                return false;
+            out.push_back(v);
+            p = *end == ',' ? end + 1 : end;
+            if (*end && *end != ',')
+                return false;
+        }
+        return !out.empty();
+    }
+
+    bool parsePolicies(const char *s, std::vector<EvictionPolicy> &out)
+    {
+        out.clear();
+        std::string list(s);
+        size_t start = 0;
+        while (start <= list.size())
+        {
+            size_t comma = list.find(',', start);
+            if (comma == std::string::npos)
+                comma = list.size();
+            EvictionPolicy policy;
+            if (!parseEvictionPolicy(list.substr(start, comma - start), policy))
+                return false;
+            out.push_back(policy);
+            start = comma + 1;
+        }
+        return !out.empty();
+    }
+
+    void usage(const char *prog)
+    {
+        std::fprintf(stderr,
+                     "usage: %s [--keys N] [--requests N] [--zipf-theta F] [--scan-every N] [--scan-length N]\n"
+                     "          [--sizes N,N,...] [--policies lru,w-tinylfu,...] [--trace FILE] [--json]\n",
+                     prog);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        auto next = [&]() -> const char *
+        {
+            if (i + 1 >= argc)
+            {
+                usage(argv[0]);
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+        bool ok = true;
+        if (std::strcmp(argv[i], "--keys") == 0)
+            opt.keys = std::max<size_t>(2, std::strtoull(next(), nullptr, 10));
+        else if (std::strcmp(argv[i], "--requests") == 0)
+            opt.requests = std::strtoull(next(), nullptr, 10);
+        else if (std::strcmp(argv[i], "--zipf-theta") == 0)
+            opt.zipf_theta = std::strtod(next(), nullptr);
+        else if (std::strcmp(argv[i], "--scan-every") == 0)
+            opt.scan_every = std::max<size_t>(1, std::strtoull(next(), nullptr, 10));
+        else if (std::strcmp(argv[i], "--scan-length") == 0)
+            opt.scan_length = std::strtoull(next(), nullptr, 10);
+        else if (std::strcmp(argv[i], "--sizes") == 0)
+            ok = parseList(next(), opt.sizes);
+        else if (std::strcmp(argv[i], "--policies") == 0)
+            ok = parsePolicies(next(), opt.policies);
+        else if (std::strcmp(argv[i], "--trace") == 0)
+            opt.trace_file = next();
+        else if (std::strcmp(argv[i], "--json") == 0)
+            opt.json = true;
+        else
+            ok = false;
+        if (!ok || opt.zipf_theta <= 0 || opt.zipf_theta >= 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.sizes.empty())
+    {
+        for (size_t percent : {1, 5, 10, 20})
+            opt.sizes.push_back(std::max<size_t>(1, opt.keys * percent / 100));
+    }
+    if (opt.policies.empty())
+        opt.policies = {EvictionPolicy::Lru, EvictionPolicy::SampledLru, EvictionPolicy::Clock,
+                        EvictionPolicy::Random, EvictionPolicy::TinyLfu};
+
+    std::vector<Trace> traces;
+    if (!opt.trace_file.empty())
+    {
+        traces.emplace_back();
+        if (!fileTrace(opt.trace_file, traces.back()))
+        {
+            std::perror(opt.trace_file.c_str());
+            return 1;
+        }
+    }
+    else
+    {
+        traces.push_back(zipfTrace(opt, false));
+        traces.push_back(zipfTrace(opt, true));
+    }
+
+    std::vector<Result> results;
+    if (!opt.json)
+        std::printf("%-12s %10s %-12s %10s\n", "trace", "size", "policy", "hit_ratio");
+    for (const Trace &t : traces)
+    {
+        for (size_t size : opt.sizes)
+        {
+            for (EvictionPolicy policy : opt.policies)
+            {
+                Result r{t.name, size, policy, replay(t, size, policy)};
+                results.push_back(r);
+                if (!opt.json)
+                {
+                    std::printf("%-12s %10zu %-12s %9.2f%%\n", r.trace.c_str(), r.size, evictionPolicyName(policy),
+                                r.hit_ratio * 100);
+                    std::fflush(stdout);
+                }
+            }
+        }
+    }
+
+    if (opt.json)
+    {
+        std::printf("{\"benchmark\":\"redis-lite-hitratio\",\"keys\":%zu,\"requests\":%zu,\"results\":[", opt.keys,
+                    opt.requests);
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const Result &r = results[i];
+            std::printf("%s{\"trace\":\"%s\",\"size\":%zu,\"policy\":\"%s\",\"hit_ratio\":%.6f}", i ? "," : "",
+                        r.trace.c_str(), r.size, evictionPolicyName(r.policy), r.hit_ratio);
+        }
+        std::printf("]}\n");
+    }
+    return 0;
+}
@@ -0,0 +1,258 @@
+// Persistence I/O: the std::ofstream/std::ifstream path the AOF and
+// snapshots used to take, against the IoEngine backends (blocking
+// pwrite/pread and io_uring), on the three patterns persistence has:
+//
+//   stream  a large file written front to back in record-sized appends
+//           (a snapshot or AOF rewrite), then fdatasynced
+//   commit  rounds of one batch write followed by an fdatasync (the AOF
+//           flusher under appendfsync always); io_uring submits both at
+//           once, the fsync linked behind the write
+//   replay  the file read back cold, record by record (startup): field by
+//           field from an ifstream, through AofReader's mapping, or in
+//           large chunks through the engine
+//
+// Files go to --dir (default /tmp), which should be on the disk to measure.
+#include "aof.h"
+#include "byteorder.h"
+#include "io_engine.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+namespace
+{
+    struct Options
+    {
+        std::string dir = "/tmp";
+        size_t bytes = 128 << 20;
+        size_t record_bytes = 128;
+        size_t rounds = 2000;
+        size_t batch_bytes = 4096;
+    };
+
+    double elapsedSec(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // One framed AOF record of `size` bytes in all.
+    std::string makeRecord(size_t size)
+    {
+        std::string record(std::max(size, AOF_FRAME_BYTES + 1), 'r');
+        for (size_t i = AOF_FRAME_BYTES; i < record.size(); ++i)
+            record[i] = static_cast<char>(i * 131);
+        sealAofFrame(record, 's');
+        return record;
+    }
+
+    // Drops the file's pages from the page cache, so it is read from disk.
+    void evict(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        ::fdatasync(fd);
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+
+    double streamOfstream(const Options &opt, const std::string &path, const std::string &record)
+    {
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out.write(aofHeader().data(), AOF_HEADER_BYTES);
+            for (size_t n = 0; n < opt.bytes; n += record.size())
+                out.write(record.data(), record.size());
+        }
+        // What a stream cannot do itself.
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        ::fdatasync(fd);
+        ::close(fd);
+        return elapsedSec(start);
+    }
+
+    double streamEngine(const Options &opt, const std::string &path, const std::string &record, IoEngine &io)
+    {
+        auto start = std::chrono::steady_clock::now();
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        IoWriter out(io, fd);
+        bool ok = out.append(aofHeader());
+        for (size_t n = 0; n < opt.bytes; n += record.size())
+            ok = out.append(record) && ok;
+        ok = out.finish(true) && ok;
+        ::close(fd);
+        if (!ok)
+            std::perror("stream write");
+        return elapsedSec(start);
+    }
+
+    // Seconds per commit round.
+    double commitSyscalls(const Options &opt, const std::string &path, const std::string &batch)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < opt.rounds; ++i)
+        {
+            if (::write(fd, batch.data(), batch.size()) != static_cast<ssize_t>(batch.size()))
+                std::perror("write");
+            ::fdatasync(fd);
+        }
+        double secs = elapsedSec(start);
+        ::close(fd);
+        return secs / opt.rounds;
+    }
+
+    double commitEngine(const Options &opt, const std::string &path, const std::string &batch, IoEngine &io)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < opt.rounds; ++i)
+        {
+            io.write(fd, batch.data(), batch.size(), IoEngine::APPEND);
+            io.sync(fd);
+            if (!io.waitAll())
+                std::perror("commit");
+        }
+        double secs = elapsedSec(start);
+        ::close(fd);
+        return secs / opt.rounds;
+    }
+
+    // The old loadAOF: a byte of op, four of length, then the payload.
+    double replayIfstream(const std::string &path, size_t &records)
+    {
+        evict(path);
+        auto start = std::chrono::steady_clock::now();
+        std::ifstream in(path, std::ios::binary);
+        char header[AOF_HEADER_BYTES];
+        in.read(header, sizeof(header));
+        std::string payload;
+        records = 0;
+        char op, crc[4], len[4];
+        while (in.read(&op, 1) && in.read(len, 4) && in.read(crc, 4))
+        {
+            uint32_t n = loadU32(len);
+            payload.resize(n);
+            if (!in.read(&payload[0], n))
+                break;
+            ++records;
+        }
+        return elapsedSec(start);
+    }
+
+    double replayMapped(const std::string &path, size_t &records)
+    {
+        evict(path);
+        auto start = std::chrono::steady_clock::now();
+        AofReader reader(path);
+        char op;
+        std::string_view payload;
+        records = 0;
+        while (reader.next(op, payload))
+            ++records;
+        return elapsedSec(start);
+    }
+
+    // Chunks of IoWriter::BUFFER_BYTES; frames are walked within each, a
+    // frame cut by the chunk's end carried over to the next.
+    double replayEngine(const std::string &path, IoEngine &io, size_t &records)
+    {
+        evict(path);
+        auto start = std::chrono::steady_clock::now();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        std::string buf(IoWriter::BUFFER_BYTES, '\0');
+        size_t have = 0, pos = AOF_HEADER_BYTES;
+        uint64_t offset = 0;
+        records = 0;
+        while (true)
+        {
+            ssize_t r = io.read(fd, &buf[have], buf.size() - have, offset);
+            if (r <= 0)
+                break;
+            offset += static_cast<uint64_t>(r);
+            have += static_cast<size_t>(r);
+            while (have - pos >= AOF_FRAME_BYTES)
+            {
+                uint32_t n = loadU32(&buf[pos + 1]);
+                if (have - pos - AOF_FRAME_BYTES < n)
+                    break;
+                pos += AOF_FRAME_BYTES + n;
+                ++records;
+            }
+            buf.erase(0, pos);
+            have -= pos;
+            pos = 0;
+            buf.resize(std::max(IoWriter::BUFFER_BYTES, have * 2));
+        }
+        ::close(fd);
+        return elapsedSec(start);
+    }
+
+    void usage(const char *prog)
+    {
+        std::fprintf(stderr,
+                     "usage: %s [--dir DIR] [--bytes N] [--record-bytes N] [--rounds N] [--batch-bytes N]\n",
+                     prog);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+            opt.dir = argv[++i];
+        else if (std::strcmp(argv[i], "--bytes") == 0 && i + 1 < argc)
+            opt.bytes = std::max<size_t>(1 << 20, std::strtoull(argv[++i], nullptr, 10));
+        else if (std::strcmp(argv[i], "--record-bytes") == 0 && i + 1 < argc)
+            opt.record_bytes = std::max<size_t>(16, std::strtoull(argv[++i], nullptr, 10));
+        else if (std::strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+            opt.rounds = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        else if (std::strcmp(argv[i], "--batch-bytes") == 0 && i + 1 < argc)
+            opt.batch_bytes = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::unique_ptr<IoEngine> blocking = IoEngine::create(IoBackend::Blocking);
+    std::unique_ptr<IoEngine> uring = IoEngine::create(IoBackend::Uring);
+    if (uring->backend() != IoBackend::Uring)
+        std::fprintf(stderr, "io_uring unavailable; its rows use the blocking backend\n");
+    std::string path = opt.dir + "/redis-lite-io-bench." + std::to_string(::getpid());
+    std::string record = makeRecord(opt.record_bytes);
+    std::string batch(opt.batch_bytes, 'b');
+    double mb = opt.bytes / 1e6;
+
+    std::printf("%-8s %-10s %12s\n", "stream", "path", "MB/s");
+    std::printf("%-8s %-10s %12.1f\n", "", "ofstream", mb / streamOfstream(opt, path, record));
+    std::printf("%-8s %-10s %12.1f\n", "", "blocking", mb / streamEngine(opt, path, record, *blocking));
+    std::printf("%-8s %-10s %12.1f\n", "", "io_uring", mb / streamEngine(opt, path, record, *uring));
+
+    std::printf("\n%-8s %-10s %12s\n", "replay", "path", "MB/s");
+    size_t records[3];
+    std::printf("%-8s %-10s %12.1f\n", "", "ifstream", mb / replayIfstream(path, records[0]));
+    std::printf("%-8s %-10s %12.1f\n", "", "mmap", mb / replayMapped(path, records[1]));
+    std::printf("%-8s %-10s %12.1f\n", "", "io_uring", mb / replayEngine(path, *uring, records[2]));
+    if (records[0] != records[1] || records[1] != records[2])
+        std::fprintf(stderr, "replay record counts differ: %zu %zu %zu\n", records[0], records[1], records[2]);
+
+    std::printf("\n%-8s %-10s %12s\n", "commit", "path", "us/round");
+    std::printf("%-8s %-10s %12.1f\n", "", "syscalls", commitSyscalls(opt, path, batch) * 1e6);
+    std::printf("%-8s %-10s %12.1f\n", "", "blocking", commitEngine(opt, path, batch, *blocking) * 1e6);
+    std::printf("%-8s %-10s %12.1f\n", "", "io_uring", commitEngine(opt, path, batch, *uring) * 1e6);
+
+    ::unlink(path.c_str());
+    return 0;
+}
@@ -0,0 +1,546 @@
+// Load generator in the spirit of redis-benchmark: drives a running server
+// over TCP with a GET/SET mix and reports throughput and latency
+// percentiles, as a table or (--json) one JSON document.
+//
+// Each worker thread runs its own epoll loop over its share of the client
+// connections. A connection sends `pipeline` commands at once and sends the
+// next batch when every reply is in; a reply's latency is measured from the
+// moment its batch was written.
+#include "zipf.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        uint16_t port = 6379;
+        size_t clients = 50;
+        size_t threads = 1;
+        size_t requests = 100000;
+        size_t pipeline = 1;
+        size_t keys = 100000;
+        size_t value_size = 32;
+        int read_percent = 90;
+        bool zipf = false;
+        double zipf_theta = 0.99;
+        bool prefill = false;
+        bool json = false;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    void appendBulk(std::string &out, std::string_view s)
+    {
+        out += '$';
+        out += std::to_string(s.size());
+        out += "\r\n";
+        out.append(s.data(), s.size());
+        out += "\r\n";
+    }
+
+    void appendGet(std::string &out, std::string_view key)
+    {
+        out += "*2\r\n$3\r\nGET\r\n";
+        appendBulk(out, key);
+    }
+
+    void appendSet(std::string &out, std::string_view key, std::string_view value)
+    {
+        out += "*3\r\n$3\r\nSET\r\n";
+        appendBulk(out, key);
+        appendBulk(out, value);
+    }
+
+    enum class Reply
+    {
+        Ok,
+        Error,
+        Incomplete
+    };
+
+    // Consumes one reply (simple string, error, integer or bulk string)
+    // starting at buf[pos].
+    Reply parseReply(const std::string &buf, size_t &pos)
+    {
+        if (pos >= buf.size())
+            return Reply::Incomplete;
+        size_t eol = buf.find("\r\n", pos);
+        if (eol == std::string::npos)
+            return Reply::Incomplete;
+        char type = buf[pos];
+        if (type == '$')
+        {
+            long long len = std::atoll(buf.c_str() + pos + 1);
+            size_t end = eol + 2 + (len < 0 ? 0 : static_cast<size_t>(len) + 2);
+            if (end > buf.size())
+                return Reply::Incomplete;
+            pos = end;
+            return Reply::Ok;
+        }
+        pos = eol + 2;
+        return type == '-' ? Reply::Error : Reply::Ok;
+    }
+
+    int connectTo(const Options &opt)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opt.port);
+        if (::inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr) != 1 ||
+            ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+
+    class Workload
+    {
+    public:
+        explicit Workload(const Options &opt)
+            : opt_(opt), value_(opt.value_size, 'x'), zipf_(opt.zipf ? opt.keys : 2, opt.zipf_theta)
+        {
+        }
+
+        template <class Rng>
+        void appendCommand(std::string &out, Rng &rng, std::string &key) const
+        {
+            size_t rank = opt_.zipf ? zipf_(rng) : std::uniform_int_distribution<size_t>(0, opt_.keys - 1)(rng);
+            key = "key:";
+            key += std::to_string(rank);
+            if (std::uniform_int_distribution<int>(0, 99)(rng) < opt_.read_percent)
+                appendGet(out, key);
+            else
+                appendSet(out, key, value_);
+        }
+
+        const std::string &value() const { return value_; }
+
+    private:
+        const Options &opt_;
+        std::string value_;
+        ZipfGenerator zipf_;
+    };
+
+    struct ThreadResult
+    {
+        std::vector<uint32_t> latencies_us;
+        size_t errors = 0;
+        bool failed = false;
+    };
+
+    class Worker
+    {
+    public:
+        Worker(const Options &opt, const Workload &workload, std::atomic<long long> &budget, size_t clients,
+               uint64_t seed)
+            : opt_(opt), workload_(workload), budget_(budget), conns_(clients), rng_(seed)
+        {
+        }
+
+        // Connects every client; false if any connection fails.
+        bool connect()
+        {
+            for (Conn &c : conns_)
+            {
+                c.fd = connectTo(opt_);
+                if (c.fd < 0)
+                    return false;
+            }
+            return true;
+        }
+
+        void run(ThreadResult &result)
+        {
+            result.latencies_us.reserve(opt_.requests / opt_.threads + opt_.pipeline);
+            epfd_ = ::epoll_create1(0);
+            size_t active = 0;
+            for (Conn &c : conns_)
+            {
+                ::fcntl(c.fd, F_SETFL, ::fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.ptr = &c;
+                ::epoll_ctl(epfd_, EPOLL_CTL_ADD, c.fd, &ev);
+                if (sendBatch(c))
+                    ++active;
+                else
+                    close(c);
+            }
+
+            std::vector<epoll_event> events(64);
+            while (active > 0)
+            {
+                int n = ::epoll_wait(epfd_, events.data(), static_cast<int>(events.size()), 1000);
+                if (n < 0 && errno != EINTR)
+                    break;
+                for (int i = 0; i < n; ++i)
+                {
+                    Conn &c = *static_cast<Conn *>(events[i].data.ptr);
+                    if ((events[i].events & EPOLLOUT) && !flush(c))
+                    {
+                        fail(c, result, active);
+                        continue;
+                    }
+                    if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                        continue;
+                    if (!readReplies(c, result))
+                    {
+                        fail(c, result, active);
+                        continue;
+                    }
+                    if (c.outstanding == 0 && !sendBatch(c))
+                    {
+                        close(c);
+                        --active;
+                    }
+                }
+            }
+            ::close(epfd_);
+        }
+
+    private:
+        struct Conn
+        {
+            int fd = -1;
+            std::string out;
+            size_t out_pos = 0;
+            bool want_write = false;
+            std::string in;
+            size_t in_pos = 0;
+            size_t outstanding = 0;
+            Clock::time_point sent;
+        };
+
+        const Options &opt_;
+        const Workload &workload_;
+        std::atomic<long long> &budget_;
+        std::vector<Conn> conns_;
+        std::mt19937_64 rng_;
+        std::string key_;
+        int epfd_ = -1;
+
+        // Claims up to a pipeline's worth of the remaining requests and sends
+        // them. False once the budget is spent.
+        bool sendBatch(Conn &c)
+        {
+            long long left = budget_.fetch_sub(static_cast<long long>(opt_.pipeline));
+            if (left <= 0)
+                return false;
+            size_t batch = std::min<size_t>(opt_.pipeline, static_cast<size_t>(left));
+            c.out.clear();
+            c.out_pos = 0;
+            for (size_t i = 0; i < batch; ++i)
+                workload_.appendCommand(c.out, rng_, key_);
+            c.outstanding = batch;
+            c.sent = Clock::now();
+            flush(c); // a broken connection shows up as a failed read
+            return true;
+        }
+
+        bool flush(Conn &c)
+        {
+            while (c.out_pos < c.out.size())
+            {
+                ssize_t n = ::send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+                if (n > 0)
+                {
+                    c.out_pos += static_cast<size_t>(n);
+                    continue;
+                }
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    watchWrites(c, true);
+                    return true;
+                }
+                return false;
+            }
+            watchWrites(c, false);
+            return true;
+        }
+
+        void watchWrites(Conn &c, bool on)
+        {
+            if (c.want_write == on)
+                return;
+            c.want_write = on;
+            epoll_event ev{};
+            ev.events = EPOLLIN | (on ? uint32_t(EPOLLOUT) : 0u);
+            ev.data.ptr = &c;
+            ::epoll_ctl(epfd_, EPOLL_CTL_MOD, c.fd, &ev);
+        }
+
+        bool readReplies(Conn &c, ThreadResult &result)
+        {
+            char buf[16384];
+            while (true)
+            {
+                ssize_t n = ::read(c.fd, buf, sizeof(buf));
+                if (n > 0)
+                {
+                    c.in.append(buf, static_cast<size_t>(n));
+                    continue;
+                }
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                return false; // closed by the server, or an error
+            }
+
+            auto now = Clock::now();
+            uint32_t us = static_cast<uint32_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(now - c.sent).count());
+            while (c.outstanding > 0)
+            {
+                Reply r = parseReply(c.in, c.in_pos);
+                if (r == Reply::Incomplete)
+                    break;
+                if (r == Reply::Error)
+                    ++result.errors;
+                result.latencies_us.push_back(us);
+                --c.outstanding;
+            }
+            if (c.in_pos == c.in.size())
+            {
+                c.in.clear();
+                c.in_pos = 0;
+            }
+            return true;
+        }
+
+        void fail(Conn &c, ThreadResult &result, size_t &active)
+        {
+            result.failed = true;
+            close(c);
+            --active;
+        }
+
+        void close(Conn &c)
+        {
+            ::epoll_ctl(epfd_, EPOLL_CTL_DEL, c.fd, nullptr);
+            ::close(c.fd);
+            c.fd = -1;
+        }
+    };
+
+    // SETs every key once over one blocking connection, pipelined.
+    bool prefill(const Options &opt, const Workload &workload)
+    {
+        int fd = connectTo(opt);
+        if (fd < 0)
+            return false;
+        constexpr size_t BATCH = 1000;
+        std::string out;
+        std::string in;
+        char buf[16384];
+        for (size_t start = 0; start < opt.keys; start += BATCH)
+        {
+            size_t end = std::min(opt.keys, start + BATCH);
+            out.clear();
+            for (size_t i = start; i < end; ++i)
+                appendSet(out, "key:" + std::to_string(i), workload.value());
+            if (::send(fd, out.data(), out.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(out.size()))
+                break;
+            size_t replies = 0;
+            size_t pos = 0;
+            in.clear();
+            while (replies < end - start)
+            {
+                ssize_t n = ::read(fd, buf, sizeof(buf));
+                if (n <= 0)
+                {
+                    ::close(fd);
+                    return false;
+                }
+                in.append(buf, static_cast<size_t>(n));
+                while (parseReply(in, pos) != Reply::Incomplete)
+                    ++replies;
+            }
+        }
+        ::close(fd);
+        return true;
+    }
+
+    double percentile(const std::vector<uint32_t> &sorted, double p)
+    {
+        if (sorted.empty())
+            return 0;
+        size_t i = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+        return sorted[std::min(sorted.size() - 1, i ? i - 1 : 0)] / 1000.0;
+    }
+
+    void usage(const char *prog)
+    {
+        std::fprintf(stderr,
+                     "usage: %s [--host H] [--port N] [--clients N] [--threads N] [--requests N] [--pipeline N]\n"
+                     "          [--keys N] [--value-size N] [--read-percent P] [--distribution uniform|zipf]\n"
+                     "          [--zipf-theta T] [--prefill] [--json]\n",
+                     prog);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        auto next = [&]() -> const char *
+        {
+            if (i + 1 >= argc)
+            {
+                usage(argv[0]);
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+        auto count = [&]() { return std::max<size_t>(1, std::strtoull(next(), nullptr, 10)); };
+        if (std::strcmp(argv[i], "--host") == 0)
+            opt.host = next();
+        else if (std::strcmp(argv[i], "--port") == 0)
+            opt.port = static_cast<uint16_t>(std::atoi(next()));
+        else if (std::strcmp(argv[i], "--clients") == 0)
+            opt.clients = count();
+        else if (std::strcmp(argv[i], "--threads") == 0)
+            opt.threads = count();
+        else if (std::strcmp(argv[i], "--requests") == 0)
+            opt.requests = count();
+        else if (std::strcmp(argv[i], "--pipeline") == 0)
+            opt.pipeline = count();
+        else if (std::strcmp(argv[i], "--keys") == 0)
+            opt.keys = count();
+        else if (std::strcmp(argv[i], "--value-size") == 0)
+            opt.value_size = std::strtoull(next(), nullptr, 10);
+        else if (std::strcmp(argv[i], "--read-percent") == 0)
+            opt.read_percent = std::atoi(next());
+        else if (std::strcmp(argv[i], "--distribution") == 0)
+        {
+            std::string d = next();
+            if (d != "uniform" && d != "zipf")
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            opt.zipf = d == "zipf";
+        }
+        else if (std::strcmp(argv[i], "--zipf-theta") == 0)
+            opt.zipf_theta = std::atof(next());
+        else if (std::strcmp(argv[i], "--prefill") == 0)
+            opt.prefill = true;
+        else if (std::strcmp(argv[i], "--json") == 0)
+            opt.json = true;
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.zipf && (opt.zipf_theta <= 0 || opt.zipf_theta >= 1))
+    {
+        std::fprintf(stderr, "--zipf-theta must be in (0, 1)\n");
+        return 1;
+    }
+    opt.threads = std::min(opt.threads, opt.clients);
+
+    Workload workload(opt);
+    if (opt.prefill && !prefill(opt, workload))
+    {
+        std::fprintf(stderr, "prefill failed: cannot talk to %s:%u\n", opt.host.c_str(), opt.port);
+        return 1;
+    }
+
+    std::atomic<long long> budget{static_cast<long long>(opt.requests)};
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t t = 0; t < opt.threads; ++t)
+    {
+        size_t clients = opt.clients / opt.threads + (t < opt.clients % opt.threads ? 1 : 0);
+        workers.push_back(std::make_unique<Worker>(opt, workload, budget, clients, 0x9e3779b97f4a7c15ULL * (t + 1)));
+        if (!workers.back()->connect())
+        {
+            std::fprintf(stderr, "cannot connect to %s:%u: %s\n", opt.host.c_str(), opt.port, std::strerror(errno));
+            return 1;
+        }
+    }
+
+    std::vector<ThreadResult> results(opt.threads);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (size_t t = 0; t < opt.threads; ++t)
+        threads.emplace_back([&, t] { workers[t]->run(results[t]); });
+    for (auto &th : threads)
+        th.join();
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<uint32_t> latencies;
+    size_t errors = 0;
+    bool failed = false;
+    for (ThreadResult &r : results)
+    {
+        latencies.insert(latencies.end(), r.latencies_us.begin(), r.latencies_us.end());
+        errors += r.errors;
+        failed = failed || r.failed;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double mean = 0;
+    for (uint32_t us : latencies)
+        mean += us;
+    mean = latencies.empty() ? 0 : mean / latencies.size() / 1000.0;
+    double max = latencies.empty() ? 0 : latencies.back() / 1000.0;
+    double ops = latencies.size() / secs;
+    const char *dist = opt.zipf ? "zipf" : "uniform";
+
+    if (opt.json)
+    {
+        std::printf("{\"tool\":\"redis-lite-loadgen\",\"clients\":%zu,\"threads\":%zu,\"pipeline\":%zu,"
+                    "\"keys\":%zu,\"value_size\":%zu,\"read_percent\":%d,\"distribution\":\"%s\","
+                    "\"requests\":%zu,\"errors\":%zu,\"seconds\":%.3f,\"ops_per_sec\":%.0f,"
+                    "\"latency_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}\n",
+                    opt.clients, opt.threads, opt.pipeline, opt.keys, opt.value_size, opt.read_percent, dist,
+                    latencies.size(), errors, secs, ops, mean, percentile(latencies, 50), percentile(latencies, 99),
+                    percentile(latencies, 99.9), max);
+    }
+    else
+    {
+        std::printf("%zu requests in %.2f s, %zu clients, %zu threads, pipeline %zu\n", latencies.size(), secs,
+                    opt.clients, opt.threads, opt.pipeline);
+        std::printf("keys=%zu value_size=%zu read=%d%% distribution=%s\n", opt.keys, opt.value_size,
+                    opt.read_percent, dist);
+        std::printf("throughput: %.0f ops/s, errors: %zu\n", ops, errors);
+        std::printf("latency ms: mean %.3f  p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n", mean,
+                    percentile(latencies, 50), percentile(latencies, 99), percentile(latencies, 99.9), max);
+    }
+    if (failed)
+    {
+        std::fprintf(stderr, "some connections were closed before all replies arrived\n");
+        return 1;
+    }
+    return 0;
+}
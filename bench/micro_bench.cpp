@@ -0,0 +1,411 @@
+// Single-threaded microbenchmarks for the hot paths of one cache shard:
+// set/get/del, eviction under each policy, AOF append, snapshot save and
+// load, AOF replay and a full restart (snapshot + AOF). The batch
+// benchmarks run MGET/MSET's path, a one-shard ShardedCache, with
+// BATCH_KEYS keys per call.
+//
+// Prints ns/op and ops/s per benchmark, or with --json one JSON document
+// that a CI job can diff against a baseline.
+#include "cache.h"
+#include "sharded_cache.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    constexpr size_t BATCH_KEYS = 100;
+    constexpr uint32_t HOTKEYS_SAMPLE_RATE = 100; // the server's default
+
+    struct Options
+    {
+        size_t keys = 200000;
+        size_t value_size = 32;
+        std::string filter;
+        bool json = false;
+    };
+
+    struct Result
+    {
+        const char *name;
+        size_t ops;
+        double secs;
+    };
+
+    struct Benchmark
+    {
+        const char *name;
+        std::function<Result(const char *)> run;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    double since(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    class Suite
+    {
+    public:
+        explicit Suite(const Options &opt) : value_(opt.value_size, 'v')
+        {
+            keys_.reserve(opt.keys);
+            for (size_t i = 0; i < opt.keys; ++i)
+                keys_.push_back("key:" + std::to_string(i));
+            // Lookups in a random order, so the index is not walked sequentially.
+            order_.resize(opt.keys);
+            for (size_t i = 0; i < opt.keys; ++i)
+                order_[i] = i;
+            std::shuffle(order_.begin(), order_.end(), std::mt19937_64(42));
+
+            char tmpl[] = "/tmp/redis-lite-bench.XXXXXX";
+            if (!mkdtemp(tmpl))
+            {
+                std::perror("mkdtemp");
+                std::exit(1);
+            }
+            dir_ = tmpl;
+        }
+
+        ~Suite() { std::filesystem::remove_all(dir_); }
+
+        std::vector<Benchmark> all()
+        {
+            return {
+                {"set_insert", [this](const char *n) { return setInsert(n); }},
+                {"set_update", [this](const char *n) { return setUpdate(n); }},
+                {"get_hit", [this](const char *n) { return getHit(n); }},
+                {"get_hit_hotkeys", [this](const char *n) { return getHit(n, HOTKEYS_SAMPLE_RATE); }},
+                {"get_miss", [this](const char *n) { return getMiss(n); }},
+                {"del", [this](const char *n) { return del(n); }},
+                {"mget", [this](const char *n) { return mget(n); }},
+                {"evict_lru", [this](const char *n) { return evict(n, EvictionPolicy::Lru); }},
+                {"evict_sampled_lru", [this](const char *n) { return evict(n, EvictionPolicy::SampledLru); }},
+                {"evict_clock", [this](const char *n) { return evict(n, EvictionPolicy::Clock); }},
+                {"evict_random", [this](const char *n) { return evict(n, EvictionPolicy::Random); }},
+                {"evict_w_tinylfu", [this](const char *n) { return evict(n, EvictionPolicy::TinyLfu); }},
+                {"aof_append", [this](const char *n) { return aofAppend(n); }},
+                {"mset_aof_append", [this](const char *n) { return msetAofAppend(n); }},
+                {"snapshot_save", [this](const char *n) { return snapshotSave(n); }},
+                {"snapshot_load", [this](const char *n) { return snapshotLoad(n); }},
+                {"aof_replay", [this](const char *n) { return aofReplay(n); }},
+                {"restart", [this](const char *n) { return restart(n); }},
+            };
+        }
+
+    private:
+        std::string value_;
+        std::vector<std::string> keys_;
+        std::vector<size_t> order_;
+        std::string dir_;
+
+        std::string path(const char *file) const { return dir_ + "/" + file; }
+
+        void clearFiles() const
+        {
+            std::filesystem::remove(path("snapshot.rdb"));
+            std::filesystem::remove(path("aof.log"));
+        }
+
+        std::unique_ptr<LRUCache> persistentCache(AppendFsync fsync = AppendFsync::No) const
+        {
+            return std::make_unique<LRUCache>(0, path("snapshot.rdb"), path("aof.log"), "1234567890123456", 0,
+                                              EvictionPolicy::Lru, fsync);
+        }
+
+        void fill(LRUCache &cache) const
+        {
+            for (const std::string &k : keys_)
+                cache.set(k, value_);
+        }
+
+        Result setInsert(const char *name)
+        {
+            LRUCache cache(0, "", "");
+            auto start = Clock::now();
+            fill(cache);
+            return {name, keys_.size(), since(start)};
+        }
+
+        Result setUpdate(const char *name)
+        {
+            LRUCache cache(0, "", "");
+            fill(cache);
+            auto start = Clock::now();
+            for (size_t i : order_)
+                cache.set(keys_[i], value_);
+            return {name, keys_.size(), since(start)};
+        }
+
+        // With a sample rate, accesses are sampled for HOTKEYS as the server
+        // does by default.
+        Result getHit(const char *name, uint32_t sample_rate = 0)
+        {
+            LRUCache cache(0, "", "");
+            cache.setHotKeySampling(sample_rate);
+            fill(cache);
+            std::string out;
+            size_t hits = 0;
+            auto start = Clock::now();
+            for (size_t i : order_)
+                hits += cache.get(keys_[i], out);
+            double secs = since(start);
+            if (hits != keys_.size())
+                std::fprintf(stderr, "%s: %zu of %zu hits\n", name, hits, keys_.size());
+            return {name, keys_.size(), secs};
+        }
+
+        Result getMiss(const char *name)
+        {
+            LRUCache cache(0, "", "");
+            fill(cache);
+            std::vector<std::string> absent;
+            absent.reserve(keys_.size());
+            for (size_t i = 0; i < keys_.size(); ++i)
+                absent.push_back("missing:" + std::to_string(i));
+            std::string out;
+            auto start = Clock::now();
+            for (size_t i : order_)
+                cache.get(absent[i], out);
+            return {name, keys_.size(), since(start)};
+        }
+
+        Result del(const char *name)
+        {
+            LRUCache cache(0, "", "");
+            fill(cache);
+            auto start = Clock::now();
+            for (size_t i : order_)
+                cache.del(keys_[i]);
+            return {name, keys_.size(), since(start)};
+        }
+
+        // Random lookups, BATCH_KEYS per call.
+        Result mget(const char *name)
+        {
+            ShardedCache cache(1, 0, "", "");
+            for (const std::string &k : keys_)
+                cache.set(k, value_);
+            std::vector<std::string_view> batch;
+            size_t hits = 0;
+            auto start = Clock::now();
+            for (size_t i = 0; i < order_.size(); i += BATCH_KEYS)
+            {
+                batch.clear();
+                for (size_t j = i; j < std::min(order_.size(), i + BATCH_KEYS); ++j)
+                    batch.push_back(keys_[order_[j]]);
+                cache.readMany(batch.data(), batch.size(), [&](bool found, std::string_view)
+                               { hits += found; });
+            }
+            double secs = since(start);
+            if (hits != keys_.size())
+                std::fprintf(stderr, "%s: %zu of %zu hits\n", name, hits, keys_.size());
+            return {name, keys_.size(), secs};
+        }
+
+        // aof_append with BATCH_KEYS keys per record.
+        Result msetAofAppend(const char *name)
+        {
+            clearFiles();
+            ShardedCache cache(1, 0, path("snapshot.rdb"), path("aof.log"), "1234567890123456", 0,
+                               EvictionPolicy::Lru, AppendFsync::No);
+            std::vector<std::string_view> pairs;
+            auto start = Clock::now();
+            for (size_t i = 0; i < keys_.size(); i += BATCH_KEYS)
+            {
+                pairs.clear();
+                for (size_t j = i; j < std::min(keys_.size(), i + BATCH_KEYS); ++j)
+                {
+                    pairs.push_back(keys_[j]);
+                    pairs.push_back(value_);
+                }
+                bool stored;
+                cache.setMany(pairs.data(), pairs.size() / 2, false, stored);
+            }
+            double secs = since(start);
+            cache.flushAOF();
+            return {name, keys_.size(), secs};
+        }
+
+        // A full cache of half the keys takes the other half: every set evicts.
+        Result evict(const char *name, EvictionPolicy policy)
+        {
+            size_t half = keys_.size() / 2;
+            LRUCache cache(half, "", "", "1234567890123456", 0, policy);
+            for (size_t i = 0; i < half; ++i)
+                cache.set(keys_[i], value_);
+            auto start = Clock::now();
+            for (size_t i = half; i < keys_.size(); ++i)
+                cache.set(keys_[i], value_);
+            double secs = since(start);
+            if (cache.evictions() != keys_.size() - half)
+                std::fprintf(stderr, "%s: %zu evictions\n", name, cache.evictions());
+            return {name, keys_.size() - half, secs};
+        }
+
+        // Includes sealing the record and handing it to the writer thread,
+        // not the write itself (appendfsync no).
+        Result aofAppend(const char *name)
+        {
+            clearFiles();
+            auto cache = persistentCache();
+            auto start = Clock::now();
+            fill(*cache);
+            double secs = since(start);
+            cache->flushAOF();
+            return {name, keys_.size(), secs};
+        }
+
+        Result snapshotSave(const char *name)
+        {
+            clearFiles();
+            auto cache = persistentCache();
+            fill(*cache);
+            auto start = Clock::now();
+            bool ok = cache->saveSnapshot();
+            double secs = since(start);
+            if (!ok)
+                std::fprintf(stderr, "%s: save failed\n", name);
+            return {name, keys_.size(), secs};
+        }
+
+        // Startup from a snapshot alone.
+        Result snapshotLoad(const char *name)
+        {
+            clearFiles();
+            {
+                auto cache = persistentCache();
+                fill(*cache);
+                cache->saveSnapshot();
+                cache->snapshotTaken(cache->aofPosition());
+            }
+            auto start = Clock::now();
+            auto cache = persistentCache();
+            double secs = since(start);
+            checkLoaded(name, *cache, keys_.size());
+            return {name, keys_.size(), secs};
+        }
+
+        // Startup from an AOF alone.
+        Result aofReplay(const char *name)
+        {
+            clearFiles();
+            {
+                auto cache = persistentCache();
+                fill(*cache);
+                cache->flushAOF();
+            }
+            std::filesystem::remove(path("snapshot.rdb"));
+            auto start = Clock::now();
+            auto cache = persistentCache();
+            double secs = since(start);
+            checkLoaded(name, *cache, keys_.size());
+            return {name, keys_.size(), secs};
+        }
+
+        // The usual restart: a snapshot plus the writes logged after it (a
+        // tenth of the keys overwritten).
+        Result restart(const char *name)
+        {
+            clearFiles();
+            {
+                auto cache = persistentCache();
+                fill(*cache);
+                cache->saveSnapshot();
+                cache->snapshotTaken(cache->aofPosition());
+                for (size_t i = 0; i < keys_.size() / 10; ++i)
+                    cache->set(keys_[order_[i]], value_);
+                cache->flushAOF();
+            }
+            auto start = Clock::now();
+            auto cache = persistentCache();
+            double secs = since(start);
+            checkLoaded(name, *cache, keys_.size());
+            return {name, keys_.size() + keys_.size() / 10, secs};
+        }
+
+        static void checkLoaded(const char *name, const LRUCache &cache, size_t expected)
+        {
+            if (cache.size() != expected)
+                std::fprintf(stderr, "%s: loaded %zu of %zu keys\n", name, cache.size(), expected);
+        }
+    };
+
+    void usage(const char *prog)
+    {
+        std::fprintf(stderr, "usage: %s [--keys N] [--value-size N] [--filter SUBSTR] [--json]\n", prog);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        auto next = [&]() -> const char *
+        {
+            if (i + 1 >= argc)
+            {
+                usage(argv[0]);
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+        if (std::strcmp(argv[i], "--keys") == 0)
+            opt.keys = std::max<size_t>(2, std::strtoull(next(), nullptr, 10));
+        else if (std::strcmp(argv[i], "--value-size") == 0)
+            opt.value_size = std::strtoull(next(), nullptr, 10);
+        else if (std::strcmp(argv[i], "--filter") == 0)
+            opt.filter = next();
+        else if (std::strcmp(argv[i], "--json") == 0)
+            opt.json = true;
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    Suite suite(opt);
+    std::vector<Result> results;
+    if (!opt.json)
+    {
+        std::printf("keys=%zu value_size=%zu\n", opt.keys, opt.value_size);
+        std::printf("%-20s %12s %12s %14s\n", "benchmark", "ops", "ns/op", "ops/s");
+    }
+    for (const Benchmark &b : suite.all())
+    {
+        if (!opt.filter.empty() && std::strstr(b.name, opt.filter.c_str()) == nullptr)
+            continue;
+        Result r = b.run(b.name);
+        results.push_back(r);
+        if (!opt.json)
+        {
+            std::printf("%-20s %12zu %12.1f %14.0f\n", r.name, r.ops, r.secs * 1e9 / r.ops, r.ops / r.secs);
+            std::fflush(stdout);
+        }
+    }
+
+    if (opt.json)
+    {
+        std::printf("{\"benchmark\":\"redis-lite-bench\",\"keys\":%zu,\"value_size\":%zu,\"results\":[", opt.keys,
+                    opt.value_size);
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const Result &r = results[i];
+            std::printf("%s{\"name\":\"%s\",\"ops\":%zu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f}", i ? "," : "",
+                        r.name, r.ops, r.secs * 1e9 / r.ops, r.ops / r.secs);
+        }
+        std::printf("]}\n");
+    }
+    return 0;
+}
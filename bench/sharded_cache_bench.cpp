@@ -0,0 +1,136 @@
+// Multithreaded throughput of ShardedCache on a uniform key workload.
+//
+// For each thread count, runs the same GET/SET mix against a single-shard
+// cache (one global lock, the old behaviour) and against a sharded one, and
+// prints ops/s plus the speedup over one thread.
+#include "sharded_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        size_t keys = 100000;
+        size_t ops_per_thread = 1000000;
+        size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+        size_t shards = 64;
+        int read_percent = 90;
+    };
+
+    double runOnce(ShardedCache &cache, const std::vector<std::string> &keys, const Options &opt, size_t threads)
+    {
+        std::atomic<bool> go{false};
+        std::atomic<size_t> ready{0};
+        std::vector<std::thread> workers;
+        const std::string value(16, 'v');
+
+        for (size_t t = 0; t < threads; ++t)
+        {
+            workers.emplace_back([&, t]
+                                 {
+                std::mt19937_64 rng(t * 7919 + 1);
+                std::uniform_int_distribution<size_t> pick(0, keys.size() - 1);
+                std::uniform_int_distribution<int> pct(0, 99);
+                std::string out;
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire))
+                    ;
+                for (size_t i = 0; i < opt.ops_per_thread; ++i)
+                {
+                    const std::string &key = keys[pick(rng)];
+                    if (pct(rng) < opt.read_percent)
+                        cache.get(key, out);
+                    else
+                        cache.set(key, value);
+                } });
+        }
+
+        while (ready.load() < threads)
+            std::this_thread::yield();
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto &w : workers)
+            w.join();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return static_cast<double>(opt.ops_per_thread * threads) / secs;
+    }
+
+    void usage(const char *prog)
+    {
+        std::fprintf(stderr,
+                     "usage: %s [--keys N] [--ops N] [--threads N] [--shards N] [--read-percent P]\n",
+                     prog);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        auto next = [&]() -> size_t
+        {
+            if (i + 1 >= argc)
+            {
+                usage(argv[0]);
+                std::exit(1);
+            }
+            return std::strtoull(argv[++i], nullptr, 10);
+        };
+        if (std::strcmp(argv[i], "--keys") == 0)
+            opt.keys = std::max<size_t>(1, next());
+        else if (std::strcmp(argv[i], "--ops") == 0)
+            opt.ops_per_thread = next();
+        else if (std::strcmp(argv[i], "--threads") == 0)
+            opt.max_threads = std::max<size_t>(1, next());
+        else if (std::strcmp(argv[i], "--shards") == 0)
+            opt.shards = std::max<size_t>(1, next());
+        else if (std::strcmp(argv[i], "--read-percent") == 0)
+            opt.read_percent = static_cast<int>(next());
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<std::string> keys;
+    keys.reserve(opt.keys);
+    for (size_t i = 0; i < opt.keys; ++i)
+        keys.push_back("key:" + std::to_string(i));
+
+    std::printf("keys=%zu ops/thread=%zu read=%d%%\n", opt.keys, opt.ops_per_thread, opt.read_percent);
+    std::printf("%-8s %16s %16s %10s\n", "threads", "1-shard ops/s", "sharded ops/s", "scaling");
+
+    double base = 0;
+    for (size_t threads = 1; threads <= opt.max_threads; threads *= 2)
+    {
+        // Capacity above the key count: measure lookups and locking, not eviction.
+        ShardedCache single(1, opt.keys * 2, "", "");
+        ShardedCache sharded(opt.shards, opt.keys * 2, "", "");
+        for (auto &k : keys)
+        {
+            single.set(k, "init");
+            sharded.set(k, "init");
+        }
+
+        double a = runOnce(single, keys, opt, threads);
+        double b = runOnce(sharded, keys, opt, threads);
+        if (threads == 1)
+            base = b;
+        std::printf("%-8zu %16.0f %16.0f %9.2fx\n", threads, a, b, b / base);
+
+        if (threads < opt.max_threads && threads * 2 > opt.max_threads)
+            threads = opt.max_threads / 2; // make the last row use every thread
+    }
+    return 0;
+}
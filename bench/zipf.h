@@ -0,0 +1,41 @@
+// zipf.h
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <random>
+
+// Zipfian ranks over [0, n), as in YCSB (Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases"). Rank 0 is the hottest key.
+class ZipfGenerator
+{
+public:
+    ZipfGenerator(size_t n, double theta) : n_(n), theta_(theta)
+    {
+        double zeta2 = 1.0 + std::pow(0.5, theta);
+        for (size_t i = 1; i <= n; ++i)
+            zetan_ += 1.0 / std::pow(static_cast<double>(i), theta);
+        alpha_ = 1.0 / (1.0 - theta);
+        eta_ = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan_);
+    }
+
+    template <class Rng>
+    size_t operator()(Rng &rng) const
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan_;
+        if (uz < 1.0)
+            return 0;
+        if (uz < 1.0 + std::pow(0.5, theta_))
+            return 1;
+        size_t rank = static_cast<size_t>(n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+        return std::min(rank, n_ - 1);
+    }
+
+private:
+    size_t n_;
+    double theta_;
+    double zetan_ = 0;
+    double alpha_;
+    double eta_;
+};
@@ -0,0 +1,208 @@
+// aof.h
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+class HistogramTotals;
+class IoEngine;
+
+// When appended data must reach the disk.
+//  Always   every write is fsynced before its client is answered
+//  EverySec fsync at most once per second (the default)
+//  No       leave flushing to the operating system
+enum class AppendFsync
+{
+    Always,
+    EverySec,
+    No
+};
+
+bool parseAppendFsync(std::string_view name, AppendFsync &out);
+const char *appendFsyncName(AppendFsync policy);
+
+// AOF file format, version 2. All integers are little-endian.
+//
+//   header  "RLAOF\0\0\0"  u32 version  u32 reserved
+//   record* u8 op  u32 length  u32 crc32c  payload[length]
+//
+// The CRC covers the op, the length and the payload, so a record torn by a
+// crash or damaged on disk is told apart from a good one before its payload
+// is looked at. What the op and payload mean is up to the writer of the
+// records. Version 1 files have no header and no CRCs.
+constexpr uint32_t AOF_VERSION = 2;
+constexpr size_t AOF_HEADER_BYTES = 16;
+constexpr size_t AOF_FRAME_BYTES = 9;
+
+// The header a version 2 file starts with.
+std::string aofHeader();
+// Makes `out` one record around a payload already placed at
+// out[AOF_FRAME_BYTES...]: fills in the op, length and CRC.
+void sealAofFrame(std::string &out, char op);
+
+// Walks the records of an AOF, checking each frame as it goes. The file is
+// mapped, so a scan only costs the checksums, which run at memory speed;
+// the kernel is asked to read READAHEAD_BYTES ahead of the scan, so it
+// seldom waits on the disk either.
+class AofReader
+{
+public:
+    enum class Format
+    {
+        Missing, // no file, or an empty one
+        Framed,  // version 2
+        Legacy   // no header: version 1, to be read some other way
+    };
+
+    explicit AofReader(const std::string &path);
+    ~AofReader();
+
+    AofReader(const AofReader &) = delete;
+    AofReader &operator=(const AofReader &) = delete;
+
+    Format format() const noexcept { return format_; }
+    // The whole file, for reading a Legacy one.
+    std::string_view data() const noexcept
+    {
+        return {reinterpret_cast<const char *>(base_), static_cast<size_t>(size_)};
+    }
+    // Gives the next record; false at the end of the file or at the first
+    // record that is cut short or fails its checksum.
+    bool next(char &op, std::string_view &payload);
+    // Offset just past the last good record (and of the header at least),
+    // and the file's size: they differ once next() stopped at a bad record.
+    uint64_t goodEnd() const noexcept { return pos_; }
+    uint64_t size() const noexcept { return size_; }
+
+    // Cuts the file back to goodEnd(), dropping a damaged tail.
+    bool truncate(std::string &err);
+
+private:
+    static constexpr uint64_t READAHEAD_BYTES = 8 << 20;
+
+    std::string path_;
+    Format format_ = Format::Missing;
+    const unsigned char *base_ = nullptr;
+    uint64_t size_ = 0;
+    uint64_t pos_ = 0;
+    uint64_t advised_ = 0; // read ahead up to here
+
+    void readAhead() noexcept;
+};
+
+// Append-only log writer. The file stays open for the writer's lifetime;
+// append() only copies into an in-memory buffer, and a background thread
+// writes the buffer out and fsyncs it according to the policy. Everything
+// appended while one write/fsync is in flight goes out together with the
+// next one, so many clients share a single fsync (group commit). File I/O
+// goes through an IoEngine: on io_uring a round's write and its fsync are
+// submitted together, the fsync linked behind the write.
+class AofWriter
+{
+public:
+    // `header` is written first to a new or empty file, and again whenever
+    // the file is replaced.
+    AofWriter(const std::string &path, AppendFsync policy, std::string header = "");
+    ~AofWriter();
+
+    AofWriter(const AofWriter &) = delete;
+    AofWriter &operator=(const AofWriter &) = delete;
+
+    // Thread-safe. Returns the log position just past the appended bytes.
+    uint64_t append(std::string_view data);
+
+    // Blocks until everything up to `pos` is fsynced (only meaningful under
+    // Always; returns immediately otherwise). Returns false if a write or
+    // fsync failed first.
+    bool waitDurable(uint64_t pos);
+
+    // Writes out and fsyncs everything appended so far, whatever the policy.
+    // Returns false if that failed.
+    bool flush();
+
+    // True while the log cannot be written: the last write or fsync failed,
+    // and the unwritten bytes are kept and retried every second. `err` says
+    // why. Callers should refuse further writes meanwhile, as redis does.
+    bool writeError(std::string &err);
+
+    // For a record the caller could not build (sealing failed) and so never
+    // appended: latched like a failed write until the flusher's next round,
+    // and the calling thread's next syncThreadWrites() returns false.
+    void recordLost(std::string_view why);
+
+    // Current log position: everything appended so far ends here.
+    uint64_t position();
+
+    // Rewrites the file as the header followed by whatever was logged after
+    // `pos`, once a snapshot taken at `pos` has made the earlier records
+    // redundant. Appends keep flowing into the buffer meanwhile.
+    void truncatePrefix(uint64_t pos);
+
+    // Like truncatePrefix(), but the records up to `pos` are replaced by the
+    // file at `base_path` (a compacted log written elsewhere, header
+    // included); the tail is appended to it and it is renamed over the log. Removes `base_path` and
+    // keeps the old log on failure.
+    bool rewrite(uint64_t pos, const std::string &base_path);
+
+    // Bytes the log file holds, counting what is still buffered.
+    uint64_t size();
+
+    AppendFsync policy() const noexcept { return policy_; }
+    const std::string &path() const noexcept { return path_; }
+
+    // Blocks until every record the calling thread appended under the Always
+    // policy is on disk. Call once per batch of commands, before replying;
+    // false means some of them never got there, or (whatever the policy)
+    // one was lost before it could be appended.
+    static bool syncThreadWrites();
+
+    // Adds the time every writer spent in write() and fsync() so far.
+    static void latencies(HistogramTotals &write, HistogramTotals &fsync);
+
+private:
+    std::string path_;
+    AppendFsync policy_;
+    std::string header_;
+    int fd_;
+
+    std::mutex mu_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::string buf_;   // appended but not yet written
+    std::string spare_; // recycled write buffer
+    // Positions count every byte ever appended, so they only grow.
+    uint64_t appended_ = 0;
+    uint64_t written_ = 0;
+    uint64_t synced_ = 0;
+    bool sync_requested_ = false;
+    bool stop_ = false;
+    // Why the last write or fsync failed; empty once one succeeds again.
+    // failures_ counts failed rounds, so a waiter can tell one ended after
+    // it began waiting. failing_ mirrors !error_.empty() for readers
+    // without mu_.
+    std::string error_;
+    uint64_t failures_ = 0;
+    bool lost_ = false; // recordLost(): the next round clears error_ if it goes well
+    std::atomic<bool> failing_{false};
+
+    // Serializes file I/O between the flusher and reset()/truncatePrefix(),
+    // and guards the mapping between log positions and file offsets: the
+    // byte at position p sits at file offset p - file_base_.
+    // file_base_ is atomic only so size() can read it without io_mu_.
+    std::mutex io_mu_;
+    std::atomic<uint64_t> file_base_{0};
+    uint64_t file_end_ = 0;
+    std::unique_ptr<IoEngine> io_; // used under io_mu_ (or before the flusher starts)
+    std::thread thread_;
+
+    void run();
+    bool writeAll(int fd, const char *data, size_t len);
+    void unwindLocked(std::string &batch);
+    bool installLocked(int out, const std::string &tmp, uint64_t pos, uint64_t prefix_len);
+};
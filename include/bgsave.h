@@ -0,0 +1,128 @@
+// bgsave.h
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+struct Database;
+class ReplicationBacklog;
+
+// Save once `seconds` have passed since the last save if at least `changes`
+// writes happened meanwhile, like "save 300 100" in redis.conf.
+struct SaveRule
+{
+    long seconds;
+    uint64_t changes;
+};
+
+// Parses "<seconds>:<changes>", e.g. "300:100".
+bool parseSaveRule(std::string_view text, SaveRule &out);
+
+// Persistence work taken off the serving path: snapshots (bgsave()), AOF
+// rewrites (bgrewriteaof()) and the snapshots a master sends to replicas
+// (bgsaveForReplication()). Each forks while holding every shard lock,
+// so the child inherits a point-in-time, copy-on-write image of the keyspace
+// and writes it out while the parent keeps serving. Only one child runs at a
+// time.
+//
+// cron() reaps the child and finishes its job in the parent: trimming the
+// AOFs to what a snapshot does not cover, or appending the records logged
+// during a rewrite to the new AOFs and swapping them in. It also starts a
+// save once a rule is due, and a rewrite once the AOFs have grown by
+// aof_rewrite_percentage since the last one (and are at least
+// aof_rewrite_min_size bytes).
+class BackgroundSaver
+{
+public:
+    explicit BackgroundSaver(std::vector<SaveRule> rules,
+                             unsigned aof_rewrite_percentage = 100,
+                             uint64_t aof_rewrite_min_size = 64ULL << 20);
+
+    BackgroundSaver(const BackgroundSaver &) = delete;
+    BackgroundSaver &operator=(const BackgroundSaver &) = delete;
+
+    // Called by every write command, with the number of keys it changed;
+    // lock-free.
+    void noteChange(uint64_t n = 1) noexcept { dirty_.fetch_add(n, std::memory_order_relaxed); }
+
+    // Both return false and set `err` if another child is running or the
+    // save could not be started/completed.
+    bool bgsave(Database &database, std::string &err);
+    bool save(Database &database, std::string &err);
+
+    // Starts a rewrite, or sets `scheduled` and leaves it to cron() if a
+    // background save is running.
+    bool bgrewriteaof(Database &database, bool &scheduled, std::string &err);
+
+    // Replication. bgsaveForReplication() forks a snapshot of the whole
+    // keyspace into one file for replicas to load, and sets `offset` to the
+    // backlog offset it matches; the replication module is told when it is
+    // done. loadReplicaSnapshot() waits for any running child, then swaps
+    // the keyspace for a snapshot received from a master and saves it.
+    bool bgsaveForReplication(Database &database, const ReplicationBacklog &backlog, uint64_t &offset,
+                              std::string &err);
+    bool loadReplicaSnapshot(Database &database, const std::string &path, std::string &err);
+
+    // Housekeeping, driven about ten times a second from one thread.
+    void cron(Database &database);
+    // Blocks until a running child has finished (at shutdown).
+    void waitForChild(Database &database);
+
+    bool inProgress() const;
+    bool aofRewriteInProgress() const;
+    uint64_t changesSinceSave() const noexcept { return dirty_.load(std::memory_order_relaxed); }
+    time_t lastSave() const;
+    bool lastSaveOk() const;
+    bool lastAofRewriteOk() const;
+    // Timings of the last fork, the last successful snapshot (background or
+    // not) and the last successful AOF rewrite.
+    uint64_t lastForkUsec() const;
+    uint64_t lastSaveDurationMs() const;
+    uint64_t lastAofRewriteDurationMs() const;
+
+private:
+    static constexpr long RETRY_DELAY = 5; // seconds between attempts after a failure
+
+    enum class Job
+    {
+        None,
+        Snapshot,
+        AofRewrite,
+        ReplicaSync
+    };
+
+    std::vector<SaveRule> rules_;
+    unsigned aof_rewrite_percentage_;
+    uint64_t aof_rewrite_min_size_;
+    std::atomic<uint64_t> dirty_{0};
+
+    mutable std::mutex mu_;
+    pid_t child_ = -1;
+    Job job_ = Job::None;
+    uint64_t dirty_at_fork_ = 0;
+    std::vector<uint64_t> aof_at_fork_; // per shard
+    time_t started_ = 0;
+    std::chrono::steady_clock::time_point started_at_;
+    uint64_t last_fork_usec_ = 0;
+    uint64_t last_save_duration_ms_ = 0;
+    uint64_t last_rewrite_duration_ms_ = 0;
+    time_t last_save_;
+    time_t last_attempt_ = 0;
+    bool last_ok_ = true;
+    bool rewrite_scheduled_ = false;
+    bool last_rewrite_ok_ = true;
+    time_t last_rewrite_attempt_ = 0;
+    uint64_t aof_base_size_ = 0; // AOF bytes right after the last rewrite
+
+    bool startLocked(Database &database, Job job, std::string &err,
+                     const ReplicationBacklog *backlog = nullptr, uint64_t *repl_offset = nullptr);
+    void finishLocked(Database &database, int status);
+    void waitLocked(Database &database);
+    const char *busyMessage() const;
+};
@@ -0,0 +1,44 @@
+// byteorder.h
+#pragma once
+#include <cstdint>
+#include <string>
+
+// Fixed little-endian encoding for on-disk integers, whatever the host.
+
+inline void storeU32(char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = static_cast<char>(v >> (8 * i));
+}
+
+inline void storeU64(char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = static_cast<char>(v >> (8 * i));
+}
+
+inline uint32_t loadU32(const void *src)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(src);
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+inline uint64_t loadU64(const void *src)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(src);
+    return uint64_t(loadU32(p)) | uint64_t(loadU32(p + 4)) << 32;
+}
+
+inline void appendU32(std::string &out, uint32_t v)
+{
+    char buf[4];
+    storeU32(buf, v);
+    out.append(buf, sizeof(buf));
+}
+
+inline void appendU64(std::string &out, uint64_t v)
+{
+    char buf[8];
+    storeU64(buf, v);
+    out.append(buf, sizeof(buf));
+}
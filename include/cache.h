@@ -1,57 +1,489 @@
 #pragma once
+#include "aof.h"
+#include "crypto.h"
+#include "frequency_sketch.h"
+#include "slab.h"
+#include "spill_store.h"
+#include "timing_wheel.h"
+#include "zeroed_allocator.h"
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
 #include <string>
-#include <unordered_map>
-#include <list>
+#include <string_view>
+#include <vector>
 
+class ReplicationBacklog;
+class SnapshotWriter;
+
+// How a full cache picks its victim.
+//  Lru        exact LRU; every hit moves the entry to the front of the list
+//  SampledLru approximate LRU; a hit only stamps the entry's access clock and
+//             eviction takes the oldest of a few randomly sampled entries
+//  Clock      second-chance CLOCK; a hit sets a reference bit
+//  Random     any entry
+//  TinyLfu    W-TinyLFU: new keys enter a small LRU window; what leaves the
+//             window only displaces the main space's victim if a frequency
+//             sketch says it is the more popular of the two, so one scan of
+//             cold keys cannot flush the hot set. The main space is a
+//             segmented LRU: a key hit while on probation becomes protected.
+enum class EvictionPolicy
+{
+    Lru,
+    SampledLru,
+    Clock,
+    Random,
+    TinyLfu
+};
+
+bool parseEvictionPolicy(std::string_view name, EvictionPolicy &out);
+const char *evictionPolicyName(EvictionPolicy policy);
+
+// Wall-clock milliseconds since the epoch; expiry deadlines are absolute in
+// this clock so that they mean the same thing after a restart.
+uint64_t unixTimeMs();
+
+// Passing empty snapshot/AOF paths gives a purely in-memory cache.
+//
+// Entries live in one contiguous slot array and are chained into an
+// intrusive LRU list by 32-bit slot indices. An open-addressing index maps
+// key hashes to slots. Each key is stored exactly once: inside the slot when
+// key and value together are short, otherwise in a single block that holds
+// the key followed by the value, taken from a per-cache slab allocator.
+// Values that are canonical decimal 64-bit integers are stored as binary
+// integers of the fewest bytes that hold them, which is never longer than the
+// text and often lets the entry stay inside its slot. Active defragmentation
+// moves blocks out of sparsely used slab pages so the pages can be returned.
+//
+// With a spill directory the cache is tiered: an evicted entry is written
+// to a SpillStore on disk instead of being dropped, and a lookup that misses
+// memory takes it from there and brings it back in (possibly pushing another
+// entry out). Every key is in exactly one tier; size() counts memory only.
+//
+// Every change is logged to the AOF and, on a replication master, handed to
+// the replication backlog as the command that replays it.
+//
+// A key may carry an expiry deadline. Deadlines sit in a timing wheel keyed
+// by slot index: an expired key is dropped when it is next looked up, and
+// expireDue() reaps the ones nobody asks for.
 class LRUCache
 {
 public:
+    // capacity limits the number of entries and maxmemory the bytes used by
+    // keys, values and per-entry metadata; 0 leaves either one unbounded.
     LRUCache(size_t capacity,
              const std::string &snapshot_path = "data/snapshot.rdb",
              const std::string &aof_path = "data/aof.log",
-             const std::string &aes_key = "1234567890123456"); // 16 bytes for AES-128
+             const std::string &aes_key = "1234567890123456", // 16 bytes for AES-128
+             size_t maxmemory = 0,
+             EvictionPolicy policy = EvictionPolicy::Lru,
+             AppendFsync fsync = AppendFsync::EverySec,
+             const std::string &spill_dir = "");
 
     ~LRUCache();
 
+    LRUCache(const LRUCache &) = delete;
+    LRUCache &operator=(const LRUCache &) = delete;
+
     // Public API
-    void set(const std::string &key, const std::string &value);
-    bool get(const std::string &key, std::string &out_value);
-    bool del(const std::string &key);
+    // Returns false (and stores nothing) if the entry alone exceeds maxmemory.
+    // The key expires at `expire_at` (unixTimeMs() clock) unless that is 0;
+    // either way any earlier deadline is replaced.
+    bool set(std::string_view key, std::string_view value, uint64_t expire_at = 0);
+    bool get(std::string_view key, std::string &out_value);
+    // Calls f(std::string_view value) if the key exists and returns whether
+    // it did. The view is only valid during the call.
+    template <typename F>
+    bool read(std::string_view key, F &&f);
+    // With `lazy` (UNLINK), a value too large for the slab pages is handed
+    // to the lazy-free thread instead of being freed here.
+    bool del(std::string_view key, bool lazy = false);
+    // Whether the key exists, in either tier; like a read, it counts as an
+    // access.
+    bool exists(std::string_view key);
+    // Whether set() would store the entry, i.e. it alone fits in maxmemory.
+    bool admits(std::string_view key, std::string_view value) const noexcept;
+
+    // Batches. Between beginBatch() and commitBatch() every change is
+    // applied as usual but its log record is held back; commitBatch() writes
+    // what the batch changed (evictions and expiries included, in order) as
+    // one AOF record, sealed in one pass and replayed all or nothing, and
+    // hands the replication backlog the batch in one piece, with runs of
+    // plain SETs and DELs merged into one MSET or DEL command.
+    void beginBatch() noexcept { batching_ = true; }
+    void commitBatch();
+    // Start loading what a lookup of `key` reads, so that it does not wait
+    // on memory when it comes: prefetchIndex() the key's home bucket, and
+    // prefetchEntry() (once that has arrived) the slot it points to. A
+    // batch issues them a few keys ahead of the key it is working on.
+    void prefetchIndex(std::string_view key) const noexcept;
+    void prefetchEntry(std::string_view key) const noexcept;
+
+    // Evictions free large values lazily too, like del(key, true).
+    void setLazyEviction(bool lazy) noexcept { lazy_eviction_ = lazy; }
+    // On a replica the master decides what goes: nothing is evicted, and an
+    // expired key is only hidden from reads until the master's DEL arrives
+    // (writes, which come from the master's stream, still see it). Active
+    // expiry is left to the caller to skip.
+    void setReplica(bool replica) noexcept { replica_ = replica; }
+    // Drops every entry and logs that (FLUSHALL). With `async` the entries
+    // are detached in O(1) and freed on the lazy-free thread. Only the AOF
+    // gets the record: a FLUSHALL empties every shard at once, and
+    // ShardedCache hands it to the replication backlog a single time.
+    void flush(bool async);
+
+    // Cursor-based iteration (SCAN). Appends to `keys` the entries whose
+    // home bucket is `cursor` and those of the following cursors, until
+    // `keys` holds `count` keys or 10 * count buckets were visited, and
+    // returns the cursor to continue from: 0 once the whole index was
+    // visited. The cursor counts home buckets in reverse-binary order, so
+    // a key present for a whole iteration is returned at least once however
+    // the index grows meanwhile (doubling splits a home bucket into two
+    // that follow each other in that order); a key may be returned twice.
+    // While rehashing both tables are visited. Expired keys are skipped;
+    // spilled keys are not visited.
+    uint64_t scan(uint64_t cursor, size_t count, std::vector<std::string> &keys) const;
+
+    // Hot keys. One access in `rate` on average (0 turns sampling off) is
+    // counted, reads and writes alike, in a Space-Saving table of the
+    // HOT_KEY_SLOTS keys sampled most; the counts halve every
+    // HOT_KEY_DECAY_SAMPLES samples, so the table follows what is hot now.
+    // Between samples an access costs one decrement. hotKeys() appends the
+    // table with each count scaled back up by the rate, and the value's
+    // length, or -1 if the key is not in memory any more.
+    struct HotKey
+    {
+        std::string key;
+        uint64_t accesses;
+        int64_t value_bytes;
+    };
+    void setHotKeySampling(uint32_t rate);
+    void hotKeys(std::vector<HotKey> &out);
+
+    // Expiry. expire() returns false if the key does not exist; a deadline
+    // already passed deletes it. persist() returns true if a deadline was
+    // removed. pttl() gives the milliseconds left, -1 for a key without a
+    // deadline and -2 for a missing key.
+    bool expire(std::string_view key, uint64_t at_ms);
+    bool persist(std::string_view key);
+    int64_t pttl(std::string_view key);
+
+    // Deletes keys whose deadline is at or before now_ms, earliest first,
+    // until none is left or the steady clock passes `until`. Returns the
+    // number deleted; `drained` tells whether nothing due is left.
+    size_t expireDue(uint64_t now_ms, std::chrono::steady_clock::time_point until, bool &drained);
 
     size_t size() const noexcept;
     size_t capacity() const noexcept;
+    // Bytes charged against maxmemory: keys, values and per-entry metadata.
+    size_t usedMemory() const noexcept { return used_bytes_; }
+    size_t maxMemory() const noexcept { return maxmemory_; }
+    EvictionPolicy policy() const noexcept { return policy_; }
+    size_t evictions() const noexcept { return evictions_; }
+    size_t expiredKeys() const noexcept { return expired_; }
+    size_t expiringKeys() const noexcept { return wheel_.size(); }
+    // Bytes actually held by slots, index and out-of-line key/value blocks.
+    size_t memoryUsage() const noexcept;
+
+    // Active defragmentation. Once enough slab pages are sparsely used,
+    // defragStep() starts a pass over the entries that moves blocks out of
+    // sparse pages, and continues it on later calls; each call runs until the
+    // steady clock passes `until`. `done` tells whether no pass is left
+    // unfinished. Returns the blocks moved.
+    size_t defragStep(std::chrono::steady_clock::time_point until, bool &done);
+    SlabAllocator::Stats allocatorStats() const noexcept { return slab_->stats(); }
+    size_t defragHits() const noexcept { return defrag_hits_; }
+    size_t defragMisses() const noexcept { return defrag_misses_; }
+    bool defragRunning() const noexcept { return defrag_running_; }
 
-    // Persistence
-    void saveSnapshot();
+    // Incremental rehashing. The index grows by moving its entries into a
+    // table twice the size a few buckets at a time: every keyed operation
+    // moves REHASH_STEP_BUCKETS of the old table's buckets, and rehashStep()
+    // moves more until the steady clock passes `until`, so an idle shard
+    // finishes too. Lookups search both tables meanwhile. `done` tells
+    // whether no move is left unfinished. Returns the entries moved.
+    size_t rehashStep(std::chrono::steady_clock::time_point until, bool &done);
+    bool rehashing() const noexcept { return !old_index_.empty(); }
+    // Sizes the index for `entries` keys at once, as loading a snapshot of
+    // that many records does, so filling it never rehashes.
+    void reserve(size_t entries);
+
+    // Tiered mode. spillGC() runs the disk tier's garbage collector until
+    // `until`; `done` tells whether nothing is left to collect.
+    bool tiered() const noexcept { return spill_ != nullptr; }
+    size_t spillGC(std::chrono::steady_clock::time_point until, bool &done);
+    SpillStore::Stats spillStats() const noexcept { return spill_ ? spill_->stats() : SpillStore::Stats{}; }
+
+    // Persistence. saveSnapshot() returns false if the file could not be
+    // written; the previous snapshot is then left in place. It does not
+    // touch the AOF: call snapshotTaken() with the aofPosition() noted
+    // before the save to drop the records the snapshot now covers.
+    bool saveSnapshot();
+    void snapshotTaken(uint64_t pos);
     void flushAOF();
 
+    // AOF rewrite, in three steps: note aofPosition(), have rewriteAOF()
+    // write a minimal log of the live entries (a forked child does this
+    // while the log keeps growing), then installAOFRewrite() with the noted
+    // position appends the records logged since and swaps the new log in.
+    // discardAOFRewrite() cleans up after a failed rewrite.
+    uint64_t aofPosition() const;
+    uint64_t aofSize() const;
+    // True while the AOF cannot be written (see AofWriter::writeError()).
+    bool aofWriteError(std::string &err) const;
+    bool rewriteAOF();
+    bool installAOFRewrite(uint64_t pos);
+    void discardAOFRewrite();
+
+    // Replication. Writes go to `backlog` as well while one is set. dumpTo()
+    // adds every live entry to a snapshot, oldest first. On a replica taking
+    // a full sync, clear() drops every entry (on the lazy-free thread with
+    // `async`) and restore() stores the master's, neither of them logged.
+    void setReplicationBacklog(ReplicationBacklog *backlog) noexcept { backlog_ = backlog; }
+    bool dumpTo(SnapshotWriter &out);
+    void clear(bool async = false);
+    void restore(std::string_view key, std::string_view value, uint64_t expire_at);
+
 private:
-    struct Entry
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr uint32_t FREE = UINT32_MAX; // key_len of an unused slot
+    static constexpr uint32_t MOVED = NIL - 1;   // slot of an old_index_ bucket already moved
+    static constexpr size_t REHASH_STEP_BUCKETS = 16;
+    static constexpr size_t INLINE_BYTES = 24;
+    static constexpr int EVICTION_SAMPLES = 5;
+    static constexpr size_t WINDOW_PERCENT = 1;     // TinyLfu: window share of the entries
+    static constexpr size_t PROTECTED_PERCENT = 80; // TinyLfu: protected share of the main space
+    static constexpr size_t MAX_VALUE = (size_t(1) << 30) - 1;
+    static constexpr size_t DEFRAG_IGNORE_BYTES = 1 << 20; // reclaimable bytes that never start a pass
+    static constexpr size_t DEFRAG_THRESHOLD_PERCENT = 10; // ... and their share of the slab pages
+    static constexpr char SET_RECORD = 's'; // AOF record types; 'S'/'D' are
+    static constexpr char DEL_RECORD = 'd'; // the older per-field format
+    static constexpr char SETEX_RECORD = 't';
+    static constexpr char EXPIRE_RECORD = 'x';
+    static constexpr char PERSIST_RECORD = 'p';
+    static constexpr char BATCH_RECORD = 'm';
+    static constexpr char FLUSH_RECORD = 'f';
+    static constexpr size_t BATCH_BUFFER_KEEP = 1 << 20; // record buffer capacity kept after a batch
+    static constexpr size_t HOT_KEY_SLOTS = 32;
+    static constexpr uint32_t HOT_KEY_DECAY_SAMPLES = 1 << 14;
+
+    struct Slot
     {
-        std::string value;
-        std::list<std::string>::iterator it;
+        uint32_t prev; // towards the most recently used end
+        uint32_t next; // towards the least recently used end; free-list link when unused
+        uint32_t hash;
+        uint32_t key_len;
+        uint32_t val_len : 30; // stored bytes; see int_value
+        uint32_t expires : 1;  // has a deadline in wheel_
+        uint32_t int_value : 1; // value is an integer stored in val_len bytes, little-endian
+        uint32_t access; // access clock (SampledLru), reference bit (Clock) or Segment (TinyLfu)
+        union
+        {
+            char inline_data[INLINE_BYTES];
+            char *heap;
+        };
+
+        bool isInline() const noexcept { return key_len + static_cast<size_t>(val_len) <= INLINE_BYTES; }
+        char *data() noexcept { return isInline() ? inline_data : heap; }
+        const char *data() const noexcept { return isInline() ? inline_data : heap; }
+        std::string_view key() const noexcept { return {data(), key_len}; }
+        // The value as stored; valueOf() gives the text of integers.
+        std::string_view stored() const noexcept { return {data() + key_len, val_len}; }
+    };
+    static_assert(sizeof(void *) != 8 || sizeof(Slot) == 48, "Slot no longer fits in 48 bytes");
+
+    // The slot is stored inverted, so zeroed memory is a table of empty
+    // (NIL) buckets.
+    struct Bucket
+    {
+        uint32_t hash;
+        uint32_t inverted_slot;
+
+        Bucket() = default;
+        Bucket(uint32_t h, uint32_t s) noexcept : hash(h), inverted_slot(~s) {}
+        uint32_t slot() const noexcept { return ~inverted_slot; } // NIL when empty
+        void setSlot(uint32_t s) noexcept { inverted_slot = ~s; }
+    };
+    using IndexTable = std::vector<Bucket, ZeroedAllocator<Bucket>>;
+
+    // Recency lists. Policies other than TinyLfu keep every entry on
+    // lists_[0].
+    enum Segment : uint32_t
+    {
+        WINDOW = 0,
+        PROBATION = 1,
+        PROTECTED = 2
+    };
+    static constexpr Segment OLDEST_FIRST[3] = {PROBATION, PROTECTED, WINDOW};
+
+    struct List
+    {
+        uint32_t head = NIL; // most recently used
+        uint32_t tail = NIL; // least recently used
+        size_t count = 0;
     };
 
     size_t capacity_;
-    std::list<std::string> lru_list_;
-    std::unordered_map<std::string, Entry> map_;
+    size_t maxmemory_;
+    EvictionPolicy policy_;
+    std::vector<Slot> slots_;
+    IndexTable index_;      // power-of-two size, linear probing
+    IndexTable old_index_;  // being moved into index_; empty when not rehashing
+    size_t rehash_pos_ = 0; // old_index_ buckets before this have been moved
+    uint32_t free_head_ = NIL;
+    List lists_[3];
+    size_t count_ = 0;
+    size_t used_bytes_ = 0;
+    size_t evictions_ = 0;
+    size_t expired_ = 0;
+    uint32_t access_clock_ = 0;
+    uint32_t clock_hand_ = 0;
+    uint64_t rng_state_ = 0x9E3779B97F4A7C15ULL;
+    FrequencySketch sketch_; // TinyLfu only
+    TimingWheel wheel_;
+    std::unique_ptr<SlabAllocator> slab_; // replaced whole by clear(true)
+    char int_text_[24]; // valueOf() of an integer value
+    uint32_t defrag_cursor_ = 0;
+    bool defrag_running_ = false;
+    size_t defrag_hits_ = 0;
+    size_t defrag_misses_ = 0;
+    bool lazy_eviction_ = false;
+    bool replica_ = false;
+    struct HotKeyCounter
+    {
+        std::string key;
+        uint32_t hash;
+        uint32_t count;
+    };
+    std::vector<HotKeyCounter> hot_keys_;
+    uint32_t hot_key_rate_ = 0;
+    uint32_t hot_key_countdown_ = 0; // accesses left before the next sample; 0 when off
+    uint32_t hot_key_samples_ = 0;   // since the counts were last halved
 
     std::string snapshot_path_;
     std::string aof_path_;
     std::string aes_key_;
+    RecordCipher cipher_;
     bool loading_;
+    std::unique_ptr<AofWriter> aof_;
+    std::unique_ptr<SpillStore> spill_; // tiered mode only
+    std::string aof_record_; // reused to build each record
+    ReplicationBacklog *backlog_ = nullptr;
+    bool batching_ = false;
+    std::string batch_record_;   // plaintext of the batch's records
+    size_t batch_records_ = 0;
+    std::string batch_stream_;   // its commands for the replication backlog
+    std::string batch_run_;      // arguments of the MSET or DEL being merged
+    size_t batch_run_args_ = 0;
+    char batch_run_op_ = 0;      // SET_RECORD or DEL_RECORD while merging
+
+    bool persistent() const noexcept { return !snapshot_path_.empty(); }
+    // Whether changes are written anywhere: an AOF or a replication backlog.
+    bool logging() const noexcept { return !loading_ && (aof_ || backlog_); }
 
     // Internals
-    void set_internal(const std::string &key, const std::string &value, bool append);
-    void del_internal(const std::string &key, bool append);
+    bool set_internal(std::string_view key, std::string_view value, uint64_t expire_at, bool append);
+    bool del_internal(std::string_view key, bool append, bool lazy = false);
+    bool expire_internal(std::string_view key, uint64_t at_ms, bool append);
+    bool persist_internal(std::string_view key, bool append);
+    // `promote` brings a key in from the disk tier if it is only there;
+    // `write` is for changes, which on a replica still find expired keys.
+    size_t findLive(std::string_view key, bool promote = true, bool write = false);
+    bool takeSpilled(std::string_view key, std::string_view &value, uint64_t &expire_at);
+    void expireSlot(uint32_t s);
+    uint64_t deadline(uint32_t s) const noexcept { return slots_[s].expires ? wheel_.deadline(s) : 0; }
+
+    // Slot storage and LRU links
+    static uint32_t hashKey(std::string_view key) noexcept;
+    // Bucket positions are always in index_; an entry found in old_index_
+    // is moved over first.
+    size_t findBucket(std::string_view key, uint32_t hash);
+    size_t slotBucket(uint32_t s);
+    size_t probe(const IndexTable &table, std::string_view key, uint32_t hash) const noexcept;
+    void insertBucket(uint32_t hash, uint32_t slot);
+    size_t placeBucket(Bucket b) noexcept;
+    size_t moveBucket(size_t old_pos) noexcept;
+    void eraseBucket(size_t pos) noexcept;
+    void growIndex();
+    void resizeIndex(size_t buckets);
+    size_t rehashBuckets(size_t n) noexcept;
+    uint32_t allocSlot();
+    void freeSlot(uint32_t s) noexcept;
+    void storeEntry(Slot &slot, std::string_view key, std::string_view value);
+    void storeValue(Slot &slot, std::string_view value);
+    void releaseData(Slot &slot, bool lazy = false) noexcept;
+    struct DroppedEntries; // what clear(true) hands to the lazy-free thread
+    static size_t encodeInteger(std::string_view value, char *out) noexcept;
+    std::string_view valueOf(uint32_t s) noexcept;
+    bool needsDefrag() const noexcept;
+    List &listOf(uint32_t s) noexcept { return lists_[policy_ == EvictionPolicy::TinyLfu ? slots_[s].access : 0]; }
+    void unlink(uint32_t s) noexcept;
+    void pushFront(uint32_t s) noexcept;
+    void removeSlot(size_t bucket_pos, bool lazy = false);
+    void scanBucket(const IndexTable &table, size_t home, uint64_t now, std::vector<std::string> &keys) const;
+
+    // Eviction
+    static size_t entryCost(size_t key_len, size_t val_len) noexcept;
+    void touch(uint32_t s) noexcept;
+    bool overLimit() const noexcept;
+    void evictUntilWithinLimits(uint32_t keep, bool append);
+    void evictSlot(uint32_t s, bool append);
+    uint32_t pickVictim(uint32_t keep) noexcept;
+    void evictTinyLfu(uint32_t keep, bool append);
+    void moveTo(uint32_t s, Segment segment) noexcept;
+    size_t windowLimit() const noexcept;
+    size_t protectedLimit() const noexcept;
+    uint32_t randomLiveSlot(uint32_t keep) noexcept;
+    uint64_t nextRandom() noexcept;
+    void sampleAccess(uint32_t s)
+    {
+        if (hot_key_countdown_ && --hot_key_countdown_ == 0)
+            countHotKey(s);
+    }
+    void countHotKey(uint32_t s);
 
     // Persistence helpers
     void loadSnapshot();
+    void loadLegacySnapshot();
     void loadAOF();
-    void appendAOF_set(const std::string &key, const std::string &value);
-    void appendAOF_del(const std::string &key);
+    void loadLegacyAOF(std::string_view data);
+    void replayRecord(char op, std::string_view sealed, std::string &plain);
+    static size_t recordSize(char op, std::string_view plain) noexcept;
+    void applyRecord(char op, std::string_view plain);
+    void propagateSet(std::string_view key, std::string_view value, uint64_t expire_at);
+    void propagateDel(std::string_view key);
+    void propagateExpire(std::string_view key, uint64_t at_ms);
+    void propagatePersist(std::string_view key);
+    // Makes aof_record_ the record; false if it could not be sealed.
+    bool buildRecord(char op, std::string_view key, std::string_view value, uint64_t expire_at = 0)
+    {
+        return buildRecord(cipher_, op, key, value, expire_at);
+    }
+    // Sealed with `cipher`: a forked child needs a cipher of its own.
+    bool buildRecord(RecordCipher &cipher, char op, std::string_view key, std::string_view value,
+                     uint64_t expire_at = 0);
+    void appendRecord(bool sealed);
+    void logRecord(char op, std::string_view key, std::string_view value, uint64_t expire_at = 0);
+    void logCommand(std::initializer_list<std::string_view> argv);
+    void logToRun(char op, std::string_view key, std::string_view value);
+    void flushRun();
+    std::string rewritePath() const { return aof_path_ + ".rewrite"; }
 
-    // AES helpers
-    std::string aes_encrypt(const std::string &plaintext);
+    // Legacy (pre-AEAD) record decryption
     std::string aes_decrypt(const std::string &ciphertext);
 };
+
+template <typename F>
+bool LRUCache::read(std::string_view key, F &&f)
+{
+    size_t pos = findLive(key);
+    if (pos == SIZE_MAX)
+        return false;
+
+    uint32_t s = index_[pos].slot();
+    touch(s);
+    sampleAccess(s);
+    f(valueOf(s));
+    return true;
+}
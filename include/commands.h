@@ -0,0 +1,64 @@
+// commands.h
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+class ShardedCache;
+class BackgroundSaver;
+class Replication;
+
+// Collects a command's reply into an output buffer, either RESP2-encoded for
+// network clients or as the plain text the interactive prompt prints.
+// Replies are appended in place; no temporaries are built per reply.
+class Reply
+{
+public:
+    enum class Mode
+    {
+        Text,
+        Resp
+    };
+
+    Reply(std::string &out, Mode mode) : out_(out), mode_(mode) {}
+
+    void status(std::string_view msg);
+    void error(std::string_view msg);
+    void bulk(std::string_view value);
+    void nil();
+    void integer(long long n);
+    // Starts an array of n elements; the next n replies are its elements.
+    // The text form just prints the elements one per line.
+    void array(size_t n);
+
+private:
+    std::string &out_;
+    Mode mode_;
+
+    void appendNumber(long long n);
+};
+
+// Everything a command handler may touch. Handlers run concurrently on the
+// server's worker threads (and a replica's link thread); the keyspace locks
+// per shard, the saver and the replication state have their own locks.
+struct Database
+{
+    ShardedCache &cache;
+    BackgroundSaver &saver;
+    Replication &replication;
+};
+
+enum class CommandStatus
+{
+    Ok,
+    Quit,     // client asked to leave (EXIT / QUIT)
+    Replicate // client is a replica (PSYNC): hand its connection over
+};
+
+// Looks the command up in the dispatch table and runs it. argv[0] is the
+// command name in any letter case.
+CommandStatus executeCommand(Database &database, const std::vector<std::string_view> &argv, Reply &reply);
+
+// Periodic housekeeping (background save triggers and the like). Call it
+// about ten times a second from a single thread.
+void serverCron(Database &database);
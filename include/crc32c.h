@@ -0,0 +1,9 @@
+// crc32c.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli). Pass the previous result as `crc` to checksum data
+// in pieces; start from 0. Uses the SSE4.2 crc32 instruction when the CPU
+// has it, table lookups otherwise.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) noexcept;
@@ -0,0 +1,51 @@
+// crypto.h
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+
+// Authenticated encryption (AES-GCM) of whole records in one pass.
+//
+// A sealed record is nonce[12] || ciphertext || tag[16], written straight
+// into the caller's buffer; nothing is allocated per call. The EVP context
+// is set up with the key once per thread and reused, so sealing a record
+// only resets the nonce. The nonce is a random 32-bit prefix followed by a
+// 64-bit counter that starts at a random value and is bumped per record:
+// never repeated within one cipher in one process, and two ciphers only
+// collide if 96 random bits line up. A forked child must not seal with a
+// cipher it inherited: the parent goes on with the same prefix and counter,
+// so both would use the same nonces. The child makes a RecordCipher of its
+// own instead.
+//
+// The key picks AES-128/192/256 by its length (16/24/32 bytes; longer keys
+// use the first 32). Thread-safe.
+class RecordCipher
+{
+public:
+    static constexpr size_t NONCE_BYTES = 12;
+    static constexpr size_t TAG_BYTES = 16;
+    static constexpr size_t OVERHEAD = NONCE_BYTES + TAG_BYTES;
+
+    // Throws std::invalid_argument for keys shorter than 16 bytes.
+    explicit RecordCipher(std::string_view key);
+
+    static constexpr size_t sealedSize(size_t plain_len) noexcept { return plain_len + OVERHEAD; }
+
+    // Encrypts the concatenation of `parts` into `out`, which must hold
+    // sealedSize(total length) bytes. `aad` is authenticated but not
+    // stored. Returns the bytes written (0 on failure).
+    size_t seal(std::string_view aad, std::initializer_list<std::string_view> parts, char *out);
+
+    // Checks and decrypts `sealed` into `out` (sealed.size() - OVERHEAD
+    // bytes). Returns false if the data or `aad` was tampered with, or the
+    // key is wrong.
+    bool open(std::string_view aad, std::string_view sealed, char *out) const;
+
+private:
+    std::string key_;
+    unsigned char prefix_[4];
+    std::atomic<uint64_t> counter_;
+};
@@ -0,0 +1,48 @@
+// frequency_sketch.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Count-min sketch of 4-bit counters estimating how often a key was seen
+// recently; the popularity test of W-TinyLFU admission. Laid out like
+// Caffeine's: the table is a run of 64-byte blocks of eight 64-bit words,
+// each word holding sixteen counters. A key picks one block and, in each of
+// four rows (a pair of words), one counter, so an update or estimate
+// touches a single cache line. Once the number of increments reaches ten
+// times the expected key count, every counter is halved (one shift and mask
+// per word, which the compiler vectorises), so old popularity fades.
+//
+// Keys are identified by a 32-bit hash; the sketch remixes it.
+class FrequencySketch
+{
+public:
+    static constexpr unsigned MAX_COUNT = 15;
+
+    // Resizes (and clears) the table for about `expected` distinct keys if
+    // it is smaller than that.
+    void ensureCapacity(size_t expected);
+    // Number of keys the table is currently sized for.
+    size_t capacity() const noexcept { return blocks_ * WORDS_PER_BLOCK; }
+
+    void increment(uint32_t hash) noexcept;
+    // Estimated recent accesses, 0 to MAX_COUNT.
+    unsigned frequency(uint32_t hash) const noexcept;
+
+    size_t memoryUsage() const noexcept { return blocks_ * sizeof(Block); }
+
+private:
+    static constexpr size_t WORDS_PER_BLOCK = 8;
+
+    struct alignas(64) Block
+    {
+        uint64_t words[WORDS_PER_BLOCK];
+    };
+
+    std::unique_ptr<Block[]> table_;
+    size_t blocks_ = 0;
+    size_t additions_ = 0;
+    size_t sample_size_ = 0;
+
+    void halve() noexcept;
+};
@@ -0,0 +1,108 @@
+// io_engine.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+// How persistence does its file I/O.
+//  Uring     io_uring: writes and fsyncs are queued and submitted together
+//            in one system call, and run while the caller goes on (the
+//            default; Blocking is used instead where the kernel refuses)
+//  Blocking  pwrite/pread/fdatasync, one system call each, in the caller
+enum class IoBackend
+{
+    Uring,
+    Blocking
+};
+
+bool parseIoBackend(std::string_view name, IoBackend &out);
+const char *ioBackendName(IoBackend backend);
+
+// The backend engines are made with from now on (--io-backend), and the one
+// they actually got: Blocking if io_uring was asked for but could not be set
+// up.
+void setIoBackend(IoBackend backend) noexcept;
+IoBackend ioBackend() noexcept;
+IoBackend effectiveIoBackend() noexcept;
+
+// Queues file operations and waits for them. Every operation gets a ticket,
+// numbered in queue order; wait(ticket) returns once that operation and all
+// queued before it have completed. An engine belongs to one thread at a
+// time.
+//
+// A sync() is ordered after every write queued before it: on io_uring it is
+// linked behind the writes queued since the last submit, and drains the
+// ring if earlier ones may still be in flight. Writes cut short (or
+// cancelled because a linked write was cut short) are finished with
+// pwrite(), and a cancelled sync is redone, before wait() returns.
+class IoEngine
+{
+public:
+    // Writes at the file position: for an O_APPEND file, at its end.
+    static constexpr uint64_t APPEND = UINT64_MAX;
+
+    // An engine of ioBackend(); a Blocking one if io_uring is unavailable.
+    static std::unique_ptr<IoEngine> create();
+    static std::unique_ptr<IoEngine> create(IoBackend backend);
+
+    virtual ~IoEngine() = default;
+
+    virtual IoBackend backend() const noexcept = 0;
+    // Queues writing data[0..len) at `offset` (or APPEND). The data must
+    // stay in place until the write has completed.
+    virtual uint64_t write(int fd, const void *data, size_t len, uint64_t offset) = 0;
+    // Queues an fdatasync of fd.
+    virtual uint64_t sync(int fd) = 0;
+    // Starts whatever is queued, without waiting for it.
+    virtual void submit() = 0;
+    // Submits, then waits as above. Returns false if any operation failed
+    // since the last wait() that returned; errno tells why.
+    virtual bool wait(uint64_t ticket) = 0;
+    bool waitAll() { return wait(last_ticket_); }
+    // Reads up to len bytes at `offset` into data, blocking; returns the
+    // bytes read (fewer only at the end of the file) or -1.
+    virtual ssize_t read(int fd, void *data, size_t len, uint64_t offset) = 0;
+
+protected:
+    uint64_t last_ticket_ = 0;
+};
+
+// Writes a file front to back through an engine, in BUFFER_BYTES chunks:
+// a full buffer is queued and the next one filled while it is written, with
+// up to BUFFERS chunks in flight. The file is not closed.
+class IoWriter
+{
+public:
+    static constexpr size_t BUFFER_BYTES = 1 << 20;
+    static constexpr size_t BUFFERS = 4;
+
+    // Writes from `offset` on (APPEND for an O_APPEND file).
+    IoWriter(IoEngine &engine, int fd, uint64_t offset = 0);
+    ~IoWriter(); // waits for what is in flight
+
+    IoWriter(const IoWriter &) = delete;
+    IoWriter &operator=(const IoWriter &) = delete;
+
+    // False once anything failed; errno tells why.
+    bool append(std::string_view data);
+    // Writes what is buffered, fdatasyncs if `sync`, and waits for it all.
+    bool finish(bool sync);
+    // Bytes appended so far.
+    uint64_t size() const noexcept { return appended_; }
+
+private:
+    IoEngine &engine_;
+    int fd_;
+    uint64_t offset_;
+    uint64_t appended_ = 0;
+    bool ok_ = true;
+    std::vector<std::string> buffers_;
+    std::vector<uint64_t> tickets_; // of each buffer's last write; 0 = none
+    size_t current_ = 0;
+
+    bool queueCurrent();
+};
@@ -0,0 +1,77 @@
+// lazy_free.h
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Frees memory on a background thread, so that dropping a large value or a
+// whole keyspace (UNLINK, FLUSHALL ASYNC, lazy eviction) does not stall the
+// thread that dropped it, nor the clients waiting on its shard lock.
+//
+// Work is handed over through a lock-free multi-producer queue (Vyukov's
+// linked list with a dummy node): enqueuing is one node allocation and one
+// atomic exchange, so a shard can hand memory over while holding its own
+// lock. A single thread drains the queue; it sleeps while the queue is
+// empty and the next enqueue wakes it.
+//
+// Thread-safe. lazyFree() is the process-wide instance.
+class LazyFree
+{
+public:
+    // Something to destroy in the background; its destructor frees the
+    // memory.
+    class Job
+    {
+    public:
+        virtual ~Job() = default;
+    };
+
+    LazyFree();
+    ~LazyFree(); // frees whatever is still queued
+
+    LazyFree(const LazyFree &) = delete;
+    LazyFree &operator=(const LazyFree &) = delete;
+
+    // Takes a block allocated with new char[]; `bytes` is its size.
+    void freeBlock(char *block, size_t bytes);
+    // Takes `job`, which frees `objects` objects holding about `bytes`.
+    void enqueue(std::unique_ptr<Job> job, size_t objects, size_t bytes);
+
+    // Objects and bytes handed over but not freed yet, and objects freed
+    // since startup.
+    size_t pendingObjects() const noexcept { return pending_objects_.load(std::memory_order_relaxed); }
+    size_t pendingBytes() const noexcept { return pending_bytes_.load(std::memory_order_relaxed); }
+    uint64_t freedObjects() const noexcept { return freed_objects_.load(std::memory_order_relaxed); }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next{nullptr};
+        std::unique_ptr<Job> job;
+        char *block = nullptr;
+        size_t objects = 0;
+        size_t bytes = 0;
+    };
+
+    std::atomic<Node *> head_; // producers link new nodes here
+    Node *tail_;               // the dummy; the consumer's end
+    std::atomic<size_t> pending_objects_{0};
+    std::atomic<size_t> pending_bytes_{0};
+    std::atomic<uint64_t> freed_objects_{0};
+
+    std::mutex mu_; // only for sleeping and waking
+    std::condition_variable cv_;
+    std::atomic<bool> sleeping_{false};
+    bool stopping_ = false;
+    std::thread thread_;
+
+    void push(Node *node);
+    Node *pop() noexcept;
+    void run();
+};
+
+LazyFree &lazyFree();
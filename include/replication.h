@@ -0,0 +1,220 @@
+// replication.h
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct Database;
+
+// The master's replication backlog: a ring buffer holding the most recent
+// bytes of the write stream, as RESP commands. Offsets count every byte
+// ever appended, so a replica that knows how far it got can be sent the
+// rest, as long as the ring has not wrapped past it.
+//
+// Writes are appended by the cache shards under their own locks, so the
+// commands of any one key come out in the order they were applied.
+// Thread-safe.
+class ReplicationBacklog
+{
+public:
+    explicit ReplicationBacklog(size_t size);
+
+    // Appends the command argv[0] argv[1] ... as a RESP array.
+    void appendCommand(std::initializer_list<std::string_view> argv);
+    // Appends commands already RESP-encoded, as one piece: a write made of
+    // several commands reaches the stream with nothing in between.
+    void append(std::string_view commands);
+
+    // RESP encoding, for writers that gather commands before appending:
+    // an array header for n arguments, and one argument.
+    static void encodeArray(std::string &out, size_t n);
+    static void encodeBulk(std::string &out, std::string_view arg);
+
+    // The offset just past the last byte appended, and of the oldest byte
+    // still held.
+    uint64_t offset() const;
+    uint64_t firstOffset() const;
+    size_t size() const noexcept { return buf_.size(); }
+
+    // Appends up to `max` bytes starting at offset `from` to `out`. Returns
+    // false if `from` is no longer (or not yet) in the ring.
+    bool copy(uint64_t from, std::string &out, size_t max) const;
+
+private:
+    mutable std::mutex mu_;
+    std::vector<char> buf_;
+    uint64_t offset_ = 0;
+};
+
+// Master/replica replication.
+//
+// A master hands every write to its backlog once the first replica has
+// connected. A replica connects and sends "PSYNC <replid> <offset>", naming
+// the master run it last followed and how many bytes of its stream it has
+// applied ("? -1" the first time). If that run is still the master's and
+// the offset still in the backlog, the master answers "+CONTINUE" and
+// carries on from there. Otherwise it answers "+FULLRESYNC <replid>
+// <offset>", has the background saver fork a snapshot of the whole keyspace
+// as of that offset, sends it as "$<length>\r\n<file>", and then the
+// commands logged since. Replicas report "REPLCONF ACK <offset>" every
+// second; the master puts a PING in the stream every second, so an idle
+// link is still seen to be alive.
+//
+// Replica sockets are served by one sender thread that copies new backlog
+// bytes to each replica every few milliseconds. A replica that falls so far
+// behind that the ring wraps past it is dropped; it will resync when it
+// reconnects.
+//
+// A replica runs a link thread that applies the stream through the regular
+// command table, so the writes reach its own AOF and snapshots as well.
+// Clients may read from a replica; writes from anyone but the link are
+// refused.
+class Replication
+{
+public:
+    // What INFO reports about a replica, as seen by its master.
+    struct ReplicaInfo
+    {
+        std::string ip;
+        uint16_t port;
+        const char *state; // wait_bgsave, send_bulk or online
+        uint64_t offset;   // last acknowledged
+        uint64_t lag;      // seconds since the last acknowledgement
+    };
+
+    struct Status
+    {
+        bool replica = false;
+        // Master side
+        std::string replid;
+        uint64_t offset = 0;
+        bool backlog_active = false;
+        size_t backlog_size = 0;
+        uint64_t backlog_first = 0;
+        uint64_t backlog_histlen = 0;
+        std::vector<ReplicaInfo> replicas;
+        // Replica side
+        std::string master_host;
+        uint16_t master_port = 0;
+        bool link_up = false;
+        long long last_io_seconds = -1;
+        bool sync_in_progress = false;
+        uint64_t replica_offset = 0;
+    };
+
+    // `sync_path` is where full-sync snapshots are written (master) or
+    // received (replica).
+    Replication(size_t backlog_size, std::string sync_path);
+    ~Replication();
+
+    Replication(const Replication &) = delete;
+    Replication &operator=(const Replication &) = delete;
+
+    bool isReplica() const noexcept { return replica_.load(std::memory_order_relaxed); }
+    // True on a replica's link thread, whose writes are allowed.
+    static bool applyingStream() noexcept;
+
+    // Master: takes over a client socket that sent PSYNC, together with any
+    // replies still owed to it.
+    void addReplica(Database &database, int fd, std::string_view replid, std::string_view offset,
+                    std::string pending);
+    // Master: the forked snapshot for the waiting replicas is written (or
+    // failed); called by the background saver.
+    void syncSnapshotDone(bool ok);
+    const std::string &syncPath() const noexcept { return sync_path_; }
+
+    // REPLICAOF host port: drops any replicas and follows the given master.
+    // Returns false if already following it.
+    bool replicaOf(Database &database, const std::string &host, uint16_t port);
+    // REPLICAOF NO ONE: stops following and becomes a master under a new
+    // replication id, keeping the data.
+    void promote(Database &database);
+
+    // Starts the full syncs replicas are waiting for; about ten times a
+    // second from the cron.
+    void cron(Database &database);
+    // Disconnects everything and stops the threads (at shutdown).
+    void stop();
+
+    Status status() const;
+
+private:
+    // Transfer limits: a replica's link is dropped once this much stream
+    // piles up while its snapshot is prepared and sent, or once it has
+    // been silent this long.
+    static constexpr size_t SYNC_BUFFER_LIMIT = 256 << 20;
+    static constexpr time_t TIMEOUT_SECONDS = 60;
+
+    enum class State
+    {
+        WaitStart,   // needs a snapshot; none forked yet
+        WaitBgsave,  // snapshot being written
+        SendBulk,    // snapshot being sent
+        Online
+    };
+
+    struct Replica
+    {
+        int fd;
+        std::string ip;
+        uint16_t port;
+        State state = State::WaitStart;
+        uint64_t sent = 0;   // next backlog offset to copy
+        std::string out;     // bytes for the socket
+        size_t out_pos = 0;
+        std::string pending; // stream held back until the snapshot is sent
+        int bulk_fd = -1;    // snapshot file being sent
+        uint64_t bulk_left = 0;
+        uint64_t bulk_pos = 0;
+        std::string in;      // acknowledgements from the replica
+        uint64_t ack = 0;
+        time_t last_ack;
+    };
+
+    size_t backlog_size_;
+    std::string sync_path_;
+    std::atomic<bool> replica_{false};
+
+    mutable std::mutex mu_;
+    std::string replid_;
+    std::shared_ptr<ReplicationBacklog> backlog_; // created for the first replica
+    std::vector<std::unique_ptr<Replica>> replicas_;
+    std::thread sender_;
+    bool sender_stop_ = false;
+    time_t last_ping_ = 0;
+
+    // Replica side, under mu_ unless noted.
+    std::string master_host_;
+    uint16_t master_port_ = 0;
+    std::thread link_;
+    bool link_stop_ = false;
+    std::condition_variable link_cv_; // wakes the link thread's retry wait
+    int link_fd_ = -1;
+    bool link_up_ = false;
+    bool sync_in_progress_ = false;
+    time_t last_io_ = 0;
+    std::string master_replid_;        // run being followed, "?" if none
+    std::atomic<uint64_t> applied_{0}; // stream bytes applied
+
+    void runSender();
+    // Both return false once the replica should be dropped.
+    bool serviceReplica(Replica &r, bool readable, time_t now);
+    bool readAcks(Replica &r, time_t now);
+    void dropReplica(size_t i);
+    void enableBacklog(Database &database);
+    void disableBacklog(Database &database);
+    void stopSender();
+
+    void runLink(Database &database);
+    void stopLink();
+    // One connection to the master, from PSYNC until the link breaks.
+    void followMaster(Database &database, int fd);
+};
@@ -0,0 +1,45 @@
+// resp.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Incremental RESP2 request parser. Arguments are returned as views into the
+// caller's read buffer, so nothing is copied on the way to the command
+// handlers. Progress through a partially received command is kept between
+// calls, so a large bulk string trickling in is not re-scanned on every read.
+class RespParser
+{
+public:
+    enum class Status
+    {
+        Complete,
+        Incomplete,
+        Error
+    };
+
+    // Parses the command starting at buf[pos]. On Complete, argv holds views
+    // into buf and pos is advanced past the command. On Incomplete, pos is
+    // left alone and the next call must pass the same command start (the
+    // bytes before it may have been discarded in between). Error covers
+    // malformed input, a bulk string not followed by CRLF, and a command
+    // larger than 1 GB.
+    Status parse(std::string_view buf, size_t &pos, std::vector<std::string_view> &argv);
+
+    // Forgets any partially parsed command.
+    void reset() noexcept;
+
+private:
+    // Offsets below are relative to the start of the command being parsed.
+    long long multibulk_ = -1; // number of arguments, -1 until the header is read
+    long long bulk_ = -1;      // length of the bulk string being waited on
+    size_t cursor_ = 0;        // next unparsed byte
+    std::vector<std::pair<uint32_t, uint32_t>> args_;
+
+    Status parseInline(std::string_view buf, size_t &pos, std::vector<std::string_view> &argv);
+};
+
+// Splits a telnet-style command line on spaces and tabs.
+void splitInline(std::string_view line, std::vector<std::string_view> &argv);
@@ -0,0 +1,33 @@
+// server.h
+#pragma once
+#include "commands.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Edge-triggered epoll front end. Clients speak RESP2 (arrays of bulk
+// strings) or plain inline commands, as with redis-cli.
+//
+// Each worker thread runs its own event loop over its own SO_REUSEPORT
+// listening socket, so the kernel spreads new connections across threads and
+// a connection stays on one thread for its whole life.
+class Server
+{
+public:
+    Server(Database &database, uint16_t port, size_t threads = 1);
+    ~Server();
+
+    // Blocks serving clients until stop() is called.
+    void run();
+    // Safe to call from a signal handler.
+    void stop() noexcept;
+
+private:
+    class EventLoop;
+
+    Database &database_;
+    uint16_t port_;
+    std::atomic<bool> running_;
+    std::vector<std::unique_ptr<EventLoop>> loops_;
+};
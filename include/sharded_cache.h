@@ -0,0 +1,249 @@
+// sharded_cache.h
+#pragma once
+#include "cache.h"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Spreads keys over independent LRUCache shards, each with its own map, LRU
+// list, slice of the capacity and lock, so threads working on different
+// shards never contend. Every method is thread-safe.
+//
+// With more than one shard, shard i persists to "<snapshot_path>.<i>" and
+// "<aof_path>.<i>" (and spills to "<spill_dir>.<i>"); a single shard keeps
+// the plain paths.
+class ShardedCache
+{
+public:
+    // capacity and maxmemory are totals; each shard enforces its slice.
+    ShardedCache(size_t num_shards, size_t capacity,
+                 const std::string &snapshot_path = "data/snapshot.rdb",
+                 const std::string &aof_path = "data/aof.log",
+                 const std::string &aes_key = "1234567890123456",
+                 size_t maxmemory = 0,
+                 EvictionPolicy policy = EvictionPolicy::Lru,
+                 AppendFsync fsync = AppendFsync::EverySec,
+                 const std::string &spill_dir = "");
+
+    bool set(std::string_view key, std::string_view value, uint64_t expire_at = 0);
+    bool get(std::string_view key, std::string &out_value);
+    // Calls f(std::string_view value) under the shard lock; see LRUCache.
+    template <typename F>
+    bool read(std::string_view key, F &&f)
+    {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        return shard.cache->read(key, std::forward<F>(f));
+    }
+    // `lazy` frees a large value on the lazy-free thread (UNLINK).
+    bool del(std::string_view key, bool lazy = false);
+    bool expire(std::string_view key, uint64_t at_ms);
+    bool persist(std::string_view key);
+    int64_t pttl(std::string_view key);
+
+    // Multi-key operations. Each is one operation on the keyspace: every
+    // shard holding one of the keys is locked (in shard order, as lockAll()
+    // does) for the whole call, so no other client sees part of it, and
+    // each shard logs its share as one batch (see LRUCache::beginBatch()).
+    // Keys are looked up in the order given, behind prefetches of the next
+    // few.
+    //
+    // readMany() calls f(bool found, std::string_view value) for each of
+    // keys[0..n) in turn, under the locks; the view is only valid during
+    // the call. setMany() stores the n pairs pairs[2i], pairs[2i + 1]
+    // without deadlines; a key given twice ends up with its last value. It
+    // stores nothing and returns false if any entry alone exceeds its
+    // shard's maxmemory. With only_new it also stores nothing if any of the
+    // keys exists; `stored` tells whether it stored. delMany() returns the
+    // number of keys deleted.
+    template <typename F>
+    void readMany(const std::string_view *keys, size_t n, F &&f);
+    bool setMany(const std::string_view *pairs, size_t n, bool only_new, bool &stored);
+    size_t delMany(const std::string_view *keys, size_t n, bool lazy = false);
+
+    // FLUSHALL: empties every shard with the whole cache locked, logs it to
+    // each AOF and once to the replication backlog. With `async` the entries
+    // are freed on the lazy-free thread. Returns the keys dropped.
+    size_t flushAll(bool async);
+    // Evictions free large values on the lazy-free thread.
+    void setLazyEviction(bool lazy);
+    bool lazyEviction() const noexcept { return lazy_eviction_; }
+    // See LRUCache::setReplica(). Set by Replication on REPLICAOF and
+    // cleared when the node is promoted.
+    void setReplica(bool replica);
+
+    // SCAN. The cursor is LRUCache::scan()'s cursor times the shard count
+    // plus the shard it is in; shards are visited in order, each under its
+    // lock for one call, and the next shard starts at cursor 0. Returns 0
+    // once every shard was visited. Cursors stay valid while the shard
+    // count does.
+    uint64_t scan(uint64_t cursor, size_t count, std::vector<std::string> &keys);
+    // HOTKEYS. setHotKeySampling() sets every shard's sample rate (see
+    // LRUCache); hotKeys() merges the shards' tables and returns the
+    // `count` keys with the most estimated accesses, most first.
+    void setHotKeySampling(uint32_t rate);
+    uint32_t hotKeySampling() const noexcept { return hot_key_rate_; }
+    std::vector<LRUCache::HotKey> hotKeys(size_t count);
+
+    // One active expiry cycle: reaps due keys shard by shard, resuming where
+    // the last cycle stopped, for at most `budget`. No shard lock is held
+    // for more than about a millisecond at a time. Returns the keys deleted.
+    // Call from one thread only.
+    size_t activeExpire(std::chrono::microseconds budget);
+    // One active defragmentation cycle, sliced over the shards the same way.
+    // Does nothing while disabled. Returns the blocks moved.
+    size_t activeDefrag(std::chrono::microseconds budget);
+    void setActiveDefrag(bool enabled) noexcept { active_defrag_ = enabled; }
+    bool activeDefragEnabled() const noexcept { return active_defrag_; }
+    // Moves index entries of shards that are growing their index, sliced
+    // the same way, so a shard that went quiet mid-resize still finishes.
+    // Returns the entries moved.
+    size_t activeRehash(std::chrono::microseconds budget);
+    size_t rehashingShards() const;
+    // One garbage collection cycle of the disk tiers, sliced the same way.
+    // Returns the records copied.
+    size_t tieredGC(std::chrono::microseconds budget);
+
+    size_t size() const;
+    size_t memoryUsage() const;
+    size_t usedMemory() const;
+    size_t evictions() const;
+    size_t expiredKeys() const;
+    size_t expiringKeys() const;
+    // Slab allocator totals and defragmentation counters over all shards.
+    SlabAllocator::Stats allocatorStats() const;
+    size_t defragHits() const;
+    size_t defragMisses() const;
+    bool defragRunning() const;
+    // Disk tier totals over all shards; all zero unless tiered.
+    SpillStore::Stats tieredStats() const;
+    bool tiered() const noexcept { return tiered_; }
+    size_t capacity() const noexcept { return capacity_; }
+    size_t maxMemory() const noexcept { return maxmemory_; }
+    EvictionPolicy policy() const noexcept { return policy_; }
+    size_t shardCount() const noexcept { return shards_.size(); }
+
+    // Writes every shard's snapshot, then drops the AOF records it covers.
+    bool saveSnapshot();
+    // Only writes the snapshots; leaves the AOFs alone, so a forked child
+    // may call it. Follow up with snapshotTaken(positions noted at the fork).
+    bool writeSnapshot();
+    void snapshotTaken(const std::vector<uint64_t> &positions);
+    void flushAOF();
+
+    // AOF rewrite across all shards; see LRUCache. aofPositions() takes no
+    // shard lock, so it may be called while lockAll() is held.
+    std::vector<uint64_t> aofPositions() const;
+    uint64_t aofSize() const;
+    // True while some shard's AOF cannot be written; `err` says why.
+    bool aofWriteError(std::string &err) const;
+    bool rewriteAOF();
+    bool installAOFRewrite(const std::vector<uint64_t> &positions);
+    void discardAOFRewrite();
+
+    // Take and release every shard lock, in shard order. Used to freeze the
+    // whole cache for a moment, e.g. around fork() for a background save.
+    void lockAll();
+    void unlockAll();
+
+    // Replication. setReplicationBacklog() has every shard hand its writes
+    // to `backlog` from now on (nullptr stops that). writeSnapshotTo() writes
+    // the whole keyspace into one snapshot at `path`, as a forked child
+    // does for replicas. replaceWithSnapshot() drops every entry, loads such
+    // a file instead and saves the result (snapshots written, AOFs emptied),
+    // with the whole cache locked.
+    void setReplicationBacklog(ReplicationBacklog *backlog);
+    bool writeSnapshotTo(const std::string &path);
+    bool replaceWithSnapshot(const std::string &path, std::string &err);
+
+private:
+    struct alignas(64) Shard
+    {
+        mutable std::mutex mu;
+        std::unique_ptr<LRUCache> cache;
+    };
+
+    size_t capacity_;
+    size_t maxmemory_;
+    EvictionPolicy policy_;
+    std::string aes_key_;
+    std::vector<Shard> shards_;
+    size_t expire_cursor_ = 0; // next shard for activeExpire()
+    size_t defrag_cursor_ = 0; // next shard for activeDefrag()
+    bool active_defrag_ = true;
+    bool lazy_eviction_ = false;
+    uint32_t hot_key_rate_ = 0;
+    ReplicationBacklog *backlog_ = nullptr;
+    size_t rehash_cursor_ = 0; // next shard for activeRehash()
+    bool tiered_;
+    size_t gc_cursor_ = 0; // next shard for tieredGC()
+
+    // Keys a batch prefetches ahead of the one it works on: the index
+    // bucket PREFETCH_INDEX keys ahead, the slot PREFETCH_ENTRY keys ahead.
+    static constexpr size_t PREFETCH_INDEX = 8;
+    static constexpr size_t PREFETCH_ENTRY = 4;
+
+    // The locks of every shard that keys[0], keys[stride], ... (n keys)
+    // fall in, taken in shard order and released on destruction.
+    class KeyLocks
+    {
+    public:
+        KeyLocks(ShardedCache &cache, const std::string_view *keys, size_t n, size_t stride);
+        ~KeyLocks();
+        KeyLocks(const KeyLocks &) = delete;
+        KeyLocks &operator=(const KeyLocks &) = delete;
+
+        // The shard of the i-th key.
+        LRUCache &operator[](size_t i) const { return *cache_.shards_[shard_of_[i]].cache; }
+        // The shards locked, in shard order.
+        const std::vector<uint32_t> &shards() const noexcept { return locked_; }
+
+    private:
+        ShardedCache &cache_;
+        std::vector<uint32_t> shard_of_;
+        std::vector<uint32_t> locked_;
+    };
+
+    size_t shardIndex(std::string_view key) const noexcept;
+    Shard &shardFor(std::string_view key) { return shards_[shardIndex(key)]; }
+    // Calls op(shard, i) for keys i = 0..n-1 (keys[i * stride]) in order,
+    // with the prefetches above.
+    template <typename Op>
+    static void forEachKey(const KeyLocks &locks, const std::string_view *keys, size_t n, size_t stride, Op op);
+    // Runs step(cache, until, done) on the shards in turn from `cursor`,
+    // each call under the shard lock for at most a slice, until every shard
+    // reports done or `budget` is spent; returns the sum of the steps.
+    template <typename Step>
+    size_t runSliced(std::chrono::microseconds budget, size_t &cursor, Step step);
+};
+
+template <typename Op>
+void ShardedCache::forEachKey(const KeyLocks &locks, const std::string_view *keys, size_t n, size_t stride, Op op)
+{
+    for (size_t i = 0; i < std::min(n, PREFETCH_INDEX); ++i)
+        locks[i].prefetchIndex(keys[i * stride]);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (i + PREFETCH_INDEX < n)
+            locks[i + PREFETCH_INDEX].prefetchIndex(keys[(i + PREFETCH_INDEX) * stride]);
+        if (i + PREFETCH_ENTRY < n)
+            locks[i + PREFETCH_ENTRY].prefetchEntry(keys[(i + PREFETCH_ENTRY) * stride]);
+        op(locks[i], i);
+    }
+}
+
+template <typename F>
+void ShardedCache::readMany(const std::string_view *keys, size_t n, F &&f)
+{
+    KeyLocks locks(*this, keys, n, 1);
+    forEachKey(locks, keys, n, 1, [&](LRUCache &cache, size_t i)
+               {
+        if (!cache.read(keys[i], [&](std::string_view value)
+                        { f(true, value); }))
+            f(false, std::string_view()); });
+}
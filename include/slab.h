@@ -0,0 +1,102 @@
+// slab.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Size-classed slab allocator for a cache's out-of-line key/value blocks.
+//
+// Blocks up to MAX_CHUNK bytes are rounded up to one of 33 size classes
+// (four per power of two, so at most 25% is lost to rounding) and carved
+// out of 64 KB pages mapped straight from the kernel; a page only ever
+// holds one class. A page's header sits at its start, so the page of any
+// block is found by masking its address. A page whose last block is freed
+// goes back to the kernel (one spare is kept to absorb churn), so memory
+// freed by deletes leaves the process instead of lingering in malloc's
+// free lists. Larger blocks use operator new.
+//
+// Partially used pages of a class are kept on a list and new blocks come
+// from its head. Pages that were full go to the front when a block is
+// freed, so allocation favours nearly full pages, and shouldMove() tells
+// a defragmenter which blocks sit in sparse pages and are worth copying
+// elsewhere so their page can be released.
+//
+// Not thread-safe: each cache shard owns one and uses it under its lock.
+class SlabAllocator
+{
+public:
+    static constexpr size_t PAGE_BYTES = 64 * 1024;
+    static constexpr size_t MAX_CHUNK = 8192;
+    static constexpr size_t CLASSES = 33;
+
+    struct Stats
+    {
+        size_t requested = 0;   // bytes asked for by live blocks
+        size_t active = 0;      // bytes of pages in use plus large blocks
+        size_t pages = 0;       // pages in use
+        size_t large_bytes = 0; // blocks above MAX_CHUNK
+        size_t reclaimable = 0; // bytes of pages that compacting blocks would free
+    };
+
+    SlabAllocator();
+    ~SlabAllocator();
+
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+    // Throws std::bad_alloc when the kernel refuses a page.
+    char *allocate(size_t n);
+    // `n` must be the size the block was allocated with.
+    void free(char *p, size_t n) noexcept;
+    // Hands a block above MAX_CHUNK over to the caller, who must delete[] it
+    // (from any thread), and returns true; returns false for a block in a
+    // page, which only free() can release.
+    bool disown(char *p, size_t n) noexcept;
+
+    // If a block allocated with `old_n` bytes has room for `new_n` (same
+    // size class), records its new size and returns true; it must then be
+    // freed with `new_n`.
+    bool resize(size_t old_n, size_t new_n) noexcept;
+
+    // Defrag hint: true if the block sits in a page used less than its
+    // class's average and another partially used page could take it.
+    bool shouldMove(const char *p, size_t n) const noexcept;
+
+    Stats stats() const noexcept;
+
+private:
+    struct Page
+    {
+        Page *prev; // partial list links
+        Page *next;
+        uint32_t cls;
+        uint32_t used;      // blocks handed out
+        uint32_t bump;      // blocks never handed out start here
+        uint32_t free_head; // offset of the first freed block, 0 if none
+        bool on_partial;
+    };
+
+    struct SizeClass
+    {
+        uint32_t size;
+        uint32_t per_page;
+        Page *partial = nullptr; // pages with free blocks
+        size_t pages = 0;
+        size_t used = 0; // blocks in use
+    };
+
+    static constexpr size_t HEADER_BYTES = 64;
+
+    SizeClass classes_[CLASSES];
+    Page *spare_ = nullptr;
+    Stats stats_;
+
+    static size_t classOf(size_t n) noexcept;
+    static Page *pageOf(const char *p) noexcept
+    {
+        return reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(PAGE_BYTES - 1));
+    }
+    Page *newPage(uint32_t cls);
+    void releasePage(Page *page) noexcept;
+    void pushPartial(SizeClass &c, Page *page) noexcept;
+    void removePartial(SizeClass &c, Page *page) noexcept;
+};
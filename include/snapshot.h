@@ -0,0 +1,90 @@
+// snapshot.h
+#pragma once
+#include "crypto.h"
+#include "io_engine.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Snapshot file format, version 3. All integers are little-endian.
+//
+//   header   "RLSNAP\0\0"  u32 version  u32 reserved
+//   block*   the block's records sealed by RecordCipher (AES-GCM)
+//   index    per block: u64 offset  u32 length  u32 records  u32 crc32c
+//   trailer  u64 index_offset  u32 blocks  u32 index_crc32c
+//            u64 records  "RLSNAPIX"
+//
+// A block's plaintext is a run of records (u32 key_len, u32 value_len, key,
+// value [u64 expire_at]), cut at about SNAPSHOT_BLOCK_BYTES. The top bit of
+// value_len flags a record whose key has an expiry deadline (unix ms), which
+// then follows the value. Each block is encrypted on its own and its CRC
+// covers the sealed bytes, so blocks can be verified, decrypted and parsed
+// independently and in parallel. Records come back in the order they were
+// added. Version 2 files (no deadlines) and version 1 files (each block
+// iv[16] followed by AES-128-CBC ciphertext) are still read.
+constexpr uint32_t SNAPSHOT_VERSION = 3;
+constexpr size_t SNAPSHOT_BLOCK_BYTES = 256 * 1024;
+
+// Streams records into "<path>.tmp" one block at a time and renames it over
+// `path` in finish(). Blocks go out through an IoWriter, so the next one is
+// encrypted while the last ones are written. Safe to use in a forked child.
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(const std::string &path, std::string_view aes_key);
+    ~SnapshotWriter();
+
+    SnapshotWriter(const SnapshotWriter &) = delete;
+    SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+    // expire_at 0 means no deadline. Values must be shorter than 2^31 bytes.
+    bool add(std::string_view key, std::string_view value, uint64_t expire_at = 0);
+    // Returns false if anything failed; `path` is then left untouched.
+    bool finish();
+
+private:
+    struct IndexEntry
+    {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t records;
+        uint32_t crc;
+    };
+
+    std::string path_;
+    std::string tmp_path_;
+    RecordCipher cipher_;
+    int fd_;
+    bool ok_;
+    std::unique_ptr<IoEngine> io_;
+    std::unique_ptr<IoWriter> writer_;
+    uint64_t offset_ = 0;
+    uint64_t records_ = 0;
+    uint32_t block_records_ = 0;
+    std::string block_;
+    std::string out_;
+    std::vector<IndexEntry> index_;
+
+    bool flushBlock();
+    bool writeAll(const std::string &data);
+};
+
+enum class SnapshotLoad
+{
+    Loaded,
+    Missing,   // no file
+    NotBlocks, // not in this format (e.g. an older snapshot)
+    Corrupt    // `err` says why; nothing past the bad block was applied
+};
+
+// Maps the file and decrypts/parses its blocks on up to `threads` workers
+// (0 = one per core). `reserve(records)` is called once before any record,
+// then `apply(key, value, expire_at)` for every record in file order, all on
+// the calling thread. Deadlines are passed on as stored, expired or not.
+SnapshotLoad loadSnapshotFile(const std::string &path, std::string_view aes_key, unsigned threads,
+                              const std::function<void(uint64_t)> &reserve,
+                              const std::function<void(std::string_view, std::string_view, uint64_t)> &apply,
+                              std::string &err);
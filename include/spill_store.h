@@ -0,0 +1,133 @@
+// spill_store.h
+#pragma once
+#include "crypto.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The disk tier of a cache shard: entries evicted from memory are appended
+// to a log of segment files and found again through a compact in-memory
+// index, so a shard can hold more data than fits in RAM and still answer
+// for all of it.
+//
+// Segment records:  u64 key_hash | u32 sealed_len | sealed(u32 klen | u32 vlen | u64 expire_at | key | value)
+// sealed with AES-GCM, the key hash as associated data. The hash stays in
+// the clear so the garbage collector can tell live records from dead ones
+// without decrypting them.
+//
+// The index keeps 24 bytes per key: the key's 64-bit hash and where its
+// record lies. Keys themselves stay on disk; the rare hash collision is
+// settled by reading the candidate records back. Records are written with
+// pwrite() as they come and read with pread(), one of each per entry.
+//
+// A key is in the store at most once: take() hands an entry back and forgets
+// it, and so does erase(). What is left of a segment once its records have
+// been taken or overwritten is dead space; collect() copies the remaining
+// live records of mostly dead segments to the end of the log and deletes
+// the segment files.
+//
+// The store only lives as long as the process: the directory is cleared
+// when it is opened and removed when it is closed. Snapshots and the AOF
+// cover the spilled entries like any others (see forEach()).
+//
+// Not thread-safe: each cache shard owns one and uses it under its lock.
+class SpillStore
+{
+public:
+    static constexpr uint64_t SEGMENT_BYTES = 64 << 20;
+    // collect() picks segments whose live records fill less than this share.
+    static constexpr uint64_t GC_LIVE_PERCENT = 50;
+
+    struct Stats
+    {
+        size_t keys = 0;
+        size_t segments = 0;
+        uint64_t disk_bytes = 0; // segment file sizes
+        uint64_t live_bytes = 0; // records still indexed
+        size_t index_bytes = 0;
+        size_t spills = 0;       // put() calls that stored an entry
+        size_t reads = 0;        // entries handed back by take()
+        size_t relocated = 0;    // records copied by collect()
+        size_t collected = 0;    // segment files deleted
+    };
+
+    // Throws std::runtime_error if the directory cannot be set up.
+    SpillStore(const std::string &dir, const std::string &aes_key);
+    ~SpillStore();
+
+    SpillStore(const SpillStore &) = delete;
+    SpillStore &operator=(const SpillStore &) = delete;
+
+    // Appends an entry whose key is not in the store. Returns false (storing
+    // nothing) if the write failed.
+    bool put(std::string_view key, std::string_view value, uint64_t expire_at);
+    // Removes the key and hands back its value (valid until the next call)
+    // and deadline. Returns false if the key is not stored.
+    bool take(std::string_view key, std::string_view &value, uint64_t &expire_at);
+    bool erase(std::string_view key);
+    // Forgets every entry and deletes the segment files.
+    void clear() noexcept;
+
+    // Calls f(key, value, expire_at) for every stored entry, segment by
+    // segment, until f returns false. Returns false if f did or a record
+    // could not be read. Only reads, so a forked child may call it.
+    bool forEach(const std::function<bool(std::string_view, std::string_view, uint64_t)> &f);
+
+    // Garbage collection: works on the current victim segment, or picks one,
+    // until the steady clock passes `until`. `done` tells whether no segment
+    // is left to collect. Returns the records copied.
+    size_t collect(std::chrono::steady_clock::time_point until, bool &done);
+
+    Stats stats() const noexcept;
+    size_t memoryUsage() const noexcept { return index_.size() * sizeof(Entry); }
+
+private:
+    static constexpr size_t HEADER_BYTES = 12; // u64 hash, u32 sealed_len
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Entry
+    {
+        uint64_t hash;
+        uint32_t segment;
+        uint32_t offset;
+        uint32_t length; // whole record; 0 marks an empty bucket
+    };
+
+    struct Segment
+    {
+        int fd = -1; // -1 once deleted
+        uint64_t size = 0;
+        uint64_t live = 0;
+    };
+
+    std::string dir_;
+    RecordCipher cipher_;
+    std::vector<Segment> segments_; // by id; ids are never reused
+    uint32_t active_ = NONE;        // segment being appended to
+    std::vector<Entry> index_;      // power-of-two size, linear probing
+    size_t count_ = 0;
+    uint32_t gc_segment_ = NONE; // segment being collected
+    uint64_t gc_offset_ = 0;     // next record in it
+    std::string write_buf_;
+    std::string read_buf_;
+    std::string plain_; // plaintext of the record find() matched
+    std::string taken_; // take()'s value lives here
+    Stats stats_;
+
+    static uint64_t hashKey(std::string_view key) noexcept;
+    std::string segmentPath(uint32_t id) const;
+    bool roll();
+    bool appendRecord(std::string_view record, uint32_t &segment, uint32_t &offset);
+    bool readRecord(uint32_t segment, uint64_t offset, uint32_t length, std::string &out);
+    bool openRecord(uint64_t hash, std::string_view record, std::string &plain);
+    size_t find(std::string_view key, uint64_t hash);
+    size_t findLocation(uint64_t hash, uint32_t segment, uint64_t offset) const noexcept;
+    void insertEntry(const Entry &entry);
+    void removeEntry(size_t pos) noexcept;
+    void growIndex();
+    void dropSegment(uint32_t id) noexcept;
+    uint32_t pickVictim() const noexcept;
+};
@@ -0,0 +1,223 @@
+// stats.h
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Instrumentation for the hot paths. Counters and histograms are written by
+// exactly one thread (see PerThread) with plain relaxed loads and stores, so
+// recording costs no locked instruction and threads never share a cache
+// line; readers sum the per-thread copies whenever they report.
+
+// A monotonically increasing count with a single writer.
+class Counter
+{
+public:
+    void add(uint64_t n = 1) noexcept { v_.store(v_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t load() const noexcept { return v_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> v_{0};
+};
+
+// HDR-style log-linear histogram of durations in nanoseconds: values below
+// 32 are exact, and every power of two above that is split into 16 equal
+// buckets, so any recorded value is off by less than 1/16 (6.25%). Values
+// from about 68 s up share the last bucket. Single writer.
+class LatencyHistogram
+{
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int MAX_BITS = 36;
+    static constexpr size_t BUCKETS = size_t(MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+    void record(uint64_t ns) noexcept
+    {
+        std::atomic<uint64_t> &b = counts_[bucketFor(ns)];
+        b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        count_.add();
+        sum_.add(ns);
+    }
+
+    uint64_t count() const noexcept { return count_.load(); }
+    uint64_t sum() const noexcept { return sum_.load(); }
+    uint64_t bucket(size_t i) const noexcept { return counts_[i].load(std::memory_order_relaxed); }
+
+    static size_t bucketFor(uint64_t ns) noexcept
+    {
+        if (ns < (uint64_t(2) << SUB_BITS))
+            return static_cast<size_t>(ns);
+        int top = 63 - __builtin_clzll(ns);
+        if (top >= MAX_BITS)
+            return BUCKETS - 1;
+        int shift = top - SUB_BITS;
+        return (size_t(shift) << SUB_BITS) + static_cast<size_t>(ns >> shift);
+    }
+
+    // Largest value that lands in bucket i.
+    static uint64_t bucketLimit(size_t i) noexcept
+    {
+        if (i < (size_t(2) << SUB_BITS))
+            return i;
+        int shift = static_cast<int>(i >> SUB_BITS) - 1;
+        uint64_t mantissa = (i & ((size_t(1) << SUB_BITS) - 1)) | (size_t(1) << SUB_BITS);
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_{};
+    Counter count_;
+    Counter sum_;
+};
+
+// Plain (reader-side) sum of any number of LatencyHistograms.
+class HistogramTotals
+{
+public:
+    void add(const LatencyHistogram &h) noexcept;
+
+    uint64_t count() const noexcept { return count_; }
+    uint64_t sum() const noexcept { return sum_; }
+    // Value at percentile p (0-100): the upper edge of its bucket, 0 if empty.
+    uint64_t percentile(double p) const noexcept;
+    uint64_t max() const noexcept;
+    // Calls to f(limit_ns, count) for every non-empty bucket, in order.
+    template <class F>
+    void forEachBucket(F &&f) const
+    {
+        for (size_t i = 0; i < counts_.size(); ++i)
+            if (counts_[i])
+                f(LatencyHistogram::bucketLimit(i), counts_[i]);
+    }
+
+private:
+    std::array<uint64_t, LatencyHistogram::BUCKETS> counts_{};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+};
+
+// One T per thread that touches it, found through a thread_local pointer.
+// Instances are chained into a lock-free list that readers walk; they are
+// never freed, and one left behind by an exited thread is taken over by the
+// next new thread, so totals never go backwards and memory stays bounded by
+// the peak number of threads.
+template <class T>
+class PerThread
+{
+public:
+    static T &local()
+    {
+        thread_local Owner owner;
+        if (!owner.node)
+            owner.node = claim();
+        return owner.node->value;
+    }
+
+    // Calls f(const T &) for every instance, live or not.
+    template <class F>
+    static void forEach(F &&f)
+    {
+        for (Node *n = head_.load(std::memory_order_acquire); n; n = n->next)
+            f(static_cast<const T &>(n->value));
+    }
+
+private:
+    struct alignas(64) Node
+    {
+        T value;
+        std::atomic<bool> owned{true};
+        Node *next = nullptr;
+    };
+
+    struct Owner
+    {
+        Node *node = nullptr;
+        ~Owner()
+        {
+            if (node)
+                node->owned.store(false, std::memory_order_release);
+        }
+    };
+
+    inline static std::atomic<Node *> head_{nullptr};
+
+    static Node *claim()
+    {
+        for (Node *n = head_.load(std::memory_order_acquire); n; n = n->next)
+        {
+            bool expected = false;
+            if (!n->owned.load(std::memory_order_relaxed) &&
+                n->owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return n;
+        }
+        Node *n = new Node;
+        n->next = head_.load(std::memory_order_relaxed);
+        while (!head_.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        return n;
+    }
+};
+
+// Records events that took at least the configured threshold, like redis'
+// latency monitor: per event name the latest and worst sample plus a
+// history of one sample per second (the worst one in that second). Off
+// while the threshold is 0. Only slow events take the lock, so calling
+// sample() on every operation is cheap.
+class LatencyMonitor
+{
+public:
+    static constexpr size_t HISTORY = 160;
+
+    struct Sample
+    {
+        time_t time;
+        uint64_t ms;
+    };
+
+    struct Event
+    {
+        std::string name;
+        Sample latest;
+        uint64_t max_ms;
+    };
+
+    void setThreshold(uint64_t ms) noexcept { threshold_ms_.store(ms, std::memory_order_relaxed); }
+    uint64_t threshold() const noexcept { return threshold_ms_.load(std::memory_order_relaxed); }
+
+    void sample(const char *event, uint64_t ns)
+    {
+        uint64_t threshold = threshold_ms_.load(std::memory_order_relaxed);
+        if (threshold && ns >= threshold * 1000000)
+            add(event, ns / 1000000);
+    }
+
+    std::vector<Event> latest() const;
+    std::vector<Sample> history(std::string_view event) const;
+    // Forgets the named events (all of them if `events` is empty); returns
+    // how many were dropped.
+    size_t reset(const std::vector<std::string_view> &events);
+
+private:
+    struct Series
+    {
+        Event event;
+        std::vector<Sample> samples; // ring of HISTORY
+        size_t next = 0;
+    };
+
+    std::atomic<uint64_t> threshold_ms_{0};
+    mutable std::mutex mu_;
+    std::vector<Series> series_;
+
+    void add(const char *event, uint64_t ms);
+};
+
+LatencyMonitor &latencyMonitor();
+
+// Resident set size of this process in bytes, 0 if unknown.
+size_t residentMemory();
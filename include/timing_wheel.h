@@ -0,0 +1,63 @@
+// timing_wheel.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Hierarchical timing wheel over millisecond deadlines, keyed by small dense
+// ids (a cache's slot indices). Six levels of 64 slots: level 0 holds the
+// timers due within 64 ms, one slot per millisecond, and every level above
+// covers 64 times the span of the one below; timers further out than
+// 64^6 ms (about two years) wait in the top level and are re-placed when it
+// turns. Scheduling and cancelling are O(1); popDue() walks the wheel one
+// tick at a time, moving a higher level's slot down when the level below
+// wraps, and skips ahead whenever level 0 is empty.
+class TimingWheel
+{
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    explicit TimingWheel(uint64_t now_ms);
+
+    // Schedules (or reschedules) `id` for `deadline_ms`. A deadline already
+    // passed fires on the next popDue().
+    void schedule(uint32_t id, uint64_t deadline_ms);
+    // No-op if `id` is not scheduled.
+    void cancel(uint32_t id) noexcept;
+
+    bool scheduled(uint32_t id) const noexcept { return id < nodes_.size() && nodes_[id].bucket != UNLINKED; }
+    uint64_t deadline(uint32_t id) const noexcept { return nodes_[id].deadline; }
+    size_t size() const noexcept { return size_; }
+    size_t memoryUsage() const noexcept { return sizeof(*this) + nodes_.capacity() * sizeof(Node); }
+
+    // Unschedules and returns one id whose deadline is at or before now_ms,
+    // earliest tick first, or NONE once nothing more is due. Work is spread
+    // over calls, so a caller can stop at any point and resume later.
+    uint32_t popDue(uint64_t now_ms) noexcept;
+
+private:
+    static constexpr int LEVELS = 6;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint32_t SLOTS = 1u << SLOT_BITS;
+    static constexpr uint32_t UNLINKED = UINT32_MAX;
+
+    struct Node
+    {
+        uint64_t deadline = 0;
+        uint32_t prev = NONE;
+        uint32_t next = NONE;
+        uint32_t bucket = UNLINKED; // level * SLOTS + slot
+    };
+
+    std::vector<Node> nodes_; // indexed by id
+    uint32_t heads_[LEVELS * SLOTS];
+    uint64_t occupied_[LEVELS] = {}; // bit per non-empty slot
+    uint64_t current_;               // tick whose level-0 slot is drained next
+    size_t size_ = 0;
+
+    void place(uint32_t id) noexcept;
+    void link(uint32_t id, uint32_t bucket) noexcept;
+    void unlink(uint32_t id) noexcept;
+    void enterTick(uint64_t tick) noexcept;
+    void cascade(int level, uint32_t slot) noexcept;
+};
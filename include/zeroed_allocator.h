@@ -0,0 +1,45 @@
+// zeroed_allocator.h
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+// Allocates from calloc and leaves value-initialization alone, so that
+// std::vector<T, ZeroedAllocator<T>>(n) of a type whose zero bytes are a
+// valid value costs no pass over the memory: a large table comes straight
+// from the kernel as zero pages, faulted in as it is first written, and
+// creating one is no pause however big it is.
+template <typename T>
+struct ZeroedAllocator
+{
+    using value_type = T;
+
+    ZeroedAllocator() = default;
+    template <typename U>
+    ZeroedAllocator(const ZeroedAllocator<U> &) noexcept {}
+
+    T *allocate(size_t n)
+    {
+        void *p = std::calloc(n, sizeof(T));
+        if (!p)
+            throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+    void deallocate(T *p, size_t) noexcept { std::free(p); }
+
+    template <typename U>
+    void construct(U *) noexcept
+    {
+    }
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&...args)
+    {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    bool operator==(const ZeroedAllocator<U> &) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const ZeroedAllocator<U> &) const noexcept { return false; }
+};
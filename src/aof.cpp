@@ -0,0 +1,538 @@
+#include "aof.h"
+#include "byteorder.h"
+#include "crc32c.h"
+#include "io_engine.h"
+#include "stats.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    constexpr char MAGIC[8] = {'R', 'L', 'A', 'O', 'F', '\0', '\0', '\0'};
+
+    // Always-policy records appended by this thread and not yet waited for.
+    thread_local std::vector<std::pair<AofWriter *, uint64_t>> t_pending;
+    // A record this thread meant to log was lost (AofWriter::recordLost()).
+    thread_local bool t_lost = false;
+
+    // Kept by each flusher thread.
+    struct AofStats
+    {
+        LatencyHistogram write;
+        LatencyHistogram fsync;
+    };
+
+    uint64_t nanosSince(std::chrono::steady_clock::time_point start)
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::steady_clock::now() - start)
+                                         .count());
+    }
+}
+
+bool parseAppendFsync(std::string_view name, AppendFsync &out)
+{
+    if (name == "always")
+        out = AppendFsync::Always;
+    else if (name == "everysec")
+        out = AppendFsync::EverySec;
+    else if (name == "no")
+        out = AppendFsync::No;
+    else
+        return false;
+    return true;
+}
+
+const char *appendFsyncName(AppendFsync policy)
+{
+    switch (policy)
+    {
+    case AppendFsync::Always:
+        return "always";
+    case AppendFsync::EverySec:
+        return "everysec";
+    case AppendFsync::No:
+        return "no";
+    }
+    return "unknown";
+}
+
+// -------------------- Format --------------------
+std::string aofHeader()
+{
+    std::string header(MAGIC, sizeof(MAGIC));
+    appendU32(header, AOF_VERSION);
+    appendU32(header, 0);
+    return header;
+}
+
+void sealAofFrame(std::string &out, char op)
+{
+    out[0] = op;
+    storeU32(&out[1], static_cast<uint32_t>(out.size() - AOF_FRAME_BYTES));
+    uint32_t crc = crc32c(0, out.data(), 5);
+    crc = crc32c(crc, out.data() + AOF_FRAME_BYTES, out.size() - AOF_FRAME_BYTES);
+    storeU32(&out[5], crc);
+}
+
+// -------------------- Reader --------------------
+AofReader::AofReader(const std::string &path) : path_(path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return;
+        throw std::runtime_error("open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return;
+    }
+    size_ = static_cast<uint64_t>(st.st_size);
+    void *map = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        throw std::runtime_error("mmap " + path + ": " + strerror(errno));
+    base_ = static_cast<const unsigned char *>(map);
+    ::madvise(map, size_, MADV_SEQUENTIAL);
+    readAhead();
+
+    // A header cut short by a crash while the file was being created is
+    // just an empty log.
+    size_t head = static_cast<size_t>(std::min<uint64_t>(size_, sizeof(MAGIC)));
+    if (std::memcmp(base_, MAGIC, head) != 0)
+    {
+        format_ = Format::Legacy;
+        return;
+    }
+    format_ = Format::Framed;
+    if (size_ < AOF_HEADER_BYTES)
+        return;
+    uint32_t version = loadU32(base_ + sizeof(MAGIC));
+    if (version != AOF_VERSION)
+        throw std::runtime_error(path + ": unsupported AOF version " + std::to_string(version));
+    pos_ = AOF_HEADER_BYTES;
+}
+
+// Keeps READAHEAD_BYTES (at least half of them) ahead of the scan in
+// flight; the default readahead of a mapping is a few hundred KB.
+void AofReader::readAhead() noexcept
+{
+    if (advised_ >= size_ || pos_ + READAHEAD_BYTES / 2 < advised_)
+        return;
+    uint64_t len = std::min(READAHEAD_BYTES, size_ - advised_);
+    ::madvise(const_cast<unsigned char *>(base_) + advised_, len, MADV_WILLNEED);
+    advised_ += len;
+}
+
+AofReader::~AofReader()
+{
+    if (base_)
+        ::munmap(const_cast<unsigned char *>(base_), size_);
+}
+
+bool AofReader::next(char &op, std::string_view &payload)
+{
+    if (format_ != Format::Framed || size_ - pos_ < AOF_FRAME_BYTES)
+        return false;
+    const unsigned char *p = base_ + pos_;
+    uint32_t length = loadU32(p + 1);
+    if (length > size_ - pos_ - AOF_FRAME_BYTES)
+        return false;
+    uint32_t crc = crc32c(0, p, 5);
+    if (crc32c(crc, p + AOF_FRAME_BYTES, length) != loadU32(p + 5))
+        return false;
+    op = static_cast<char>(p[0]);
+    payload = {reinterpret_cast<const char *>(p) + AOF_FRAME_BYTES, length};
+    pos_ += AOF_FRAME_BYTES + length;
+    readAhead();
+    return true;
+}
+
+bool AofReader::truncate(std::string &err)
+{
+    if (::truncate(path_.c_str(), static_cast<off_t>(pos_)) < 0)
+    {
+        err = "truncate " + path_ + ": " + strerror(errno);
+        return false;
+    }
+    size_ = pos_;
+    return true;
+}
+
+// -------------------- Writer --------------------
+AofWriter::AofWriter(const std::string &path, AppendFsync policy, std::string header)
+    : path_(path), policy_(policy), header_(std::move(header)), io_(IoEngine::create())
+{
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+        throw std::runtime_error("open " + path_ + ": " + strerror(errno));
+    struct stat st;
+    if (::fstat(fd_, &st) == 0)
+        appended_ = written_ = synced_ = file_end_ = static_cast<uint64_t>(st.st_size);
+    if (appended_ == 0 && !header_.empty())
+    {
+        io_->write(fd_, header_.data(), header_.size(), IoEngine::APPEND);
+        io_->sync(fd_);
+        if (!io_->waitAll())
+        {
+            ::close(fd_);
+            throw std::runtime_error("write " + path_ + ": " + strerror(errno));
+        }
+        appended_ = written_ = synced_ = file_end_ = header_.size();
+    }
+    thread_ = std::thread([this]
+                          { run(); });
+}
+
+AofWriter::~AofWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+        sync_requested_ = true;
+    }
+    work_cv_.notify_one();
+    thread_.join();
+    ::close(fd_);
+}
+
+uint64_t AofWriter::append(std::string_view data)
+{
+    uint64_t pos;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        bool idle = buf_.empty();
+        buf_.append(data);
+        appended_ += data.size();
+        pos = appended_;
+        // A busy flusher picks the new bytes up on its next round anyway.
+        if (idle)
+            work_cv_.notify_one();
+    }
+
+    if (policy_ == AppendFsync::Always)
+    {
+        for (auto &p : t_pending)
+        {
+            if (p.first == this)
+            {
+                p.second = pos;
+                return pos;
+            }
+        }
+        t_pending.emplace_back(this, pos);
+    }
+    return pos;
+}
+
+bool AofWriter::waitDurable(uint64_t pos)
+{
+    if (policy_ != AppendFsync::Always)
+        return true;
+    std::unique_lock<std::mutex> lock(mu_);
+    uint64_t failures = failures_;
+    done_cv_.wait(lock, [&]
+                  { return synced_ >= pos || failures_ != failures; });
+    return synced_ >= pos;
+}
+
+bool AofWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mu_);
+    uint64_t target = appended_;
+    uint64_t failures = failures_;
+    sync_requested_ = true;
+    work_cv_.notify_one();
+    done_cv_.wait(lock, [&]
+                  { return synced_ >= target || failures_ != failures; });
+    return synced_ >= target;
+}
+
+bool AofWriter::writeError(std::string &err)
+{
+    if (!failing_.load(std::memory_order_relaxed))
+        return false;
+    std::lock_guard<std::mutex> lock(mu_);
+    err = error_;
+    return !err.empty();
+}
+
+void AofWriter::recordLost(std::string_view why)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::cerr << "[AOF] " << path_ << ": " << why << "; refusing writes for now\n";
+        error_.assign(why);
+        ++failures_;
+        lost_ = true;
+        failing_.store(true, std::memory_order_relaxed);
+    }
+    done_cv_.notify_all();
+    t_lost = true;
+}
+
+uint64_t AofWriter::position()
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return appended_;
+}
+
+void AofWriter::truncatePrefix(uint64_t pos)
+{
+    if (!flush())
+        return;
+    std::lock_guard<std::mutex> io_lock(io_mu_);
+    if (pos <= file_base_ + header_.size() || pos > file_end_)
+        return;
+
+    std::string tmp = path_ + ".tmp";
+    int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0 || !writeAll(out, header_.data(), header_.size()))
+    {
+        std::cerr << "[AOF] could not truncate " << path_ << ": " << strerror(errno) << "\n";
+        if (out >= 0)
+            ::close(out);
+        ::unlink(tmp.c_str());
+        return;
+    }
+    installLocked(out, tmp, pos, header_.size());
+}
+
+bool AofWriter::rewrite(uint64_t pos, const std::string &base_path)
+{
+    if (!flush())
+    {
+        ::unlink(base_path.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> io_lock(io_mu_);
+    int out = ::open(base_path.c_str(), O_WRONLY | O_CLOEXEC);
+    struct stat st;
+    if (pos < file_base_ || pos > file_end_ || out < 0 || ::fstat(out, &st) < 0)
+    {
+        std::cerr << "[AOF] could not rewrite " << path_ << ": " << strerror(errno) << "\n";
+        if (out >= 0)
+            ::close(out);
+        ::unlink(base_path.c_str());
+        return false;
+    }
+    return installLocked(out, base_path, pos, static_cast<uint64_t>(st.st_size));
+}
+
+uint64_t AofWriter::size()
+{
+    return position() - file_base_.load(std::memory_order_relaxed);
+}
+
+// Appends the records logged from `pos` on to `out`, which already holds
+// `prefix_len` bytes that stand in for everything before `pos`, and moves
+// it over the log. The flusher is held off (io_mu_) for the duration, so the
+// file is not growing; only the tail logged after `pos` has to be copied.
+bool AofWriter::installLocked(int out, const std::string &tmp, uint64_t pos, uint64_t prefix_len)
+{
+    int in = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok = in >= 0;
+    {
+        // Each chunk read is written out while the next one is read.
+        IoWriter writer(*io_, out, prefix_len);
+        std::string chunk(IoWriter::BUFFER_BYTES, '\0');
+        uint64_t off = pos - file_base_;
+        while (ok)
+        {
+            ssize_t r = io_->read(in, &chunk[0], chunk.size(), off);
+            if (r <= 0)
+            {
+                ok = r == 0;
+                break;
+            }
+            ok = writer.append(std::string_view(chunk.data(), static_cast<size_t>(r)));
+            off += static_cast<uint64_t>(r);
+        }
+        ok = writer.finish(true) && ok;
+    }
+    if (in >= 0)
+        ::close(in);
+    if (!ok || ::rename(tmp.c_str(), path_.c_str()) < 0)
+    {
+        std::cerr << "[AOF] could not replace " << path_ << ": " << strerror(errno) << "\n";
+        ::close(out);
+        ::unlink(tmp.c_str());
+        return false;
+    }
+
+    // Keep appending to the new file.
+    ::close(fd_);
+    int flags = ::fcntl(out, F_GETFL);
+    ::fcntl(out, F_SETFL, flags | O_APPEND);
+    fd_ = out;
+    file_base_ = pos - prefix_len;
+    return true;
+}
+
+bool AofWriter::syncThreadWrites()
+{
+    bool ok = !t_lost;
+    t_lost = false;
+    for (auto &p : t_pending)
+        ok = p.first->waitDurable(p.second) && ok;
+    t_pending.clear();
+    return ok;
+}
+
+void AofWriter::latencies(HistogramTotals &write, HistogramTotals &fsync)
+{
+    PerThread<AofStats>::forEach([&](const AofStats &stats)
+                                 {
+        write.add(stats.write);
+        fsync.add(stats.fsync); });
+}
+
+// -------------------- Background flusher --------------------
+void AofWriter::run()
+{
+    using clock = std::chrono::steady_clock;
+    auto last_sync = clock::now();
+    AofStats &stats = PerThread<AofStats>::local();
+
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true)
+    {
+        // After a failure the unwritten bytes are retried once a second
+        // (or when a flush asks), not as soon as more are appended.
+        work_cv_.wait_for(lock, std::chrono::seconds(1), [&]
+                          { return stop_ || sync_requested_ || (!buf_.empty() && error_.empty()); });
+
+        std::string batch;
+        batch.swap(spare_);
+        batch.swap(buf_);
+        uint64_t end = appended_;
+        bool dirty = end > synced_;
+        bool forced = sync_requested_;
+        sync_requested_ = false;
+        bool stopping = stop_;
+        bool probe = lost_;
+        lost_ = false;
+        lock.unlock();
+
+        bool written = true;
+        bool synced = false;
+        bool failed = false;
+        bool busy = false;
+        int err = 0;
+        {
+            std::lock_guard<std::mutex> io_lock(io_mu_);
+            // The write and the fsync go to the kernel together; the fsync
+            // runs once the write is done.
+            auto start = clock::now();
+            uint64_t write_ticket = 0, sync_ticket = 0;
+            if (!batch.empty())
+                write_ticket = io_->write(fd_, batch.data(), batch.size(), IoEngine::APPEND);
+            bool due = policy_ == AppendFsync::Always ||
+                       (policy_ == AppendFsync::EverySec && start - last_sync >= std::chrono::seconds(1));
+            if (dirty && (forced || due))
+                sync_ticket = io_->sync(fd_);
+            busy = write_ticket || sync_ticket;
+            if (write_ticket)
+            {
+                written = io_->wait(write_ticket);
+                if (!written)
+                    err = errno;
+                uint64_t ns = nanosSince(start);
+                stats.write.record(ns);
+                latencyMonitor().sample("aof-write", ns);
+            }
+            if (sync_ticket)
+            {
+                auto written_at = clock::now();
+                synced = io_->wait(sync_ticket) && written;
+                if (!synced && !err)
+                    err = errno;
+                uint64_t ns = nanosSince(written_at);
+                stats.fsync.record(ns);
+                latencyMonitor().sample("aof-fsync", ns);
+                if (synced)
+                    last_sync = start;
+            }
+            failed = !written || (sync_ticket && !synced);
+            if (!written)
+                unwindLocked(batch);
+            file_end_ = written ? end : end - batch.size();
+        }
+
+        lock.lock();
+        uint64_t done = written ? end : end - batch.size();
+        if (done > written_)
+            written_ = done;
+        if (synced && end > synced_)
+            synced_ = end;
+        if (written)
+        {
+            batch.clear();
+            spare_.swap(batch);
+        }
+        else
+        {
+            // What did not reach the file goes out first on the next try.
+            batch.append(buf_);
+            buf_.swap(batch);
+        }
+        if (failed)
+        {
+            std::string msg = strerror(err);
+            if (msg != error_)
+                std::cerr << "[AOF] write to " << path_ << " failed: " << msg << "; refusing writes until it works\n";
+            error_ = msg;
+            ++failures_;
+            failing_.store(true, std::memory_order_relaxed);
+        }
+        else if ((busy || probe) && !error_.empty())
+        {
+            std::cerr << "[AOF] writes to " << path_ << " work again\n";
+            error_.clear();
+            failing_.store(false, std::memory_order_relaxed);
+        }
+        done_cv_.notify_all();
+        if (stopping && (buf_.empty() || failed))
+        {
+            if (!buf_.empty())
+                std::cerr << "[AOF] " << buf_.size() << " bytes never made it to " << path_ << "\n";
+            break;
+        }
+    }
+}
+
+// Cuts what a failed write got out of `batch` back off the file, so the
+// retry appends whole records. If the file cannot be cut, that part counts
+// as written and is dropped from `batch` instead.
+void AofWriter::unwindLocked(std::string &batch)
+{
+    off_t keep = static_cast<off_t>(file_end_ - file_base_);
+    if (::ftruncate(fd_, keep) == 0)
+        return;
+    struct stat st;
+    if (::fstat(fd_, &st) == 0 && st.st_size > keep)
+        batch.erase(0, std::min(static_cast<size_t>(st.st_size - keep), batch.size()));
+}
+
+bool AofWriter::writeAll(int fd, const char *data, size_t len)
+{
+    io_->write(fd, data, len, IoEngine::APPEND);
+    if (io_->waitAll())
+        return true;
+    std::cerr << "[AOF] write to " << path_ << " failed: " << strerror(errno) << "\n";
+    return false;
+}
@@ -0,0 +1,371 @@
+#include "bgsave.h"
+#include "commands.h"
+#include "replication.h"
+#include "sharded_cache.h"
+#include "stats.h"
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    uint64_t nanosSince(Clock::time_point start)
+    {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+    }
+}
+
+bool parseSaveRule(std::string_view text, SaveRule &out)
+{
+    size_t colon = text.find(':');
+    if (colon == std::string_view::npos)
+        return false;
+    const char *first = text.data();
+    const char *mid = text.data() + colon;
+    const char *last = text.data() + text.size();
+    auto r1 = std::from_chars(first, mid, out.seconds);
+    auto r2 = std::from_chars(mid + 1, last, out.changes);
+    return r1.ec == std::errc() && r1.ptr == mid && r2.ec == std::errc() && r2.ptr == last &&
+           out.seconds >= 0 && out.changes > 0;
+}
+
+BackgroundSaver::BackgroundSaver(std::vector<SaveRule> rules,
+                                 unsigned aof_rewrite_percentage,
+                                 uint64_t aof_rewrite_min_size)
+    : rules_(std::move(rules)),
+      aof_rewrite_percentage_(aof_rewrite_percentage),
+      aof_rewrite_min_size_(aof_rewrite_min_size),
+      last_save_(std::time(nullptr))
+{
+}
+
+const char *BackgroundSaver::busyMessage() const
+{
+    return job_ == Job::AofRewrite ? "ERR Background append only file rewriting in progress"
+                                   : "ERR Background save already in progress";
+}
+
+bool BackgroundSaver::bgsave(Database &database, std::string &err)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    if (child_ > 0)
+    {
+        err = busyMessage();
+        return false;
+    }
+    return startLocked(database, Job::Snapshot, err);
+}
+
+bool BackgroundSaver::bgrewriteaof(Database &database, bool &scheduled, std::string &err)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    scheduled = false;
+    if (job_ == Job::AofRewrite)
+    {
+        err = busyMessage();
+        return false;
+    }
+    if (child_ > 0)
+    {
+        rewrite_scheduled_ = true;
+        scheduled = true;
+        return true;
+    }
+    return startLocked(database, Job::AofRewrite, err);
+}
+
+bool BackgroundSaver::bgsaveForReplication(Database &database, const ReplicationBacklog &backlog,
+                                           uint64_t &offset, std::string &err)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    if (child_ > 0)
+    {
+        err = busyMessage();
+        return false;
+    }
+    return startLocked(database, Job::ReplicaSync, err, &backlog, &offset);
+}
+
+bool BackgroundSaver::loadReplicaSnapshot(Database &database, const std::string &path, std::string &err)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    // A child's job refers to AOF positions the swap would invalidate.
+    waitLocked(database);
+    auto start = Clock::now();
+    bool ok = database.cache.replaceWithSnapshot(path, err);
+    last_ok_ = ok;
+    last_attempt_ = std::time(nullptr);
+    if (!ok)
+        return false;
+    dirty_.store(0, std::memory_order_relaxed);
+    last_save_ = last_attempt_;
+    last_save_duration_ms_ = nanosSince(start) / 1000000;
+    return true;
+}
+
+bool BackgroundSaver::startLocked(Database &database, Job job, std::string &err,
+                                  const ReplicationBacklog *backlog, uint64_t *repl_offset)
+{
+    time_t now = std::time(nullptr);
+    if (job == Job::Snapshot)
+        last_attempt_ = now;
+    else if (job == Job::AofRewrite)
+        last_rewrite_attempt_ = now;
+
+    // With every shard lock held no other thread is inside the keyspace or
+    // OpenSSL, so the child's copy of memory is consistent and it can use
+    // both without deadlocking on a lock it inherited.
+    database.cache.lockAll();
+    std::vector<uint64_t> aof_pos = database.cache.aofPositions();
+    uint64_t dirty = dirty_.load(std::memory_order_relaxed);
+    // Writes reach the backlog under their shard lock, so nothing can slip
+    // in between this offset and the child's image.
+    if (backlog)
+        *repl_offset = backlog->offset();
+
+    auto fork_start = Clock::now();
+    pid_t pid = ::fork();
+    if (pid == 0)
+    {
+        // Child: only this thread exists here. Release the shard locks it
+        // inherited so the regular save paths can take them again.
+        database.cache.unlockAll();
+        bool ok = job == Job::Snapshot     ? database.cache.writeSnapshot()
+                  : job == Job::AofRewrite ? database.cache.rewriteAOF()
+                                           : database.cache.writeSnapshotTo(database.replication.syncPath());
+        ::_exit(ok ? 0 : 1);
+    }
+    int fork_errno = errno;
+    uint64_t fork_ns = nanosSince(fork_start);
+    database.cache.unlockAll();
+
+    if (pid < 0)
+    {
+        if (job == Job::Snapshot)
+            last_ok_ = false;
+        else if (job == Job::AofRewrite)
+            last_rewrite_ok_ = false;
+        err = std::string("ERR fork failed: ") + strerror(fork_errno);
+        std::cerr << "[Persistence] " << err << "\n";
+        return false;
+    }
+    last_fork_usec_ = fork_ns / 1000;
+    latencyMonitor().sample("fork", fork_ns);
+    child_ = pid;
+    job_ = job;
+    dirty_at_fork_ = dirty;
+    aof_at_fork_ = std::move(aof_pos);
+    started_ = now;
+    started_at_ = fork_start;
+    if (job == Job::Snapshot)
+        std::cout << "[Snapshot] Background saving started by pid " << pid << "\n";
+    else if (job == Job::AofRewrite)
+        std::cout << "[AOF] Background rewrite started by pid " << pid << "\n";
+    else
+        std::cout << "[Replication] Snapshot for replicas started by pid " << pid << "\n";
+    return true;
+}
+
+void BackgroundSaver::finishLocked(Database &database, int status)
+{
+    Job job = job_;
+    child_ = -1;
+    job_ = Job::None;
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    uint64_t child_ms = nanosSince(started_at_) / 1000000;
+
+    if (job == Job::ReplicaSync)
+    {
+        if (!ok)
+            std::cerr << "[Replication] Snapshot for replicas failed\n";
+        database.replication.syncSnapshotDone(ok);
+        return;
+    }
+
+    if (job == Job::AofRewrite)
+    {
+        if (ok)
+        {
+            // Appending what was logged meanwhile holds up the AOF writer.
+            auto start = Clock::now();
+            ok = database.cache.installAOFRewrite(aof_at_fork_);
+            latencyMonitor().sample("aof-rewrite-install", nanosSince(start));
+        }
+        else
+            database.cache.discardAOFRewrite();
+        last_rewrite_ok_ = ok;
+        if (!ok)
+        {
+            std::cerr << "[AOF] Background rewrite failed\n";
+            return;
+        }
+        last_rewrite_duration_ms_ = child_ms;
+        aof_base_size_ = database.cache.aofSize();
+        std::cout << "[AOF] Background rewrite finished (" << aof_base_size_ << " bytes)\n";
+        return;
+    }
+
+    last_ok_ = ok;
+    if (!ok)
+    {
+        std::cerr << "[Snapshot] Background save failed\n";
+        return;
+    }
+    // Writes that arrived after the fork are not in the snapshot; they stay
+    // counted, and stay in the AOF.
+    dirty_.fetch_sub(dirty_at_fork_, std::memory_order_relaxed);
+    last_save_ = started_;
+    last_save_duration_ms_ = child_ms;
+    auto start = Clock::now();
+    database.cache.snapshotTaken(aof_at_fork_);
+    latencyMonitor().sample("aof-truncate", nanosSince(start));
+    std::cout << "[Snapshot] Background save finished.\n";
+}
+
+bool BackgroundSaver::save(Database &database, std::string &err)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    if (child_ > 0)
+    {
+        err = busyMessage();
+        return false;
+    }
+
+    uint64_t dirty = dirty_.load(std::memory_order_relaxed);
+    auto start = Clock::now();
+    bool ok = database.cache.saveSnapshot();
+    last_ok_ = ok;
+    last_attempt_ = std::time(nullptr);
+    if (!ok)
+    {
+        err = "ERR snapshot could not be written";
+        return false;
+    }
+    dirty_.fetch_sub(dirty, std::memory_order_relaxed);
+    last_save_ = last_attempt_;
+    last_save_duration_ms_ = nanosSince(start) / 1000000;
+    std::cout << "[Snapshot] Saved.\n";
+    return true;
+}
+
+void BackgroundSaver::cron(Database &database)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    if (child_ > 0)
+    {
+        int status = 0;
+        pid_t r = ::waitpid(child_, &status, WNOHANG);
+        if (r == child_)
+            finishLocked(database, status);
+        else if (r < 0 && errno != EINTR)
+            finishLocked(database, -1);
+        return;
+    }
+
+    std::string err;
+    time_t now = std::time(nullptr);
+    if (rewrite_scheduled_)
+    {
+        rewrite_scheduled_ = false;
+        startLocked(database, Job::AofRewrite, err);
+        return;
+    }
+
+    if (last_ok_ || now - last_attempt_ >= RETRY_DELAY)
+    {
+        uint64_t dirty = dirty_.load(std::memory_order_relaxed);
+        for (const SaveRule &rule : rules_)
+        {
+            if (dirty >= rule.changes && now - last_save_ >= rule.seconds)
+            {
+                std::cout << "[Snapshot] " << rule.changes << " changes in " << rule.seconds
+                          << " seconds. Saving...\n";
+                startLocked(database, Job::Snapshot, err);
+                return;
+            }
+        }
+    }
+
+    if (aof_rewrite_percentage_ && (last_rewrite_ok_ || now - last_rewrite_attempt_ >= RETRY_DELAY))
+    {
+        uint64_t size = database.cache.aofSize();
+        uint64_t base = aof_base_size_ ? aof_base_size_ : 1;
+        if (size >= aof_rewrite_min_size_ && size > base && (size - base) * 100 / base >= aof_rewrite_percentage_)
+        {
+            std::cout << "[AOF] Log grew from " << aof_base_size_ << " to " << size << " bytes. Rewriting...\n";
+            startLocked(database, Job::AofRewrite, err);
+        }
+    }
+}
+
+void BackgroundSaver::waitForChild(Database &database)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    waitLocked(database);
+}
+
+void BackgroundSaver::waitLocked(Database &database)
+{
+    if (child_ <= 0)
+        return;
+    int status = 0;
+    pid_t r;
+    do
+        r = ::waitpid(child_, &status, 0);
+    while (r < 0 && errno == EINTR);
+    finishLocked(database, r == child_ ? status : -1);
+}
+
+bool BackgroundSaver::inProgress() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return job_ == Job::Snapshot;
+}
+
+bool BackgroundSaver::aofRewriteInProgress() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return job_ == Job::AofRewrite;
+}
+
+time_t BackgroundSaver::lastSave() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return last_save_;
+}
+
+bool BackgroundSaver::lastSaveOk() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return last_ok_;
+}
+
+bool BackgroundSaver::lastAofRewriteOk() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return last_rewrite_ok_;
+}
+
+uint64_t BackgroundSaver::lastForkUsec() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return last_fork_usec_;
+}
+
+uint64_t BackgroundSaver::lastSaveDurationMs() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return last_save_duration_ms_;
+}
+
+uint64_t BackgroundSaver::lastAofRewriteDurationMs() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return last_rewrite_duration_ms_;
+}
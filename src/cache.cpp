@@ -1,239 +1,1717 @@
 #include "cache.h"
+#include "byteorder.h"
+#include "io_engine.h"
+#include "lazy_free.h"
+#include "replication.h"
+#include "snapshot.h"
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <charconv>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <vector>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <stdexcept>
+#include <unistd.h>
+#include <utility>
+
+bool parseEvictionPolicy(std::string_view name, EvictionPolicy &out)
+{
+    if (name == "lru" || name == "allkeys-lru")
+        out = EvictionPolicy::Lru;
+    else if (name == "sampled-lru")
+        out = EvictionPolicy::SampledLru;
+    else if (name == "clock")
+        out = EvictionPolicy::Clock;
+    else if (name == "random" || name == "allkeys-random")
+        out = EvictionPolicy::Random;
+    else if (name == "w-tinylfu" || name == "tinylfu")
+        out = EvictionPolicy::TinyLfu;
+    else
+        return false;
+    return true;
+}
+
+const char *evictionPolicyName(EvictionPolicy policy)
+{
+    switch (policy)
+    {
+    case EvictionPolicy::Lru:
+        return "lru";
+    case EvictionPolicy::SampledLru:
+        return "sampled-lru";
+    case EvictionPolicy::Clock:
+        return "clock";
+    case EvictionPolicy::Random:
+        return "random";
+    case EvictionPolicy::TinyLfu:
+        return "w-tinylfu";
+    }
+    return "unknown";
+}
+
+uint64_t unixTimeMs()
+{
+    using namespace std::chrono;
+    return static_cast<uint64_t>(duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count());
+}
 
 LRUCache::LRUCache(size_t capacity,
                    const std::string &snapshot_path,
                    const std::string &aof_path,
-                   const std::string &aes_key)
-    : capacity_(capacity), snapshot_path_(snapshot_path),
-      aof_path_(aof_path), aes_key_(aes_key), loading_(true)
+                   const std::string &aes_key,
+                   size_t maxmemory,
+                   EvictionPolicy policy,
+                   AppendFsync fsync,
+                   const std::string &spill_dir)
+    : capacity_(capacity ? capacity : SIZE_MAX), maxmemory_(maxmemory), policy_(policy),
+      wheel_(unixTimeMs()), slab_(std::make_unique<SlabAllocator>()), snapshot_path_(snapshot_path),
+      aof_path_(aof_path), aes_key_(aes_key), cipher_(aes_key), loading_(true)
 {
-    std::filesystem::create_directories("data");
-    loadSnapshot();
-    loadAOF();
+    if (policy_ == EvictionPolicy::TinyLfu && capacity_ != SIZE_MAX)
+        sketch_.ensureCapacity(capacity_);
+    // Before loading: a snapshot larger than the capacity spills its oldest
+    // entries.
+    if (!spill_dir.empty())
+        spill_ = std::make_unique<SpillStore>(spill_dir, aes_key);
+    if (persistent())
+    {
+        auto dir = std::filesystem::path(snapshot_path_).parent_path();
+        if (!dir.empty())
+            std::filesystem::create_directories(dir);
+        loadSnapshot();
+        loadAOF();
+        // Deadlines were replayed as written; drop what has expired since.
+        bool drained;
+        expireDue(unixTimeMs(), std::chrono::steady_clock::time_point::max(), drained);
+        aof_ = std::make_unique<AofWriter>(aof_path_, fsync, aofHeader());
+    }
     loading_ = false;
 }
 
 LRUCache::~LRUCache()
 {
-    saveSnapshot();
+    for (const List &list : lists_)
+        for (uint32_t s = list.head; s != NIL; s = slots_[s].next)
+            releaseData(slots_[s]);
 }
 
 // -------------------- Public API --------------------
-size_t LRUCache::size() const noexcept { return map_.size(); }
+size_t LRUCache::size() const noexcept { return count_; }
 size_t LRUCache::capacity() const noexcept { return capacity_; }
 
-void LRUCache::set(const std::string &key, const std::string &value)
+size_t LRUCache::memoryUsage() const noexcept
+{
+    return slots_.capacity() * sizeof(Slot) + (index_.size() + old_index_.size()) * sizeof(Bucket) +
+           slab_->stats().active + wheel_.memoryUsage() + sketch_.memoryUsage() +
+           (spill_ ? spill_->memoryUsage() : 0);
+}
+
+bool LRUCache::set(std::string_view key, std::string_view value, uint64_t expire_at)
 {
-    set_internal(key, value, true);
+    return set_internal(key, value, expire_at, true);
 }
 
-bool LRUCache::get(const std::string &key, std::string &out_value)
+bool LRUCache::get(std::string_view key, std::string &out_value)
 {
-    auto it = map_.find(key);
-    if (it == map_.end())
+    return read(key, [&](std::string_view value)
+                { out_value.assign(value); });
+}
+
+bool LRUCache::del(std::string_view key, bool lazy)
+{
+    return del_internal(key, true, lazy);
+}
+
+bool LRUCache::exists(std::string_view key)
+{
+    size_t pos = findLive(key);
+    if (pos == SIZE_MAX)
         return false;
+    uint32_t s = index_[pos].slot();
+    touch(s);
+    sampleAccess(s);
+    return true;
+}
 
-    lru_list_.splice(lru_list_.begin(), lru_list_, it->second.it);
-    it->second.it = lru_list_.begin();
-    out_value = it->second.value;
+bool LRUCache::admits(std::string_view key, std::string_view value) const noexcept
+{
+    if (value.size() > MAX_VALUE)
+        return false;
+    char encoded[8];
+    size_t int_len = encodeInteger(value, encoded);
+    return !maxmemory_ || entryCost(key.size(), int_len ? int_len : value.size()) <= maxmemory_;
+}
+
+void LRUCache::prefetchIndex(std::string_view key) const noexcept
+{
+    uint32_t hash = hashKey(key);
+    if (!index_.empty())
+        __builtin_prefetch(&index_[hash & (index_.size() - 1)]);
+    if (rehashing())
+        __builtin_prefetch(&old_index_[hash & (old_index_.size() - 1)]);
+}
+
+void LRUCache::prefetchEntry(std::string_view key) const noexcept
+{
+    // Only the home bucket is looked at: the key is usually there, and
+    // this must not wait on a probe.
+    uint32_t hash = hashKey(key);
+    if (index_.empty())
+        return;
+    const Bucket &b = index_[hash & (index_.size() - 1)];
+    if (b.hash == hash && b.slot() < MOVED)
+        __builtin_prefetch(&slots_[b.slot()]);
+}
+
+bool LRUCache::expire(std::string_view key, uint64_t at_ms)
+{
+    return expire_internal(key, at_ms, true);
+}
+
+bool LRUCache::persist(std::string_view key)
+{
+    return persist_internal(key, true);
+}
+
+int64_t LRUCache::pttl(std::string_view key)
+{
+    size_t pos = findLive(key);
+    if (pos == SIZE_MAX)
+        return -2;
+    uint64_t at = deadline(index_[pos].slot());
+    if (at == 0)
+        return -1;
+    uint64_t now = unixTimeMs();
+    return at > now ? static_cast<int64_t>(at - now) : 0;
+}
+
+size_t LRUCache::expireDue(uint64_t now_ms, std::chrono::steady_clock::time_point until, bool &drained)
+{
+    // The clock is only read every few keys; deleting one is far cheaper.
+    size_t n = 0;
+    drained = false;
+    while (true)
+    {
+        if ((n & 31) == 31 && std::chrono::steady_clock::now() >= until)
+            return n;
+        uint32_t s = wheel_.popDue(now_ms);
+        if (s == TimingWheel::NONE)
+            break;
+        expireSlot(s);
+        ++n;
+    }
+    drained = true;
+    return n;
+}
+
+// A pass visits every slot once, in array order; the cursor is an index, so
+// writes between calls do not invalidate it.
+size_t LRUCache::defragStep(std::chrono::steady_clock::time_point until, bool &done)
+{
+    done = true;
+    if (!defrag_running_)
+    {
+        if (!needsDefrag())
+            return 0;
+        defrag_running_ = true;
+        defrag_cursor_ = 0;
+    }
+    size_t moved = 0;
+    for (size_t n = 1; defrag_cursor_ < slots_.size(); ++n)
+    {
+        if ((n & 63) == 0 && std::chrono::steady_clock::now() >= until)
+        {
+            done = false;
+            return moved;
+        }
+        Slot &slot = slots_[defrag_cursor_++];
+        if (slot.key_len == FREE || slot.isInline())
+            continue;
+        size_t size = slot.key_len + static_cast<size_t>(slot.val_len);
+        if (!slab_->shouldMove(slot.heap, size))
+        {
+            ++defrag_misses_;
+            continue;
+        }
+        // Comes from a fuller page that already exists, so this cannot fail.
+        char *block = slab_->allocate(size);
+        std::memcpy(block, slot.heap, size);
+        slab_->free(slot.heap, size);
+        slot.heap = block;
+        ++defrag_hits_;
+        ++moved;
+    }
+    defrag_running_ = false;
+    return moved;
+}
+
+size_t LRUCache::spillGC(std::chrono::steady_clock::time_point until, bool &done)
+{
+    done = true;
+    return spill_ ? spill_->collect(until, done) : 0;
+}
+
+bool LRUCache::needsDefrag() const noexcept
+{
+    SlabAllocator::Stats stats = slab_->stats();
+    return stats.reclaimable > DEFRAG_IGNORE_BYTES &&
+           stats.reclaimable * 100 > stats.pages * SlabAllocator::PAGE_BYTES * DEFRAG_THRESHOLD_PERCENT;
+}
+
+bool LRUCache::saveSnapshot()
+{
+    if (!persistent())
+        return true;
+    SnapshotWriter out(snapshot_path_, aes_key_);
+    return dumpTo(out) && out.finish();
+}
+
+bool LRUCache::dumpTo(SnapshotWriter &out)
+{
+    // Oldest first, so that loading the snapshot rebuilds the same LRU order;
+    // spilled entries are older than any in memory. Keys already expired
+    // are left out.
+    uint64_t now = unixTimeMs();
+    if (spill_ && !spill_->forEach([&](std::string_view key, std::string_view value, uint64_t at)
+                                   { return (at && at <= now) || out.add(key, value, at); }))
+        return false;
+    for (Segment segment : OLDEST_FIRST)
+    {
+        for (uint32_t s = lists_[segment].tail; s != NIL; s = slots_[s].prev)
+        {
+            uint64_t at = deadline(s);
+            if (at && at <= now)
+                continue;
+            if (!out.add(slots_[s].key(), valueOf(s), at))
+                return false;
+        }
+    }
     return true;
 }
 
-bool LRUCache::del(const std::string &key)
+// The entries clear(true) detached: freeing them walks the slots, which
+// would take long on the command thread.
+struct LRUCache::DroppedEntries : LazyFree::Job
+{
+    std::vector<Slot> slots;
+    IndexTable index, old_index;
+    std::unique_ptr<SlabAllocator> slab;
+    TimingWheel wheel{0};
+
+    ~DroppedEntries() override
+    {
+        for (Slot &slot : slots)
+            if (slot.key_len != FREE && !slot.isInline())
+                slab->free(slot.heap, slot.key_len + static_cast<size_t>(slot.val_len));
+    }
+};
+
+void LRUCache::clear(bool async)
+{
+    if (async && count_ > 0)
+    {
+        auto dropped = std::make_unique<DroppedEntries>();
+        dropped->slots.swap(slots_);
+        dropped->index.swap(index_);
+        dropped->old_index.swap(old_index_);
+        dropped->slab = std::exchange(slab_, std::make_unique<SlabAllocator>());
+        std::swap(dropped->wheel, wheel_);
+        lazyFree().enqueue(std::move(dropped), count_, used_bytes_);
+    }
+    else
+    {
+        for (const List &list : lists_)
+            for (uint32_t s = list.head; s != NIL; s = slots_[s].next)
+                releaseData(slots_[s]);
+        std::vector<Slot>().swap(slots_);
+        IndexTable().swap(index_);
+        IndexTable().swap(old_index_);
+    }
+    rehash_pos_ = 0;
+    free_head_ = NIL;
+    for (List &list : lists_)
+        list = List{};
+    count_ = 0;
+    used_bytes_ = 0;
+    wheel_ = TimingWheel(unixTimeMs());
+    defrag_running_ = false;
+    hot_keys_.clear();
+    if (spill_)
+        spill_->clear();
+}
+
+void LRUCache::flush(bool async)
 {
-    return (map_.find(key) != map_.end()) ? (del_internal(key, true), true) : false;
+    clear(async);
+    if (aof_)
+        appendRecord(buildRecord(FLUSH_RECORD, {}, {}));
 }
 
-void LRUCache::saveSnapshot()
+namespace
 {
-    std::ofstream out(snapshot_path_, std::ios::binary);
-    for (auto &kv : map_)
+    uint64_t reverseBits(uint64_t v) noexcept
     {
-        std::string enc_key = aes_encrypt(kv.first);
-        std::string enc_val = aes_encrypt(kv.second.value);
+        v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+        v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        return __builtin_bswap64(v);
+    }
 
-        size_t klen = enc_key.size();
-        size_t vlen = enc_val.size();
-        out.write(reinterpret_cast<char *>(&klen), sizeof(klen));
-        out.write(enc_key.data(), klen);
-        out.write(reinterpret_cast<char *>(&vlen), sizeof(vlen));
-        out.write(enc_val.data(), vlen);
+    // The cursor after v when counting in reverse-binary order over the
+    // bits of mask: the highest bit flips fastest.
+    uint64_t nextCursor(uint64_t v, uint64_t mask) noexcept
+    {
+        return reverseBits(reverseBits(v | ~mask) + 1);
     }
-    out.close();
+}
+
+// The cursor is the dictScan() cursor of Redis, over home buckets. While
+// rehashing, a home bucket of the old (smaller) table is visited together
+// with the home buckets of index_ it splits into, which are the cursors
+// that follow it until the bits only index_ has wrap around.
+uint64_t LRUCache::scan(uint64_t cursor, size_t count, std::vector<std::string> &keys) const
+{
+    if (index_.empty())
+        return 0;
+    uint64_t large_mask = index_.size() - 1;
+    uint64_t small_mask = rehashing() ? old_index_.size() - 1 : large_mask;
+    uint64_t now = unixTimeMs();
+    uint64_t v = cursor;
+    size_t visits = count * 10;
+    do
+    {
+        if (rehashing())
+            scanBucket(old_index_, v & small_mask, now, keys);
+        do
+        {
+            scanBucket(index_, v & large_mask, now, keys);
+            v = nextCursor(v, large_mask);
+        } while (v & (small_mask ^ large_mask));
+    } while (v != 0 && keys.size() < count && --visits > 0);
+    return v;
+}
+
+// Linear probing keeps every entry of a home bucket in the run of occupied
+// buckets that starts there: deletion shifts entries back rather than
+// leaving holes, and old_index_ only ever gains MOVED markers.
+void LRUCache::scanBucket(const IndexTable &table, size_t home, uint64_t now, std::vector<std::string> &keys) const
+{
+    size_t mask = table.size() - 1;
+    for (size_t pos = home; table[pos].slot() != NIL; pos = (pos + 1) & mask)
+    {
+        const Bucket &b = table[pos];
+        if (b.slot() == MOVED || (b.hash & mask) != home)
+            continue;
+        uint64_t at = deadline(b.slot());
+        if (at && at <= now)
+            continue;
+        keys.emplace_back(slots_[b.slot()].key());
+    }
+}
+
+void LRUCache::setHotKeySampling(uint32_t rate)
+{
+    hot_key_rate_ = rate;
+    hot_key_countdown_ = rate;
+    hot_key_samples_ = 0;
+    hot_keys_.clear();
+}
+
+void LRUCache::hotKeys(std::vector<HotKey> &out)
+{
+    for (const HotKeyCounter &counter : hot_keys_)
+    {
+        if (counter.count == 0)
+            continue;
+        size_t pos = findLive(counter.key, false);
+        int64_t bytes = pos == SIZE_MAX ? -1 : static_cast<int64_t>(valueOf(index_[pos].slot()).size());
+        out.push_back({counter.key, static_cast<uint64_t>(counter.count) * hot_key_rate_, bytes});
+    }
+}
+
+void LRUCache::restore(std::string_view key, std::string_view value, uint64_t expire_at)
+{
+    set_internal(key, value, expire_at, false);
 }
 
 void LRUCache::flushAOF()
 {
-    // Nothing fancy: we append on each op; this ensures flush
-    std::ofstream out(aof_path_, std::ios::binary | std::ios::app);
-    out.flush();
-    out.close();
+    if (aof_)
+        aof_->flush();
+}
+
+void LRUCache::snapshotTaken(uint64_t pos)
+{
+    if (aof_)
+        aof_->truncatePrefix(pos);
+}
+
+uint64_t LRUCache::aofPosition() const
+{
+    return aof_ ? aof_->position() : 0;
+}
+
+uint64_t LRUCache::aofSize() const
+{
+    return aof_ ? aof_->size() : 0;
+}
+
+bool LRUCache::aofWriteError(std::string &err) const
+{
+    return aof_ && aof_->writeError(err);
+}
+
+bool LRUCache::rewriteAOF()
+{
+    if (!aof_)
+        return true;
+    int fd = ::open(rewritePath().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    std::unique_ptr<IoEngine> io = IoEngine::create();
+    IoWriter out(*io, fd);
+    // This runs in a forked child: cipher_ is a copy of the parent's, which
+    // goes on sealing the same nonces. The rewrite gets its own.
+    RecordCipher cipher(aes_key_);
+    bool ok = out.append(aofHeader());
+    // The rewrite stands for the whole cache, but a snapshot older than it
+    // is still loaded first on startup: it starts by dropping that, or keys
+    // deleted since the snapshot would come back.
+    ok = ok && buildRecord(cipher, FLUSH_RECORD, {}, {}) && out.append(aof_record_);
+    // One set per live entry, oldest first, as in the snapshot.
+    uint64_t now = unixTimeMs();
+    if (spill_)
+        ok = ok && spill_->forEach([&](std::string_view key, std::string_view value, uint64_t at)
+                                   {
+            if (at && at <= now)
+                return true;
+            return buildRecord(cipher, at ? SETEX_RECORD : SET_RECORD, key, value, at) &&
+                   out.append(aof_record_); });
+    for (Segment segment : OLDEST_FIRST)
+    {
+        for (uint32_t s = lists_[segment].tail; s != NIL && ok; s = slots_[s].prev)
+        {
+            uint64_t at = deadline(s);
+            if (at && at <= now)
+                continue;
+            ok = buildRecord(cipher, at ? SETEX_RECORD : SET_RECORD, slots_[s].key(), valueOf(s), at) &&
+                 out.append(aof_record_);
+        }
+    }
+    // installAOFRewrite() syncs the file once the tail is appended.
+    ok = out.finish(false) && ok;
+    return ::close(fd) == 0 && ok;
+}
+
+bool LRUCache::installAOFRewrite(uint64_t pos)
+{
+    return !aof_ || aof_->rewrite(pos, rewritePath());
+}
+
+void LRUCache::discardAOFRewrite()
+{
+    if (aof_)
+        std::remove(rewritePath().c_str());
 }
 
 // -------------------- Internals --------------------
-void LRUCache::set_internal(const std::string &key, const std::string &value, bool append)
+bool LRUCache::set_internal(std::string_view key, std::string_view value, uint64_t expire_at, bool append)
 {
-    auto it = map_.find(key);
-    if (it != map_.end())
+    if (value.size() > MAX_VALUE)
+        throw std::length_error("LRUCache: value too large");
+    char encoded[8];
+    size_t int_len = encodeInteger(value, encoded);
+    std::string_view stored = int_len ? std::string_view(encoded, int_len) : value;
+    if (maxmemory_ && entryCost(key.size(), stored.size()) > maxmemory_)
+        return false;
+
+    uint32_t hash = hashKey(key);
+    size_t pos = findBucket(key, hash);
+    uint32_t s;
+    if (pos != SIZE_MAX)
     {
-        it->second.value = value;
-        lru_list_.splice(lru_list_.begin(), lru_list_, it->second.it);
-        it->second.it = lru_list_.begin();
+        s = index_[pos].slot();
+        Slot &slot = slots_[s];
+        used_bytes_ -= entryCost(slot.key_len, slot.val_len);
+        storeValue(slot, stored);
+        used_bytes_ += entryCost(key.size(), stored.size());
+        if (policy_ == EvictionPolicy::TinyLfu)
+            touch(s);
+        else
+        {
+            unlink(s);
+            pushFront(s);
+        }
     }
     else
     {
-        if (map_.size() >= capacity_)
+        // A new value replaces any copy on disk.
+        if (spill_)
+            spill_->erase(key);
+        s = allocSlot();
+        slots_[s].hash = hash;
+        slots_[s].access = WINDOW;
+        storeEntry(slots_[s], key, stored);
+        pushFront(s);
+        insertBucket(hash, s);
+        ++count_;
+        used_bytes_ += entryCost(key.size(), stored.size());
+        if (policy_ == EvictionPolicy::TinyLfu)
+        {
+            // Without a count limit the sketch follows the population.
+            if (count_ > sketch_.capacity())
+                sketch_.ensureCapacity(count_ * 2);
+            sketch_.increment(hash);
+        }
+    }
+    slots_[s].int_value = int_len != 0;
+    if (policy_ != EvictionPolicy::TinyLfu)
+        slots_[s].access = policy_ == EvictionPolicy::Clock ? 1 : ++access_clock_;
+    if (expire_at)
+    {
+        wheel_.schedule(s, expire_at);
+        slots_[s].expires = 1;
+    }
+    else if (slots_[s].expires)
+    {
+        wheel_.cancel(s);
+        slots_[s].expires = 0;
+    }
+    if (append)
+        sampleAccess(s);
+    evictUntilWithinLimits(s, append);
+
+    if (append && logging())
+        propagateSet(key, value, expire_at);
+    return true;
+}
+
+bool LRUCache::del_internal(std::string_view key, bool append, bool lazy)
+{
+    size_t pos = findLive(key, false, true);
+    std::string_view value;
+    uint64_t at;
+    if (pos != SIZE_MAX)
+        removeSlot(pos, lazy);
+    else if (!spill_ || !takeSpilled(key, value, at))
+        return false;
+    if (append && logging())
+        propagateDel(key);
+    return true;
+}
+
+bool LRUCache::expire_internal(std::string_view key, uint64_t at_ms, bool append)
+{
+    size_t pos = findLive(key, true, true);
+    if (pos == SIZE_MAX)
+        return false;
+    uint32_t s = index_[pos].slot();
+    if (!loading_ && !replica_ && at_ms <= unixTimeMs())
+    {
+        expireSlot(s);
+        return true;
+    }
+    wheel_.schedule(s, at_ms);
+    slots_[s].expires = 1;
+    if (append && logging())
+        propagateExpire(key, at_ms);
+    return true;
+}
+
+bool LRUCache::persist_internal(std::string_view key, bool append)
+{
+    size_t pos = findLive(key, true, true);
+    if (pos == SIZE_MAX)
+        return false;
+    uint32_t s = index_[pos].slot();
+    if (!slots_[s].expires)
+        return false;
+    wheel_.cancel(s);
+    slots_[s].expires = 0;
+    if (append && logging())
+        propagatePersist(key);
+    return true;
+}
+
+// Like findBucket(), but a key past its deadline is deleted on the spot and
+// reported missing. While loading, deadlines are only recorded: a later
+// record may still move or drop one (the constructor purges at the end).
+// A replica deletes nothing on its own clock; see setReplica().
+size_t LRUCache::findLive(std::string_view key, bool promote, bool write)
+{
+    size_t pos = findBucket(key, hashKey(key));
+    if (pos == SIZE_MAX && promote && spill_)
+    {
+        // Back into memory, as the newest entry; the log already has it.
+        std::string_view value;
+        uint64_t at;
+        if (!takeSpilled(key, value, at))
+            return SIZE_MAX;
+        set_internal(key, value, at, false);
+        return findBucket(key, hashKey(key));
+    }
+    if (pos == SIZE_MAX)
+        return pos;
+    uint32_t s = index_[pos].slot();
+    if (!loading_ && slots_[s].expires && wheel_.deadline(s) <= unixTimeMs())
+    {
+        if (replica_)
+            return write ? pos : SIZE_MAX;
+        expireSlot(s);
+        return SIZE_MAX;
+    }
+    return pos;
+}
+
+// Takes a key off the disk tier. One found expired is deleted as expireSlot()
+// would and reported missing.
+bool LRUCache::takeSpilled(std::string_view key, std::string_view &value, uint64_t &expire_at)
+{
+    if (!spill_->take(key, value, expire_at))
+        return false;
+    // On a replica the key comes back as it is; findLive() hides it.
+    if (loading_ || replica_ || expire_at == 0 || expire_at > unixTimeMs())
+        return true;
+    if (logging())
+        propagateDel(key);
+    ++expired_;
+    return false;
+}
+
+// Deletes an expired key. The log gets an explicit DEL, so replaying it
+// does not depend on the clock at replay time.
+void LRUCache::expireSlot(uint32_t s)
+{
+    if (logging())
+        propagateDel(slots_[s].key());
+    removeSlot(slotBucket(s));
+    ++expired_;
+}
+
+// -------------------- Slot storage --------------------
+uint32_t LRUCache::hashKey(std::string_view key) noexcept
+{
+    uint64_t h = std::hash<std::string_view>{}(key);
+    return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+size_t LRUCache::findBucket(std::string_view key, uint32_t hash)
+{
+    if (rehashing())
+        rehashBuckets(REHASH_STEP_BUCKETS);
+    size_t pos = probe(index_, key, hash);
+    if (pos != SIZE_MAX || !rehashing())
+        return pos;
+    pos = probe(old_index_, key, hash);
+    return pos != SIZE_MAX ? moveBucket(pos) : SIZE_MAX;
+}
+
+size_t LRUCache::probe(const IndexTable &table, std::string_view key, uint32_t hash) const noexcept
+{
+    if (table.empty())
+        return SIZE_MAX;
+    size_t mask = table.size() - 1;
+    for (size_t pos = hash & mask;; pos = (pos + 1) & mask)
+    {
+        const Bucket &b = table[pos];
+        if (b.slot() == NIL)
+            return SIZE_MAX;
+        if (b.hash == hash && b.slot() != MOVED && slots_[b.slot()].key() == key)
+            return pos;
+    }
+}
+
+size_t LRUCache::slotBucket(uint32_t s)
+{
+    uint32_t hash = slots_[s].hash;
+    size_t mask = index_.size() - 1;
+    for (size_t pos = hash & mask; index_[pos].slot() != NIL; pos = (pos + 1) & mask)
+        if (index_[pos].slot() == s)
+            return pos;
+    mask = old_index_.size() - 1;
+    size_t pos = hash & mask;
+    while (old_index_[pos].slot() != s)
+        pos = (pos + 1) & mask;
+    return moveBucket(pos);
+}
+
+void LRUCache::insertBucket(uint32_t hash, uint32_t slot)
+{
+    // Keep the load factor at or below 3/4 so probe sequences stay short.
+    if ((count_ + 1) * 4 > index_.size() * 3)
+        growIndex();
+    placeBucket(Bucket(hash, slot));
+}
+
+size_t LRUCache::placeBucket(Bucket b) noexcept
+{
+    size_t mask = index_.size() - 1;
+    size_t pos = b.hash & mask;
+    while (index_[pos].slot() != NIL)
+        pos = (pos + 1) & mask;
+    index_[pos] = b;
+    return pos;
+}
+
+// The old bucket stays behind as MOVED rather than empty: it may sit in the
+// middle of another key's probe run.
+size_t LRUCache::moveBucket(size_t old_pos) noexcept
+{
+    size_t pos = placeBucket(old_index_[old_pos]);
+    old_index_[old_pos].setSlot(MOVED);
+    return pos;
+}
+
+// Backward-shift deletion: pull later members of the probe run into the hole
+// so lookups never need tombstones. Only index_ ever loses entries.
+void LRUCache::eraseBucket(size_t pos) noexcept
+{
+    size_t mask = index_.size() - 1;
+    size_t hole = pos;
+    for (size_t next = (hole + 1) & mask; index_[next].slot() != NIL; next = (next + 1) & mask)
+    {
+        size_t home = index_[next].hash & mask;
+        // Move the entry back if its home position does not lie in (hole, next].
+        if (((next - home) & mask) >= ((next - hole) & mask))
         {
-            std::string lru_key = lru_list_.back();
-            lru_list_.pop_back();
-            map_.erase(lru_key);
-            if (!loading_ && append)
-                appendAOF_del(lru_key);
+            index_[hole] = index_[next];
+            hole = next;
         }
-        lru_list_.push_front(key);
-        map_.emplace(key, Entry{value, lru_list_.begin()});
     }
-    if (!loading_ && append)
-        appendAOF_set(key, value);
+    index_[hole].setSlot(NIL);
 }
 
-void LRUCache::del_internal(const std::string &key, bool append)
+// Doubles the index. Its entries move over incrementally; the new table
+// starts at most 3/8 full and the next doubling is due at 3/4, so with
+// REHASH_STEP_BUCKETS moved per insert the move is long finished by then.
+void LRUCache::growIndex()
 {
-    auto it = map_.find(key);
-    if (it == map_.end())
+    if (index_.empty())
+        IndexTable(16).swap(index_);
+    else
+        resizeIndex(index_.size() * 2);
+}
+
+void LRUCache::resizeIndex(size_t buckets)
+{
+    if (rehashing())
+        rehashBuckets(old_index_.size());
+    old_index_.swap(index_);
+    IndexTable(buckets).swap(index_);
+    rehash_pos_ = 0;
+}
+
+size_t LRUCache::rehashBuckets(size_t n) noexcept
+{
+    size_t moved = 0;
+    for (size_t end = std::min(old_index_.size(), rehash_pos_ + n); rehash_pos_ < end; ++rehash_pos_)
+    {
+        Bucket &b = old_index_[rehash_pos_];
+        if (b.slot() == NIL || b.slot() == MOVED)
+            continue;
+        placeBucket(b);
+        b.setSlot(MOVED);
+        ++moved;
+    }
+    if (rehash_pos_ == old_index_.size())
+    {
+        IndexTable().swap(old_index_);
+        rehash_pos_ = 0;
+    }
+    return moved;
+}
+
+size_t LRUCache::rehashStep(std::chrono::steady_clock::time_point until, bool &done)
+{
+    size_t moved = 0;
+    while (rehashing() && std::chrono::steady_clock::now() < until)
+        moved += rehashBuckets(1024);
+    done = !rehashing();
+    return moved;
+}
+
+void LRUCache::reserve(size_t entries)
+{
+    size_t buckets = 16;
+    while (buckets * 3 < entries * 4)
+        buckets *= 2;
+    if (buckets <= index_.size())
         return;
-    lru_list_.erase(it->second.it);
-    map_.erase(it);
-    if (!loading_ && append)
-        appendAOF_del(key);
+    resizeIndex(buckets);
+    rehashBuckets(old_index_.size());
+}
+
+uint32_t LRUCache::allocSlot()
+{
+    if (free_head_ != NIL)
+    {
+        uint32_t s = free_head_;
+        free_head_ = slots_[s].next;
+        return s;
+    }
+    if (slots_.size() >= MOVED)
+        throw std::length_error("LRUCache: too many entries");
+    slots_.emplace_back();
+    return static_cast<uint32_t>(slots_.size() - 1);
+}
+
+void LRUCache::freeSlot(uint32_t s) noexcept
+{
+    slots_[s].key_len = FREE;
+    slots_[s].next = free_head_;
+    free_head_ = s;
+}
+
+void LRUCache::storeEntry(Slot &slot, std::string_view key, std::string_view value)
+{
+    slot.key_len = static_cast<uint32_t>(key.size());
+    slot.val_len = static_cast<uint32_t>(value.size());
+    char *dst = slot.inline_data;
+    if (!slot.isInline())
+    {
+        slot.heap = slab_->allocate(key.size() + value.size());
+        dst = slot.heap;
+    }
+    std::memcpy(dst, key.data(), key.size());
+    std::memcpy(dst + key.size(), value.data(), value.size());
+}
+
+void LRUCache::storeValue(Slot &slot, std::string_view value)
+{
+    if (value.size() == slot.val_len)
+    {
+        std::memcpy(slot.data() + slot.key_len, value.data(), value.size());
+        return;
+    }
+    // A block of the same size class is rewritten where it is.
+    size_t old_size = slot.key_len + static_cast<size_t>(slot.val_len);
+    size_t new_size = slot.key_len + value.size();
+    if (!slot.isInline() && new_size > INLINE_BYTES && slab_->resize(old_size, new_size))
+    {
+        slot.val_len = static_cast<uint32_t>(value.size());
+        std::memcpy(slot.heap + slot.key_len, value.data(), value.size());
+        return;
+    }
+    // The key may live in the block being replaced, so copy it out first.
+    char key_buf[INLINE_BYTES];
+    std::string key_heap;
+    std::string_view key;
+    if (slot.key_len <= INLINE_BYTES)
+    {
+        std::memcpy(key_buf, slot.data(), slot.key_len);
+        key = std::string_view(key_buf, slot.key_len);
+    }
+    else
+    {
+        key_heap.assign(slot.key());
+        key = key_heap;
+    }
+    releaseData(slot);
+    storeEntry(slot, key, value);
+}
+
+void LRUCache::releaseData(Slot &slot, bool lazy) noexcept
+{
+    if (slot.isInline())
+        return;
+    size_t n = slot.key_len + static_cast<size_t>(slot.val_len);
+    if (lazy && slab_->disown(slot.heap, n))
+        lazyFree().freeBlock(slot.heap, n);
+    else
+        slab_->free(slot.heap, n);
+}
+
+// Returns the number of bytes written to `out` (1 to 8), or 0 if `value` is
+// not the canonical decimal text of an int64 (no sign but '-', no leading
+// zeros, no "-0"), which is then stored as text so it reads back unchanged.
+size_t LRUCache::encodeInteger(std::string_view value, char *out) noexcept
+{
+    if (value.empty() || value.size() > 20)
+        return 0;
+    size_t digits = value[0] == '-' ? 1 : 0;
+    if (digits == value.size() || value[digits] < '0' || value[digits] > '9' ||
+        (value[digits] == '0' && value.size() != 1))
+        return 0;
+    int64_t v;
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), v);
+    if (ec != std::errc() || end != value.data() + value.size())
+        return 0;
+    // Fewest little-endian bytes whose sign extension gives v back.
+    size_t n = 1;
+    while (n < 8 && (v < -(int64_t(1) << (8 * n - 1)) || v >= (int64_t(1) << (8 * n - 1))))
+        ++n;
+    for (size_t i = 0; i < n; ++i)
+        out[i] = static_cast<char>(static_cast<uint64_t>(v) >> (8 * i));
+    return n;
+}
+
+// The value's text. For an integer it is formatted into int_text_, which the
+// next call overwrites.
+std::string_view LRUCache::valueOf(uint32_t s) noexcept
+{
+    const Slot &slot = slots_[s];
+    std::string_view stored = slot.stored();
+    if (!slot.int_value)
+        return stored;
+    uint64_t u = 0;
+    for (size_t i = 0; i < stored.size(); ++i)
+        u |= uint64_t(static_cast<unsigned char>(stored[i])) << (8 * i);
+    if (stored.size() < 8 && (u >> (8 * stored.size() - 1)) & 1)
+        u |= ~uint64_t(0) << (8 * stored.size());
+    char *end = std::to_chars(int_text_, int_text_ + sizeof(int_text_), static_cast<int64_t>(u)).ptr;
+    return {int_text_, static_cast<size_t>(end - int_text_)};
+}
+
+void LRUCache::unlink(uint32_t s) noexcept
+{
+    Slot &slot = slots_[s];
+    List &list = listOf(s);
+    if (slot.prev != NIL)
+        slots_[slot.prev].next = slot.next;
+    else
+        list.head = slot.next;
+    if (slot.next != NIL)
+        slots_[slot.next].prev = slot.prev;
+    else
+        list.tail = slot.prev;
+    --list.count;
+}
+
+void LRUCache::pushFront(uint32_t s) noexcept
+{
+    Slot &slot = slots_[s];
+    List &list = listOf(s);
+    slot.prev = NIL;
+    slot.next = list.head;
+    if (list.head != NIL)
+        slots_[list.head].prev = s;
+    list.head = s;
+    if (list.tail == NIL)
+        list.tail = s;
+    ++list.count;
+}
+
+void LRUCache::removeSlot(size_t bucket_pos, bool lazy)
+{
+    uint32_t s = index_[bucket_pos].slot();
+    used_bytes_ -= entryCost(slots_[s].key_len, slots_[s].val_len);
+    if (slots_[s].expires)
+    {
+        wheel_.cancel(s);
+        slots_[s].expires = 0;
+    }
+    eraseBucket(bucket_pos);
+    unlink(s);
+    releaseData(slots_[s], lazy);
+    freeSlot(s);
+    --count_;
+}
+
+// -------------------- Eviction --------------------
+size_t LRUCache::entryCost(size_t key_len, size_t val_len) noexcept
+{
+    size_t cost = sizeof(Slot) + sizeof(Bucket);
+    if (key_len + val_len > INLINE_BYTES)
+        cost += key_len + val_len;
+    return cost;
+}
+
+void LRUCache::touch(uint32_t s) noexcept
+{
+    switch (policy_)
+    {
+    case EvictionPolicy::Lru:
+        unlink(s);
+        pushFront(s);
+        break;
+    case EvictionPolicy::SampledLru:
+        slots_[s].access = ++access_clock_;
+        break;
+    case EvictionPolicy::Clock:
+        slots_[s].access = 1;
+        break;
+    case EvictionPolicy::Random:
+        break;
+    case EvictionPolicy::TinyLfu:
+        sketch_.increment(slots_[s].hash);
+        if (slots_[s].access == PROTECTED || slots_[s].access == PROBATION)
+        {
+            moveTo(s, PROTECTED);
+            // Keep the protected segment to its share: its oldest entry
+            // goes back on probation.
+            uint32_t oldest = lists_[PROTECTED].tail;
+            if (lists_[PROTECTED].count > protectedLimit() && oldest != s)
+                moveTo(oldest, PROBATION);
+        }
+        else
+            moveTo(s, WINDOW);
+        break;
+    }
+}
+
+bool LRUCache::overLimit() const noexcept
+{
+    return count_ > capacity_ || (maxmemory_ && used_bytes_ > maxmemory_);
+}
+
+// Evicts until both limits hold again, never touching `keep` (the entry
+// that was just written).
+void LRUCache::evictUntilWithinLimits(uint32_t keep, bool append)
+{
+    // A replica holds whatever the master holds; see setReplica().
+    if (replica_)
+        return;
+    if (policy_ == EvictionPolicy::TinyLfu)
+    {
+        evictTinyLfu(keep, append);
+        return;
+    }
+    while (overLimit() && count_ > 1)
+    {
+        uint32_t victim = pickVictim(keep);
+        if (victim == NIL)
+            break;
+        evictSlot(victim, append);
+    }
+}
+
+// In tiered mode the entry moves to disk and, still existing, is not
+// logged; if the write fails it is dropped as usual.
+void LRUCache::evictSlot(uint32_t s, bool append)
+{
+    if (spill_ && spill_->put(slots_[s].key(), valueOf(s), deadline(s)))
+    {
+        removeSlot(slotBucket(s), lazy_eviction_);
+        return;
+    }
+    if (append && logging())
+        propagateDel(slots_[s].key());
+    removeSlot(slotBucket(s), lazy_eviction_);
+    ++evictions_;
+}
+
+uint32_t LRUCache::pickVictim(uint32_t keep) noexcept
+{
+    uint32_t tail = lists_[0].tail;
+    switch (policy_)
+    {
+    case EvictionPolicy::Lru:
+    case EvictionPolicy::TinyLfu: // not used; see evictTinyLfu()
+        return tail != keep ? tail : slots_[tail].prev;
+
+    case EvictionPolicy::SampledLru:
+    {
+        uint32_t best = NIL;
+        for (int i = 0; i < EVICTION_SAMPLES; ++i)
+        {
+            uint32_t s = randomLiveSlot(keep);
+            // Clock values wrap; compare ages rather than raw stamps.
+            if (s != NIL && (best == NIL || access_clock_ - slots_[s].access > access_clock_ - slots_[best].access))
+                best = s;
+        }
+        return best;
+    }
+
+    case EvictionPolicy::Clock:
+    {
+        // Two sweeps clear every reference bit, so a victim is always found.
+        size_t n = slots_.size();
+        for (size_t step = 0; step < 2 * n + 1; ++step)
+        {
+            uint32_t s = clock_hand_;
+            clock_hand_ = static_cast<uint32_t>((clock_hand_ + 1) % n);
+            Slot &slot = slots_[s];
+            if (slot.key_len == FREE || s == keep)
+                continue;
+            if (slot.access)
+            {
+                slot.access = 0;
+                continue;
+            }
+            return s;
+        }
+        return NIL;
+    }
+
+    case EvictionPolicy::Random:
+        return randomLiveSlot(keep);
+    }
+    return NIL;
+}
+
+// Picks a random occupied slot. Slots are dense unless many keys were
+// deleted, so a few probes almost always suffice; fall back to the LRU tail.
+uint32_t LRUCache::randomLiveSlot(uint32_t keep) noexcept
+{
+    for (int attempt = 0; attempt < 32; ++attempt)
+    {
+        uint32_t s = static_cast<uint32_t>(nextRandom() % slots_.size());
+        if (slots_[s].key_len != FREE && s != keep)
+            return s;
+    }
+    uint32_t tail = lists_[0].tail;
+    return tail != keep ? tail : slots_[tail].prev;
+}
+
+// The window's oldest entry, once the window is over its share, is the
+// candidate for the main space. While the cache is over its limits the
+// candidate and the main space's victim (oldest on probation, else oldest
+// protected) are compared by estimated frequency and the less popular one
+// is evicted; ties go against the candidate. Candidates left once the
+// limits hold move to probation.
+void LRUCache::evictTinyLfu(uint32_t keep, bool append)
+{
+    auto oldest = [&](Segment segment)
+    {
+        uint32_t tail = lists_[segment].tail;
+        return tail != keep || tail == NIL ? tail : slots_[tail].prev;
+    };
+    while (overLimit() && count_ > 1)
+    {
+        uint32_t candidate = lists_[WINDOW].count > windowLimit() ? oldest(WINDOW) : NIL;
+        uint32_t victim = oldest(PROBATION);
+        if (victim == NIL)
+            victim = oldest(PROTECTED);
+
+        uint32_t loser;
+        if (candidate == NIL)
+            loser = victim != NIL ? victim : oldest(WINDOW);
+        else if (victim == NIL || sketch_.frequency(slots_[candidate].hash) <= sketch_.frequency(slots_[victim].hash))
+            loser = candidate;
+        else
+        {
+            loser = victim;
+            moveTo(candidate, PROBATION);
+        }
+        if (loser == NIL)
+            break;
+        evictSlot(loser, append);
+    }
+    while (lists_[WINDOW].count > windowLimit() && lists_[WINDOW].tail != keep)
+        moveTo(lists_[WINDOW].tail, PROBATION);
+}
+
+void LRUCache::moveTo(uint32_t s, Segment segment) noexcept
+{
+    unlink(s);
+    slots_[s].access = segment;
+    pushFront(s);
+}
+
+// Segment shares are in entries, of the capacity or, without one, of the
+// current population (a memory-bounded cache hovers near its limit).
+size_t LRUCache::windowLimit() const noexcept
+{
+    size_t total = capacity_ != SIZE_MAX ? capacity_ : count_;
+    return std::max<size_t>(1, total * WINDOW_PERCENT / 100);
+}
+
+size_t LRUCache::protectedLimit() const noexcept
+{
+    size_t total = capacity_ != SIZE_MAX ? capacity_ : count_;
+    size_t main = total - std::min(total, windowLimit());
+    return std::max<size_t>(1, main * PROTECTED_PERCENT / 100);
+}
+
+uint64_t LRUCache::nextRandom() noexcept
+{
+    // xorshift64*
+    rng_state_ ^= rng_state_ >> 12;
+    rng_state_ ^= rng_state_ << 25;
+    rng_state_ ^= rng_state_ >> 27;
+    return rng_state_ * 2685821657736338717ULL;
+}
+
+// Space-Saving: a key missing from the full table takes the place of the
+// least counted one and inherits its count, so a count overestimates by at
+// most what the replaced key had. The gaps between samples are random
+// around the rate, so accesses that recur with the sampling period are not
+// all seen or all missed.
+void LRUCache::countHotKey(uint32_t s)
+{
+    hot_key_countdown_ = 1 + static_cast<uint32_t>(nextRandom() % (2 * static_cast<uint64_t>(hot_key_rate_) - 1));
+    if (++hot_key_samples_ == HOT_KEY_DECAY_SAMPLES)
+    {
+        hot_key_samples_ = 0;
+        for (HotKeyCounter &counter : hot_keys_)
+            counter.count /= 2;
+    }
+    const Slot &slot = slots_[s];
+    HotKeyCounter *least = nullptr;
+    for (HotKeyCounter &counter : hot_keys_)
+    {
+        if (counter.hash == slot.hash && counter.key == slot.key())
+        {
+            ++counter.count;
+            return;
+        }
+        if (!least || counter.count < least->count)
+            least = &counter;
+    }
+    if (hot_keys_.size() < HOT_KEY_SLOTS)
+        hot_keys_.push_back({std::string(slot.key()), slot.hash, 1});
+    else
+    {
+        least->key.assign(slot.key());
+        least->hash = slot.hash;
+        ++least->count;
+    }
 }
 
 // -------------------- Persistence --------------------
 void LRUCache::loadSnapshot()
 {
-    std::ifstream in(snapshot_path_, std::ios::binary);
+    std::string err;
+    SnapshotLoad status = loadSnapshotFile(
+        snapshot_path_, aes_key_, 0,
+        [this](uint64_t records)
+        {
+            size_t entries = static_cast<size_t>(std::min<uint64_t>(records, capacity_));
+            slots_.reserve(entries);
+            reserve(entries);
+        },
+        [this](std::string_view key, std::string_view value, uint64_t expire_at)
+        { set_internal(key, value, expire_at, false); },
+        err);
+    if (status == SnapshotLoad::Corrupt)
+        throw std::runtime_error(err);
+    if (status == SnapshotLoad::NotBlocks)
+        loadLegacySnapshot();
+}
+
+// Snapshots written before the block format: host-endian size_t lengths,
+// every key and value encrypted on its own. Lengths are checked against
+// what is left of the file before anything is allocated.
+void LRUCache::loadLegacySnapshot()
+{
+    std::ifstream in(snapshot_path_, std::ios::binary | std::ios::ate);
     if (!in)
         return;
+    uint64_t left = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
 
-    while (in.peek() != EOF)
+    auto readField = [&](std::string &field)
     {
-        size_t klen = 0, vlen = 0;
-        in.read(reinterpret_cast<char *>(&klen), sizeof(klen));
-        std::string enc_key(klen, '\0');
-        in.read(&enc_key[0], klen);
-
-        in.read(reinterpret_cast<char *>(&vlen), sizeof(vlen));
-        std::string enc_val(vlen, '\0');
-        in.read(&enc_val[0], vlen);
+        size_t len = 0;
+        if (left < sizeof(len) || !in.read(reinterpret_cast<char *>(&len), sizeof(len)))
+            return false;
+        left -= sizeof(len);
+        if (len > left)
+            return false;
+        field.resize(len);
+        if (!in.read(&field[0], static_cast<std::streamsize>(len)))
+            return false;
+        left -= len;
+        return true;
+    };
 
+    std::string enc_key, enc_val;
+    while (left > 0)
+    {
+        if (!readField(enc_key) || !readField(enc_val))
+            throw std::runtime_error(snapshot_path_ + ": truncated snapshot");
         std::string key = aes_decrypt(enc_key);
         std::string val = aes_decrypt(enc_val);
 
-        set_internal(key, val, false);
+        set_internal(key, val, 0, false);
     }
-    in.close();
 }
 
+// Replays the log on top of the snapshot. A record that is cut short or
+// fails its checksum ends the log: it is almost always the half-written
+// last record of a crash, and nothing after it can be trusted anyway, so the
+// file is cut back to the last good record and loading carries on from
+// there. A record that passes its checksum but not authentication was
+// written under another key, which stops the load instead.
 void LRUCache::loadAOF()
 {
-    std::ifstream in(aof_path_, std::ios::binary);
-    if (!in)
+    AofReader reader(aof_path_);
+    if (reader.format() == AofReader::Format::Legacy)
+    {
+        loadLegacyAOF(reader.data());
         return;
+    }
+
+    char op;
+    std::string_view sealed;
+    std::string plain;
+    while (reader.next(op, sealed))
+        replayRecord(op, sealed, plain);
+    if (reader.goodEnd() < reader.size())
+    {
+        std::cerr << "[AOF] " << aof_path_ << ": dropping " << reader.size() - reader.goodEnd()
+                  << " bytes after the last good record (offset " << reader.goodEnd() << ")\n";
+        std::string err;
+        if (!reader.truncate(err))
+            throw std::runtime_error(err);
+    }
+}
+
+// Version 1 logs: no header and no checksums. Records are as in version 2
+// without the CRC or, older still, 'S'/'D' records with host-endian size_t
+// lengths and every key and value encrypted on its own. They are read up to
+// the first record that does not fit in the file and written out again in
+// the current format, so nothing is ever appended to a headerless log.
+void LRUCache::loadLegacyAOF(std::string_view data)
+{
+    std::string tmp = aof_path_ + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    std::string header = aofHeader();
+    out.write(header.data(), header.size());
+
+    size_t pos = 0;
+    auto take = [&](size_t n, std::string_view &field)
+    {
+        if (n > data.size() - pos)
+            return false;
+        field = data.substr(pos, n);
+        pos += n;
+        return true;
+    };
+    auto takeLength = [&](size_t &n)
+    {
+        std::string_view field;
+        if (!take(sizeof(n), field))
+            return false;
+        std::memcpy(&n, field.data(), sizeof(n));
+        return true;
+    };
 
-    while (in.peek() != EOF)
+    std::string plain;
+    size_t good = 0;
+    bool sealed = true;
+    while (pos < data.size())
     {
-        char op;
-        in.read(&op, 1);
-        if (op == 'S')
+        char op = data[pos++];
+        if (op == SET_RECORD || op == DEL_RECORD || op == SETEX_RECORD || op == EXPIRE_RECORD ||
+            op == PERSIST_RECORD || op == FLUSH_RECORD)
+        {
+            std::string_view length, sealed;
+            if (!take(4, length) || !take(loadU32(length.data()), sealed))
+                break;
+            replayRecord(op, sealed, plain);
+            aof_record_.resize(AOF_FRAME_BYTES);
+            aof_record_.append(sealed);
+            sealAofFrame(aof_record_, op);
+        }
+        else if (op == 'S')
         {
             size_t klen = 0, vlen = 0;
-            in.read(reinterpret_cast<char *>(&klen), sizeof(klen));
-            std::string enc_key(klen, '\0');
-            in.read(&enc_key[0], klen);
-            in.read(reinterpret_cast<char *>(&vlen), sizeof(vlen));
-            std::string enc_val(vlen, '\0');
-            in.read(&enc_val[0], vlen);
-            std::string key = aes_decrypt(enc_key);
-            std::string val = aes_decrypt(enc_val);
-            set_internal(key, val, false);
+            std::string_view enc_key, enc_val;
+            if (!takeLength(klen) || !take(klen, enc_key) || !takeLength(vlen) || !take(vlen, enc_val))
+                break;
+            std::string key = aes_decrypt(std::string(enc_key));
+            std::string val = aes_decrypt(std::string(enc_val));
+            set_internal(key, val, 0, false);
+            sealed = buildRecord(SET_RECORD, key, val);
         }
         else if (op == 'D')
         {
             size_t klen = 0;
-            in.read(reinterpret_cast<char *>(&klen), sizeof(klen));
-            std::string enc_key(klen, '\0');
-            in.read(&enc_key[0], klen);
-            std::string key = aes_decrypt(enc_key);
+            std::string_view enc_key;
+            if (!takeLength(klen) || !take(klen, enc_key))
+                break;
+            std::string key = aes_decrypt(std::string(enc_key));
             del_internal(key, false);
+            sealed = buildRecord(DEL_RECORD, key, {});
+        }
+        else if (op == 'F')
+        {
+            clear();
+            sealed = buildRecord(FLUSH_RECORD, {}, {});
         }
+        else
+            break;
+        if (!sealed)
+            break;
+        out.write(aof_record_.data(), aof_record_.size());
+        good = pos;
+    }
+    if (good < data.size())
+        std::cerr << "[AOF] " << aof_path_ << ": dropping " << data.size() - good
+                  << " bytes after the last good record (offset " << good << ")\n";
+
+    out.close();
+    if (!sealed || !out || std::rename(tmp.c_str(), aof_path_.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("could not convert " + aof_path_ + " to AOF version " +
+                                 std::to_string(AOF_VERSION));
     }
-    in.close();
 }
 
-void LRUCache::appendAOF_set(const std::string &key, const std::string &value)
+void LRUCache::replayRecord(char op, std::string_view sealed, std::string &plain)
 {
-    std::ofstream out(aof_path_, std::ios::binary | std::ios::app);
-    std::string enc_key = aes_encrypt(key);
-    std::string enc_val = aes_encrypt(value);
-    char op = 'S';
-    out.write(&op, 1);
-    size_t klen = enc_key.size();
-    size_t vlen = enc_val.size();
-    out.write(reinterpret_cast<char *>(&klen), sizeof(klen));
-    out.write(enc_key.data(), klen);
-    out.write(reinterpret_cast<char *>(&vlen), sizeof(vlen));
-    out.write(enc_val.data(), vlen);
-    out.close();
+    if (op != SET_RECORD && op != DEL_RECORD && op != SETEX_RECORD && op != EXPIRE_RECORD &&
+        op != PERSIST_RECORD && op != BATCH_RECORD && op != FLUSH_RECORD)
+        throw std::runtime_error(aof_path_ + ": unknown record type");
+    if (sealed.size() < RecordCipher::OVERHEAD)
+        throw std::runtime_error(aof_path_ + ": malformed record");
+    plain.resize(sealed.size() - RecordCipher::OVERHEAD);
+    if (!cipher_.open({&op, 1}, sealed, &plain[0]))
+        throw std::runtime_error(aof_path_ + ": record failed authentication");
+    if (op != BATCH_RECORD)
+    {
+        size_t n = recordSize(op, plain);
+        if (n == 0 || n != plain.size())
+            throw std::runtime_error(aof_path_ + ": malformed record");
+        applyRecord(op, plain);
+        return;
+    }
+
+    // A batch is applied only once all of it is known to parse.
+    std::string_view rest = plain;
+    while (!rest.empty())
+    {
+        size_t n = recordSize(rest[0], rest.substr(1));
+        if (n == 0 || 1 + n > rest.size())
+            throw std::runtime_error(aof_path_ + ": malformed record");
+        rest.remove_prefix(1 + n);
+    }
+    rest = plain;
+    while (!rest.empty())
+    {
+        size_t n = recordSize(rest[0], rest.substr(1));
+        applyRecord(rest[0], rest.substr(1, n));
+        rest.remove_prefix(1 + n);
+    }
 }
 
-void LRUCache::appendAOF_del(const std::string &key)
+// The length of the record of type `op` that `plain` starts with, as its
+// header gives it; 0 if there is no whole header or the type is unknown.
+size_t LRUCache::recordSize(char op, std::string_view plain) noexcept
 {
-    std::ofstream out(aof_path_, std::ios::binary | std::ios::app);
-    std::string enc_key = aes_encrypt(key);
-    char op = 'D';
-    out.write(&op, 1);
-    size_t klen = enc_key.size();
-    out.write(reinterpret_cast<char *>(&klen), sizeof(klen));
-    out.write(enc_key.data(), klen);
-    out.close();
+    if (plain.size() < 8)
+        return 0;
+    size_t timed = op == SETEX_RECORD || op == EXPIRE_RECORD ? 8 : 0;
+    if (!timed && op != SET_RECORD && op != DEL_RECORD && op != PERSIST_RECORD && op != FLUSH_RECORD)
+        return 0;
+    return 8 + size_t(loadU32(plain.data())) + loadU32(plain.data() + 4) + timed;
 }
 
-// -------------------- AES Encryption --------------------
-std::string LRUCache::aes_encrypt(const std::string &plaintext)
+void LRUCache::applyRecord(char op, std::string_view plain)
 {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx)
-        return "";
+    uint32_t klen = loadU32(plain.data());
+    uint32_t vlen = loadU32(plain.data() + 4);
+    std::string_view key(plain.data() + 8, klen);
+    std::string_view value(plain.data() + 8 + klen, vlen);
+    uint64_t at = op == SETEX_RECORD || op == EXPIRE_RECORD ? loadU64(plain.data() + 8 + klen + vlen) : 0;
+    if (op == SET_RECORD || op == SETEX_RECORD)
+        set_internal(key, value, at, false);
+    else if (op == DEL_RECORD)
+        del_internal(key, false);
+    else if (op == EXPIRE_RECORD)
+        expire_internal(key, at, false);
+    else if (op == PERSIST_RECORD)
+        persist_internal(key, false);
+    else
+        clear();
+}
 
-    const EVP_CIPHER *cipher = EVP_aes_128_cbc();
-    unsigned char iv[16];
-    RAND_bytes(iv, sizeof(iv));
+// Records are AOF frames (see aof.h) whose payload is sealed(u32 klen
+// u32 vlen key value [u64 at]). op is SET_RECORD, SETEX_RECORD, DEL_RECORD,
+// EXPIRE_RECORD, PERSIST_RECORD or FLUSH_RECORD; the last four carry no
+// value (vlen 0), FLUSH no key either, and SETEX and EXPIRE end with the
+// absolute deadline in ms. FLUSH drops everything before it; a rewritten
+// log starts with one. The op byte is authenticated too. A BATCH_RECORD
+// seals any number of such records, each as its op byte followed by its
+// plaintext, and is replayed as a whole.
+//
+// A replication backlog gets the same change as a command: SET (with PXAT
+// when the key has a deadline), DEL, PEXPIREAT or PERSIST.
+void LRUCache::propagateSet(std::string_view key, std::string_view value, uint64_t expire_at)
+{
+    if (aof_)
+        logRecord(expire_at ? SETEX_RECORD : SET_RECORD, key, value, expire_at);
+    if (backlog_)
+    {
+        if (!expire_at)
+        {
+            if (batching_)
+                logToRun(SET_RECORD, key, value);
+            else
+                backlog_->appendCommand({"SET", key, value});
+        }
+        else
+        {
+            char at[24];
+            auto res = std::to_chars(at, at + sizeof(at), expire_at);
+            logCommand({"SET", key, value, "PXAT", {at, static_cast<size_t>(res.ptr - at)}});
+        }
+    }
+}
 
-    EVP_EncryptInit_ex(ctx, cipher, nullptr,
-                       reinterpret_cast<const unsigned char *>(aes_key_.data()), iv);
+void LRUCache::propagateDel(std::string_view key)
+{
+    if (aof_)
+        logRecord(DEL_RECORD, key, {});
+    if (backlog_)
+    {
+        if (batching_)
+            logToRun(DEL_RECORD, key, {});
+        else
+            backlog_->appendCommand({"DEL", key});
+    }
+}
 
-    std::vector<unsigned char> outbuf(plaintext.size() + 16);
-    int outlen1 = 0;
-    EVP_EncryptUpdate(ctx, outbuf.data(), &outlen1,
-                      reinterpret_cast<const unsigned char *>(plaintext.data()), plaintext.size());
+void LRUCache::propagateExpire(std::string_view key, uint64_t at_ms)
+{
+    if (aof_)
+        logRecord(EXPIRE_RECORD, key, {}, at_ms);
+    if (backlog_)
+    {
+        char at[24];
+        auto res = std::to_chars(at, at + sizeof(at), at_ms);
+        logCommand({"PEXPIREAT", key, {at, static_cast<size_t>(res.ptr - at)}});
+    }
+}
 
-    int outlen2 = 0;
-    EVP_EncryptFinal_ex(ctx, outbuf.data() + outlen1, &outlen2);
+void LRUCache::propagatePersist(std::string_view key)
+{
+    if (aof_)
+        logRecord(PERSIST_RECORD, key, {});
+    if (backlog_)
+        logCommand({"PERSIST", key});
+}
 
-    EVP_CIPHER_CTX_free(ctx);
+bool LRUCache::buildRecord(RecordCipher &cipher, char op, std::string_view key, std::string_view value,
+                           uint64_t expire_at)
+{
+    char lengths[8];
+    storeU32(lengths, static_cast<uint32_t>(key.size()));
+    storeU32(lengths + 4, static_cast<uint32_t>(value.size()));
+    char at[8];
+    storeU64(at, expire_at);
+    size_t at_len = op == SETEX_RECORD || op == EXPIRE_RECORD ? sizeof(at) : 0;
+    size_t sealed = RecordCipher::sealedSize(sizeof(lengths) + key.size() + value.size() + at_len);
+
+    // Reuses aof_record_'s capacity: no allocation once it has grown.
+    aof_record_.resize(AOF_FRAME_BYTES + sealed);
+    if (cipher.seal({&op, 1}, {{lengths, sizeof(lengths)}, key, value, {at, at_len}},
+                    &aof_record_[AOF_FRAME_BYTES]) != sealed)
+        return false;
+    sealAofFrame(aof_record_, op);
+    return true;
+}
+
+// A record that could not be sealed is never appended: it would pass its
+// CRC on replay and then fail authentication, which stops startup. The
+// change is lost to the log instead, and the writer treats that like a
+// failed write (MISCONF for a moment, and the client is failed).
+void LRUCache::appendRecord(bool sealed)
+{
+    if (sealed)
+        aof_->append(aof_record_);
+    else
+        aof_->recordLost("could not seal an AOF record");
+}
+
+// Appends the record to the AOF, or to the batch's plaintext while one is
+// open.
+void LRUCache::logRecord(char op, std::string_view key, std::string_view value, uint64_t expire_at)
+{
+    if (!batching_)
+    {
+        appendRecord(buildRecord(op, key, value, expire_at));
+        return;
+    }
+    char header[9];
+    header[0] = op;
+    storeU32(header + 1, static_cast<uint32_t>(key.size()));
+    storeU32(header + 5, static_cast<uint32_t>(value.size()));
+    batch_record_.append(header, sizeof(header)).append(key).append(value);
+    if (op == SETEX_RECORD || op == EXPIRE_RECORD)
+    {
+        char at[8];
+        storeU64(at, expire_at);
+        batch_record_.append(at, sizeof(at));
+    }
+    ++batch_records_;
+}
+
+void LRUCache::logCommand(std::initializer_list<std::string_view> argv)
+{
+    if (!batching_)
+    {
+        backlog_->appendCommand(argv);
+        return;
+    }
+    flushRun();
+    ReplicationBacklog::encodeArray(batch_stream_, argv.size());
+    for (std::string_view arg : argv)
+        ReplicationBacklog::encodeBulk(batch_stream_, arg);
+}
 
-    std::string result(reinterpret_cast<char *>(iv), sizeof(iv));
-    result += std::string(reinterpret_cast<char *>(outbuf.data()), outlen1 + outlen2);
-    return result;
+// Batches only: adds a plain SET (op SET_RECORD) or a DEL to the MSET or
+// DEL command being gathered, ending that first if it is the other kind.
+void LRUCache::logToRun(char op, std::string_view key, std::string_view value)
+{
+    if (op != batch_run_op_)
+        flushRun();
+    batch_run_op_ = op;
+    ReplicationBacklog::encodeBulk(batch_run_, key);
+    if (op == SET_RECORD)
+        ReplicationBacklog::encodeBulk(batch_run_, value);
+    batch_run_args_ += op == SET_RECORD ? 2 : 1;
+}
+
+void LRUCache::flushRun()
+{
+    if (batch_run_args_ == 0)
+        return;
+    ReplicationBacklog::encodeArray(batch_stream_, 1 + batch_run_args_);
+    ReplicationBacklog::encodeBulk(batch_stream_, batch_run_op_ == SET_RECORD ? "MSET" : "DEL");
+    batch_stream_.append(batch_run_);
+    batch_run_.clear();
+    batch_run_args_ = 0;
+    batch_run_op_ = 0;
+}
+
+void LRUCache::commitBatch()
+{
+    batching_ = false;
+    if (aof_ && batch_records_ > 0)
+    {
+        // A batch of one is logged as that record.
+        char op = BATCH_RECORD;
+        std::string_view plain = batch_record_;
+        if (batch_records_ == 1)
+        {
+            op = plain[0];
+            plain.remove_prefix(1);
+        }
+        size_t sealed = RecordCipher::sealedSize(plain.size());
+        aof_record_.resize(AOF_FRAME_BYTES + sealed);
+        bool ok = cipher_.seal({&op, 1}, {plain}, &aof_record_[AOF_FRAME_BYTES]) == sealed;
+        if (ok)
+            sealAofFrame(aof_record_, op);
+        appendRecord(ok);
+    }
+    if (backlog_)
+    {
+        flushRun();
+        if (!batch_stream_.empty())
+            backlog_->append(batch_stream_);
+    }
+    batch_record_.clear();
+    batch_records_ = 0;
+    batch_stream_.clear();
+    // One huge batch should not pin its buffers for good.
+    for (std::string *buf : {&aof_record_, &batch_record_, &batch_stream_, &batch_run_})
+        if (buf->capacity() > BATCH_BUFFER_KEEP)
+            std::string().swap(*buf);
 }
 
+// -------------------- Legacy decryption --------------------
+// AES-128-CBC with a random IV prefix, one key or value at a time; only
+// needed to read files written by older versions.
 std::string LRUCache::aes_decrypt(const std::string &ciphertext)
 {
     if (ciphertext.size() < 16)
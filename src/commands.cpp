@@ -0,0 +1,1142 @@
+#include "commands.h"
+#include "bgsave.h"
+#include "aof.h"
+#include "io_engine.h"
+#include "lazy_free.h"
+#include "replication.h"
+#include "sharded_cache.h"
+#include "stats.h"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+// -------------------- Reply --------------------
+void Reply::appendNumber(long long n)
+{
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), n);
+    out_.append(buf, res.ptr - buf);
+}
+
+void Reply::status(std::string_view msg)
+{
+    if (mode_ == Mode::Resp)
+        out_.push_back('+');
+    out_.append(msg);
+    out_.append(mode_ == Mode::Resp ? "\r\n" : "\n");
+}
+
+void Reply::error(std::string_view msg)
+{
+    if (mode_ == Mode::Resp)
+        out_.push_back('-');
+    out_.append(msg);
+    out_.append(mode_ == Mode::Resp ? "\r\n" : "\n");
+}
+
+void Reply::bulk(std::string_view value)
+{
+    if (mode_ == Mode::Resp)
+    {
+        out_.push_back('$');
+        appendNumber(static_cast<long long>(value.size()));
+        out_.append("\r\n");
+        out_.append(value);
+        out_.append("\r\n");
+    }
+    else
+    {
+        out_.append(value);
+        out_.push_back('\n');
+    }
+}
+
+void Reply::nil()
+{
+    out_.append(mode_ == Mode::Resp ? "$-1\r\n" : "(nil)\n");
+}
+
+void Reply::integer(long long n)
+{
+    if (mode_ == Mode::Resp)
+        out_.push_back(':');
+    appendNumber(n);
+    out_.append(mode_ == Mode::Resp ? "\r\n" : "\n");
+}
+
+void Reply::array(size_t n)
+{
+    if (mode_ == Mode::Resp)
+    {
+        out_.push_back('*');
+        appendNumber(static_cast<long long>(n));
+        out_.append("\r\n");
+    }
+    else if (n == 0)
+    {
+        out_.append("(empty array)\n");
+    }
+}
+
+// -------------------- Handlers --------------------
+namespace
+{
+    using Args = std::vector<std::string_view>;
+
+    // Key lookup outcomes, per thread.
+    struct KeyspaceStats
+    {
+        Counter hits;
+        Counter misses;
+    };
+
+    bool equalsIgnoreCase(std::string_view upper, std::string_view s)
+    {
+        if (upper.size() != s.size())
+            return false;
+        for (size_t i = 0; i < s.size(); ++i)
+        {
+            char c = s[i];
+            if (c >= 'a' && c <= 'z')
+                c = static_cast<char>(c - ('a' - 'A'));
+            if (c != upper[i])
+                return false;
+        }
+        return true;
+    }
+
+    bool parseInteger(std::string_view s, long long &out)
+    {
+        auto res = std::from_chars(s.data(), s.data() + s.size(), out);
+        return res.ec == std::errc() && res.ptr == s.data() + s.size();
+    }
+
+    constexpr long long DEADLINE_LIMIT = INT64_MAX / 4; // leaves room for now + amount
+
+    // Absolute deadline for a relative timeout of `amount` seconds or
+    // milliseconds; false if it does not fit. May lie in the past.
+    bool deadlineFrom(long long amount, bool seconds, int64_t &at)
+    {
+        if (seconds && (amount > DEADLINE_LIMIT / 1000 || amount < -DEADLINE_LIMIT / 1000))
+            return false;
+        long long ms = seconds ? amount * 1000 : amount;
+        if (ms > DEADLINE_LIMIT || ms < -DEADLINE_LIMIT)
+            return false;
+        at = static_cast<int64_t>(unixTimeMs()) + ms;
+        return true;
+    }
+
+    // The same for a unix time in seconds or milliseconds.
+    bool deadlineAt(long long amount, bool seconds, int64_t &at)
+    {
+        if (seconds && (amount > DEADLINE_LIMIT / 1000 || amount < -DEADLINE_LIMIT / 1000))
+            return false;
+        at = seconds ? amount * 1000 : amount;
+        return at <= DEADLINE_LIMIT && at >= -DEADLINE_LIMIT;
+    }
+
+    const char *const NOT_AN_INTEGER = "ERR value is not an integer or out of range";
+
+    // SET key value [EX seconds | PX milliseconds | EXAT unix-seconds |
+    // PXAT unix-milliseconds]
+    CommandStatus cmdSet(Database &database, const Args &argv, Reply &reply)
+    {
+        int64_t at = 0;
+        for (size_t i = 3; i < argv.size(); i += 2)
+        {
+            bool ex = equalsIgnoreCase("EX", argv[i]);
+            bool exat = equalsIgnoreCase("EXAT", argv[i]);
+            bool relative = ex || equalsIgnoreCase("PX", argv[i]);
+            bool absolute = exat || equalsIgnoreCase("PXAT", argv[i]);
+            if ((!relative && !absolute) || i + 1 >= argv.size() || at != 0)
+            {
+                reply.error("ERR syntax error");
+                return CommandStatus::Ok;
+            }
+            long long amount;
+            if (!parseInteger(argv[i + 1], amount))
+            {
+                reply.error(NOT_AN_INTEGER);
+                return CommandStatus::Ok;
+            }
+            if (amount <= 0 || !(relative ? deadlineFrom(amount, ex, at) : deadlineAt(amount, exat, at)))
+            {
+                reply.error("ERR invalid expire time in 'set' command");
+                return CommandStatus::Ok;
+            }
+        }
+        if (!database.cache.set(argv[1], argv[2], static_cast<uint64_t>(at)))
+        {
+            reply.error("OOM command not allowed when used memory > 'maxmemory'");
+            return CommandStatus::Ok;
+        }
+        database.saver.noteChange();
+        reply.status("OK");
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdGet(Database &database, const Args &argv, Reply &reply)
+    {
+        KeyspaceStats &stats = PerThread<KeyspaceStats>::local();
+        // The reply is written from the stored value under the shard lock.
+        if (database.cache.read(argv[1], [&](std::string_view value)
+                                { reply.bulk(value); }))
+            stats.hits.add();
+        else
+        {
+            stats.misses.add();
+            reply.nil();
+        }
+        return CommandStatus::Ok;
+    }
+
+    // MGET key [key ...]
+    CommandStatus cmdMget(Database &database, const Args &argv, Reply &reply)
+    {
+        KeyspaceStats &stats = PerThread<KeyspaceStats>::local();
+        reply.array(argv.size() - 1);
+        database.cache.readMany(argv.data() + 1, argv.size() - 1, [&](bool found, std::string_view value)
+                                {
+            if (found)
+            {
+                stats.hits.add();
+                reply.bulk(value);
+            }
+            else
+            {
+                stats.misses.add();
+                reply.nil();
+            } });
+        return CommandStatus::Ok;
+    }
+
+    // MSET key value [key value ...] / MSETNX, which stores nothing if any
+    // of the keys exists.
+    CommandStatus msetGeneric(Database &database, const Args &argv, Reply &reply, bool only_new)
+    {
+        if (argv.size() % 2 == 0)
+        {
+            reply.error(only_new ? "ERR wrong number of args for 'MSETNX'" : "ERR wrong number of args for 'MSET'");
+            return CommandStatus::Ok;
+        }
+        size_t n = argv.size() / 2;
+        bool stored;
+        if (!database.cache.setMany(argv.data() + 1, n, only_new, stored))
+        {
+            reply.error("OOM command not allowed when used memory > 'maxmemory'");
+            return CommandStatus::Ok;
+        }
+        if (stored)
+            database.saver.noteChange(n);
+        if (only_new)
+            reply.integer(stored ? 1 : 0);
+        else
+            reply.status("OK");
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdMset(Database &database, const Args &argv, Reply &reply)
+    {
+        return msetGeneric(database, argv, reply, false);
+    }
+
+    CommandStatus cmdMsetnx(Database &database, const Args &argv, Reply &reply)
+    {
+        return msetGeneric(database, argv, reply, true);
+    }
+
+    // DEL / MDEL / UNLINK key [key ...]: the number of keys deleted. UNLINK
+    // leaves freeing large values to the lazy-free thread.
+    CommandStatus delGeneric(Database &database, const Args &argv, Reply &reply, bool lazy)
+    {
+        size_t removed = argv.size() == 2 ? database.cache.del(argv[1], lazy)
+                                          : database.cache.delMany(argv.data() + 1, argv.size() - 1, lazy);
+        if (removed)
+            database.saver.noteChange(removed);
+        reply.integer(static_cast<long long>(removed));
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdDel(Database &database, const Args &argv, Reply &reply)
+    {
+        return delGeneric(database, argv, reply, false);
+    }
+
+    CommandStatus cmdUnlink(Database &database, const Args &argv, Reply &reply)
+    {
+        return delGeneric(database, argv, reply, true);
+    }
+
+    // FLUSHALL [ASYNC | SYNC]; FLUSHDB is the same, there being one keyspace.
+    CommandStatus cmdFlushall(Database &database, const Args &argv, Reply &reply)
+    {
+        bool async = false;
+        if (argv.size() > 2 || (argv.size() == 2 && !(async = equalsIgnoreCase("ASYNC", argv[1])) &&
+                                !equalsIgnoreCase("SYNC", argv[1])))
+        {
+            reply.error("ERR syntax error");
+            return CommandStatus::Ok;
+        }
+        size_t dropped = database.cache.flushAll(async);
+        database.saver.noteChange(std::max<size_t>(dropped, 1));
+        reply.status("OK");
+        return CommandStatus::Ok;
+    }
+
+    // EXPIRE key seconds / PEXPIRE key milliseconds, or EXPIREAT/PEXPIREAT
+    // with a unix time; a deadline already passed deletes the key.
+    CommandStatus expireGeneric(Database &database, const Args &argv, Reply &reply, bool seconds, bool absolute,
+                                const char *name)
+    {
+        long long amount;
+        if (!parseInteger(argv[2], amount))
+        {
+            reply.error(NOT_AN_INTEGER);
+            return CommandStatus::Ok;
+        }
+        int64_t at;
+        if (!(absolute ? deadlineAt(amount, seconds, at) : deadlineFrom(amount, seconds, at)))
+        {
+            reply.error(std::string("ERR invalid expire time in '") + name + "' command");
+            return CommandStatus::Ok;
+        }
+        bool found = database.cache.expire(argv[1], static_cast<uint64_t>(std::max<int64_t>(at, 0)));
+        if (found)
+            database.saver.noteChange();
+        reply.integer(found ? 1 : 0);
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdExpire(Database &database, const Args &argv, Reply &reply)
+    {
+        return expireGeneric(database, argv, reply, true, false, "expire");
+    }
+
+    CommandStatus cmdPexpire(Database &database, const Args &argv, Reply &reply)
+    {
+        return expireGeneric(database, argv, reply, false, false, "pexpire");
+    }
+
+    CommandStatus cmdExpireat(Database &database, const Args &argv, Reply &reply)
+    {
+        return expireGeneric(database, argv, reply, true, true, "expireat");
+    }
+
+    CommandStatus cmdPexpireat(Database &database, const Args &argv, Reply &reply)
+    {
+        return expireGeneric(database, argv, reply, false, true, "pexpireat");
+    }
+
+    // -2 if the key does not exist, -1 if it has no deadline.
+    CommandStatus cmdTtl(Database &database, const Args &argv, Reply &reply)
+    {
+        int64_t ms = database.cache.pttl(argv[1]);
+        reply.integer(ms < 0 ? ms : (ms + 500) / 1000);
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdPttl(Database &database, const Args &argv, Reply &reply)
+    {
+        reply.integer(database.cache.pttl(argv[1]));
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdPersist(Database &database, const Args &argv, Reply &reply)
+    {
+        bool removed = database.cache.persist(argv[1]);
+        if (removed)
+            database.saver.noteChange();
+        reply.integer(removed ? 1 : 0);
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdStrlen(Database &database, const Args &argv, Reply &reply)
+    {
+        size_t length = 0;
+        database.cache.read(argv[1], [&](std::string_view value)
+                            { length = value.size(); });
+        reply.integer(static_cast<long long>(length));
+        return CommandStatus::Ok;
+    }
+
+    // Whether the pattern element at pattern[p] matches c; `next` is set to
+    // the position after it. An unterminated class runs to the end.
+    bool matchElement(std::string_view pattern, size_t p, unsigned char c, size_t &next)
+    {
+        auto at = [&](size_t i)
+        { return static_cast<unsigned char>(pattern[i]); };
+        switch (pattern[p])
+        {
+        case '?':
+            next = p + 1;
+            return true;
+        case '\\':
+            if (p + 1 == pattern.size())
+            {
+                next = p + 1;
+                return c == '\\';
+            }
+            next = p + 2;
+            return at(p + 1) == c;
+        case '[':
+        {
+            size_t q = p + 1;
+            bool negate = q < pattern.size() && pattern[q] == '^';
+            q += negate;
+            bool matched = false;
+            while (q < pattern.size() && pattern[q] != ']')
+            {
+                if (pattern[q] == '\\' && q + 1 < pattern.size())
+                {
+                    matched |= at(q + 1) == c;
+                    q += 2;
+                }
+                else if (q + 2 < pattern.size() && pattern[q + 1] == '-' && pattern[q + 2] != ']')
+                {
+                    unsigned char lo = std::min(at(q), at(q + 2)), hi = std::max(at(q), at(q + 2));
+                    matched |= c >= lo && c <= hi;
+                    q += 3;
+                }
+                else
+                    matched |= at(q++) == c;
+            }
+            next = std::min(q + 1, pattern.size());
+            return matched != negate;
+        }
+        default:
+            next = p + 1;
+            return at(p) == c;
+        }
+    }
+
+    // Glob-style matching as in redis: * any run of characters, ? any one,
+    // [abc], [a-z] and [^...] classes, \x a literal x. On a mismatch the
+    // last * takes one more character, which is enough for globs.
+    bool globMatch(std::string_view pattern, std::string_view s)
+    {
+        size_t p = 0, i = 0;
+        size_t star = std::string_view::npos, star_i = 0;
+        while (i < s.size())
+        {
+            size_t next;
+            if (p < pattern.size() && pattern[p] == '*')
+            {
+                star = ++p;
+                star_i = i;
+            }
+            else if (p < pattern.size() && matchElement(pattern, p, static_cast<unsigned char>(s[i]), next))
+            {
+                p = next;
+                ++i;
+            }
+            else if (star == std::string_view::npos)
+                return false;
+            else
+            {
+                p = star;
+                i = ++star_i;
+            }
+        }
+        while (p < pattern.size() && pattern[p] == '*')
+            ++p;
+        return p == pattern.size();
+    }
+
+    // SCAN cursor [MATCH pattern] [COUNT count]: the next cursor (0 when
+    // done) and a batch of keys. COUNT is how many keys to look at, 10 by
+    // default; MATCH filters the ones looked at, so a batch may be empty
+    // before the iteration is over.
+    CommandStatus cmdScan(Database &database, const Args &argv, Reply &reply)
+    {
+        uint64_t cursor;
+        auto res = std::from_chars(argv[1].data(), argv[1].data() + argv[1].size(), cursor);
+        if (res.ec != std::errc() || res.ptr != argv[1].data() + argv[1].size())
+        {
+            reply.error("ERR invalid cursor");
+            return CommandStatus::Ok;
+        }
+        std::string_view pattern = "*";
+        long long count = 10;
+        for (size_t i = 2; i < argv.size(); i += 2)
+        {
+            bool ok = i + 1 < argv.size();
+            if (ok && equalsIgnoreCase("MATCH", argv[i]))
+                pattern = argv[i + 1];
+            else if (ok && equalsIgnoreCase("COUNT", argv[i]))
+            {
+                if (!parseInteger(argv[i + 1], count))
+                {
+                    reply.error(NOT_AN_INTEGER);
+                    return CommandStatus::Ok;
+                }
+                ok = count >= 1;
+            }
+            else
+                ok = false;
+            if (!ok)
+            {
+                reply.error("ERR syntax error");
+                return CommandStatus::Ok;
+            }
+        }
+        std::vector<std::string> keys;
+        uint64_t next = database.cache.scan(cursor, static_cast<size_t>(count), keys);
+        if (pattern != "*")
+            keys.erase(std::remove_if(keys.begin(), keys.end(), [&](const std::string &key)
+                                      { return !globMatch(pattern, key); }),
+                       keys.end());
+        char buf[24];
+        auto end = std::to_chars(buf, buf + sizeof(buf), next).ptr;
+        reply.array(2);
+        reply.bulk(std::string_view(buf, end - buf));
+        reply.array(keys.size());
+        for (const std::string &key : keys)
+            reply.bulk(key);
+        return CommandStatus::Ok;
+    }
+
+    // HOTKEYS [COUNT count]: the keys accessed most, as sampled on the
+    // shards (see --hotkeys-sample-rate), most first, each with its
+    // estimated accesses and value length (-1 if no longer in memory).
+    CommandStatus cmdHotkeys(Database &database, const Args &argv, Reply &reply)
+    {
+        long long count = 10;
+        bool ok = argv.size() == 1 || (argv.size() == 3 && equalsIgnoreCase("COUNT", argv[1]));
+        if (ok && argv.size() == 3 && !parseInteger(argv[2], count))
+        {
+            reply.error(NOT_AN_INTEGER);
+            return CommandStatus::Ok;
+        }
+        if (!ok || count < 1)
+        {
+            reply.error("ERR syntax error");
+            return CommandStatus::Ok;
+        }
+        if (database.cache.hotKeySampling() == 0)
+        {
+            reply.error("ERR hot key sampling is off (--hotkeys-sample-rate 0)");
+            return CommandStatus::Ok;
+        }
+        std::vector<LRUCache::HotKey> keys = database.cache.hotKeys(static_cast<size_t>(count));
+        reply.array(keys.size());
+        for (const LRUCache::HotKey &key : keys)
+        {
+            reply.array(3);
+            reply.bulk(key.key);
+            reply.integer(static_cast<long long>(key.accesses));
+            reply.integer(key.value_bytes);
+        }
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdSave(Database &database, const Args &, Reply &reply)
+    {
+        std::string err;
+        if (database.saver.save(database, err))
+            reply.status("OK");
+        else
+            reply.error(err);
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdBgsave(Database &database, const Args &, Reply &reply)
+    {
+        std::string err;
+        if (database.saver.bgsave(database, err))
+            reply.status("Background saving started");
+        else
+            reply.error(err);
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdBgrewriteaof(Database &database, const Args &, Reply &reply)
+    {
+        std::string err;
+        bool scheduled = false;
+        if (!database.saver.bgrewriteaof(database, scheduled, err))
+            reply.error(err);
+        else if (scheduled)
+            reply.status("Background append only file rewriting scheduled");
+        else
+            reply.status("Background append only file rewriting started");
+        return CommandStatus::Ok;
+    }
+
+    // REPLICAOF host port | REPLICAOF NO ONE
+    CommandStatus cmdReplicaof(Database &database, const Args &argv, Reply &reply)
+    {
+        if (equalsIgnoreCase("NO", argv[1]) && equalsIgnoreCase("ONE", argv[2]))
+        {
+            database.replication.promote(database);
+            reply.status("OK");
+            return CommandStatus::Ok;
+        }
+        long long port;
+        if (!parseInteger(argv[2], port) || port <= 0 || port > 65535)
+        {
+            reply.error("ERR Invalid master port");
+            return CommandStatus::Ok;
+        }
+        if (database.replication.replicaOf(database, std::string(argv[1]), static_cast<uint16_t>(port)))
+            reply.status("OK");
+        else
+            reply.status("OK Already connected to specified master");
+        return CommandStatus::Ok;
+    }
+
+    // PSYNC replid offset: a replica asking for the write stream. Nothing is
+    // replied here; the server hands the connection to the replication
+    // module, which answers.
+    CommandStatus cmdPsync(Database &database, const Args &argv, Reply &reply)
+    {
+        long long offset;
+        if (!parseInteger(argv[2], offset))
+        {
+            reply.error(NOT_AN_INTEGER);
+            return CommandStatus::Ok;
+        }
+        if (database.replication.isReplica())
+        {
+            reply.error("ERR Can't PSYNC from a replica");
+            return CommandStatus::Ok;
+        }
+        return CommandStatus::Replicate;
+    }
+
+    CommandStatus cmdPing(Database &, const Args &argv, Reply &reply)
+    {
+        if (argv.size() >= 2)
+            reply.bulk(argv[1]);
+        else
+            reply.status("PONG");
+        return CommandStatus::Ok;
+    }
+
+    CommandStatus cmdQuit(Database &, const Args &, Reply &reply)
+    {
+        reply.status("bye");
+        return CommandStatus::Quit;
+    }
+
+    // Report on the command table itself; defined below it.
+    CommandStatus cmdInfo(Database &database, const Args &argv, Reply &reply);
+    CommandStatus cmdLatency(Database &database, const Args &argv, Reply &reply);
+
+    using Handler = CommandStatus (*)(Database &, const Args &, Reply &);
+
+    struct CommandSpec
+    {
+        std::string_view name;
+        int arity; // Redis convention: N = exactly N words, -N = at least N
+        Handler handler;
+        bool write = false; // changes the keyspace; refused on a replica
+    };
+
+    constexpr CommandSpec COMMANDS[] = {
+        {"SET", -3, cmdSet, true},
+        {"GET", 2, cmdGet},
+        {"DEL", -2, cmdDel, true},
+        {"MGET", -2, cmdMget},
+        {"MSET", -3, cmdMset, true},
+        {"MSETNX", -3, cmdMsetnx, true},
+        {"MDEL", -2, cmdDel, true},
+        {"UNLINK", -2, cmdUnlink, true},
+        {"FLUSHALL", -1, cmdFlushall, true},
+        {"FLUSHDB", -1, cmdFlushall, true},
+        {"EXPIRE", 3, cmdExpire, true},
+        {"PEXPIRE", 3, cmdPexpire, true},
+        {"EXPIREAT", 3, cmdExpireat, true},
+        {"PEXPIREAT", 3, cmdPexpireat, true},
+        {"TTL", 2, cmdTtl},
+        {"PTTL", 2, cmdPttl},
+        {"PERSIST", 2, cmdPersist, true},
+        {"STRLEN", 2, cmdStrlen},
+        {"SCAN", -2, cmdScan},
+        {"HOTKEYS", -1, cmdHotkeys},
+        {"INFO", -1, cmdInfo},
+        {"SAVE", 1, cmdSave},
+        {"BGSAVE", 1, cmdBgsave},
+        {"BGREWRITEAOF", 1, cmdBgrewriteaof},
+        {"LATENCY", -2, cmdLatency},
+        {"REPLICAOF", 3, cmdReplicaof},
+        {"SLAVEOF", 3, cmdReplicaof},
+        {"PSYNC", 3, cmdPsync},
+        {"PING", -1, cmdPing},
+        {"EXIT", 1, cmdQuit},
+        {"QUIT", 1, cmdQuit},
+    };
+    constexpr size_t NUM_COMMANDS = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+    // -------------------- Perfect hash --------------------
+    // Case-insensitive FNV-1a over the command name. A seed that maps every
+    // name in COMMANDS to its own slot is searched for at compile time, so a
+    // lookup is one hash, one table load and one name comparison.
+    constexpr size_t TABLE_SIZE = 128;
+    constexpr uint8_t NO_COMMAND = 0xFF;
+    static_assert(NUM_COMMANDS < NO_COMMAND && NUM_COMMANDS <= TABLE_SIZE, "command table too small");
+
+    constexpr uint32_t commandHash(std::string_view name, uint32_t seed)
+    {
+        uint32_t h = 2166136261u ^ seed;
+        for (char c : name)
+        {
+            h ^= static_cast<uint8_t>(c | 0x20);
+            h *= 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    constexpr bool seedIsPerfect(uint32_t seed)
+    {
+        bool used[TABLE_SIZE] = {};
+        for (const CommandSpec &spec : COMMANDS)
+        {
+            size_t slot = commandHash(spec.name, seed) % TABLE_SIZE;
+            if (used[slot])
+                return false;
+            used[slot] = true;
+        }
+        return true;
+    }
+
+    constexpr uint32_t findSeed()
+    {
+        for (uint32_t seed = 0; seed < 100000; ++seed)
+            if (seedIsPerfect(seed))
+                return seed;
+        return UINT32_MAX;
+    }
+
+    constexpr uint32_t SEED = findSeed();
+    static_assert(SEED != UINT32_MAX, "no perfect hash seed for the command table");
+
+    constexpr std::array<uint8_t, TABLE_SIZE> buildTable()
+    {
+        std::array<uint8_t, TABLE_SIZE> table{};
+        for (auto &slot : table)
+            slot = NO_COMMAND;
+        for (size_t i = 0; i < NUM_COMMANDS; ++i)
+            table[commandHash(COMMANDS[i].name, SEED) % TABLE_SIZE] = static_cast<uint8_t>(i);
+        return table;
+    }
+
+    constexpr std::array<uint8_t, TABLE_SIZE> TABLE = buildTable();
+
+    const CommandSpec *lookupCommand(std::string_view name)
+    {
+        uint8_t idx = TABLE[commandHash(name, SEED) % TABLE_SIZE];
+        if (idx == NO_COMMAND || !equalsIgnoreCase(COMMANDS[idx].name, name))
+            return nullptr;
+        return &COMMANDS[idx];
+    }
+
+    // -------------------- Introspection --------------------
+    // Calls and latency of every command, per thread; a command's call count
+    // is its histogram's count.
+    struct CommandStats
+    {
+        LatencyHistogram latency[NUM_COMMANDS];
+    };
+
+    std::vector<HistogramTotals> commandLatencies()
+    {
+        std::vector<HistogramTotals> totals(NUM_COMMANDS);
+        PerThread<CommandStats>::forEach([&](const CommandStats &stats)
+                                         {
+            for (size_t i = 0; i < NUM_COMMANDS; ++i)
+                totals[i].add(stats.latency[i]); });
+        return totals;
+    }
+
+    std::string lowerName(std::string_view name)
+    {
+        std::string out(name);
+        for (char &c : out)
+            c = static_cast<char>(c | 0x20);
+        return out;
+    }
+
+    std::string usec(double ns)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.3f", ns / 1000.0);
+        return buf;
+    }
+
+    void appendSection(std::string &out, const char *title)
+    {
+        if (!out.empty())
+            out.append("\r\n");
+        out.append("# ").append(title).append("\r\n");
+    }
+
+    void appendField(std::string &out, std::string_view name, std::string_view value)
+    {
+        out.append(name).append(":").append(value).append("\r\n");
+    }
+
+    void appendField(std::string &out, std::string_view name, uint64_t value)
+    {
+        appendField(out, name, std::to_string(value));
+    }
+
+    // "calls=N,p50=..,p99=..,p99.9=..,max=.." with times in microseconds.
+    std::string latencySummary(const HistogramTotals &h)
+    {
+        return "calls=" + std::to_string(h.count()) + ",p50=" + usec(h.percentile(50)) +
+               ",p99=" + usec(h.percentile(99)) + ",p99.9=" + usec(h.percentile(99.9)) +
+               ",max=" + usec(h.max());
+    }
+
+    // INFO [section]: keyspace, memory, tiered, replication, persistence,
+    // stats, commandstats or latencystats; all of them by default.
+    CommandStatus cmdInfo(Database &database, const Args &argv, Reply &reply)
+    {
+        std::string_view section = argv.size() >= 2 ? argv[1] : std::string_view();
+        if (equalsIgnoreCase("ALL", section) || equalsIgnoreCase("EVERYTHING", section))
+            section = {};
+        auto want = [&](std::string_view upper)
+        { return section.empty() || equalsIgnoreCase(upper, section); };
+
+        ShardedCache &cache = database.cache;
+        BackgroundSaver &saver = database.saver;
+        std::string out;
+
+        if (want("KEYSPACE"))
+        {
+            appendSection(out, "Keyspace");
+            appendField(out, "entries", cache.size());
+            appendField(out, "expires", cache.expiringKeys());
+            appendField(out, "capacity", cache.capacity());
+            appendField(out, "shards", cache.shardCount());
+            appendField(out, "rehashing_shards", cache.rehashingShards());
+        }
+
+        if (want("MEMORY"))
+        {
+            size_t entries = cache.size();
+            size_t footprint = cache.memoryUsage();
+            appendSection(out, "Memory");
+            appendField(out, "used_memory", cache.usedMemory());
+            appendField(out, "used_memory_cache", footprint);
+            appendField(out, "used_memory_rss", residentMemory());
+            appendField(out, "maxmemory", cache.maxMemory());
+            appendField(out, "maxmemory_policy", evictionPolicyName(cache.policy()));
+            appendField(out, "bytes_per_entry", entries ? footprint / entries : 0);
+            SlabAllocator::Stats slab = cache.allocatorStats();
+            char ratio[32];
+            std::snprintf(ratio, sizeof(ratio), "%.2f",
+                          slab.requested ? static_cast<double>(slab.active) / slab.requested : 1.0);
+            appendField(out, "allocator_allocated", slab.requested);
+            appendField(out, "allocator_active", slab.active);
+            appendField(out, "allocator_frag_ratio", ratio);
+            appendField(out, "allocator_frag_bytes", slab.active - slab.requested);
+            appendField(out, "allocator_reclaimable", slab.reclaimable);
+            appendField(out, "active_defrag", cache.activeDefragEnabled() ? "yes" : "no");
+            appendField(out, "active_defrag_running", cache.defragRunning() ? "1" : "0");
+            appendField(out, "active_defrag_hits", cache.defragHits());
+            appendField(out, "active_defrag_misses", cache.defragMisses());
+            appendField(out, "lazyfree_pending_objects", lazyFree().pendingObjects());
+            appendField(out, "lazyfree_pending_bytes", lazyFree().pendingBytes());
+            appendField(out, "lazyfree_lazy_eviction", cache.lazyEviction() ? "yes" : "no");
+        }
+
+        if (want("TIERED"))
+        {
+            SpillStore::Stats tier = cache.tieredStats();
+            appendSection(out, "Tiered");
+            appendField(out, "tiered_enabled", cache.tiered() ? "1" : "0");
+            appendField(out, "tiered_keys", tier.keys);
+            appendField(out, "tiered_segments", tier.segments);
+            appendField(out, "tiered_disk_bytes", tier.disk_bytes);
+            appendField(out, "tiered_live_bytes", tier.live_bytes);
+            appendField(out, "tiered_index_bytes", tier.index_bytes);
+            appendField(out, "tiered_spills", tier.spills);
+            appendField(out, "tiered_reads", tier.reads);
+            appendField(out, "tiered_gc_relocated", tier.relocated);
+            appendField(out, "tiered_gc_segments_freed", tier.collected);
+        }
+
+        if (want("REPLICATION"))
+        {
+            Replication::Status repl = database.replication.status();
+            appendSection(out, "Replication");
+            appendField(out, "role", repl.replica ? "slave" : "master");
+            if (repl.replica)
+            {
+                appendField(out, "master_host", repl.master_host);
+                appendField(out, "master_port", repl.master_port);
+                appendField(out, "master_link_status", repl.link_up ? "up" : "down");
+                appendField(out, "master_last_io_seconds_ago", std::to_string(repl.last_io_seconds));
+                appendField(out, "master_sync_in_progress", repl.sync_in_progress ? "1" : "0");
+                appendField(out, "slave_repl_offset", repl.replica_offset);
+                appendField(out, "slave_read_only", "1");
+            }
+            appendField(out, "connected_slaves", repl.replicas.size());
+            for (size_t i = 0; i < repl.replicas.size(); ++i)
+            {
+                const Replication::ReplicaInfo &r = repl.replicas[i];
+                appendField(out, "slave" + std::to_string(i),
+                            "ip=" + r.ip + ",port=" + std::to_string(r.port) + ",state=" + r.state +
+                                ",offset=" + std::to_string(r.offset) + ",lag=" + std::to_string(r.lag));
+            }
+            appendField(out, "master_replid", repl.replid);
+            appendField(out, "master_repl_offset", repl.offset);
+            appendField(out, "repl_backlog_active", repl.backlog_active ? "1" : "0");
+            appendField(out, "repl_backlog_size", repl.backlog_size);
+            appendField(out, "repl_backlog_first_byte_offset", repl.backlog_first);
+            appendField(out, "repl_backlog_histlen", repl.backlog_histlen);
+        }
+
+        if (want("PERSISTENCE"))
+        {
+            HistogramTotals aof_write, aof_fsync;
+            AofWriter::latencies(aof_write, aof_fsync);
+            appendSection(out, "Persistence");
+            appendField(out, "rdb_changes_since_last_save", saver.changesSinceSave());
+            appendField(out, "rdb_bgsave_in_progress", saver.inProgress() ? "1" : "0");
+            appendField(out, "rdb_last_save_time", static_cast<uint64_t>(saver.lastSave()));
+            appendField(out, "rdb_last_bgsave_status", saver.lastSaveOk() ? "ok" : "err");
+            appendField(out, "rdb_last_save_duration_ms", saver.lastSaveDurationMs());
+            appendField(out, "aof_current_size", cache.aofSize());
+            appendField(out, "aof_rewrite_in_progress", saver.aofRewriteInProgress() ? "1" : "0");
+            appendField(out, "aof_last_bgrewrite_status", saver.lastAofRewriteOk() ? "ok" : "err");
+            appendField(out, "aof_last_rewrite_duration_ms", saver.lastAofRewriteDurationMs());
+            std::string aof_error;
+            appendField(out, "aof_last_write_status", cache.aofWriteError(aof_error) ? "err" : "ok");
+            appendField(out, "aof_write_latency_usec", latencySummary(aof_write));
+            appendField(out, "aof_fsync_latency_usec", latencySummary(aof_fsync));
+            appendField(out, "io_backend", ioBackendName(effectiveIoBackend()));
+            appendField(out, "latest_fork_usec", saver.lastForkUsec());
+        }
+
+        std::vector<HistogramTotals> latencies;
+        if (want("STATS") || want("COMMANDSTATS") || want("LATENCYSTATS"))
+            latencies = commandLatencies();
+
+        if (want("STATS"))
+        {
+            uint64_t commands = 0;
+            for (const HistogramTotals &h : latencies)
+                commands += h.count();
+            uint64_t hits = 0, misses = 0;
+            PerThread<KeyspaceStats>::forEach([&](const KeyspaceStats &stats)
+                                              {
+                hits += stats.hits.load();
+                misses += stats.misses.load(); });
+            appendSection(out, "Stats");
+            appendField(out, "total_commands_processed", commands);
+            appendField(out, "keyspace_hits", hits);
+            appendField(out, "keyspace_misses", misses);
+            appendField(out, "expired_keys", cache.expiredKeys());
+            appendField(out, "evicted_keys", cache.evictions());
+            appendField(out, "lazyfreed_objects", lazyFree().freedObjects());
+            appendField(out, "hotkeys_sample_rate", cache.hotKeySampling());
+            appendField(out, "latency_monitor_threshold_ms", latencyMonitor().threshold());
+        }
+
+        if (want("COMMANDSTATS"))
+        {
+            appendSection(out, "Commandstats");
+            for (size_t i = 0; i < NUM_COMMANDS; ++i)
+            {
+                const HistogramTotals &h = latencies[i];
+                if (h.count() == 0)
+                    continue;
+                appendField(out, "cmdstat_" + lowerName(COMMANDS[i].name),
+                            "calls=" + std::to_string(h.count()) + ",usec=" + std::to_string(h.sum() / 1000) +
+                                ",usec_per_call=" + usec(static_cast<double>(h.sum()) / h.count()));
+            }
+        }
+
+        if (want("LATENCYSTATS"))
+        {
+            appendSection(out, "Latencystats");
+            for (size_t i = 0; i < NUM_COMMANDS; ++i)
+            {
+                const HistogramTotals &h = latencies[i];
+                if (h.count() == 0)
+                    continue;
+                appendField(out, "latency_percentiles_usec_" + lowerName(COMMANDS[i].name),
+                            "p50=" + usec(h.percentile(50)) + ",p99=" + usec(h.percentile(99)) +
+                                ",p99.9=" + usec(h.percentile(99.9)));
+            }
+        }
+
+        reply.bulk(out);
+        return CommandStatus::Ok;
+    }
+
+    // Cumulative counts at power-of-two microsecond bounds, as redis'
+    // LATENCY HISTOGRAM reports them.
+    std::vector<std::pair<uint64_t, uint64_t>> powerOfTwoBuckets(const HistogramTotals &h)
+    {
+        std::vector<std::pair<uint64_t, uint64_t>> out;
+        uint64_t seen = 0;
+        h.forEachBucket([&](uint64_t limit_ns, uint64_t count)
+                        {
+            uint64_t us = std::max<uint64_t>(1, (limit_ns + 999) / 1000);
+            uint64_t bound = 1;
+            while (bound < us)
+                bound <<= 1;
+            seen += count;
+            if (!out.empty() && out.back().first == bound)
+                out.back().second = seen;
+            else
+                out.emplace_back(bound, seen); });
+        return out;
+    }
+
+    // LATENCY LATEST | HISTORY event | RESET [event ...] | HISTOGRAM [command ...]
+    CommandStatus cmdLatency(Database &, const Args &argv, Reply &reply)
+    {
+        std::string_view sub = argv[1];
+        LatencyMonitor &monitor = latencyMonitor();
+        if (equalsIgnoreCase("LATEST", sub) && argv.size() == 2)
+        {
+            std::vector<LatencyMonitor::Event> events = monitor.latest();
+            reply.array(events.size());
+            for (const LatencyMonitor::Event &e : events)
+            {
+                reply.array(4);
+                reply.bulk(e.name);
+                reply.integer(e.latest.time);
+                reply.integer(static_cast<long long>(e.latest.ms));
+                reply.integer(static_cast<long long>(e.max_ms));
+            }
+        }
+        else if (equalsIgnoreCase("HISTORY", sub) && argv.size() == 3)
+        {
+            std::vector<LatencyMonitor::Sample> samples = monitor.history(argv[2]);
+            reply.array(samples.size());
+            for (const LatencyMonitor::Sample &sample : samples)
+            {
+                reply.array(2);
+                reply.integer(sample.time);
+                reply.integer(static_cast<long long>(sample.ms));
+            }
+        }
+        else if (equalsIgnoreCase("RESET", sub))
+        {
+            reply.integer(static_cast<long long>(monitor.reset(Args(argv.begin() + 2, argv.end()))));
+        }
+        else if (equalsIgnoreCase("HISTOGRAM", sub))
+        {
+            std::vector<HistogramTotals> latencies = commandLatencies();
+            std::vector<size_t> picked;
+            for (size_t i = 0; i < NUM_COMMANDS; ++i)
+            {
+                bool named = argv.size() == 2;
+                for (size_t a = 2; a < argv.size() && !named; ++a)
+                    named = equalsIgnoreCase(COMMANDS[i].name, argv[a]);
+                if (named && latencies[i].count() > 0)
+                    picked.push_back(i);
+            }
+            reply.array(picked.size() * 2);
+            for (size_t i : picked)
+            {
+                std::vector<std::pair<uint64_t, uint64_t>> buckets = powerOfTwoBuckets(latencies[i]);
+                reply.bulk(lowerName(COMMANDS[i].name));
+                reply.array(4);
+                reply.bulk("calls");
+                reply.integer(static_cast<long long>(latencies[i].count()));
+                reply.bulk("histogram_usec");
+                reply.array(buckets.size() * 2);
+                for (const auto &b : buckets)
+                {
+                    reply.integer(static_cast<long long>(b.first));
+                    reply.integer(static_cast<long long>(b.second));
+                }
+            }
+        }
+        else
+        {
+            reply.error("ERR unknown subcommand or wrong number of arguments for 'LATENCY'");
+        }
+        return CommandStatus::Ok;
+    }
+}
+
+// -------------------- Dispatch --------------------
+CommandStatus executeCommand(Database &database, const std::vector<std::string_view> &argv, Reply &reply)
+{
+    if (argv.empty())
+        return CommandStatus::Ok;
+
+    const CommandSpec *spec = lookupCommand(argv[0]);
+    if (!spec)
+    {
+        reply.error("ERR unknown command");
+        return CommandStatus::Ok;
+    }
+
+    int argc = static_cast<int>(argv.size());
+    if ((spec->arity > 0 && argc != spec->arity) || (spec->arity < 0 && argc < -spec->arity))
+    {
+        std::string msg = "ERR wrong number of args for '";
+        msg.append(spec->name);
+        msg.push_back('\'');
+        reply.error(msg);
+        return CommandStatus::Ok;
+    }
+
+    if (spec->write && database.replication.isReplica() && !Replication::applyingStream())
+    {
+        reply.error("READONLY You can't write against a read only replica.");
+        return CommandStatus::Ok;
+    }
+
+    // A write the AOF cannot keep is refused rather than lost; the master's
+    // stream is still applied on a replica.
+    std::string aof_error;
+    if (spec->write && !Replication::applyingStream() && database.cache.aofWriteError(aof_error))
+    {
+        reply.error("MISCONF Errors writing to the AOF file: " + aof_error);
+        return CommandStatus::Ok;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    CommandStatus status = spec->handler(database, argv, reply);
+    uint64_t ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    PerThread<CommandStats>::local().latency[spec - COMMANDS].record(ns);
+    latencyMonitor().sample("command", ns);
+    return status;
+}
+
+// -------------------- Cron --------------------
+// A quarter of the 100 ms cron period, as redis allows its expiry cycle.
+constexpr std::chrono::microseconds ACTIVE_EXPIRE_BUDGET(25000);
+// Defragmentation is never urgent: 5% of the cron period; the same for
+// the disk tier's garbage collection.
+constexpr std::chrono::microseconds ACTIVE_DEFRAG_BUDGET(5000);
+constexpr std::chrono::microseconds TIERED_GC_BUDGET(5000);
+// Writes move index entries as they go; this only finishes a resize on
+// shards that went quiet, a millisecond per cron as redis gives each db.
+constexpr std::chrono::microseconds ACTIVE_REHASH_BUDGET(1000);
+
+void serverCron(Database &database)
+{
+    database.cache.activeRehash(ACTIVE_REHASH_BUDGET);
+    auto start = std::chrono::steady_clock::now();
+    // A replica expires nothing on its own clock: the master's DELs do it.
+    if (!database.replication.isReplica())
+    {
+        database.cache.activeExpire(ACTIVE_EXPIRE_BUDGET);
+        latencyMonitor().sample("expire-cycle", static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    }
+    auto expired = std::chrono::steady_clock::now();
+    if (database.cache.activeDefrag(ACTIVE_DEFRAG_BUDGET) > 0)
+        latencyMonitor().sample("active-defrag-cycle", static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - expired).count()));
+    auto defragged = std::chrono::steady_clock::now();
+    if (database.cache.tieredGC(TIERED_GC_BUDGET) > 0)
+        latencyMonitor().sample("tiered-gc-cycle", static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - defragged).count()));
+    database.saver.cron(database);
+    database.replication.cron(database);
+}
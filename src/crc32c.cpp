@@ -0,0 +1,143 @@
+#include "crc32c.h"
+#include <array>
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace
+{
+    constexpr uint32_t POLY = 0x82F63B78; // reflected Castagnoli polynomial
+
+    // Slicing-by-8: TABLES[k][b] is the CRC of byte b followed by k zero bytes.
+    constexpr std::array<std::array<uint32_t, 256>, 8> makeTables()
+    {
+        std::array<std::array<uint32_t, 256>, 8> tables{};
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+            tables[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int k = 1; k < 8; ++k)
+                tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+        return tables;
+    }
+
+    constexpr auto TABLES = makeTables();
+
+    // The register runs un-inverted in here; crc32c() inverts on the way in
+    // and out.
+    uint32_t softwareCrc(uint32_t crc, const unsigned char *p, size_t len) noexcept
+    {
+        while (len >= 8)
+        {
+            uint32_t lo, hi;
+            std::memcpy(&lo, p, 4);
+            std::memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            lo = __builtin_bswap32(lo);
+            hi = __builtin_bswap32(hi);
+#endif
+            lo ^= crc;
+            crc = TABLES[7][lo & 0xFF] ^ TABLES[6][(lo >> 8) & 0xFF] ^ TABLES[5][(lo >> 16) & 0xFF] ^
+                  TABLES[4][lo >> 24] ^ TABLES[3][hi & 0xFF] ^ TABLES[2][(hi >> 8) & 0xFF] ^
+                  TABLES[1][(hi >> 16) & 0xFF] ^ TABLES[0][hi >> 24];
+            p += 8;
+            len -= 8;
+        }
+        while (len--)
+            crc = TABLES[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    // The crc32 instruction has a latency of three cycles but issues every
+    // cycle, so long buffers are cut into three lanes of LANE_BYTES that are
+    // checksummed side by side and then joined: the CRC of A followed by B
+    // is the register after A shifted through |B| zero bytes, xored with
+    // the CRC of B started from zero.
+    constexpr size_t LANE_BYTES = 4096;
+
+    // a * b modulo the polynomial, both in reflected bit order.
+    constexpr uint32_t multiplyModP(uint32_t a, uint32_t b) noexcept
+    {
+        uint32_t product = 0;
+        for (uint32_t m = 1u << 31; m != 0; m >>= 1)
+        {
+            if (a & m)
+                product ^= b;
+            b = (b & 1) ? (b >> 1) ^ POLY : b >> 1;
+        }
+        return product;
+    }
+
+    // x^(8 * bytes) modulo the polynomial: multiplying a register by it
+    // feeds it `bytes` zero bytes.
+    constexpr uint32_t zeroBytesOperator(size_t bytes)
+    {
+        uint32_t x = 1u << 31; // x^0
+        for (size_t i = 0; i < 8 * bytes; ++i)
+            x = (x & 1) ? (x >> 1) ^ POLY : x >> 1;
+        return x;
+    }
+
+    constexpr uint32_t SHIFT_LANE = zeroBytesOperator(LANE_BYTES);
+
+    __attribute__((target("sse4.2"))) uint32_t hardwareCrc(uint32_t crc, const unsigned char *p, size_t len) noexcept
+    {
+        while (len >= 3 * LANE_BYTES)
+        {
+            uint64_t a = crc, b = 0, c = 0;
+            for (size_t i = 0; i < LANE_BYTES; i += 8)
+            {
+                uint64_t wa, wb, wc;
+                std::memcpy(&wa, p + i, 8);
+                std::memcpy(&wb, p + LANE_BYTES + i, 8);
+                std::memcpy(&wc, p + 2 * LANE_BYTES + i, 8);
+                a = _mm_crc32_u64(a, wa);
+                b = _mm_crc32_u64(b, wb);
+                c = _mm_crc32_u64(c, wc);
+            }
+            crc = multiplyModP(SHIFT_LANE, multiplyModP(SHIFT_LANE, static_cast<uint32_t>(a)) ^
+                                               static_cast<uint32_t>(b)) ^
+                  static_cast<uint32_t>(c);
+            p += 3 * LANE_BYTES;
+            len -= 3 * LANE_BYTES;
+        }
+        uint64_t c = crc;
+        while (len >= 8)
+        {
+            uint64_t w;
+            std::memcpy(&w, p, 8);
+            c = _mm_crc32_u64(c, w);
+            p += 8;
+            len -= 8;
+        }
+        crc = static_cast<uint32_t>(c);
+        while (len--)
+            crc = _mm_crc32_u8(crc, *p++);
+        return crc;
+    }
+
+    using CrcFunction = uint32_t (*)(uint32_t, const unsigned char *, size_t) noexcept;
+
+    CrcFunction pickCrc() noexcept
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2") ? hardwareCrc : softwareCrc;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) noexcept
+{
+#if defined(__x86_64__)
+    static const CrcFunction impl = pickCrc();
+#else
+    constexpr auto impl = softwareCrc;
+#endif
+    return ~impl(~crc, static_cast<const unsigned char *>(data), len);
+}
@@ -0,0 +1,141 @@
+#include "crypto.h"
+#include "byteorder.h"
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    const EVP_CIPHER *cipherFor(size_t key_len)
+    {
+        if (key_len >= 32)
+            return EVP_aes_256_gcm();
+        if (key_len >= 24)
+            return EVP_aes_192_gcm();
+        return EVP_aes_128_gcm();
+    }
+
+    // Per-thread encrypt/decrypt contexts with the key schedule already
+    // loaded, one pair per distinct key. Freed when the thread exits.
+    struct ThreadContexts
+    {
+        struct Entry
+        {
+            std::string key;
+            EVP_CIPHER_CTX *enc;
+            EVP_CIPHER_CTX *dec;
+        };
+        std::vector<Entry> entries;
+
+        ~ThreadContexts()
+        {
+            for (Entry &e : entries)
+            {
+                EVP_CIPHER_CTX_free(e.enc);
+                EVP_CIPHER_CTX_free(e.dec);
+            }
+        }
+
+        Entry *get(const std::string &key)
+        {
+            for (Entry &e : entries)
+            {
+                if (e.key == key)
+                    return &e;
+            }
+            const EVP_CIPHER *cipher = cipherFor(key.size());
+            const unsigned char *k = reinterpret_cast<const unsigned char *>(key.data());
+            Entry e{key, EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_new()};
+            if (!e.enc || !e.dec ||
+                EVP_EncryptInit_ex(e.enc, cipher, nullptr, k, nullptr) != 1 ||
+                EVP_DecryptInit_ex(e.dec, cipher, nullptr, k, nullptr) != 1)
+            {
+                EVP_CIPHER_CTX_free(e.enc);
+                EVP_CIPHER_CTX_free(e.dec);
+                return nullptr;
+            }
+            entries.push_back(e);
+            return &entries.back();
+        }
+    };
+
+    thread_local ThreadContexts t_contexts;
+}
+
+RecordCipher::RecordCipher(std::string_view key)
+{
+    if (key.size() < 16)
+        throw std::invalid_argument("encryption key must be at least 16 bytes");
+    key_.assign(key.substr(0, key.size() >= 32 ? 32 : key.size() >= 24 ? 24 : 16));
+
+    unsigned char seed[12];
+    if (RAND_bytes(seed, sizeof(seed)) != 1)
+        throw std::runtime_error("RAND_bytes failed");
+    std::memcpy(prefix_, seed, sizeof(prefix_));
+    counter_.store(loadU64(seed + 4), std::memory_order_relaxed);
+}
+
+size_t RecordCipher::seal(std::string_view aad, std::initializer_list<std::string_view> parts, char *out)
+{
+    ThreadContexts::Entry *ctx = t_contexts.get(key_);
+    if (!ctx)
+        return 0;
+
+    unsigned char *nonce = reinterpret_cast<unsigned char *>(out);
+    std::memcpy(nonce, prefix_, sizeof(prefix_));
+    storeU64(out + sizeof(prefix_), counter_.fetch_add(1, std::memory_order_relaxed));
+
+    unsigned char *p = nonce + NONCE_BYTES;
+    int len = 0;
+    if (EVP_EncryptInit_ex(ctx->enc, nullptr, nullptr, nullptr, nonce) != 1)
+        return 0;
+    if (!aad.empty() &&
+        EVP_EncryptUpdate(ctx->enc, nullptr, &len, reinterpret_cast<const unsigned char *>(aad.data()),
+                          static_cast<int>(aad.size())) != 1)
+        return 0;
+    for (std::string_view part : parts)
+    {
+        if (part.empty())
+            continue;
+        if (EVP_EncryptUpdate(ctx->enc, p, &len, reinterpret_cast<const unsigned char *>(part.data()),
+                              static_cast<int>(part.size())) != 1)
+            return 0;
+        p += len;
+    }
+    if (EVP_EncryptFinal_ex(ctx->enc, p, &len) != 1)
+        return 0;
+    p += len;
+    if (EVP_CIPHER_CTX_ctrl(ctx->enc, EVP_CTRL_GCM_GET_TAG, TAG_BYTES, p) != 1)
+        return 0;
+    return static_cast<size_t>(p + TAG_BYTES - nonce);
+}
+
+bool RecordCipher::open(std::string_view aad, std::string_view sealed, char *out) const
+{
+    if (sealed.size() < OVERHEAD)
+        return false;
+    ThreadContexts::Entry *ctx = t_contexts.get(key_);
+    if (!ctx)
+        return false;
+
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(sealed.data());
+    size_t body = sealed.size() - OVERHEAD;
+    unsigned char *dst = reinterpret_cast<unsigned char *>(out);
+    unsigned char tag[TAG_BYTES];
+    std::memcpy(tag, in + NONCE_BYTES + body, TAG_BYTES);
+    int len = 0;
+    if (EVP_DecryptInit_ex(ctx->dec, nullptr, nullptr, nullptr, in) != 1)
+        return false;
+    if (!aad.empty() &&
+        EVP_DecryptUpdate(ctx->dec, nullptr, &len, reinterpret_cast<const unsigned char *>(aad.data()),
+                          static_cast<int>(aad.size())) != 1)
+        return false;
+    if (body && EVP_DecryptUpdate(ctx->dec, dst, &len, in + NONCE_BYTES, static_cast<int>(body)) != 1)
+        return false;
+    if (EVP_CIPHER_CTX_ctrl(ctx->dec, EVP_CTRL_GCM_SET_TAG, TAG_BYTES, tag) != 1)
+        return false;
+    int tail = 0;
+    return EVP_DecryptFinal_ex(ctx->dec, dst + body, &tail) == 1;
+}
@@ -0,0 +1,88 @@
+#include "frequency_sketch.h"
+#include <algorithm>
+
+namespace
+{
+    // 64-bit finaliser (murmur3 fmix64): spreads the 32-bit key hash so that
+    // block choice and counter choice use independent bits.
+    uint64_t mix(uint64_t h) noexcept
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    constexpr uint64_t LOW_BITS = 0x1111111111111111ULL;  // lowest bit of every counter
+    constexpr uint64_t HALF_MASK = 0x7777777777777777ULL; // a counter's bits after >> 1
+}
+
+void FrequencySketch::ensureCapacity(size_t expected)
+{
+    size_t words = WORDS_PER_BLOCK;
+    while (words < expected)
+        words <<= 1;
+    if (words / WORDS_PER_BLOCK <= blocks_)
+        return;
+    blocks_ = words / WORDS_PER_BLOCK;
+    table_.reset(new Block[blocks_]());
+    additions_ = 0;
+    sample_size_ = 10 * std::max<size_t>(expected, 1);
+}
+
+void FrequencySketch::increment(uint32_t hash) noexcept
+{
+    if (blocks_ == 0)
+        return;
+    uint64_t h = mix(hash);
+    uint64_t *block = table_[(h >> 32) & (blocks_ - 1)].words;
+    bool added = false;
+    for (int row = 0; row < 4; ++row)
+    {
+        // Row r owns words 2r and 2r+1 of the block; 5 bits pick one of
+        // their 32 counters.
+        unsigned pick = static_cast<unsigned>(h >> (row * 5)) & 31;
+        uint64_t &word = block[row * 2 + (pick >> 4)];
+        unsigned shift = (pick & 15) * 4;
+        if (((word >> shift) & MAX_COUNT) != MAX_COUNT)
+        {
+            word += uint64_t(1) << shift;
+            added = true;
+        }
+    }
+    if (added && ++additions_ >= sample_size_)
+        halve();
+}
+
+unsigned FrequencySketch::frequency(uint32_t hash) const noexcept
+{
+    if (blocks_ == 0)
+        return 0;
+    uint64_t h = mix(hash);
+    const uint64_t *block = table_[(h >> 32) & (blocks_ - 1)].words;
+    unsigned freq = MAX_COUNT;
+    for (int row = 0; row < 4; ++row)
+    {
+        unsigned pick = static_cast<unsigned>(h >> (row * 5)) & 31;
+        uint64_t word = block[row * 2 + (pick >> 4)];
+        freq = std::min(freq, static_cast<unsigned>(word >> ((pick & 15) * 4)) & MAX_COUNT);
+    }
+    return freq;
+}
+
+// Halves every counter. Counters that were odd lose half an increment each;
+// four rows count every addition, hence the division by four.
+void FrequencySketch::halve() noexcept
+{
+    size_t odd = 0;
+    uint64_t *words = table_[0].words;
+    size_t n = blocks_ * WORDS_PER_BLOCK;
+    for (size_t i = 0; i < n; ++i)
+    {
+        odd += static_cast<size_t>(__builtin_popcountll(words[i] & LOW_BITS));
+        words[i] = (words[i] >> 1) & HALF_MASK;
+    }
+    additions_ = (additions_ - std::min(additions_, odd / 4)) / 2;
+}
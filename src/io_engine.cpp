@@ -0,0 +1,609 @@
+#include "io_engine.h"
+#include <linux/io_uring.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+    std::atomic<IoBackend> g_backend{IoBackend::Uring};
+    std::atomic<bool> g_uring_refused{false};
+
+    // Submission queue size. At most this many operations are outstanding,
+    // so the completion queue (twice the size) never overflows.
+    constexpr unsigned RING_ENTRIES = 64;
+
+    bool writeFully(int fd, const char *data, size_t len, uint64_t offset)
+    {
+        while (len > 0)
+        {
+            ssize_t w = offset == IoEngine::APPEND ? ::write(fd, data, len)
+                                                   : ::pwrite(fd, data, len, static_cast<off_t>(offset));
+            if (w < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += w;
+            len -= static_cast<size_t>(w);
+            if (offset != IoEngine::APPEND)
+                offset += static_cast<uint64_t>(w);
+        }
+        return true;
+    }
+
+    ssize_t readFully(int fd, char *data, size_t len, uint64_t offset)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t r = ::pread(fd, data + done, len - done, static_cast<off_t>(offset + done));
+            if (r < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (r == 0)
+                break;
+            done += static_cast<size_t>(r);
+        }
+        return static_cast<ssize_t>(done);
+    }
+
+    // -------------------- Blocking --------------------
+    class BlockingEngine final : public IoEngine
+    {
+    public:
+        IoBackend backend() const noexcept override { return IoBackend::Blocking; }
+
+        uint64_t write(int fd, const void *data, size_t len, uint64_t offset) override
+        {
+            if (!writeFully(fd, static_cast<const char *>(data), len, offset))
+                fail();
+            return ++last_ticket_;
+        }
+
+        uint64_t sync(int fd) override
+        {
+            if (::fdatasync(fd) < 0)
+                fail();
+            return ++last_ticket_;
+        }
+
+        void submit() override {}
+
+        bool wait(uint64_t) override
+        {
+            if (error_ == 0)
+                return true;
+            errno = error_;
+            error_ = 0;
+            return false;
+        }
+
+        ssize_t read(int fd, void *data, size_t len, uint64_t offset) override
+        {
+            return readFully(fd, static_cast<char *>(data), len, offset);
+        }
+
+    private:
+        int error_ = 0; // first failure since the last wait()
+
+        void fail() noexcept
+        {
+            if (error_ == 0)
+                error_ = errno;
+        }
+    };
+
+    // -------------------- io_uring --------------------
+    // Driven through the raw system calls and the rings mapped from the
+    // kernel, as liburing would.
+    class UringEngine final : public IoEngine
+    {
+    public:
+        // nullptr if the kernel does not offer io_uring (or the features used
+        // here), or refuses it, e.g. under a seccomp policy.
+        static std::unique_ptr<UringEngine> open();
+        ~UringEngine() override;
+
+        IoBackend backend() const noexcept override { return IoBackend::Uring; }
+        uint64_t write(int fd, const void *data, size_t len, uint64_t offset) override;
+        uint64_t sync(int fd) override;
+        void submit() override;
+        bool wait(uint64_t ticket) override;
+        ssize_t read(int fd, void *data, size_t len, uint64_t offset) override;
+
+    private:
+        struct Op
+        {
+            uint8_t opcode;
+            int fd;
+            const char *data;
+            uint32_t len;
+            uint64_t offset;
+            int *result_out = nullptr; // reads: where the result goes
+            bool done = false;
+            int result = 0;
+        };
+
+        int ring_fd_ = -1;
+        void *sq_map_ = MAP_FAILED;
+        size_t sq_map_bytes_ = 0;
+        void *cq_map_ = MAP_FAILED;
+        size_t cq_map_bytes_ = 0;
+        io_uring_sqe *sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+        size_t sqes_bytes_ = 0;
+        unsigned *sq_tail_ = nullptr;
+        unsigned *sq_array_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned *cq_head_ = nullptr;
+        unsigned *cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe *cqes_ = nullptr;
+
+        unsigned queued_tail_ = 0;    // SQ tail including what is not submitted yet
+        unsigned submitted_tail_ = 0; // SQ tail the kernel has taken
+        std::deque<Op> ops_;          // not yet reaped, in ticket order
+        uint64_t first_ticket_ = 1;   // of ops_.front()
+        bool data_since_sync_ = false; // a write was finished by hand since the last sync
+        int error_ = 0;
+
+        UringEngine() = default;
+        io_uring_sqe &queue(const Op &op, uint8_t flags = 0);
+        uint8_t order();
+        void makeRoom();
+        int enter(unsigned submit, unsigned min_complete, unsigned flags);
+        void awaitCompletion();
+        void reap();
+        void drain(uint64_t ticket);
+        void finish(Op &op);
+        void runBlocking(Op &op);
+        void fail(int error) noexcept
+        {
+            if (error_ == 0)
+                error_ = error;
+        }
+    };
+
+    std::unique_ptr<UringEngine> UringEngine::open()
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = static_cast<int>(::syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+        if (fd < 0)
+            return nullptr;
+        std::unique_ptr<UringEngine> engine(new UringEngine);
+        engine->ring_fd_ = fd;
+        // RW_CUR_POS (5.6) is needed for APPEND writes; it came with the
+        // WRITE opcode.
+        if (!(params.features & IORING_FEAT_RW_CUR_POS))
+            return nullptr;
+
+        engine->sq_map_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        engine->cq_map_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            engine->sq_map_bytes_ = engine->cq_map_bytes_ = std::max(engine->sq_map_bytes_, engine->cq_map_bytes_);
+        engine->sq_map_ = ::mmap(nullptr, engine->sq_map_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 fd, IORING_OFF_SQ_RING);
+        if (engine->sq_map_ == MAP_FAILED)
+            return nullptr;
+        if (!single)
+        {
+            engine->cq_map_ = ::mmap(nullptr, engine->cq_map_bytes_, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (engine->cq_map_ == MAP_FAILED)
+                return nullptr;
+        }
+        engine->sqes_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+        engine->sqes_ = static_cast<io_uring_sqe *>(::mmap(nullptr, engine->sqes_bytes_, PROT_READ | PROT_WRITE,
+                                                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (engine->sqes_ == MAP_FAILED)
+            return nullptr;
+
+        char *sq = static_cast<char *>(engine->sq_map_);
+        char *cq = single ? sq : static_cast<char *>(engine->cq_map_);
+        engine->sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        engine->sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        engine->sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        engine->cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        engine->cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        engine->cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        engine->cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        engine->queued_tail_ = engine->submitted_tail_ = *engine->sq_tail_;
+        return engine;
+    }
+
+    UringEngine::~UringEngine()
+    {
+        if (ring_fd_ < 0)
+            return;
+        waitAll();
+        if (sqes_ != MAP_FAILED)
+            ::munmap(sqes_, sqes_bytes_);
+        if (cq_map_ != MAP_FAILED)
+            ::munmap(cq_map_, cq_map_bytes_);
+        if (sq_map_ != MAP_FAILED)
+            ::munmap(sq_map_, sq_map_bytes_);
+        ::close(ring_fd_);
+    }
+
+    uint64_t UringEngine::write(int fd, const void *data, size_t len, uint64_t offset)
+    {
+        // A write larger than an SQE can say goes out in pieces.
+        const char *p = static_cast<const char *>(data);
+        do
+        {
+            uint32_t piece = static_cast<uint32_t>(std::min<size_t>(len, 1u << 30));
+            makeRoom();
+            queue(Op{IORING_OP_WRITE, fd, p, piece, offset}, offset == APPEND ? order() : 0);
+            p += piece;
+            len -= piece;
+            if (offset != APPEND)
+                offset += piece;
+        } while (len > 0);
+        return last_ticket_;
+    }
+
+    uint64_t UringEngine::sync(int fd)
+    {
+        makeRoom();
+        io_uring_sqe &sqe = queue(Op{IORING_OP_FSYNC, fd, nullptr, 0, 0}, order());
+        sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+        return last_ticket_;
+    }
+
+    io_uring_sqe &UringEngine::queue(const Op &op, uint8_t flags)
+    {
+        unsigned index = queued_tail_ & sq_mask_;
+        io_uring_sqe &sqe = sqes_[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = op.opcode;
+        sqe.flags = flags;
+        sqe.fd = op.fd;
+        sqe.addr = reinterpret_cast<uint64_t>(op.data);
+        sqe.len = op.len;
+        sqe.off = op.offset; // APPEND is -1: the file position
+        sqe.user_data = ++last_ticket_;
+        sq_array_[index] = index;
+        ++queued_tail_;
+        ops_.push_back(op);
+        return sqe;
+    }
+
+    // Makes the operation about to be queued run after everything queued
+    // before it: the unsubmitted ones become a chain that it ends, and the
+    // chain waits for the submitted ones still in flight. Returns the flags
+    // for the new operation's SQE.
+    uint8_t UringEngine::order()
+    {
+        size_t submitted = ops_.size() - (queued_tail_ - submitted_tail_);
+        bool in_flight = false;
+        for (size_t i = 0; i < submitted && !in_flight; ++i)
+            in_flight = !ops_[i].done;
+        if (submitted_tail_ == queued_tail_)
+            return in_flight ? IOSQE_IO_DRAIN : 0;
+        for (unsigned t = submitted_tail_; t != queued_tail_; ++t)
+            sqes_[t & sq_mask_].flags |= IOSQE_IO_LINK;
+        if (in_flight)
+            sqes_[submitted_tail_ & sq_mask_].flags |= IOSQE_IO_DRAIN;
+        return 0;
+    }
+
+    // Keeps what is outstanding within the rings.
+    void UringEngine::makeRoom()
+    {
+        if (ops_.size() < RING_ENTRIES)
+            return;
+        submit();
+        while (ops_.size() >= RING_ENTRIES)
+        {
+            if (!ops_.front().done)
+                awaitCompletion();
+            reap();
+        }
+    }
+
+    int UringEngine::enter(unsigned submit, unsigned min_complete, unsigned flags)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, submit, min_complete, flags, nullptr, 0));
+    }
+
+    void UringEngine::submit()
+    {
+        if (submitted_tail_ == queued_tail_)
+            return;
+        __atomic_store_n(sq_tail_, queued_tail_, __ATOMIC_RELEASE);
+        while (submitted_tail_ != queued_tail_)
+        {
+            int n = enter(queued_tail_ - submitted_tail_, 0, 0);
+            if (n > 0)
+            {
+                submitted_tail_ += static_cast<unsigned>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            // Out of resources for now: make room by waiting for an earlier
+            // operation, if there is one.
+            bool earlier = ops_.size() > queued_tail_ - submitted_tail_;
+            if (n < 0 && (errno == EAGAIN || errno == EBUSY) && earlier && enter(0, 1, IORING_ENTER_GETEVENTS) >= 0)
+            {
+                reap();
+                continue;
+            }
+            // The kernel will not take them: withdraw them from the ring
+            // (nothing reads it between calls) and do them here, in order.
+            __atomic_store_n(sq_tail_, submitted_tail_, __ATOMIC_RELEASE);
+            size_t first = ops_.size() - (queued_tail_ - submitted_tail_);
+            queued_tail_ = submitted_tail_;
+            for (size_t i = first; i < ops_.size(); ++i)
+                runBlocking(ops_[i]);
+        }
+    }
+
+    // Blocks until the kernel posts a completion. Should waiting itself fail,
+    // the oldest operation is given up on with that error.
+    void UringEngine::awaitCompletion()
+    {
+        if (enter(0, 1, IORING_ENTER_GETEVENTS) >= 0 || errno == EINTR)
+            return;
+        Op &op = ops_.front();
+        op.result = -errno;
+        op.done = true;
+    }
+
+    // Takes the completions the kernel posted; the operations are finished
+    // from the front, in ticket order.
+    void UringEngine::reap()
+    {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+            if (cqe.user_data < first_ticket_)
+                continue; // given up on
+            Op &op = ops_[cqe.user_data - first_ticket_];
+            op.result = cqe.res;
+            op.done = true;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        while (!ops_.empty() && ops_.front().done)
+        {
+            finish(ops_.front());
+            ops_.pop_front();
+            ++first_ticket_;
+        }
+    }
+
+    void UringEngine::drain(uint64_t ticket)
+    {
+        submit();
+        while (!ops_.empty() && first_ticket_ <= ticket)
+        {
+            if (!ops_.front().done)
+                awaitCompletion();
+            reap();
+        }
+    }
+
+    void UringEngine::finish(Op &op)
+    {
+        if (op.opcode == IORING_OP_READ)
+        {
+            *op.result_out = op.result;
+            return;
+        }
+        if (op.opcode == IORING_OP_FSYNC)
+        {
+            // Redone if cancelled, or if data was written by hand after the
+            // kernel may have run it.
+            if (op.result == -ECANCELED || (op.result == 0 && data_since_sync_))
+                op.result = ::fdatasync(op.fd) < 0 ? -errno : 0;
+            data_since_sync_ = false;
+            if (op.result < 0)
+                fail(-op.result);
+            return;
+        }
+        if (op.result == -ECANCELED)
+            op.result = 0;
+        else if (op.result < 0)
+        {
+            fail(-op.result);
+            return;
+        }
+        size_t done = static_cast<size_t>(op.result);
+        if (done < op.len)
+        {
+            data_since_sync_ = true;
+            uint64_t offset = op.offset == APPEND ? APPEND : op.offset + done;
+            if (!writeFully(op.fd, op.data + done, op.len - done, offset))
+                fail(errno);
+        }
+    }
+
+    // Does an operation the kernel did not take, as if it had completed it.
+    void UringEngine::runBlocking(Op &op)
+    {
+        if (op.opcode == IORING_OP_FSYNC)
+            op.result = ::fdatasync(op.fd) < 0 ? -errno : 0;
+        else if (op.opcode == IORING_OP_WRITE)
+            op.result = writeFully(op.fd, op.data, op.len, op.offset) ? static_cast<int>(op.len) : -errno;
+        else
+        {
+            ssize_t r = readFully(op.fd, const_cast<char *>(op.data), op.len, op.offset);
+            op.result = r < 0 ? -errno : static_cast<int>(r);
+        }
+        op.done = true;
+    }
+
+    bool UringEngine::wait(uint64_t ticket)
+    {
+        drain(ticket);
+        if (error_ == 0)
+            return true;
+        errno = error_;
+        error_ = 0;
+        return false;
+    }
+
+    ssize_t UringEngine::read(int fd, void *data, size_t len, uint64_t offset)
+    {
+        char *p = static_cast<char *>(data);
+        size_t done = 0;
+        while (done < len)
+        {
+            uint32_t piece = static_cast<uint32_t>(std::min<size_t>(len - done, 1u << 30));
+            int result;
+            makeRoom();
+            Op op{IORING_OP_READ, fd, p + done, piece, offset + done};
+            op.result_out = &result;
+            queue(op);
+            drain(last_ticket_);
+            if (result == -EINTR || result == -EAGAIN)
+                continue;
+            if (result < 0)
+            {
+                errno = -result;
+                return -1;
+            }
+            if (result == 0)
+                break;
+            done += static_cast<size_t>(result);
+        }
+        return static_cast<ssize_t>(done);
+    }
+}
+
+bool parseIoBackend(std::string_view name, IoBackend &out)
+{
+    if (name == "uring" || name == "io_uring")
+        out = IoBackend::Uring;
+    else if (name == "blocking")
+        out = IoBackend::Blocking;
+    else
+        return false;
+    return true;
+}
+
+const char *ioBackendName(IoBackend backend)
+{
+    switch (backend)
+    {
+    case IoBackend::Uring:
+        return "io_uring";
+    case IoBackend::Blocking:
+        return "blocking";
+    }
+    return "unknown";
+}
+
+void setIoBackend(IoBackend backend) noexcept
+{
+    g_backend.store(backend, std::memory_order_relaxed);
+}
+
+IoBackend ioBackend() noexcept
+{
+    return g_backend.load(std::memory_order_relaxed);
+}
+
+IoBackend effectiveIoBackend() noexcept
+{
+    return ioBackend() == IoBackend::Uring && !g_uring_refused.load(std::memory_order_relaxed) ? IoBackend::Uring
+                                                                                              : IoBackend::Blocking;
+}
+
+std::unique_ptr<IoEngine> IoEngine::create()
+{
+    return create(ioBackend());
+}
+
+std::unique_ptr<IoEngine> IoEngine::create(IoBackend backend)
+{
+    if (backend == IoBackend::Uring && !g_uring_refused.load(std::memory_order_relaxed))
+    {
+        if (std::unique_ptr<UringEngine> engine = UringEngine::open())
+            return engine;
+        g_uring_refused.store(true, std::memory_order_relaxed);
+    }
+    return std::make_unique<BlockingEngine>();
+}
+
+// -------------------- IoWriter --------------------
+IoWriter::IoWriter(IoEngine &engine, int fd, uint64_t offset)
+    : engine_(engine), fd_(fd), offset_(offset), buffers_(BUFFERS), tickets_(BUFFERS, 0)
+{
+    buffers_[0].reserve(BUFFER_BYTES);
+}
+
+IoWriter::~IoWriter()
+{
+    engine_.waitAll();
+}
+
+bool IoWriter::append(std::string_view data)
+{
+    while (ok_ && !data.empty())
+    {
+        std::string &buf = buffers_[current_];
+        size_t n = std::min(data.size(), BUFFER_BYTES - buf.size());
+        buf.append(data.data(), n);
+        data.remove_prefix(n);
+        appended_ += n;
+        if (buf.size() == BUFFER_BYTES)
+            queueCurrent();
+    }
+    return ok_;
+}
+
+// Queues the current buffer and moves on to the next one, once the write
+// that last used that one is done.
+bool IoWriter::queueCurrent()
+{
+    std::string &buf = buffers_[current_];
+    if (!buf.empty())
+    {
+        tickets_[current_] = engine_.write(fd_, buf.data(), buf.size(), offset_);
+        engine_.submit();
+        if (offset_ != IoEngine::APPEND)
+            offset_ += buf.size();
+        current_ = (current_ + 1) % BUFFERS;
+    }
+    if (tickets_[current_] != 0)
+    {
+        ok_ = engine_.wait(tickets_[current_]) && ok_;
+        tickets_[current_] = 0;
+    }
+    buffers_[current_].clear();
+    buffers_[current_].reserve(BUFFER_BYTES);
+    return ok_;
+}
+
+bool IoWriter::finish(bool sync)
+{
+    if (ok_ && !buffers_[current_].empty())
+    {
+        tickets_[current_] = engine_.write(fd_, buffers_[current_].data(), buffers_[current_].size(), offset_);
+        if (offset_ != IoEngine::APPEND)
+            offset_ += buffers_[current_].size();
+    }
+    if (ok_ && sync)
+        engine_.sync(fd_);
+    ok_ = engine_.waitAll() && ok_;
+    for (size_t i = 0; i < BUFFERS; ++i)
+    {
+        buffers_[i].clear();
+        tickets_[i] = 0;
+    }
+    return ok_;
+}
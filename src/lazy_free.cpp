@@ -0,0 +1,102 @@
+#include "lazy_free.h"
+#include <chrono>
+
+namespace
+{
+    // A wakeup lost to a race costs at most this much delay.
+    constexpr std::chrono::milliseconds IDLE_WAIT(100);
+}
+
+LazyFree::LazyFree() : head_(new Node), tail_(head_.load())
+{
+    thread_ = std::thread([this]
+                          { run(); });
+}
+
+LazyFree::~LazyFree()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+    delete tail_;
+}
+
+void LazyFree::freeBlock(char *block, size_t bytes)
+{
+    Node *node = new Node;
+    node->block = block;
+    node->objects = 1;
+    node->bytes = bytes;
+    push(node);
+}
+
+void LazyFree::enqueue(std::unique_ptr<Job> job, size_t objects, size_t bytes)
+{
+    Node *node = new Node;
+    node->job = std::move(job);
+    node->objects = objects;
+    node->bytes = bytes;
+    push(node);
+}
+
+void LazyFree::push(Node *node)
+{
+    pending_objects_.fetch_add(node->objects, std::memory_order_relaxed);
+    pending_bytes_.fetch_add(node->bytes, std::memory_order_relaxed);
+    Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_seq_cst);
+    // Pairs with run(): it announces that it sleeps before its last look at
+    // the queue, so either it sees this node or this sees it asleep.
+    if (sleeping_.load(std::memory_order_seq_cst))
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        cv_.notify_one();
+    }
+}
+
+// The oldest node, which becomes the new dummy once its work is taken out;
+// nullptr when the queue is empty (or a push is half done).
+LazyFree::Node *LazyFree::pop() noexcept
+{
+    Node *next = tail_->next.load(std::memory_order_acquire);
+    if (!next)
+        return nullptr;
+    delete tail_;
+    tail_ = next;
+    return next;
+}
+
+void LazyFree::run()
+{
+    while (true)
+    {
+        if (Node *node = pop())
+        {
+            node->job.reset();
+            delete[] node->block;
+            node->block = nullptr;
+            pending_objects_.fetch_sub(node->objects, std::memory_order_relaxed);
+            pending_bytes_.fetch_sub(node->bytes, std::memory_order_relaxed);
+            freed_objects_.fetch_add(node->objects, std::memory_order_relaxed);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mu_);
+        sleeping_.store(true, std::memory_order_seq_cst);
+        if (!tail_->next.load(std::memory_order_seq_cst))
+        {
+            if (stopping_)
+                return;
+            cv_.wait_for(lock, IDLE_WAIT);
+        }
+        sleeping_.store(false, std::memory_order_relaxed);
+    }
+}
+
+LazyFree &lazyFree()
+{
+    static LazyFree instance;
+    return instance;
+}
@@ -1,130 +1,326 @@
-#include "cache.h"
-#include "persistence.h"
-#include <iostream>
-#include <sstream>
+#include "aof.h"
+#include "bgsave.h"
+#include "commands.h"
+#include "io_engine.h"
+#include "replication.h"
+#include "resp.h"
+#include "server.h"
+#include "sharded_cache.h"
+#include "stats.h"
 #include <algorithm>
-#include <unordered_map>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string_view>
+#include <vector>
 
-static inline std::string trim(const std::string &s)
+static Server *g_server = nullptr;
+
+static void handleSignal(int)
 {
-    auto a = s.find_first_not_of(" \t\r\n");
-    if (a == std::string::npos)
-        return "";
-    auto b = s.find_last_not_of(" \t\r\n");
-    return s.substr(a, b - a + 1);
+    if (g_server)
+        g_server->stop();
 }
 
-int main(int argc, char **argv)
+// Accepts plain bytes or a kb/mb/gb suffix, as in "256mb".
+static bool parseMemory(const std::string &text, size_t &out)
 {
-    size_t capacity = 1000;
-    if (argc >= 2)
+    size_t end = 0;
+    unsigned long long n = 0;
+    try
     {
-        try
-        {
-            capacity = std::stoul(argv[1]);
-        }
-        catch (...)
-        {
-        }
+        n = std::stoull(text, &end);
     }
+    catch (...)
+    {
+        return false;
+    }
+    std::string unit = text.substr(end);
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
+    if (unit == "kb" || unit == "k")
+        n <<= 10;
+    else if (unit == "mb" || unit == "m")
+        n <<= 20;
+    else if (unit == "gb" || unit == "g")
+        n <<= 30;
+    else if (!unit.empty() && unit != "b")
+        return false;
+    out = static_cast<size_t>(n);
+    return true;
+}
 
-    // Our cache
-    LRUCache cache(capacity);
-
-    // Persistence manager
-    Persistence persistence("data/snapshot.rdb", "data/aof.log");
-
-    // DB backing store
-    std::unordered_map<std::string, std::string> db;
-    persistence.load(db); // restore from snapshot + AOF
-
-    std::cout << "redis-lite (toy) AES + Hybrid Snapshot/AOF — capacity=" << capacity << "\n";
-    std::cout << "Commands: SET key value | GET key | DEL key | INFO | SAVE | EXIT\n";
+static void runRepl(Database &database)
+{
+    std::cout << "Commands: SET key value [EX s|PX ms] | GET key | DEL key [key ...] | UNLINK key [key ...] | FLUSHALL [ASYNC] | MGET key [key ...] | MSET key value [key value ...] | EXPIRE key s | TTL key | PERSIST key | STRLEN key | SCAN cursor [MATCH pattern] [COUNT n] | HOTKEYS [COUNT n] | INFO [section] | LATENCY | SAVE | BGSAVE | BGREWRITEAOF | REPLICAOF host port | EXIT\n";
 
     std::string line;
+    std::string out;
+    std::vector<std::string_view> argv;
     while (true)
     {
         std::cout << "rl> ";
         if (!std::getline(std::cin, line))
             break;
-        line = trim(line);
-        if (line.empty())
+        splitInline(line, argv);
+        if (argv.empty())
             continue;
 
-        std::istringstream iss(line);
-        std::string cmd;
-        iss >> cmd;
-        std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+        out.clear();
+        Reply reply(out, Reply::Mode::Text);
+        CommandStatus status = executeCommand(database, argv, reply);
+        if (status == CommandStatus::Replicate)
+            reply.error("ERR PSYNC needs a network connection");
+        if (!AofWriter::syncThreadWrites())
+        {
+            out.clear();
+            reply.error("MISCONF Errors writing to the AOF file");
+        }
+        serverCron(database);
+        std::cout << out;
+        if (status == CommandStatus::Quit)
+            break;
+    }
+}
 
-        if (cmd == "SET")
+int main(int argc, char **argv)
+{
+    size_t capacity = 0; // no limit
+    int port = -1;
+    size_t threads = 1;
+    size_t shards = 0;
+    size_t maxmemory = 0;
+    EvictionPolicy policy = EvictionPolicy::Lru;
+    AppendFsync fsync = AppendFsync::EverySec;
+    bool active_defrag = true;
+    bool lazy_eviction = false;
+    uint32_t hotkeys_sample_rate = 100;
+    bool tiered = false;
+    // redis.conf's defaults, unless --save is given
+    std::vector<SaveRule> save_rules = {{3600, 1}, {300, 100}, {60, 10000}};
+    bool custom_save = false;
+    unsigned aof_rewrite_percentage = 100;
+    size_t aof_rewrite_min_size = 64 << 20;
+    size_t repl_backlog_size = 1 << 20;
+    std::string master_host;
+    int master_port = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--auto-aof-rewrite-percentage") == 0 && i + 1 < argc)
+        {
+            aof_rewrite_percentage = static_cast<unsigned>(std::max(0, std::atoi(argv[++i])));
+            continue;
+        }
+        if (std::strcmp(argv[i], "--auto-aof-rewrite-min-size") == 0 && i + 1 < argc)
         {
-            std::string key, value;
-            iss >> key >> value;
-            if (key.empty() || value.empty())
+            if (!parseMemory(argv[++i], aof_rewrite_min_size))
             {
-                std::cout << "ERR wrong number of args for 'SET'\n";
+                std::cerr << "invalid --auto-aof-rewrite-min-size: " << argv[i] << "\n";
+                return 1;
+            }
+            continue;
+        }
+        if (std::strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+        {
+            // Repeatable "<seconds>:<changes>"; "none" disables automatic saves.
+            if (!custom_save)
+                save_rules.clear();
+            custom_save = true;
+            SaveRule rule;
+            if (std::strcmp(argv[++i], "none") == 0)
                 continue;
+            if (!parseSaveRule(argv[i], rule))
+            {
+                std::cerr << "invalid --save (want <seconds>:<changes>): " << argv[i] << "\n";
+                return 1;
             }
-            cache.set(key, value);
-            db[key] = value;
-
-            persistence.appendCommand("SET " + key + " " + value);
-            persistence.periodicSnapshot(db);
-
-            std::cout << "OK\n";
+            save_rules.push_back(rule);
+            continue;
         }
-        else if (cmd == "GET")
+        if (std::strcmp(argv[i], "--io-backend") == 0 && i + 1 < argc)
         {
-            std::string key;
-            iss >> key;
-            if (key.empty())
+            IoBackend backend;
+            if (!parseIoBackend(argv[++i], backend))
             {
-                std::cout << "(nil)\n";
-                continue;
+                std::cerr << "unknown --io-backend (want uring or blocking): " << argv[i] << "\n";
+                return 1;
             }
-            std::string val;
-            if (cache.get(key, val))
-                std::cout << val << "\n";
-            else
-                std::cout << "(nil)\n";
+            setIoBackend(backend);
+            continue;
         }
-        else if (cmd == "DEL")
+        if (std::strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc)
         {
-            std::string key;
-            iss >> key;
-            if (key.empty())
+            if (!parseAppendFsync(argv[++i], fsync))
             {
-                std::cout << "ERR\n";
-                continue;
+                std::cerr << "unknown --appendfsync: " << argv[i] << "\n";
+                return 1;
             }
-            bool removed = cache.del(key);
-            if (removed)
+            continue;
+        }
+        if (std::strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc)
+        {
+            if (!parseMemory(argv[++i], maxmemory))
             {
-                db.erase(key);
-                persistence.appendCommand("DEL " + key);
-                persistence.periodicSnapshot(db);
+                std::cerr << "invalid --maxmemory: " << argv[i] << "\n";
+                return 1;
             }
-            std::cout << (removed ? "1\n" : "0\n");
+            continue;
         }
-        else if (cmd == "INFO")
+        if (std::strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc)
         {
-            std::cout << "entries: " << cache.size() << " capacity: " << cache.capacity() << "\n";
+            if (!parseEvictionPolicy(argv[++i], policy))
+            {
+                std::cerr << "unknown --maxmemory-policy: " << argv[i] << "\n";
+                return 1;
+            }
+            continue;
         }
-        else if (cmd == "SAVE")
+        if (std::strcmp(argv[i], "--activedefrag") == 0 && i + 1 < argc)
         {
-            persistence.saveSnapshot(db);
-            std::cout << "Snapshot saved manually.\n";
+            std::string_view value = argv[++i];
+            if (value != "yes" && value != "no")
+            {
+                std::cerr << "invalid --activedefrag (want yes or no): " << value << "\n";
+                return 1;
+            }
+            active_defrag = value == "yes";
+            continue;
         }
-        else if (cmd == "EXIT" || cmd == "QUIT")
+        if (std::strcmp(argv[i], "--lazyfree-lazy-eviction") == 0 && i + 1 < argc)
         {
-            std::cout << "bye\n";
-            persistence.saveSnapshot(db);
-            break;
+            std::string_view value = argv[++i];
+            if (value != "yes" && value != "no")
+            {
+                std::cerr << "invalid --lazyfree-lazy-eviction (want yes or no): " << value << "\n";
+                return 1;
+            }
+            lazy_eviction = value == "yes";
+            continue;
+        }
+        if (std::strcmp(argv[i], "--hotkeys-sample-rate") == 0 && i + 1 < argc)
+        {
+            // One access in N is sampled for HOTKEYS; 0 turns that off.
+            hotkeys_sample_rate = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+            continue;
+        }
+        if (std::strcmp(argv[i], "--tiered") == 0 && i + 1 < argc)
+        {
+            std::string_view value = argv[++i];
+            if (value != "yes" && value != "no")
+            {
+                std::cerr << "invalid --tiered (want yes or no): " << value << "\n";
+                return 1;
+            }
+            tiered = value == "yes";
+            continue;
+        }
+        if (std::strcmp(argv[i], "--replicaof") == 0 && i + 2 < argc)
+        {
+            master_host = argv[++i];
+            master_port = std::atoi(argv[++i]);
+            if (master_port <= 0 || master_port > 65535)
+            {
+                std::cerr << "invalid --replicaof port: " << argv[i] << "\n";
+                return 1;
+            }
+            continue;
         }
-        else
+        if (std::strcmp(argv[i], "--repl-backlog-size") == 0 && i + 1 < argc)
         {
-            std::cout << "ERR unknown command\n";
+            if (!parseMemory(argv[++i], repl_backlog_size) || repl_backlog_size == 0)
+            {
+                std::cerr << "invalid --repl-backlog-size: " << argv[i] << "\n";
+                return 1;
+            }
+            continue;
+        }
+        if (std::strcmp(argv[i], "--latency-monitor-threshold") == 0 && i + 1 < argc)
+        {
+            // Milliseconds; events at least this slow show up in LATENCY. 0 = off.
+            latencyMonitor().setThreshold(static_cast<uint64_t>(std::max(0, std::atoi(argv[++i]))));
+            continue;
+        }
+        if (std::strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+        {
+            port = std::atoi(argv[++i]);
+            continue;
+        }
+        if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = std::max(1, std::atoi(argv[++i]));
+            continue;
         }
+        if (std::strcmp(argv[i], "--shards") == 0 && i + 1 < argc)
+        {
+            shards = std::max(1, std::atoi(argv[++i]));
+            continue;
+        }
+        try
+        {
+            capacity = std::stoul(argv[i]);
+        }
+        catch (...)
+        {
+        }
+    }
+
+    // A single thread keeps one shard (exact LRU, unsuffixed files); with more
+    // threads, use enough shards that two busy threads rarely meet on a lock.
+    if (shards == 0)
+        shards = threads == 1 ? 1 : threads * 4;
+
+    // The one keyspace; restores itself from snapshot + AOF. It only evicts
+    // when given a capacity or --maxmemory.
+    std::unique_ptr<ShardedCache> keyspace;
+    try
+    {
+        keyspace = std::make_unique<ShardedCache>(shards, capacity, "data/snapshot.rdb", "data/aof.log",
+                                                  "1234567890123456", maxmemory, policy, fsync,
+                                                  tiered ? "data/spill" : "");
     }
+    catch (const std::exception &e)
+    {
+        // Refuse to start rather than serve (and later save over) partial data.
+        std::cerr << "could not load data: " << e.what() << "\n";
+        return 1;
+    }
+    ShardedCache &cache = *keyspace;
+    cache.setActiveDefrag(active_defrag);
+    cache.setLazyEviction(lazy_eviction);
+    cache.setHotKeySampling(hotkeys_sample_rate);
+
+    BackgroundSaver saver(std::move(save_rules), aof_rewrite_percentage, aof_rewrite_min_size);
+
+    Replication replication(repl_backlog_size, "data/replsync.rdb");
+
+    Database database{cache, saver, replication};
+    if (!master_host.empty())
+        replication.replicaOf(database, master_host, static_cast<uint16_t>(master_port));
+
+    std::cout << "redis-lite (toy) AES + Hybrid Snapshot/AOF — capacity="
+              << (capacity ? std::to_string(capacity) : "unlimited") << ", keys=" << cache.size() << "\n";
+
+    if (port > 0)
+    {
+        Server server(database, static_cast<uint16_t>(port), threads);
+        g_server = &server;
+        std::signal(SIGINT, handleSignal);
+        std::signal(SIGTERM, handleSignal);
+        std::signal(SIGPIPE, SIG_IGN);
+        server.run();
+        g_server = nullptr;
+    }
+    else
+    {
+        runRepl(database);
+    }
+
+    // Final foreground save, once the link to a master is down (nothing
+    // changes after the save) and any background save has been reaped.
+    replication.stop();
+    saver.waitForChild(database);
+    std::string err;
+    if (!saver.save(database, err))
+        std::cerr << err << "\n";
     return 0;
 }
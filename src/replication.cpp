@@ -0,0 +1,859 @@
+#include "replication.h"
+#include "aof.h"
+#include "bgsave.h"
+#include "commands.h"
+#include "resp.h"
+#include "sharded_cache.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <random>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr int SENDER_INTERVAL_MS = 10; // longest a write waits to go out
+    constexpr size_t BULK_CHUNK = 64 * 1024;
+
+    thread_local bool t_applying = false;
+
+    void appendHeader(std::string &out, char type, size_t n)
+    {
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), n);
+        out.push_back(type);
+        out.append(buf, res.ptr - buf);
+        out.append("\r\n");
+    }
+
+    void appendCommandTo(std::string &out, std::initializer_list<std::string_view> argv)
+    {
+        appendHeader(out, '*', argv.size());
+        for (std::string_view arg : argv)
+        {
+            appendHeader(out, '$', arg.size());
+            out.append(arg);
+            out.append("\r\n");
+        }
+    }
+
+    bool parseOffset(std::string_view text, uint64_t &out)
+    {
+        auto res = std::from_chars(text.data(), text.data() + text.size(), out);
+        return res.ec == std::errc() && res.ptr == text.data() + text.size();
+    }
+
+    std::string randomId()
+    {
+        static const char HEX[] = "0123456789abcdef";
+        std::random_device rd;
+        std::string id(40, '0');
+        for (char &c : id)
+            c = HEX[rd() & 15];
+        return id;
+    }
+
+    bool sendAll(int fd, std::string_view data)
+    {
+        while (!data.empty())
+        {
+            ssize_t w = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return false;
+            data.remove_prefix(static_cast<size_t>(w));
+        }
+        return true;
+    }
+
+    bool writeAll(int fd, const char *data, size_t len)
+    {
+        while (len > 0)
+        {
+            ssize_t w = ::write(fd, data, len);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return false;
+            data += w;
+            len -= static_cast<size_t>(w);
+        }
+        return true;
+    }
+
+    int connectTo(const std::string &host, uint16_t port)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *res = nullptr;
+        if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+            return -1;
+        int fd = -1;
+        for (addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next)
+        {
+            fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd >= 0 && ::connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        ::freeaddrinfo(res);
+        if (fd >= 0)
+        {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd;
+    }
+
+    // Waits up to `timeout` seconds for data and appends what arrived to
+    // `in`. Returns 1 if data came, 0 on timeout and -1 once the link is
+    // broken.
+    int receive(int fd, std::string &in, time_t timeout)
+    {
+        time_t start = std::time(nullptr);
+        while (true)
+        {
+            pollfd p{fd, POLLIN, 0};
+            int r = ::poll(&p, 1, 1000);
+            if (r < 0 && errno != EINTR)
+                return -1;
+            if (r > 0)
+            {
+                char buf[16 * 1024];
+                ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+                if (n < 0 && (errno == EINTR || errno == EAGAIN))
+                    continue;
+                if (n <= 0)
+                    return -1;
+                in.append(buf, static_cast<size_t>(n));
+                return 1;
+            }
+            if (std::time(nullptr) - start >= timeout)
+                return 0;
+        }
+    }
+
+    // Takes one "\r\n"-terminated line off the front of `in`.
+    bool readLine(int fd, std::string &in, std::string &line, time_t timeout)
+    {
+        size_t eol;
+        while ((eol = in.find("\r\n")) == std::string::npos)
+        {
+            if (in.size() > 1024 || receive(fd, in, timeout) <= 0)
+                return false;
+        }
+        line.assign(in, 0, eol);
+        in.erase(0, eol + 2);
+        return true;
+    }
+}
+
+// -------------------- ReplicationBacklog --------------------
+ReplicationBacklog::ReplicationBacklog(size_t size) : buf_(size ? size : 1) {}
+
+void ReplicationBacklog::appendCommand(std::initializer_list<std::string_view> argv)
+{
+    // Encoded before taking the lock; reuses the thread's buffer.
+    thread_local std::string cmd;
+    cmd.clear();
+    appendCommandTo(cmd, argv);
+    append(cmd);
+}
+
+void ReplicationBacklog::append(std::string_view data)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    size_t n = buf_.size();
+    if (data.size() > n)
+    {
+        offset_ += data.size() - n;
+        data.remove_prefix(data.size() - n);
+    }
+    size_t at = static_cast<size_t>(offset_ % n);
+    size_t first = std::min(data.size(), n - at);
+    std::memcpy(&buf_[at], data.data(), first);
+    std::memcpy(&buf_[0], data.data() + first, data.size() - first);
+    offset_ += data.size();
+}
+
+void ReplicationBacklog::encodeArray(std::string &out, size_t n)
+{
+    appendHeader(out, '*', n);
+}
+
+void ReplicationBacklog::encodeBulk(std::string &out, std::string_view arg)
+{
+    appendHeader(out, '$', arg.size());
+    out.append(arg);
+    out.append("\r\n");
+}
+
+uint64_t ReplicationBacklog::offset() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return offset_;
+}
+
+uint64_t ReplicationBacklog::firstOffset() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return offset_ > buf_.size() ? offset_ - buf_.size() : 0;
+}
+
+bool ReplicationBacklog::copy(uint64_t from, std::string &out, size_t max) const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    size_t n = buf_.size();
+    uint64_t first = offset_ > n ? offset_ - n : 0;
+    if (from < first || from > offset_)
+        return false;
+    size_t len = static_cast<size_t>(std::min<uint64_t>(max, offset_ - from));
+    size_t at = static_cast<size_t>(from % n);
+    size_t head = std::min(len, n - at);
+    out.append(&buf_[at], head);
+    out.append(&buf_[0], len - head);
+    return true;
+}
+
+// -------------------- Replication --------------------
+Replication::Replication(size_t backlog_size, std::string sync_path)
+    : backlog_size_(backlog_size), sync_path_(std::move(sync_path)), replid_(randomId()), master_replid_("?")
+{
+}
+
+Replication::~Replication()
+{
+    stop();
+}
+
+bool Replication::applyingStream() noexcept
+{
+    return t_applying;
+}
+
+void Replication::stop()
+{
+    stopLink();
+    stopSender();
+    std::lock_guard<std::mutex> lock(mu_);
+    while (!replicas_.empty())
+        dropReplica(replicas_.size() - 1);
+}
+
+Replication::Status Replication::status() const
+{
+    Status s;
+    time_t now = std::time(nullptr);
+    std::lock_guard<std::mutex> lock(mu_);
+    s.replica = replica_.load(std::memory_order_relaxed);
+    s.replid = s.replica ? master_replid_ : replid_;
+    if (backlog_)
+    {
+        s.offset = backlog_->offset();
+        s.backlog_active = true;
+        s.backlog_size = backlog_->size();
+        s.backlog_first = backlog_->firstOffset();
+        s.backlog_histlen = s.offset - s.backlog_first;
+    }
+    for (const auto &r : replicas_)
+    {
+        static const char *const NAMES[] = {"wait_bgsave", "wait_bgsave", "send_bulk", "online"};
+        s.replicas.push_back({r->ip, r->port, NAMES[static_cast<int>(r->state)], r->ack,
+                              static_cast<uint64_t>(std::max<time_t>(0, now - r->last_ack))});
+    }
+    if (s.replica)
+    {
+        s.offset = applied_.load(std::memory_order_relaxed);
+        s.master_host = master_host_;
+        s.master_port = master_port_;
+        s.link_up = link_up_;
+        s.last_io_seconds = link_up_ ? static_cast<long long>(now - last_io_) : -1;
+        s.sync_in_progress = sync_in_progress_;
+        s.replica_offset = s.offset;
+    }
+    return s;
+}
+
+// -------------------- Master side --------------------
+void Replication::addReplica(Database &database, int fd, std::string_view replid, std::string_view offset,
+                             std::string pending)
+{
+    auto r = std::make_unique<Replica>();
+    r->fd = fd;
+    r->out = std::move(pending);
+    r->last_ack = std::time(nullptr);
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    char ip[INET6_ADDRSTRLEN] = "?";
+    r->port = 0;
+    if (::getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &len) == 0)
+    {
+        if (addr.ss_family == AF_INET)
+        {
+            auto *in = reinterpret_cast<sockaddr_in *>(&addr);
+            ::inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+            r->port = ntohs(in->sin_port);
+        }
+        else if (addr.ss_family == AF_INET6)
+        {
+            auto *in6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+            ::inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+            r->port = ntohs(in6->sin6_port);
+        }
+    }
+    r->ip = ip;
+
+    std::lock_guard<std::mutex> lock(mu_);
+    if (replica_.load(std::memory_order_relaxed))
+    {
+        // Became a replica since the command was checked.
+        ::close(fd);
+        return;
+    }
+    if (!backlog_)
+        enableBacklog(database);
+    uint64_t from;
+    if (replid == replid_ && parseOffset(offset, from) && from >= backlog_->firstOffset() &&
+        from <= backlog_->offset())
+    {
+        r->out.append("+CONTINUE\r\n");
+        r->sent = from;
+        r->state = State::Online;
+        std::cout << "[Replication] Replica " << r->ip << ":" << r->port << " resumed at offset " << from << "\n";
+    }
+    else
+    {
+        // cron() forks the snapshot.
+        std::cout << "[Replication] Replica " << r->ip << ":" << r->port << " needs a full sync\n";
+    }
+    replicas_.push_back(std::move(r));
+    if (!sender_.joinable())
+    {
+        sender_stop_ = false;
+        sender_ = std::thread(&Replication::runSender, this);
+    }
+}
+
+void Replication::enableBacklog(Database &database)
+{
+    backlog_ = std::make_shared<ReplicationBacklog>(backlog_size_);
+    database.cache.setReplicationBacklog(backlog_.get());
+}
+
+void Replication::disableBacklog(Database &database)
+{
+    if (!backlog_)
+        return;
+    // Once every shard has let go of it no writer can still be using it.
+    database.cache.setReplicationBacklog(nullptr);
+    backlog_.reset();
+}
+
+void Replication::cron(Database &database)
+{
+    std::shared_ptr<ReplicationBacklog> backlog;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        time_t now = std::time(nullptr);
+        if (backlog_ && !replicas_.empty() && now != last_ping_)
+        {
+            last_ping_ = now;
+            backlog_->appendCommand({"PING"});
+        }
+        bool waiting = false;
+        for (const auto &r : replicas_)
+            waiting = waiting || r->state == State::WaitStart;
+        if (!waiting)
+            return;
+        backlog = backlog_;
+    }
+
+    // Not under mu_: the saver calls back into syncSnapshotDone() with its
+    // own lock held. While another child runs this fails; try again later.
+    uint64_t offset;
+    std::string err;
+    if (!database.saver.bgsaveForReplication(database, *backlog, offset, err))
+        return;
+
+    std::lock_guard<std::mutex> lock(mu_);
+    std::string reply = "+FULLRESYNC " + replid_ + " " + std::to_string(offset) + "\r\n";
+    for (auto &r : replicas_)
+    {
+        if (r->state != State::WaitStart)
+            continue;
+        r->state = State::WaitBgsave;
+        r->sent = offset;
+        r->out.append(reply);
+    }
+}
+
+void Replication::syncSnapshotDone(bool ok)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    struct stat st{};
+    int fd = ok ? ::open(sync_path_.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    if (fd >= 0 && ::fstat(fd, &st) < 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    if (ok && fd < 0)
+        std::cerr << "[Replication] Cannot open the sync snapshot: " << strerror(errno) << "\n";
+    for (size_t i = replicas_.size(); i-- > 0;)
+    {
+        Replica &r = *replicas_[i];
+        if (r.state != State::WaitBgsave)
+            continue;
+        int bulk = fd >= 0 ? ::dup(fd) : -1;
+        if (bulk < 0)
+        {
+            // It reconnects and asks again.
+            dropReplica(i);
+            continue;
+        }
+        r.bulk_fd = bulk;
+        r.bulk_left = static_cast<uint64_t>(st.st_size);
+        r.bulk_pos = 0;
+        appendHeader(r.out, '$', static_cast<size_t>(st.st_size));
+        r.state = State::SendBulk;
+    }
+    if (fd >= 0)
+        ::close(fd);
+    // The open descriptors keep the data; nothing else needs the file.
+    std::remove(sync_path_.c_str());
+}
+
+void Replication::runSender()
+{
+    std::vector<pollfd> fds;
+    std::unique_lock<std::mutex> lock(mu_);
+    while (!sender_stop_)
+    {
+        fds.clear();
+        for (const auto &r : replicas_)
+        {
+            short events = POLLIN;
+            if (r->out_pos < r->out.size())
+                events |= POLLOUT;
+            fds.push_back({r->fd, events, 0});
+        }
+        lock.unlock();
+        ::poll(fds.data(), fds.size(), SENDER_INTERVAL_MS);
+        lock.lock();
+
+        time_t now = std::time(nullptr);
+        for (size_t i = 0; i < replicas_.size();)
+        {
+            Replica &r = *replicas_[i];
+            bool readable = false;
+            for (const pollfd &p : fds)
+                if (p.fd == r.fd)
+                    readable = (p.revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+            if (serviceReplica(r, readable, now))
+                ++i;
+            else
+                dropReplica(i);
+        }
+    }
+}
+
+bool Replication::serviceReplica(Replica &r, bool readable, time_t now)
+{
+    if (readable && !readAcks(r, now))
+        return false;
+
+    if (r.state != State::WaitStart)
+    {
+        // An online replica only gets more once it has taken most of what
+        // it was given; one still syncing has everything held back for it.
+        bool online = r.state == State::Online;
+        std::string &dst = online ? r.out : r.pending;
+        if (!online || r.out.size() - r.out_pos < backlog_->size())
+        {
+            size_t before = dst.size();
+            if (!backlog_->copy(r.sent, dst, backlog_->size()))
+            {
+                std::cerr << "[Replication] Replica " << r.ip << ":" << r.port
+                          << " fell behind the backlog; dropping it\n";
+                return false;
+            }
+            r.sent += dst.size() - before;
+        }
+        if (r.pending.size() > SYNC_BUFFER_LIMIT)
+        {
+            std::cerr << "[Replication] Replica " << r.ip << ":" << r.port
+                      << " exceeded the sync buffer limit; dropping it\n";
+            return false;
+        }
+    }
+
+    while (true)
+    {
+        if (r.out_pos == r.out.size())
+        {
+            r.out.clear();
+            r.out_pos = 0;
+            if (r.state != State::SendBulk)
+                break;
+            if (r.bulk_left == 0)
+            {
+                ::close(r.bulk_fd);
+                r.bulk_fd = -1;
+                r.out.swap(r.pending);
+                r.pending = std::string();
+                r.state = State::Online;
+                r.last_ack = now;
+                std::cout << "[Replication] Replica " << r.ip << ":" << r.port << " is in sync\n";
+                continue;
+            }
+            r.out.resize(static_cast<size_t>(std::min<uint64_t>(BULK_CHUNK, r.bulk_left)));
+            ssize_t n = ::pread(r.bulk_fd, &r.out[0], r.out.size(), static_cast<off_t>(r.bulk_pos));
+            if (n <= 0)
+            {
+                std::cerr << "[Replication] Cannot read the sync snapshot\n";
+                return false;
+            }
+            r.out.resize(static_cast<size_t>(n));
+            r.bulk_pos += static_cast<uint64_t>(n);
+            r.bulk_left -= static_cast<uint64_t>(n);
+        }
+        ssize_t w = ::send(r.fd, r.out.data() + r.out_pos, r.out.size() - r.out_pos, MSG_NOSIGNAL);
+        if (w > 0)
+        {
+            r.out_pos += static_cast<size_t>(w);
+            continue;
+        }
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        return false;
+    }
+
+    if (r.state == State::Online && now - r.last_ack > TIMEOUT_SECONDS)
+    {
+        std::cerr << "[Replication] Replica " << r.ip << ":" << r.port << " timed out\n";
+        return false;
+    }
+    return true;
+}
+
+// "REPLCONF ACK <offset>" is all a replica sends.
+bool Replication::readAcks(Replica &r, time_t now)
+{
+    while (true)
+    {
+        char buf[4096];
+        ssize_t n = ::read(r.fd, buf, sizeof(buf));
+        if (n > 0)
+        {
+            r.in.append(buf, static_cast<size_t>(n));
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        std::cout << "[Replication] Replica " << r.ip << ":" << r.port << " disconnected\n";
+        return false;
+    }
+
+    RespParser parser;
+    std::vector<std::string_view> argv;
+    size_t pos = 0;
+    while (true)
+    {
+        RespParser::Status res = parser.parse(r.in, pos, argv);
+        if (res == RespParser::Status::Incomplete)
+            break;
+        if (res == RespParser::Status::Error)
+            return false;
+        uint64_t ack;
+        if (argv.size() == 3 && argv[0].size() == 8 && strncasecmp(argv[0].data(), "REPLCONF", 8) == 0 &&
+            argv[1].size() == 3 && strncasecmp(argv[1].data(), "ACK", 3) == 0 && parseOffset(argv[2], ack))
+        {
+            r.ack = ack;
+            r.last_ack = now;
+        }
+    }
+    r.in.erase(0, pos);
+    return true;
+}
+
+void Replication::dropReplica(size_t i)
+{
+    Replica &r = *replicas_[i];
+    ::close(r.fd);
+    if (r.bulk_fd >= 0)
+        ::close(r.bulk_fd);
+    replicas_.erase(replicas_.begin() + static_cast<ptrdiff_t>(i));
+}
+
+void Replication::stopSender()
+{
+    std::thread t;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        sender_stop_ = true;
+        t = std::move(sender_);
+    }
+    if (t.joinable())
+        t.join();
+}
+
+// -------------------- Replica side --------------------
+bool Replication::replicaOf(Database &database, const std::string &host, uint16_t port)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (replica_.load(std::memory_order_relaxed) && host == master_host_ && port == master_port_)
+            return false;
+    }
+    stopLink();
+    stopSender();
+
+    std::lock_guard<std::mutex> lock(mu_);
+    // Replicas of this node would miss everything the new master sends.
+    while (!replicas_.empty())
+        dropReplica(replicas_.size() - 1);
+    disableBacklog(database);
+    master_host_ = host;
+    master_port_ = port;
+    link_stop_ = false;
+    link_up_ = false;
+    sync_in_progress_ = false;
+    replica_.store(true, std::memory_order_relaxed);
+    database.cache.setReplica(true);
+    link_ = std::thread(&Replication::runLink, this, std::ref(database));
+    std::cout << "[Replication] Following master " << host << ":" << port << "\n";
+    return true;
+}
+
+void Replication::promote(Database &database)
+{
+    if (!replica_.load(std::memory_order_relaxed))
+        return;
+    stopLink();
+    std::lock_guard<std::mutex> lock(mu_);
+    replica_.store(false, std::memory_order_relaxed);
+    database.cache.setReplica(false);
+    master_host_.clear();
+    master_port_ = 0;
+    link_up_ = false;
+    sync_in_progress_ = false;
+    // The data may diverge from the old master's from now on.
+    replid_ = randomId();
+    master_replid_ = "?";
+    applied_.store(0, std::memory_order_relaxed);
+    std::cout << "[Replication] No longer a replica; replication id " << replid_ << "\n";
+}
+
+void Replication::stopLink()
+{
+    std::thread t;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        link_stop_ = true;
+        if (link_fd_ >= 0)
+            ::shutdown(link_fd_, SHUT_RDWR);
+        t = std::move(link_);
+    }
+    link_cv_.notify_all();
+    if (t.joinable())
+        t.join();
+}
+
+void Replication::runLink(Database &database)
+{
+    t_applying = true;
+    std::unique_lock<std::mutex> lock(mu_);
+    while (!link_stop_)
+    {
+        std::string host = master_host_;
+        uint16_t port = master_port_;
+        lock.unlock();
+        int fd = connectTo(host, port);
+        lock.lock();
+        if (fd >= 0 && !link_stop_)
+        {
+            link_fd_ = fd;
+            lock.unlock();
+            followMaster(database, fd);
+            lock.lock();
+            link_fd_ = -1;
+            link_up_ = false;
+            sync_in_progress_ = false;
+        }
+        else if (fd < 0)
+            std::cerr << "[Replication] Cannot connect to master " << host << ":" << port << "\n";
+        if (fd >= 0)
+            ::close(fd);
+        link_cv_.wait_for(lock, std::chrono::seconds(1), [this]
+                          { return link_stop_; });
+    }
+}
+
+void Replication::followMaster(Database &database, int fd)
+{
+    std::string replid, offset;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        replid = master_replid_;
+        offset = replid == "?" ? "-1" : std::to_string(applied_.load(std::memory_order_relaxed));
+    }
+    std::string in;
+    std::string line;
+    std::string cmd;
+    appendCommandTo(cmd, {"PSYNC", replid, offset});
+    if (!sendAll(fd, cmd) || !readLine(fd, in, line, TIMEOUT_SECONDS))
+    {
+        std::cerr << "[Replication] No answer to PSYNC\n";
+        return;
+    }
+
+    if (line.compare(0, 12, "+FULLRESYNC ") == 0)
+    {
+        size_t space = line.find(' ', 12);
+        uint64_t start;
+        if (space == std::string::npos || !parseOffset(std::string_view(line).substr(space + 1), start))
+        {
+            std::cerr << "[Replication] Bad reply to PSYNC: " << line << "\n";
+            return;
+        }
+        std::string new_replid = line.substr(12, space - 12);
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            sync_in_progress_ = true;
+        }
+        std::cout << "[Replication] Full sync from master, offset " << start << "\n";
+
+        // The snapshot: "$<length>\r\n" and the file.
+        uint64_t length;
+        if (!readLine(fd, in, line, TIMEOUT_SECONDS) || line.empty() || line[0] != '$' ||
+            !parseOffset(std::string_view(line).substr(1), length))
+        {
+            std::cerr << "[Replication] Bad snapshot header from master\n";
+            return;
+        }
+        int file = ::open(sync_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file < 0)
+        {
+            std::cerr << "[Replication] Cannot create " << sync_path_ << ": " << strerror(errno) << "\n";
+            return;
+        }
+        bool ok = true;
+        while (ok && length > 0)
+        {
+            if (in.empty() && receive(fd, in, TIMEOUT_SECONDS) <= 0)
+                ok = false;
+            size_t take = static_cast<size_t>(std::min<uint64_t>(length, in.size()));
+            if (ok && !writeAll(file, in.data(), take))
+                ok = false;
+            in.erase(0, take);
+            length -= take;
+        }
+        ok = ::close(file) == 0 && ok;
+        std::string err;
+        if (!ok)
+            err = "transfer failed";
+        else if (!database.saver.loadReplicaSnapshot(database, sync_path_, err))
+            ok = false;
+        std::remove(sync_path_.c_str());
+        if (!ok)
+        {
+            std::cerr << "[Replication] Full sync failed: " << err << "\n";
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mu_);
+        master_replid_ = new_replid;
+        applied_.store(start, std::memory_order_relaxed);
+        sync_in_progress_ = false;
+        std::cout << "[Replication] Full sync done\n";
+    }
+    else if (line == "+CONTINUE")
+    {
+        std::cout << "[Replication] Resumed from master at offset " << offset << "\n";
+    }
+    else
+    {
+        std::cerr << "[Replication] Master refused PSYNC: " << line << "\n";
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        link_up_ = true;
+        last_io_ = std::time(nullptr);
+    }
+
+    // The stream: apply every complete command, count its bytes and report
+    // progress once a second.
+    RespParser parser;
+    std::vector<std::string_view> argv;
+    std::string scratch;
+    Reply reply(scratch, Reply::Mode::Resp);
+    time_t last_ack = 0;
+    time_t last_io = std::time(nullptr);
+    while (true)
+    {
+        size_t pos = 0;
+        while (pos < in.size())
+        {
+            size_t start = pos;
+            RespParser::Status res = parser.parse(in, pos, argv);
+            if (res == RespParser::Status::Incomplete)
+                break;
+            if (res == RespParser::Status::Error)
+            {
+                std::cerr << "[Replication] Protocol error in the stream from master\n";
+                return;
+            }
+            executeCommand(database, argv, reply);
+            scratch.clear();
+            applied_.fetch_add(pos - start, std::memory_order_relaxed);
+        }
+        in.erase(0, pos);
+        AofWriter::syncThreadWrites();
+
+        time_t now = std::time(nullptr);
+        if (now != last_ack)
+        {
+            last_ack = now;
+            cmd.clear();
+            appendCommandTo(cmd, {"REPLCONF", "ACK", std::to_string(applied_.load(std::memory_order_relaxed))});
+            if (!sendAll(fd, cmd))
+                break;
+        }
+        int r = receive(fd, in, 1);
+        if (r < 0)
+            break;
+        if (r == 0)
+        {
+            if (std::time(nullptr) - last_io < TIMEOUT_SECONDS)
+                continue;
+            std::cerr << "[Replication] Master timed out\n";
+            return;
+        }
+        last_io = std::time(nullptr);
+        std::lock_guard<std::mutex> lock(mu_);
+        last_io_ = last_io;
+    }
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!link_stop_)
+        std::cerr << "[Replication] Lost the link to master\n";
+}
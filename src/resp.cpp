@@ -0,0 +1,146 @@
+#include "resp.h"
+
+namespace
+{
+    constexpr size_t MAX_INLINE = 64 * 1024;
+    constexpr long long MAX_MULTIBULK = 1024 * 1024;
+    constexpr long long MAX_BULK = 512LL * 1024 * 1024;
+    // One whole command, as redis' client-query-buffer-limit. Also keeps
+    // every offset in args_ within 32 bits.
+    constexpr long long MAX_QUERY = 1024LL * 1024 * 1024;
+
+    // Reads "<digits>\r\n" at buf[at]. Returns 0 if incomplete, -1 if
+    // malformed, otherwise the number of bytes consumed.
+    long long readLength(std::string_view buf, size_t at, long long &out)
+    {
+        size_t eol = buf.find('\r', at);
+        if (eol == std::string_view::npos || eol + 1 >= buf.size())
+            return buf.size() - at > 32 ? -1 : 0;
+        if (buf[eol + 1] != '\n' || eol == at)
+            return -1;
+        long long n = 0;
+        bool neg = false;
+        size_t i = at;
+        if (buf[i] == '-')
+        {
+            neg = true;
+            ++i;
+        }
+        for (; i < eol; ++i)
+        {
+            char c = buf[i];
+            if (c < '0' || c > '9' || n > MAX_BULK)
+                return -1;
+            n = n * 10 + (c - '0');
+        }
+        out = neg ? -n : n;
+        return static_cast<long long>(eol + 2 - at);
+    }
+}
+
+void splitInline(std::string_view line, std::vector<std::string_view> &argv)
+{
+    argv.clear();
+    size_t i = 0, n = line.size();
+    while (i < n)
+    {
+        while (i < n && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r' || line[i] == '\n'))
+            ++i;
+        size_t start = i;
+        while (i < n && line[i] != ' ' && line[i] != '\t' && line[i] != '\r' && line[i] != '\n')
+            ++i;
+        if (i > start)
+            argv.push_back(line.substr(start, i - start));
+    }
+}
+
+void RespParser::reset() noexcept
+{
+    multibulk_ = -1;
+    bulk_ = -1;
+    cursor_ = 0;
+    args_.clear();
+}
+
+RespParser::Status RespParser::parseInline(std::string_view buf, size_t &pos, std::vector<std::string_view> &argv)
+{
+    size_t eol = buf.find('\n', pos);
+    if (eol == std::string_view::npos)
+        return buf.size() - pos > MAX_INLINE ? Status::Error : Status::Incomplete;
+    splitInline(buf.substr(pos, eol - pos), argv);
+    pos = eol + 1;
+    return Status::Complete;
+}
+
+RespParser::Status RespParser::parse(std::string_view buf, size_t &pos, std::vector<std::string_view> &argv)
+{
+    argv.clear();
+    if (pos >= buf.size())
+        return Status::Incomplete;
+    if (multibulk_ < 0 && buf[pos] != '*')
+        return parseInline(buf, pos, argv);
+
+    std::string_view cmd = buf.substr(pos);
+    if (multibulk_ < 0)
+    {
+        long long n = 0;
+        long long used = readLength(cmd, 1, n);
+        if (used == 0)
+            return Status::Incomplete;
+        if (used < 0 || n < 0 || n > MAX_MULTIBULK)
+        {
+            reset();
+            return Status::Error;
+        }
+        multibulk_ = n;
+        cursor_ = 1 + used;
+        args_.clear();
+    }
+
+    while (static_cast<long long>(args_.size()) < multibulk_)
+    {
+        if (bulk_ < 0)
+        {
+            if (cursor_ >= cmd.size())
+                return Status::Incomplete;
+            if (cmd[cursor_] != '$')
+            {
+                reset();
+                return Status::Error;
+            }
+            long long len = 0;
+            long long used = readLength(cmd, cursor_ + 1, len);
+            if (used == 0)
+                return Status::Incomplete;
+            if (used < 0 || len < 0 || len > MAX_BULK)
+            {
+                reset();
+                return Status::Error;
+            }
+            bulk_ = len;
+            cursor_ += 1 + used;
+            if (static_cast<long long>(cursor_) + bulk_ + 2 > MAX_QUERY)
+            {
+                reset();
+                return Status::Error;
+            }
+        }
+        if (cmd.size() < cursor_ + bulk_ + 2)
+            return Status::Incomplete;
+        // A wrong length prefix shows here, not as a garbled next command.
+        if (cmd[cursor_ + bulk_] != '\r' || cmd[cursor_ + bulk_ + 1] != '\n')
+        {
+            reset();
+            return Status::Error;
+        }
+        args_.emplace_back(static_cast<uint32_t>(cursor_), static_cast<uint32_t>(bulk_));
+        cursor_ += bulk_ + 2;
+        bulk_ = -1;
+    }
+
+    for (auto &a : args_)
+        argv.push_back(cmd.substr(a.first, a.second));
+    pos += cursor_;
+    reset();
+    return Status::Complete;
+}
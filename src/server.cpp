@@ -0,0 +1,404 @@
+#include "server.h"
+#include "aof.h"
+#include "replication.h"
+#include "resp.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace
+{
+    constexpr int MAX_EVENTS = 256;
+    constexpr size_t READ_CHUNK = 16 * 1024;
+    constexpr size_t MAX_BATCH = 1024 * 1024; // run buffered commands once this much is pending
+    constexpr std::chrono::milliseconds CRON_INTERVAL(100);
+
+    void setNonBlocking(int fd)
+    {
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    int openListener(uint16_t port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            throw std::runtime_error(std::string("socket: ") + strerror(errno));
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        {
+            close(fd);
+            throw std::runtime_error(std::string("bind: ") + strerror(errno));
+        }
+        if (listen(fd, SOMAXCONN) < 0)
+        {
+            close(fd);
+            throw std::runtime_error(std::string("listen: ") + strerror(errno));
+        }
+        setNonBlocking(fd);
+        return fd;
+    }
+}
+
+class Server::EventLoop
+{
+public:
+    // Exactly one loop runs the cron, between batches of events.
+    EventLoop(Database &database, uint16_t port, const std::atomic<bool> &running, bool runs_cron);
+    ~EventLoop();
+
+    void run();
+
+private:
+    // Read buffer that sockets read into directly; parsed arguments are views
+    // into it, so it is only compacted between batches.
+    struct InputBuffer
+    {
+        std::unique_ptr<char[]> data;
+        size_t cap = 0;
+        size_t len = 0;
+
+        char *reserve(size_t n);
+        std::string_view view() const noexcept { return {data.get(), len}; }
+        void consume(size_t n) noexcept;
+    };
+
+    struct Connection
+    {
+        int fd;
+        InputBuffer in;
+        std::string out;
+        size_t out_pos = 0;
+        bool closing = false;
+        bool replica = false; // sent PSYNC; psync holds its arguments
+        std::string psync[2];
+        RespParser parser;
+        std::vector<std::string_view> argv;
+    };
+
+    Database &database_;
+    const std::atomic<bool> &running_;
+    int listen_fd_;
+    int epoll_fd_;
+    std::unordered_map<int, std::unique_ptr<Connection>> conns_;
+    bool runs_cron_;
+    std::chrono::steady_clock::time_point next_cron_;
+
+    void acceptClients();
+    void handleReadable(Connection &conn);
+    void processInput(Connection &conn);
+    bool flushOutput(Connection &conn);
+    void closeConnection(int fd);
+    void handOverToReplication(int fd);
+};
+
+// -------------------- InputBuffer --------------------
+char *Server::EventLoop::InputBuffer::reserve(size_t n)
+{
+    if (cap - len < n)
+    {
+        size_t new_cap = cap ? cap : READ_CHUNK;
+        while (new_cap - len < n)
+            new_cap *= 2;
+        std::unique_ptr<char[]> grown(new char[new_cap]);
+        if (len)
+            std::memcpy(grown.get(), data.get(), len);
+        data = std::move(grown);
+        cap = new_cap;
+    }
+    return data.get() + len;
+}
+
+void Server::EventLoop::InputBuffer::consume(size_t n) noexcept
+{
+    if (n >= len)
+    {
+        len = 0;
+        return;
+    }
+    std::memmove(data.get(), data.get() + n, len - n);
+    len -= n;
+}
+
+// -------------------- Server --------------------
+Server::Server(Database &database, uint16_t port, size_t threads)
+    : database_(database), port_(port), running_(false)
+{
+    for (size_t i = 0; i < (threads ? threads : 1); ++i)
+        loops_.push_back(std::make_unique<EventLoop>(database_, port_, running_, i == 0));
+}
+
+Server::~Server() = default;
+
+void Server::stop() noexcept
+{
+    running_.store(false, std::memory_order_relaxed);
+}
+
+void Server::run()
+{
+    running_ = true;
+    std::cout << "redis-lite listening on port " << port_ << " (" << loops_.size() << " threads)\n";
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < loops_.size(); ++i)
+        workers.emplace_back([this, i]
+                             { loops_[i]->run(); });
+    loops_[0]->run();
+    for (auto &t : workers)
+        t.join();
+}
+
+// -------------------- EventLoop --------------------
+Server::EventLoop::EventLoop(Database &database, uint16_t port, const std::atomic<bool> &running,
+                             bool runs_cron)
+    : database_(database), running_(running), listen_fd_(openListener(port)), epoll_fd_(-1),
+      runs_cron_(runs_cron), next_cron_(std::chrono::steady_clock::now())
+{
+    epoll_fd_ = epoll_create1(0);
+    if (epoll_fd_ < 0)
+    {
+        close(listen_fd_);
+        throw std::runtime_error(std::string("epoll_create1: ") + strerror(errno));
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+}
+
+Server::EventLoop::~EventLoop()
+{
+    for (auto &kv : conns_)
+        close(kv.first);
+    close(epoll_fd_);
+    close(listen_fd_);
+}
+
+void Server::EventLoop::run()
+{
+    epoll_event events[MAX_EVENTS];
+    while (running_.load(std::memory_order_relaxed))
+    {
+        // The timeout bounds how long a stop() request can go unnoticed, and
+        // how late the cron may run.
+        int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, 100);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("epoll_wait: ") + strerror(errno));
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd_)
+            {
+                acceptClients();
+                continue;
+            }
+
+            auto it = conns_.find(fd);
+            if (it == conns_.end())
+                continue;
+            Connection &conn = *it->second;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeConnection(fd);
+                continue;
+            }
+            if (events[i].events & EPOLLIN)
+                handleReadable(conn);
+            else if (events[i].events & EPOLLOUT)
+            {
+                if (!flushOutput(conn))
+                    closeConnection(fd);
+            }
+        }
+
+        if (runs_cron_)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= next_cron_)
+            {
+                serverCron(database_);
+                next_cron_ = now + CRON_INTERVAL;
+            }
+        }
+    }
+}
+
+// -------------------- Connections --------------------
+void Server::EventLoop::acceptClients()
+{
+    while (true)
+    {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return; // EAGAIN: accept queue drained
+        }
+        setNonBlocking(fd);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            close(fd);
+            continue;
+        }
+        auto conn = std::make_unique<Connection>();
+        conn->fd = fd;
+        conns_.emplace(fd, std::move(conn));
+    }
+}
+
+void Server::EventLoop::handleReadable(Connection &conn)
+{
+    // Edge-triggered: drain the socket completely before going back to epoll.
+    bool peer_closed = false;
+    while (true)
+    {
+        char *dst = conn.in.reserve(READ_CHUNK);
+        ssize_t r = read(conn.fd, dst, conn.in.cap - conn.in.len);
+        if (r > 0)
+        {
+            conn.in.len += r;
+            if (conn.in.len >= MAX_BATCH)
+                processInput(conn);
+            continue;
+        }
+        if (r == 0)
+        {
+            peer_closed = true;
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            peer_closed = true;
+        break;
+    }
+
+    processInput(conn);
+
+    if (conn.replica && !peer_closed)
+        handOverToReplication(conn.fd);
+    else if (!flushOutput(conn) || peer_closed)
+        closeConnection(conn.fd);
+}
+
+// Runs every complete command in the read buffer, pipelined or not, so the
+// whole batch is answered with a single write.
+void Server::EventLoop::processInput(Connection &conn)
+{
+    std::string_view buf = conn.in.view();
+    size_t pos = 0;
+    size_t replies = conn.out.size();
+    Reply reply(conn.out, Reply::Mode::Resp);
+    while (!conn.closing && !conn.replica && pos < buf.size())
+    {
+        RespParser::Status res = conn.parser.parse(buf, pos, conn.argv);
+        if (res == RespParser::Status::Incomplete)
+            break;
+        if (res == RespParser::Status::Error)
+        {
+            reply.error("ERR Protocol error");
+            conn.closing = true;
+            break;
+        }
+        CommandStatus status = executeCommand(database_, conn.argv, reply);
+        if (status == CommandStatus::Quit)
+            conn.closing = true;
+        else if (status == CommandStatus::Replicate)
+        {
+            conn.replica = true;
+            conn.psync[0].assign(conn.argv[1]);
+            conn.psync[1].assign(conn.argv[2]);
+        }
+    }
+    conn.argv.clear();
+    conn.in.consume(pos);
+    // Under appendfsync always, hold the replies until the batch's writes are
+    // on disk; concurrent batches share the same fsync. If they never get
+    // there, the client must not see them acknowledged: its replies give way
+    // to an error and the connection is closed.
+    if (!AofWriter::syncThreadWrites())
+    {
+        conn.out.resize(replies);
+        reply.error("MISCONF Errors writing to the AOF file");
+        conn.closing = true;
+    }
+}
+
+// Writes as much pending output as the socket accepts. Returns false once the
+// connection should be dropped.
+bool Server::EventLoop::flushOutput(Connection &conn)
+{
+    while (conn.out_pos < conn.out.size())
+    {
+        ssize_t w = write(conn.fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos);
+        if (w > 0)
+        {
+            conn.out_pos += w;
+            continue;
+        }
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true; // EPOLLOUT will tell us when to resume
+        return false;
+    }
+    conn.out.clear();
+    conn.out_pos = 0;
+    return !conn.closing;
+}
+
+void Server::EventLoop::closeConnection(int fd)
+{
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    conns_.erase(fd);
+}
+
+// The socket leaves this loop for the replication sender, with whatever
+// output the client has not read yet; anything it sent after PSYNC is
+// dropped.
+void Server::EventLoop::handOverToReplication(int fd)
+{
+    auto it = conns_.find(fd);
+    std::unique_ptr<Connection> conn = std::move(it->second);
+    conns_.erase(it);
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    database_.replication.addReplica(database_, fd, conn->psync[0], conn->psync[1],
+                                     conn->out.substr(conn->out_pos));
+}
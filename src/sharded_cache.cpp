@@ -0,0 +1,620 @@
+#include "sharded_cache.h"
+#include "replication.h"
+#include "snapshot.h"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+
+ShardedCache::ShardedCache(size_t num_shards, size_t capacity,
+                           const std::string &snapshot_path,
+                           const std::string &aof_path,
+                           const std::string &aes_key,
+                           size_t maxmemory,
+                           EvictionPolicy policy,
+                           AppendFsync fsync,
+                           const std::string &spill_dir)
+    : capacity_(capacity), maxmemory_(maxmemory), policy_(policy), aes_key_(aes_key),
+      shards_(num_shards ? num_shards : 1),
+      tiered_(!spill_dir.empty())
+{
+    size_t n = shards_.size();
+    for (size_t i = 0; i < n; ++i)
+    {
+        // Spread the remainder so the slices add up to the requested limits.
+        // A limit smaller than the shard count still leaves every shard bounded.
+        size_t slice = capacity ? std::max<size_t>(1, capacity / n + (i < capacity % n ? 1 : 0)) : 0;
+        size_t mem_slice = maxmemory ? std::max<size_t>(1, maxmemory / n + (i < maxmemory % n ? 1 : 0)) : 0;
+        std::string suffix = n > 1 ? "." + std::to_string(i) : "";
+        shards_[i].cache = std::make_unique<LRUCache>(
+            slice,
+            snapshot_path.empty() ? snapshot_path : snapshot_path + suffix,
+            aof_path.empty() ? aof_path : aof_path + suffix,
+            aes_key, mem_slice, policy, fsync,
+            spill_dir.empty() ? spill_dir : spill_dir + suffix);
+    }
+}
+
+size_t ShardedCache::shardIndex(std::string_view key) const noexcept
+{
+    // The shard maps hash the same key again with std::hash, so mix the bits
+    // before reducing; otherwise each shard would only see a residue class.
+    uint64_t h = std::hash<std::string_view>{}(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h % shards_.size();
+}
+
+bool ShardedCache::set(std::string_view key, std::string_view value, uint64_t expire_at)
+{
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    return shard.cache->set(key, value, expire_at);
+}
+
+bool ShardedCache::get(std::string_view key, std::string &out_value)
+{
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    return shard.cache->get(key, out_value);
+}
+
+bool ShardedCache::del(std::string_view key, bool lazy)
+{
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    return shard.cache->del(key, lazy);
+}
+
+bool ShardedCache::expire(std::string_view key, uint64_t at_ms)
+{
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    return shard.cache->expire(key, at_ms);
+}
+
+bool ShardedCache::persist(std::string_view key)
+{
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    return shard.cache->persist(key);
+}
+
+int64_t ShardedCache::pttl(std::string_view key)
+{
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    return shard.cache->pttl(key);
+}
+
+ShardedCache::KeyLocks::KeyLocks(ShardedCache &cache, const std::string_view *keys, size_t n, size_t stride)
+    : cache_(cache), shard_of_(n)
+{
+    size_t shards = cache.shards_.size();
+    std::vector<bool> used(shards, false);
+    for (size_t i = 0; i < n; ++i)
+    {
+        shard_of_[i] = static_cast<uint32_t>(shards == 1 ? 0 : cache.shardIndex(keys[i * stride]));
+        used[shard_of_[i]] = true;
+    }
+    for (size_t s = 0; s < shards; ++s)
+        if (used[s])
+        {
+            cache.shards_[s].mu.lock();
+            locked_.push_back(static_cast<uint32_t>(s));
+        }
+}
+
+ShardedCache::KeyLocks::~KeyLocks()
+{
+    for (uint32_t s : locked_)
+        cache_.shards_[s].mu.unlock();
+}
+
+bool ShardedCache::setMany(const std::string_view *pairs, size_t n, bool only_new, bool &stored)
+{
+    stored = false;
+    KeyLocks locks(*this, pairs, n, 2);
+    for (size_t i = 0; i < n; ++i)
+        if (!locks[i].admits(pairs[2 * i], pairs[2 * i + 1]))
+            return false;
+
+    // Opened before the existence checks, so that keys they find expired
+    // are logged with the batch too.
+    for (uint32_t s : locks.shards())
+        shards_[s].cache->beginBatch();
+    bool exists = false;
+    if (only_new)
+        forEachKey(locks, pairs, n, 2, [&](LRUCache &cache, size_t i)
+                   { exists = exists || cache.exists(pairs[2 * i]); });
+    if (!exists)
+    {
+        forEachKey(locks, pairs, n, 2, [&](LRUCache &cache, size_t i)
+                   { cache.set(pairs[2 * i], pairs[2 * i + 1]); });
+        stored = true;
+    }
+    for (uint32_t s : locks.shards())
+        shards_[s].cache->commitBatch();
+    return true;
+}
+
+size_t ShardedCache::delMany(const std::string_view *keys, size_t n, bool lazy)
+{
+    KeyLocks locks(*this, keys, n, 1);
+    for (uint32_t s : locks.shards())
+        shards_[s].cache->beginBatch();
+    size_t deleted = 0;
+    forEachKey(locks, keys, n, 1, [&](LRUCache &cache, size_t i)
+               { deleted += cache.del(keys[i], lazy); });
+    for (uint32_t s : locks.shards())
+        shards_[s].cache->commitBatch();
+    return deleted;
+}
+
+size_t ShardedCache::flushAll(bool async)
+{
+    lockAll();
+    size_t dropped = 0;
+    for (auto &shard : shards_)
+    {
+        dropped += shard.cache->size();
+        shard.cache->flush(async);
+    }
+    if (backlog_)
+    {
+        if (async)
+            backlog_->appendCommand({"FLUSHALL", "ASYNC"});
+        else
+            backlog_->appendCommand({"FLUSHALL"});
+    }
+    unlockAll();
+    return dropped;
+}
+
+void ShardedCache::setLazyEviction(bool lazy)
+{
+    lazy_eviction_ = lazy;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        shard.cache->setLazyEviction(lazy);
+    }
+}
+
+void ShardedCache::setReplica(bool replica)
+{
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        shard.cache->setReplica(replica);
+    }
+}
+
+uint64_t ShardedCache::scan(uint64_t cursor, size_t count, std::vector<std::string> &keys)
+{
+    size_t n = shards_.size();
+    size_t i = cursor % n;
+    uint64_t v = cursor / n;
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(shards_[i].mu);
+            v = shards_[i].cache->scan(v, count, keys);
+        }
+        if (v != 0)
+            return v * n + i;
+        if (++i == n)
+            return 0;
+        if (keys.size() >= count)
+            return i;
+    }
+}
+
+void ShardedCache::setHotKeySampling(uint32_t rate)
+{
+    hot_key_rate_ = rate;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        shard.cache->setHotKeySampling(rate);
+    }
+}
+
+std::vector<LRUCache::HotKey> ShardedCache::hotKeys(size_t count)
+{
+    std::vector<LRUCache::HotKey> keys;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        shard.cache->hotKeys(keys);
+    }
+    std::sort(keys.begin(), keys.end(), [](const LRUCache::HotKey &a, const LRUCache::HotKey &b)
+              { return a.accesses > b.accesses; });
+    if (keys.size() > count)
+        keys.resize(count);
+    return keys;
+}
+
+template <typename Step>
+size_t ShardedCache::runSliced(std::chrono::microseconds budget, size_t &cursor, Step step)
+{
+    using clock = std::chrono::steady_clock;
+    constexpr std::chrono::microseconds SLICE(1000);
+    clock::time_point deadline = clock::now() + budget;
+    size_t n = shards_.size();
+    size_t total = 0;
+
+    // Visit every shard in turn; a shard with work left when its slice ends
+    // gets another one once the others had theirs.
+    size_t pending = n;
+    std::vector<bool> drained(n, false);
+    while (pending > 0)
+    {
+        clock::time_point now = clock::now();
+        if (now >= deadline)
+            return total;
+        size_t i = cursor;
+        cursor = (cursor + 1) % n;
+        if (drained[i])
+            continue;
+        bool done;
+        {
+            std::lock_guard<std::mutex> lock(shards_[i].mu);
+            total += step(*shards_[i].cache, std::min(deadline, now + SLICE), done);
+        }
+        if (done)
+        {
+            drained[i] = true;
+            --pending;
+        }
+    }
+    return total;
+}
+
+size_t ShardedCache::activeExpire(std::chrono::microseconds budget)
+{
+    uint64_t now_ms = unixTimeMs();
+    return runSliced(budget, expire_cursor_,
+                     [now_ms](LRUCache &cache, std::chrono::steady_clock::time_point until, bool &done)
+                     { return cache.expireDue(now_ms, until, done); });
+}
+
+size_t ShardedCache::activeDefrag(std::chrono::microseconds budget)
+{
+    if (!active_defrag_)
+        return 0;
+    return runSliced(budget, defrag_cursor_,
+                     [](LRUCache &cache, std::chrono::steady_clock::time_point until, bool &done)
+                     { return cache.defragStep(until, done); });
+}
+
+size_t ShardedCache::activeRehash(std::chrono::microseconds budget)
+{
+    return runSliced(budget, rehash_cursor_,
+                     [](LRUCache &cache, std::chrono::steady_clock::time_point until, bool &done)
+                     { return cache.rehashStep(until, done); });
+}
+
+size_t ShardedCache::rehashingShards() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->rehashing();
+    }
+    return total;
+}
+
+size_t ShardedCache::tieredGC(std::chrono::microseconds budget)
+{
+    if (!tiered_)
+        return 0;
+    return runSliced(budget, gc_cursor_,
+                     [](LRUCache &cache, std::chrono::steady_clock::time_point until, bool &done)
+                     { return cache.spillGC(until, done); });
+}
+
+size_t ShardedCache::size() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->size();
+    }
+    return total;
+}
+
+size_t ShardedCache::memoryUsage() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->memoryUsage();
+    }
+    return total;
+}
+
+size_t ShardedCache::usedMemory() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->usedMemory();
+    }
+    return total;
+}
+
+size_t ShardedCache::evictions() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->evictions();
+    }
+    return total;
+}
+
+size_t ShardedCache::expiredKeys() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->expiredKeys();
+    }
+    return total;
+}
+
+size_t ShardedCache::expiringKeys() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->expiringKeys();
+    }
+    return total;
+}
+
+SlabAllocator::Stats ShardedCache::allocatorStats() const
+{
+    SlabAllocator::Stats total;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        SlabAllocator::Stats stats = shard.cache->allocatorStats();
+        total.requested += stats.requested;
+        total.active += stats.active;
+        total.pages += stats.pages;
+        total.large_bytes += stats.large_bytes;
+        total.reclaimable += stats.reclaimable;
+    }
+    return total;
+}
+
+size_t ShardedCache::defragHits() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->defragHits();
+    }
+    return total;
+}
+
+size_t ShardedCache::defragMisses() const
+{
+    size_t total = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        total += shard.cache->defragMisses();
+    }
+    return total;
+}
+
+bool ShardedCache::defragRunning() const
+{
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        if (shard.cache->defragRunning())
+            return true;
+    }
+    return false;
+}
+
+SpillStore::Stats ShardedCache::tieredStats() const
+{
+    SpillStore::Stats total;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        SpillStore::Stats stats = shard.cache->spillStats();
+        total.keys += stats.keys;
+        total.segments += stats.segments;
+        total.disk_bytes += stats.disk_bytes;
+        total.live_bytes += stats.live_bytes;
+        total.index_bytes += stats.index_bytes;
+        total.spills += stats.spills;
+        total.reads += stats.reads;
+        total.relocated += stats.relocated;
+        total.collected += stats.collected;
+    }
+    return total;
+}
+
+bool ShardedCache::saveSnapshot()
+{
+    bool ok = true;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        uint64_t pos = shard.cache->aofPosition();
+        if (shard.cache->saveSnapshot())
+            shard.cache->snapshotTaken(pos);
+        else
+            ok = false;
+    }
+    return ok;
+}
+
+bool ShardedCache::writeSnapshot()
+{
+    bool ok = true;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        ok = shard.cache->saveSnapshot() && ok;
+    }
+    return ok;
+}
+
+void ShardedCache::snapshotTaken(const std::vector<uint64_t> &positions)
+{
+    // Like installAOFRewrite(): the writers have their own locks.
+    for (size_t i = 0; i < shards_.size(); ++i)
+        shards_[i].cache->snapshotTaken(positions[i]);
+}
+
+void ShardedCache::flushAOF()
+{
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        shard.cache->flushAOF();
+    }
+}
+
+std::vector<uint64_t> ShardedCache::aofPositions() const
+{
+    std::vector<uint64_t> positions;
+    positions.reserve(shards_.size());
+    for (auto &shard : shards_)
+        positions.push_back(shard.cache->aofPosition());
+    return positions;
+}
+
+uint64_t ShardedCache::aofSize() const
+{
+    // The writers keep their own counts; no shard lock needed.
+    uint64_t total = 0;
+    for (auto &shard : shards_)
+        total += shard.cache->aofSize();
+    return total;
+}
+
+bool ShardedCache::aofWriteError(std::string &err) const
+{
+    // Like aofSize(): the writers keep their own state.
+    for (auto &shard : shards_)
+    {
+        if (shard.cache->aofWriteError(err))
+            return true;
+    }
+    return false;
+}
+
+bool ShardedCache::rewriteAOF()
+{
+    bool ok = true;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        ok = ok && shard.cache->rewriteAOF();
+    }
+    return ok;
+}
+
+bool ShardedCache::installAOFRewrite(const std::vector<uint64_t> &positions)
+{
+    // Each shard's log is swapped on its own; a shard that fails keeps its
+    // complete old log, which is still correct.
+    bool ok = true;
+    for (size_t i = 0; i < shards_.size(); ++i)
+        ok = shards_[i].cache->installAOFRewrite(positions[i]) && ok;
+    return ok;
+}
+
+void ShardedCache::discardAOFRewrite()
+{
+    for (auto &shard : shards_)
+        shard.cache->discardAOFRewrite();
+}
+
+void ShardedCache::lockAll()
+{
+    for (auto &shard : shards_)
+        shard.mu.lock();
+}
+
+void ShardedCache::unlockAll()
+{
+    for (auto &shard : shards_)
+        shard.mu.unlock();
+}
+
+void ShardedCache::setReplicationBacklog(ReplicationBacklog *backlog)
+{
+    lockAll();
+    backlog_ = backlog;
+    for (auto &shard : shards_)
+        shard.cache->setReplicationBacklog(backlog);
+    unlockAll();
+}
+
+bool ShardedCache::writeSnapshotTo(const std::string &path)
+{
+    SnapshotWriter out(path, aes_key_);
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        if (!shard.cache->dumpTo(out))
+            return false;
+    }
+    return out.finish();
+}
+
+bool ShardedCache::replaceWithSnapshot(const std::string &path, std::string &err)
+{
+    lockAll();
+    for (auto &shard : shards_)
+        shard.cache->clear(true);
+    SnapshotLoad status = loadSnapshotFile(
+        path, aes_key_, 0,
+        [this](uint64_t records)
+        {
+            // Keys spread evenly over the shards, give or take; an eighth to
+            // spare keeps an unlucky shard from rehashing.
+            uint64_t per_shard = records / shards_.size() + records / (8 * shards_.size());
+            for (auto &shard : shards_)
+                shard.cache->reserve(static_cast<size_t>(std::min<uint64_t>(per_shard, shard.cache->capacity())));
+        },
+        [this](std::string_view key, std::string_view value, uint64_t expire_at)
+        { shardFor(key).cache->restore(key, value, expire_at); },
+        err);
+    bool ok = status == SnapshotLoad::Loaded;
+    if (status == SnapshotLoad::Missing || status == SnapshotLoad::NotBlocks)
+        err = "not a snapshot: " + path;
+    // What was loaded is the data now, complete or not; the old records in
+    // the AOFs no longer apply to it.
+    for (auto &shard : shards_)
+    {
+        uint64_t pos = shard.cache->aofPosition();
+        if (shard.cache->saveSnapshot())
+            shard.cache->snapshotTaken(pos);
+        else
+        {
+            err = "snapshot could not be written";
+            ok = false;
+        }
+    }
+    unlockAll();
+    return ok;
+}
@@ -0,0 +1,237 @@
+#include "slab.h"
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+namespace
+{
+    // Size of class i: 32..64 in steps of 8, then four steps per doubling
+    // up to MAX_CHUNK.
+    size_t classSize(size_t i) noexcept
+    {
+        if (i < 5)
+            return 32 + 8 * i;
+        size_t group = (i - 5) / 4;
+        size_t base = size_t(64) << group;
+        return base + (base / 4) * ((i - 5) % 4 + 1);
+    }
+}
+
+SlabAllocator::SlabAllocator()
+{
+    static_assert(sizeof(Page) <= HEADER_BYTES, "page header too large");
+    for (size_t i = 0; i < CLASSES; ++i)
+    {
+        classes_[i].size = static_cast<uint32_t>(classSize(i));
+        classes_[i].per_page = static_cast<uint32_t>((PAGE_BYTES - HEADER_BYTES) / classes_[i].size);
+    }
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    // Full pages are on no list; the owner frees every block first, so
+    // only partial pages whose blocks were never all freed could remain.
+    for (SizeClass &c : classes_)
+    {
+        while (c.partial)
+        {
+            Page *page = c.partial;
+            removePartial(c, page);
+            ::munmap(page, PAGE_BYTES);
+        }
+    }
+    if (spare_)
+        ::munmap(spare_, PAGE_BYTES);
+}
+
+size_t SlabAllocator::classOf(size_t n) noexcept
+{
+    if (n <= 32)
+        return 0;
+    if (n <= 64)
+        return (n - 32 + 7) / 8;
+    size_t group = static_cast<size_t>(63 - __builtin_clzll(n - 1)) - 6;
+    size_t base = size_t(64) << group;
+    size_t step = base / 4;
+    return 5 + 4 * group + (n - base + step - 1) / step - 1;
+}
+
+bool SlabAllocator::resize(size_t old_n, size_t new_n) noexcept
+{
+    if (old_n > MAX_CHUNK || new_n > MAX_CHUNK ? old_n != new_n : classOf(old_n) != classOf(new_n))
+        return false;
+    stats_.requested = stats_.requested - old_n + new_n;
+    return true;
+}
+
+char *SlabAllocator::allocate(size_t n)
+{
+    stats_.requested += n;
+    if (n > MAX_CHUNK)
+    {
+        stats_.large_bytes += n;
+        stats_.active += n;
+        return new char[n];
+    }
+
+    uint32_t cls = static_cast<uint32_t>(classOf(n));
+    SizeClass &c = classes_[cls];
+    Page *page = c.partial ? c.partial : newPage(cls);
+    char *base = reinterpret_cast<char *>(page);
+    char *p;
+    if (page->free_head)
+    {
+        p = base + page->free_head;
+        uint32_t next;
+        std::memcpy(&next, p, sizeof(next));
+        page->free_head = next;
+    }
+    else
+    {
+        p = base + HEADER_BYTES + size_t(page->bump) * c.size;
+        ++page->bump;
+    }
+    ++page->used;
+    ++c.used;
+    if (page->used == c.per_page)
+        removePartial(c, page);
+    return p;
+}
+
+void SlabAllocator::free(char *p, size_t n) noexcept
+{
+    stats_.requested -= n;
+    if (n > MAX_CHUNK)
+    {
+        stats_.large_bytes -= n;
+        stats_.active -= n;
+        delete[] p;
+        return;
+    }
+
+    Page *page = pageOf(p);
+    SizeClass &c = classes_[page->cls];
+    uint32_t offset = static_cast<uint32_t>(p - reinterpret_cast<char *>(page));
+    std::memcpy(p, &page->free_head, sizeof(page->free_head));
+    page->free_head = offset;
+    --page->used;
+    --c.used;
+    if (page->used == 0)
+    {
+        if (page->on_partial)
+            removePartial(c, page);
+        releasePage(page);
+        --c.pages;
+    }
+    else if (!page->on_partial)
+        pushPartial(c, page); // was full: nearly full pages are filled first
+}
+
+bool SlabAllocator::disown(char *, size_t n) noexcept
+{
+    if (n <= MAX_CHUNK)
+        return false;
+    stats_.requested -= n;
+    stats_.large_bytes -= n;
+    stats_.active -= n;
+    return true;
+}
+
+bool SlabAllocator::shouldMove(const char *p, size_t n) const noexcept
+{
+    if (n > MAX_CHUNK)
+        return false;
+    const Page *page = pageOf(p);
+    const SizeClass &c = classes_[page->cls];
+    // Blocks only move towards fuller pages, so a pass cannot shuffle them
+    // back and forth.
+    if (!c.partial || c.partial == page || c.partial->used <= page->used)
+        return false;
+    // used / per_page < c.used / (c.pages * per_page)
+    return size_t(page->used) * c.pages < c.used;
+}
+
+SlabAllocator::Stats SlabAllocator::stats() const noexcept
+{
+    Stats s = stats_;
+    for (const SizeClass &c : classes_)
+    {
+        size_t needed = (c.used + c.per_page - 1) / c.per_page;
+        s.reclaimable += (c.pages - needed) * PAGE_BYTES;
+    }
+    return s;
+}
+
+// Pages are mapped PAGE_BYTES-aligned: map twice the size and trim.
+SlabAllocator::Page *SlabAllocator::newPage(uint32_t cls)
+{
+    void *mem;
+    if (spare_)
+    {
+        mem = spare_;
+        spare_ = nullptr;
+    }
+    else
+    {
+        void *raw = ::mmap(nullptr, 2 * PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            throw std::bad_alloc();
+        uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = (start + PAGE_BYTES - 1) & ~uintptr_t(PAGE_BYTES - 1);
+        if (aligned > start)
+            ::munmap(raw, aligned - start);
+        if (aligned + PAGE_BYTES < start + 2 * PAGE_BYTES)
+            ::munmap(reinterpret_cast<void *>(aligned + PAGE_BYTES), start + PAGE_BYTES - aligned);
+        mem = reinterpret_cast<void *>(aligned);
+    }
+
+    Page *page = static_cast<Page *>(mem);
+    page->prev = page->next = nullptr;
+    page->cls = cls;
+    page->used = 0;
+    page->bump = 0;
+    page->free_head = 0;
+    page->on_partial = false;
+    SizeClass &c = classes_[cls];
+    pushPartial(c, page);
+    ++c.pages;
+    ++stats_.pages;
+    stats_.active += PAGE_BYTES;
+    return page;
+}
+
+void SlabAllocator::releasePage(Page *page) noexcept
+{
+    --stats_.pages;
+    stats_.active -= PAGE_BYTES;
+    if (!spare_)
+    {
+        // Keep the mapping but let the kernel drop its memory.
+        ::madvise(page, PAGE_BYTES, MADV_DONTNEED);
+        spare_ = page;
+        return;
+    }
+    ::munmap(page, PAGE_BYTES);
+}
+
+void SlabAllocator::pushPartial(SizeClass &c, Page *page) noexcept
+{
+    page->prev = nullptr;
+    page->next = c.partial;
+    if (c.partial)
+        c.partial->prev = page;
+    c.partial = page;
+    page->on_partial = true;
+}
+
+void SlabAllocator::removePartial(SizeClass &c, Page *page) noexcept
+{
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        c.partial = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+    page->prev = page->next = nullptr;
+    page->on_partial = false;
+}
@@ -0,0 +1,381 @@
+#include "snapshot.h"
+#include "byteorder.h"
+#include "crc32c.h"
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+    constexpr char MAGIC[8] = {'R', 'L', 'S', 'N', 'A', 'P', '\0', '\0'};
+    constexpr char TRAILER_MAGIC[8] = {'R', 'L', 'S', 'N', 'A', 'P', 'I', 'X'};
+    constexpr size_t HEADER_BYTES = 16;
+    constexpr size_t INDEX_ENTRY_BYTES = 20;
+    constexpr size_t TRAILER_BYTES = 32;
+    constexpr size_t IV_BYTES = 16;
+    constexpr uint32_t HAS_EXPIRY = 0x80000000u; // value_len flag, version 3
+
+    struct BlockRef
+    {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t records;
+        uint32_t crc;
+    };
+
+    bool decodeBlock(const RecordCipher &cipher, const unsigned char *base, const BlockRef &ref,
+                     std::string &plain)
+    {
+        const unsigned char *p = base + ref.offset;
+        if (crc32c(0, p, ref.length) != ref.crc || ref.length < RecordCipher::OVERHEAD)
+            return false;
+        plain.resize(ref.length - RecordCipher::OVERHEAD);
+        return cipher.open({}, {reinterpret_cast<const char *>(p), ref.length}, &plain[0]);
+    }
+
+    // Version 1 blocks: iv[16] then AES-128-CBC.
+    bool decodeCbcBlock(EVP_CIPHER_CTX *ctx, const unsigned char *base, const BlockRef &ref,
+                        std::string_view key, std::string &plain)
+    {
+        const unsigned char *p = base + ref.offset;
+        if (ref.length < IV_BYTES + 16 || (ref.length - IV_BYTES) % 16 != 0)
+            return false;
+        if (crc32c(0, p, ref.length) != ref.crc)
+            return false;
+
+        plain.resize(ref.length - IV_BYTES + 16);
+        unsigned char *out = reinterpret_cast<unsigned char *>(&plain[0]);
+        int len1 = 0, len2 = 0;
+        if (EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), nullptr,
+                               reinterpret_cast<const unsigned char *>(key.data()), p) != 1 ||
+            EVP_DecryptUpdate(ctx, out, &len1, p + IV_BYTES, static_cast<int>(ref.length - IV_BYTES)) != 1 ||
+            EVP_DecryptFinal_ex(ctx, out + len1, &len2) != 1)
+            return false;
+        plain.resize(static_cast<size_t>(len1 + len2));
+        return true;
+    }
+}
+
+// -------------------- Writer --------------------
+SnapshotWriter::SnapshotWriter(const std::string &path, std::string_view aes_key)
+    : path_(path), tmp_path_(path + ".tmp"), cipher_(aes_key)
+{
+    fd_ = ::open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ok_ = fd_ >= 0;
+    if (ok_)
+    {
+        io_ = IoEngine::create();
+        writer_ = std::make_unique<IoWriter>(*io_, fd_);
+    }
+    block_.reserve(SNAPSHOT_BLOCK_BYTES + 64);
+
+    std::string header(MAGIC, sizeof(MAGIC));
+    appendU32(header, SNAPSHOT_VERSION);
+    appendU32(header, 0);
+    ok_ = ok_ && writeAll(header);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (fd_ >= 0)
+    {
+        // finish() was not reached or failed.
+        writer_.reset();
+        ::close(fd_);
+        ::unlink(tmp_path_.c_str());
+    }
+}
+
+bool SnapshotWriter::add(std::string_view key, std::string_view value, uint64_t expire_at)
+{
+    if (!ok_)
+        return false;
+    appendU32(block_, static_cast<uint32_t>(key.size()));
+    appendU32(block_, static_cast<uint32_t>(value.size()) | (expire_at ? HAS_EXPIRY : 0));
+    block_.append(key);
+    block_.append(value);
+    if (expire_at)
+        appendU64(block_, expire_at);
+    ++block_records_;
+    ++records_;
+    if (block_.size() >= SNAPSHOT_BLOCK_BYTES)
+        return flushBlock();
+    return true;
+}
+
+bool SnapshotWriter::flushBlock()
+{
+    if (!ok_ || block_records_ == 0)
+        return ok_;
+
+    out_.resize(RecordCipher::sealedSize(block_.size()));
+    if (cipher_.seal({}, {block_}, &out_[0]) != out_.size())
+    {
+        ok_ = false;
+        return false;
+    }
+
+    uint32_t length = static_cast<uint32_t>(out_.size());
+    index_.push_back({offset_, length, block_records_, crc32c(0, out_.data(), out_.size())});
+    block_.clear();
+    block_records_ = 0;
+    return writeAll(out_);
+}
+
+bool SnapshotWriter::finish()
+{
+    if (!flushBlock())
+        return false;
+
+    std::string tail;
+    tail.reserve(index_.size() * INDEX_ENTRY_BYTES + TRAILER_BYTES);
+    for (const IndexEntry &e : index_)
+    {
+        appendU64(tail, e.offset);
+        appendU32(tail, e.length);
+        appendU32(tail, e.records);
+        appendU32(tail, e.crc);
+    }
+    uint64_t index_offset = offset_;
+    uint32_t index_crc = crc32c(0, tail.data(), tail.size());
+    appendU64(tail, index_offset);
+    appendU32(tail, static_cast<uint32_t>(index_.size()));
+    appendU32(tail, index_crc);
+    appendU64(tail, records_);
+    tail.append(TRAILER_MAGIC, sizeof(TRAILER_MAGIC));
+
+    ok_ = writeAll(tail) && writer_->finish(true);
+    writer_.reset();
+    ok_ = ::close(fd_) == 0 && ok_;
+    fd_ = -1;
+    if (ok_ && ::rename(tmp_path_.c_str(), path_.c_str()) == 0)
+        return true;
+    ::unlink(tmp_path_.c_str());
+    ok_ = false;
+    return false;
+}
+
+bool SnapshotWriter::writeAll(const std::string &data)
+{
+    if (!writer_->append(data))
+    {
+        ok_ = false;
+        return false;
+    }
+    offset_ += data.size();
+    return true;
+}
+
+// -------------------- Loader --------------------
+SnapshotLoad loadSnapshotFile(const std::string &path, std::string_view aes_key, unsigned threads,
+                              const std::function<void(uint64_t)> &reserve,
+                              const std::function<void(std::string_view, std::string_view, uint64_t)> &apply,
+                              std::string &err)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return SnapshotLoad::Missing;
+        err = "open " + path + ": " + strerror(errno);
+        return SnapshotLoad::Corrupt;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(MAGIC))
+    {
+        ::close(fd);
+        return SnapshotLoad::NotBlocks;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void *map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        err = "mmap " + path + ": " + strerror(errno);
+        return SnapshotLoad::Corrupt;
+    }
+    const unsigned char *base = static_cast<const unsigned char *>(map);
+    // Every block is needed, by workers spread over the file: have it all
+    // read in ahead of them.
+    ::madvise(map, size, MADV_WILLNEED);
+    auto fail = [&](const std::string &why)
+    {
+        err = path + ": " + why;
+        ::munmap(map, size);
+        return SnapshotLoad::Corrupt;
+    };
+
+    if (std::memcmp(base, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        ::munmap(map, size);
+        return SnapshotLoad::NotBlocks;
+    }
+    if (size < HEADER_BYTES + TRAILER_BYTES)
+        return fail("truncated");
+    uint32_t version = loadU32(base + 8);
+    if (version < 1 || version > SNAPSHOT_VERSION)
+        return fail("unsupported snapshot version " + std::to_string(version));
+    std::unique_ptr<RecordCipher> cipher;
+    try
+    {
+        cipher = std::make_unique<RecordCipher>(aes_key);
+    }
+    catch (const std::exception &e)
+    {
+        return fail(e.what());
+    }
+
+    // Trailer and block index
+    const unsigned char *trailer = base + size - TRAILER_BYTES;
+    if (std::memcmp(trailer + 24, TRAILER_MAGIC, sizeof(TRAILER_MAGIC)) != 0)
+        return fail("missing block index (incomplete write?)");
+    uint64_t index_offset = loadU64(trailer);
+    uint32_t blocks = loadU32(trailer + 8);
+    uint32_t index_crc = loadU32(trailer + 12);
+    uint64_t records = loadU64(trailer + 16);
+    if (index_offset < HEADER_BYTES || index_offset + uint64_t(blocks) * INDEX_ENTRY_BYTES != size - TRAILER_BYTES)
+        return fail("bad block index bounds");
+    if (crc32c(0, base + index_offset, size_t(blocks) * INDEX_ENTRY_BYTES) != index_crc)
+        return fail("block index checksum mismatch");
+
+    std::vector<BlockRef> index(blocks);
+    uint64_t counted = 0;
+    for (uint32_t i = 0; i < blocks; ++i)
+    {
+        const unsigned char *e = base + index_offset + size_t(i) * INDEX_ENTRY_BYTES;
+        index[i] = {loadU64(e), loadU32(e + 8), loadU32(e + 12), loadU32(e + 16)};
+        if (index[i].offset < HEADER_BYTES || index[i].offset + index[i].length > index_offset)
+            return fail("block " + std::to_string(i) + " out of bounds");
+        counted += index[i].records;
+    }
+    if (counted != records)
+        return fail("record count mismatch");
+
+    ::madvise(map, size, MADV_WILLNEED);
+    reserve(records);
+
+    // Workers decrypt blocks ahead of the applying thread, at most `window`
+    // blocks ahead, so the decrypted copy never holds more than a few blocks.
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<unsigned>(threads, std::max<uint32_t>(blocks, 1));
+    const size_t window = size_t(threads) * 2;
+
+    struct Decoded
+    {
+        std::string plain;
+        bool ready = false;
+        bool ok = false;
+    };
+    std::vector<Decoded> decoded(blocks);
+    std::mutex mu;
+    std::condition_variable cv;
+    size_t next = 0;
+    size_t applied = 0;
+    bool stop = false;
+
+    auto worker = [&]
+    {
+        EVP_CIPHER_CTX *ctx = version == 1 ? EVP_CIPHER_CTX_new() : nullptr;
+        while (true)
+        {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                cv.wait(lock, [&]
+                        { return stop || next >= blocks || next < applied + window; });
+                if (stop || next >= blocks)
+                    break;
+                i = next++;
+            }
+            std::string plain;
+            bool ok = version == 1 ? ctx && decodeCbcBlock(ctx, base, index[i], aes_key, plain)
+                                   : decodeBlock(*cipher, base, index[i], plain);
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                decoded[i].plain.swap(plain);
+                decoded[i].ok = ok;
+                decoded[i].ready = true;
+            }
+            cv.notify_all();
+        }
+        EVP_CIPHER_CTX_free(ctx);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads && blocks > 0; ++t)
+        pool.emplace_back(worker);
+
+    SnapshotLoad status = SnapshotLoad::Loaded;
+    for (uint32_t i = 0; i < blocks && status == SnapshotLoad::Loaded; ++i)
+    {
+        std::string plain;
+        bool ok;
+        {
+            std::unique_lock<std::mutex> lock(mu);
+            cv.wait(lock, [&]
+                    { return decoded[i].ready; });
+            plain.swap(decoded[i].plain);
+            ok = decoded[i].ok;
+        }
+        if (!ok)
+        {
+            err = path + ": block " + std::to_string(i) + " failed its checksum or did not decrypt";
+            status = SnapshotLoad::Corrupt;
+            break;
+        }
+
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(plain.data());
+        const unsigned char *end = p + plain.size();
+        uint32_t n = 0;
+        while (end - p >= 8)
+        {
+            uint32_t klen = loadU32(p);
+            uint32_t vlen = loadU32(p + 4);
+            size_t at_len = 0;
+            if (version >= 3 && (vlen & HAS_EXPIRY))
+            {
+                vlen &= ~HAS_EXPIRY;
+                at_len = 8;
+            }
+            p += 8;
+            if (uint64_t(klen) + vlen + at_len > uint64_t(end - p))
+                break;
+            uint64_t expire_at = at_len ? loadU64(p + klen + vlen) : 0;
+            apply({reinterpret_cast<const char *>(p), klen}, {reinterpret_cast<const char *>(p) + klen, vlen},
+                  expire_at);
+            p += klen + vlen + at_len;
+            ++n;
+        }
+        if (p != end || n != index[i].records)
+        {
+            err = path + ": block " + std::to_string(i) + " is malformed";
+            status = SnapshotLoad::Corrupt;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            ++applied;
+        }
+        cv.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto &t : pool)
+        t.join();
+    ::munmap(map, size);
+    return status;
+}
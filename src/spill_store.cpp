@@ -0,0 +1,446 @@
+#include "spill_store.h"
+#include "byteorder.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace
+{
+    constexpr size_t FIELD_BYTES = 16; // u32 klen, u32 vlen, u64 expire_at
+
+    bool preadAll(int fd, char *buf, size_t len, uint64_t offset)
+    {
+        while (len > 0)
+        {
+            ssize_t n = ::pread(fd, buf, len, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            buf += n;
+            len -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+        return true;
+    }
+
+    bool pwriteAll(int fd, const char *buf, size_t len, uint64_t offset)
+    {
+        while (len > 0)
+        {
+            ssize_t n = ::pwrite(fd, buf, len, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            buf += n;
+            len -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+        return true;
+    }
+}
+
+SpillStore::SpillStore(const std::string &dir, const std::string &aes_key) : dir_(dir), cipher_(aes_key)
+{
+    // Whatever an earlier run left behind is also in its snapshot and AOF.
+    std::error_code ec;
+    std::filesystem::remove_all(dir_, ec);
+    if (!ec)
+        std::filesystem::create_directories(dir_, ec);
+    if (ec)
+        throw std::runtime_error("spill directory " + dir_ + ": " + ec.message());
+}
+
+SpillStore::~SpillStore()
+{
+    for (Segment &seg : segments_)
+    {
+        if (seg.fd >= 0)
+            ::close(seg.fd);
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(dir_, ec);
+}
+
+// -------------------- Public API --------------------
+bool SpillStore::put(std::string_view key, std::string_view value, uint64_t expire_at)
+{
+    uint64_t hash = hashKey(key);
+    char fields[FIELD_BYTES];
+    storeU32(fields, static_cast<uint32_t>(key.size()));
+    storeU32(fields + 4, static_cast<uint32_t>(value.size()));
+    storeU64(fields + 8, expire_at);
+    size_t sealed = RecordCipher::sealedSize(FIELD_BYTES + key.size() + value.size());
+
+    // Reuses write_buf_'s capacity: no allocation once it has grown.
+    write_buf_.resize(HEADER_BYTES + sealed);
+    storeU64(&write_buf_[0], hash);
+    storeU32(&write_buf_[8], static_cast<uint32_t>(sealed));
+    if (cipher_.seal({write_buf_.data(), 8}, {{fields, sizeof(fields)}, key, value}, &write_buf_[HEADER_BYTES]) == 0)
+        return false;
+
+    uint32_t segment, offset;
+    if (!appendRecord(write_buf_, segment, offset))
+        return false;
+    uint32_t length = static_cast<uint32_t>(write_buf_.size());
+    insertEntry(Entry{hash, segment, offset, length});
+    segments_[segment].live += length;
+    ++count_;
+    ++stats_.spills;
+    return true;
+}
+
+bool SpillStore::take(std::string_view key, std::string_view &value, uint64_t &expire_at)
+{
+    size_t pos = find(key, hashKey(key));
+    if (pos == SIZE_MAX)
+        return false;
+    // find() left the record's plaintext in plain_; keep it out of the way
+    // of later lookups.
+    taken_.swap(plain_);
+    uint32_t klen = loadU32(taken_.data());
+    uint32_t vlen = loadU32(taken_.data() + 4);
+    expire_at = loadU64(taken_.data() + 8);
+    value = std::string_view(taken_.data() + FIELD_BYTES + klen, vlen);
+    removeEntry(pos);
+    ++stats_.reads;
+    return true;
+}
+
+bool SpillStore::erase(std::string_view key)
+{
+    size_t pos = find(key, hashKey(key));
+    if (pos == SIZE_MAX)
+        return false;
+    removeEntry(pos);
+    return true;
+}
+
+void SpillStore::clear() noexcept
+{
+    for (uint32_t id = 0; id < segments_.size(); ++id)
+    {
+        if (segments_[id].fd < 0)
+            continue;
+        ::close(segments_[id].fd);
+        ::unlink(segmentPath(id).c_str());
+    }
+    segments_.clear();
+    active_ = NONE;
+    index_.clear();
+    count_ = 0;
+    gc_segment_ = NONE;
+    gc_offset_ = 0;
+}
+
+bool SpillStore::forEach(const std::function<bool(std::string_view, std::string_view, uint64_t)> &f)
+{
+    std::string record;
+    std::string plain;
+    for (uint32_t id = 0; id < segments_.size(); ++id)
+    {
+        const Segment &seg = segments_[id];
+        if (seg.fd < 0 || seg.live == 0)
+            continue;
+        for (uint64_t offset = 0; offset < seg.size;)
+        {
+            char header[HEADER_BYTES];
+            if (!preadAll(seg.fd, header, sizeof(header), offset))
+                return false;
+            uint64_t hash = loadU64(header);
+            uint32_t length = static_cast<uint32_t>(HEADER_BYTES + loadU32(header + 8));
+            size_t pos = findLocation(hash, id, offset);
+            if (pos != SIZE_MAX)
+            {
+                if (!readRecord(id, offset, length, record) || !openRecord(hash, record, plain))
+                    return false;
+                uint32_t klen = loadU32(plain.data());
+                uint32_t vlen = loadU32(plain.data() + 4);
+                if (!f({plain.data() + FIELD_BYTES, klen}, {plain.data() + FIELD_BYTES + klen, vlen},
+                       loadU64(plain.data() + 8)))
+                    return false;
+            }
+            offset += length;
+        }
+    }
+    return true;
+}
+
+// Copies the victim's live records, in file order, to the end of the log.
+// Dead records are recognised by the index no longer pointing at them.
+size_t SpillStore::collect(std::chrono::steady_clock::time_point until, bool &done)
+{
+    size_t moved = 0;
+    done = false;
+    for (size_t n = 1;; ++n)
+    {
+        if (gc_segment_ == NONE)
+        {
+            gc_segment_ = pickVictim();
+            gc_offset_ = 0;
+            if (gc_segment_ == NONE)
+            {
+                done = true;
+                return moved;
+            }
+        }
+        if ((n & 15) == 0 && std::chrono::steady_clock::now() >= until)
+            return moved;
+
+        uint32_t victim = gc_segment_;
+        if (segments_[victim].live == 0 || gc_offset_ >= segments_[victim].size)
+        {
+            dropSegment(victim);
+            continue;
+        }
+        char header[HEADER_BYTES];
+        if (!preadAll(segments_[victim].fd, header, sizeof(header), gc_offset_))
+        {
+            std::cerr << "[Tiered] could not read " << segmentPath(victim) << ": " << strerror(errno) << "\n";
+            gc_segment_ = NONE;
+            done = true;
+            return moved;
+        }
+        uint64_t hash = loadU64(header);
+        uint32_t length = static_cast<uint32_t>(HEADER_BYTES + loadU32(header + 8));
+        size_t pos = findLocation(hash, victim, gc_offset_);
+        if (pos != SIZE_MAX)
+        {
+            // The sealed bytes do not depend on where they sit: copy as is.
+            uint32_t segment, offset;
+            if (!readRecord(victim, gc_offset_, length, read_buf_) || !appendRecord(read_buf_, segment, offset))
+            {
+                gc_segment_ = NONE;
+                done = true;
+                return moved;
+            }
+            index_[pos].segment = segment;
+            index_[pos].offset = offset;
+            segments_[segment].live += length;
+            segments_[victim].live -= length;
+            ++stats_.relocated;
+            ++moved;
+        }
+        gc_offset_ += length;
+    }
+}
+
+SpillStore::Stats SpillStore::stats() const noexcept
+{
+    Stats s = stats_;
+    s.keys = count_;
+    s.index_bytes = memoryUsage();
+    for (const Segment &seg : segments_)
+    {
+        if (seg.fd < 0)
+            continue;
+        ++s.segments;
+        s.disk_bytes += seg.size;
+        s.live_bytes += seg.live;
+    }
+    return s;
+}
+
+// -------------------- Segments --------------------
+uint64_t SpillStore::hashKey(std::string_view key) noexcept
+{
+    uint64_t h = std::hash<std::string_view>{}(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+std::string SpillStore::segmentPath(uint32_t id) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "segment-%06u.log", id);
+    return dir_ + "/" + name;
+}
+
+// Starts a new segment. The old active one is deleted if nothing in it is
+// live any more.
+bool SpillStore::roll()
+{
+    uint32_t id = static_cast<uint32_t>(segments_.size());
+    std::string path = segmentPath(id);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "[Tiered] could not create " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    segments_.push_back(Segment{fd, 0, 0});
+    uint32_t old = active_;
+    active_ = id;
+    if (old != NONE && segments_[old].live == 0)
+        dropSegment(old);
+    return true;
+}
+
+bool SpillStore::appendRecord(std::string_view record, uint32_t &segment, uint32_t &offset)
+{
+    if (active_ == NONE ||
+        (segments_[active_].size > 0 && segments_[active_].size + record.size() > SEGMENT_BYTES))
+    {
+        if (!roll())
+            return false;
+    }
+    Segment &seg = segments_[active_];
+    if (!pwriteAll(seg.fd, record.data(), record.size(), seg.size))
+    {
+        std::cerr << "[Tiered] write to " << segmentPath(active_) << " failed: " << strerror(errno) << "\n";
+        return false;
+    }
+    segment = active_;
+    offset = static_cast<uint32_t>(seg.size);
+    seg.size += record.size();
+    return true;
+}
+
+bool SpillStore::readRecord(uint32_t segment, uint64_t offset, uint32_t length, std::string &out)
+{
+    out.resize(length);
+    if (!preadAll(segments_[segment].fd, &out[0], length, offset))
+    {
+        std::cerr << "[Tiered] could not read " << segmentPath(segment) << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool SpillStore::openRecord(uint64_t hash, std::string_view record, std::string &plain)
+{
+    uint32_t sealed = loadU32(record.data() + 8);
+    if (loadU64(record.data()) != hash || HEADER_BYTES + uint64_t(sealed) != record.size() ||
+        sealed < RecordCipher::OVERHEAD + FIELD_BYTES)
+        return false;
+    plain.resize(sealed - RecordCipher::OVERHEAD);
+    if (!cipher_.open({record.data(), 8}, {record.data() + HEADER_BYTES, sealed}, &plain[0]))
+    {
+        std::cerr << "[Tiered] record in " << dir_ << " failed authentication\n";
+        return false;
+    }
+    return FIELD_BYTES + uint64_t(loadU32(plain.data())) + loadU32(plain.data() + 4) == plain.size();
+}
+
+// -------------------- Index --------------------
+// Every entry with the key's hash is a candidate; its record decides. On a
+// match, plain_ holds the record's plaintext.
+size_t SpillStore::find(std::string_view key, uint64_t hash)
+{
+    if (index_.empty())
+        return SIZE_MAX;
+    size_t mask = index_.size() - 1;
+    for (size_t pos = hash & mask;; pos = (pos + 1) & mask)
+    {
+        const Entry &e = index_[pos];
+        if (e.length == 0)
+            return SIZE_MAX;
+        if (e.hash != hash)
+            continue;
+        if (readRecord(e.segment, e.offset, e.length, read_buf_) && openRecord(hash, read_buf_, plain_) &&
+            std::string_view(plain_.data() + FIELD_BYTES, loadU32(plain_.data())) == key)
+            return pos;
+    }
+}
+
+size_t SpillStore::findLocation(uint64_t hash, uint32_t segment, uint64_t offset) const noexcept
+{
+    if (index_.empty())
+        return SIZE_MAX;
+    size_t mask = index_.size() - 1;
+    for (size_t pos = hash & mask;; pos = (pos + 1) & mask)
+    {
+        const Entry &e = index_[pos];
+        if (e.length == 0)
+            return SIZE_MAX;
+        if (e.hash == hash && e.segment == segment && e.offset == offset)
+            return pos;
+    }
+}
+
+void SpillStore::insertEntry(const Entry &entry)
+{
+    // Keep the load factor at or below 3/4 so probe sequences stay short.
+    if ((count_ + 1) * 4 > index_.size() * 3)
+        growIndex();
+    size_t mask = index_.size() - 1;
+    size_t pos = entry.hash & mask;
+    while (index_[pos].length != 0)
+        pos = (pos + 1) & mask;
+    index_[pos] = entry;
+}
+
+// Backward-shift deletion, as in LRUCache's index.
+void SpillStore::removeEntry(size_t pos) noexcept
+{
+    uint32_t segment = index_[pos].segment;
+    segments_[segment].live -= index_[pos].length;
+    size_t mask = index_.size() - 1;
+    size_t hole = pos;
+    for (size_t next = (hole + 1) & mask; index_[next].length != 0; next = (next + 1) & mask)
+    {
+        size_t home = index_[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            index_[hole] = index_[next];
+            hole = next;
+        }
+    }
+    index_[hole].length = 0;
+    --count_;
+    if (segments_[segment].live == 0 && segment != active_)
+        dropSegment(segment);
+}
+
+void SpillStore::growIndex()
+{
+    std::vector<Entry> old;
+    old.swap(index_);
+    index_.assign(old.empty() ? 16 : old.size() * 2, Entry{0, 0, 0, 0});
+    size_t mask = index_.size() - 1;
+    for (const Entry &e : old)
+    {
+        if (e.length == 0)
+            continue;
+        size_t pos = e.hash & mask;
+        while (index_[pos].length != 0)
+            pos = (pos + 1) & mask;
+        index_[pos] = e;
+    }
+}
+
+void SpillStore::dropSegment(uint32_t id) noexcept
+{
+    Segment &seg = segments_[id];
+    if (seg.fd < 0)
+        return;
+    ::close(seg.fd);
+    ::unlink(segmentPath(id).c_str());
+    seg = Segment{};
+    ++stats_.collected;
+    if (gc_segment_ == id)
+        gc_segment_ = NONE;
+}
+
+// The sealed segment with the smallest live share, if below GC_LIVE_PERCENT.
+uint32_t SpillStore::pickVictim() const noexcept
+{
+    uint32_t best = NONE;
+    for (uint32_t id = 0; id < segments_.size(); ++id)
+    {
+        const Segment &seg = segments_[id];
+        if (id == active_ || seg.fd < 0 || seg.live * 100 >= seg.size * GC_LIVE_PERCENT)
+            continue;
+        if (best == NONE || seg.live * segments_[best].size < segments_[best].live * seg.size)
+            best = id;
+    }
+    return best;
+}
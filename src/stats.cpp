@@ -0,0 +1,137 @@
+#include "stats.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <unistd.h>
+
+// -------------------- HistogramTotals --------------------
+void HistogramTotals::add(const LatencyHistogram &h) noexcept
+{
+    for (size_t i = 0; i < counts_.size(); ++i)
+        counts_[i] += h.bucket(i);
+    count_ += h.count();
+    sum_ += h.sum();
+}
+
+uint64_t HistogramTotals::percentile(double p) const noexcept
+{
+    // Bucket counts and count_ are loaded at slightly different moments, so
+    // go by the buckets themselves.
+    uint64_t total = 0;
+    for (uint64_t c : counts_)
+        total += c;
+    if (total == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100.0 * static_cast<double>(total)));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i)
+    {
+        seen += counts_[i];
+        if (seen >= rank)
+            return LatencyHistogram::bucketLimit(i);
+    }
+    return max();
+}
+
+uint64_t HistogramTotals::max() const noexcept
+{
+    for (size_t i = counts_.size(); i-- > 0;)
+    {
+        if (counts_[i])
+            return LatencyHistogram::bucketLimit(i);
+    }
+    return 0;
+}
+
+// -------------------- LatencyMonitor --------------------
+void LatencyMonitor::add(const char *event, uint64_t ms)
+{
+    time_t now = std::time(nullptr);
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = std::find_if(series_.begin(), series_.end(), [&](const Series &s)
+                           { return s.event.name == event; });
+    if (it == series_.end())
+    {
+        series_.push_back(Series{Event{event, {now, ms}, ms}, {}, 0});
+        it = series_.end() - 1;
+        it->samples.reserve(HISTORY);
+    }
+
+    Series &s = *it;
+    s.event.latest = {now, ms};
+    s.event.max_ms = std::max(s.event.max_ms, ms);
+
+    // One sample per second: keep the worst.
+    size_t last = (s.next + HISTORY - 1) % HISTORY;
+    if (!s.samples.empty() && s.samples[last].time == now)
+    {
+        s.samples[last].ms = std::max(s.samples[last].ms, ms);
+        return;
+    }
+    if (s.samples.size() < HISTORY)
+        s.samples.push_back({now, ms});
+    else
+        s.samples[s.next] = {now, ms};
+    s.next = (s.next + 1) % HISTORY;
+}
+
+std::vector<LatencyMonitor::Event> LatencyMonitor::latest() const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    std::vector<Event> out;
+    out.reserve(series_.size());
+    for (const Series &s : series_)
+        out.push_back(s.event);
+    return out;
+}
+
+std::vector<LatencyMonitor::Sample> LatencyMonitor::history(std::string_view event) const
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    std::vector<Sample> out;
+    for (const Series &s : series_)
+    {
+        if (s.event.name != event)
+            continue;
+        // Oldest first.
+        size_t n = s.samples.size();
+        size_t start = n < HISTORY ? 0 : s.next;
+        for (size_t i = 0; i < n; ++i)
+            out.push_back(s.samples[(start + i) % n]);
+    }
+    return out;
+}
+
+size_t LatencyMonitor::reset(const std::vector<std::string_view> &events)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    size_t before = series_.size();
+    if (events.empty())
+        series_.clear();
+    else
+    {
+        series_.erase(std::remove_if(series_.begin(), series_.end(), [&](const Series &s)
+                                     { return std::find(events.begin(), events.end(), s.event.name) != events.end(); }),
+                      series_.end());
+    }
+    return before - series_.size();
+}
+
+LatencyMonitor &latencyMonitor()
+{
+    static LatencyMonitor monitor;
+    return monitor;
+}
+
+// -------------------- Memory --------------------
+size_t residentMemory()
+{
+    FILE *f = std::fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    unsigned long size = 0, resident = 0;
+    int n = std::fscanf(f, "%lu %lu", &size, &resident);
+    std::fclose(f);
+    return n == 2 ? resident * static_cast<size_t>(::sysconf(_SC_PAGESIZE)) : 0;
+}
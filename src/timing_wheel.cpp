@@ -0,0 +1,129 @@
+#include "timing_wheel.h"
+#include <algorithm>
+
+TimingWheel::TimingWheel(uint64_t now_ms) : current_(now_ms)
+{
+    std::fill(std::begin(heads_), std::end(heads_), NONE);
+}
+
+void TimingWheel::schedule(uint32_t id, uint64_t deadline_ms)
+{
+    if (id >= nodes_.size())
+        nodes_.resize(static_cast<size_t>(id) + 1);
+    if (nodes_[id].bucket != UNLINKED)
+        unlink(id);
+    else
+        ++size_;
+    nodes_[id].deadline = deadline_ms;
+    place(id);
+}
+
+void TimingWheel::cancel(uint32_t id) noexcept
+{
+    if (!scheduled(id))
+        return;
+    unlink(id);
+    --size_;
+}
+
+uint32_t TimingWheel::popDue(uint64_t now_ms) noexcept
+{
+    while (true)
+    {
+        uint32_t bucket = static_cast<uint32_t>(current_ & (SLOTS - 1));
+        uint32_t id = heads_[bucket];
+        if (id != NONE)
+        {
+            unlink(id);
+            --size_;
+            return id;
+        }
+        if (current_ >= now_ms)
+            return NONE;
+
+        // With levels 0..k-1 empty nothing is due before level k next
+        // turns: its timers all lie past the current 64^k ms block.
+        int level = 0;
+        while (level < LEVELS && occupied_[level] == 0)
+            ++level;
+        uint64_t next = current_ + 1;
+        if (level == LEVELS)
+            next = now_ms;
+        else if (level > 0)
+            next = (current_ | ((uint64_t(1) << (SLOT_BITS * level)) - 1)) + 1;
+        if (next > now_ms)
+        {
+            current_ = now_ms;
+            return NONE;
+        }
+        enterTick(next);
+    }
+}
+
+// Picks the level whose span covers the time left, and within it the slot
+// the deadline falls in.
+void TimingWheel::place(uint32_t id) noexcept
+{
+    uint64_t d = std::max(nodes_[id].deadline, current_);
+    uint64_t diff = d - current_;
+    int level = 0;
+    while (level < LEVELS - 1 && diff >= (uint64_t(1) << (SLOT_BITS * (level + 1))))
+        ++level;
+    uint64_t span = uint64_t(1) << (SLOT_BITS * LEVELS);
+    if (diff >= span)
+        d = current_ + span - 1; // re-placed with its real deadline when the top level turns
+    uint32_t slot = static_cast<uint32_t>((d >> (SLOT_BITS * level)) & (SLOTS - 1));
+    link(id, static_cast<uint32_t>(level) * SLOTS + slot);
+}
+
+void TimingWheel::link(uint32_t id, uint32_t bucket) noexcept
+{
+    Node &n = nodes_[id];
+    n.bucket = bucket;
+    n.prev = NONE;
+    n.next = heads_[bucket];
+    if (n.next != NONE)
+        nodes_[n.next].prev = id;
+    heads_[bucket] = id;
+    occupied_[bucket / SLOTS] |= uint64_t(1) << (bucket % SLOTS);
+}
+
+void TimingWheel::unlink(uint32_t id) noexcept
+{
+    Node &n = nodes_[id];
+    if (n.prev != NONE)
+        nodes_[n.prev].next = n.next;
+    else
+        heads_[n.bucket] = n.next;
+    if (n.next != NONE)
+        nodes_[n.next].prev = n.prev;
+    if (heads_[n.bucket] == NONE)
+        occupied_[n.bucket / SLOTS] &= ~(uint64_t(1) << (n.bucket % SLOTS));
+    n.bucket = UNLINKED;
+}
+
+// Moves to `tick`; when it starts a new block at some level, the matching
+// slots of the levels above are spread over the levels below.
+void TimingWheel::enterTick(uint64_t tick) noexcept
+{
+    current_ = tick;
+    for (int level = 1; level < LEVELS; ++level)
+    {
+        if (tick & ((uint64_t(1) << (SLOT_BITS * level)) - 1))
+            break;
+        cascade(level, static_cast<uint32_t>((tick >> (SLOT_BITS * level)) & (SLOTS - 1)));
+    }
+}
+
+void TimingWheel::cascade(int level, uint32_t slot) noexcept
+{
+    uint32_t bucket = static_cast<uint32_t>(level) * SLOTS + slot;
+    uint32_t id = heads_[bucket];
+    while (id != NONE)
+    {
+        uint32_t next = nodes_[id].next;
+        unlink(id);
+        place(id);
+        id = next;
+    }
+}
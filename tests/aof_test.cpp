@@ -0,0 +1,301 @@
+// AOF persistence checks, run by ctest. Each case works in a fresh
+// temporary directory and reports what failed on stderr.
+#include "aof.h"
+#include "cache.h"
+#include "crypto.h"
+#include "io_engine.h"
+#include "test.h"
+#include <fcntl.h>
+#include <set>
+#include <stdexcept>
+#include <sys/wait.h>
+#include <vector>
+
+namespace
+{
+    // The descriptor this process has `path` open on, or -1.
+    int findFd(const std::string &path)
+    {
+        for (const auto &entry : std::filesystem::directory_iterator("/proc/self/fd"))
+        {
+            std::error_code ec;
+            if (std::filesystem::read_symlink(entry.path(), ec) == path)
+                return std::stoi(entry.path().filename().string());
+        }
+        return -1;
+    }
+
+    // The rewrite is sealed in a forked child while the parent keeps
+    // logging: no nonce may show up twice in the installed log.
+    bool rewriteNoncesAreUnique(const std::string &dir)
+    {
+        std::string aof = dir + "/aof.log";
+        {
+            LRUCache cache(0, dir + "/snapshot.rdb", aof);
+            for (int i = 0; i < 3; ++i)
+                CHECK(cache.set("k" + std::to_string(i), "v"));
+            cache.flushAOF();
+            uint64_t pos = cache.aofPosition();
+
+            pid_t pid = ::fork();
+            CHECK(pid >= 0);
+            if (pid == 0)
+                ::_exit(cache.rewriteAOF() ? 0 : 1);
+            CHECK(cache.set("after1", "v"));
+            CHECK(cache.set("after2", "v"));
+            int status = 0;
+            CHECK(::waitpid(pid, &status, 0) == pid);
+            CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            CHECK(cache.installAOFRewrite(pos));
+            cache.flushAOF();
+        }
+
+        AofReader reader(aof);
+        std::set<std::string> nonces;
+        size_t records = 0;
+        char op;
+        std::string_view sealed;
+        while (reader.next(op, sealed))
+        {
+            CHECK(sealed.size() >= RecordCipher::NONCE_BYTES);
+            CHECK(nonces.insert(std::string(sealed.substr(0, RecordCipher::NONCE_BYTES))).second);
+            ++records;
+        }
+        // The flush record, k0..k2, after1 and after2.
+        CHECK(records == 6);
+
+        LRUCache reloaded(0, dir + "/snapshot.rdb", aof);
+        std::string value;
+        CHECK(reloaded.size() == 5);
+        CHECK(reloaded.get("after2", value) && value == "v");
+        return true;
+    }
+
+    // A write that fails (the log's descriptor swapped for /dev/full) is
+    // neither acknowledged nor forgotten: the batch stays buffered, writes
+    // are refused until a retry gets it onto the file.
+    bool failedWritesAreKept(const std::string &dir)
+    {
+        std::string path = dir + "/aof.log";
+        AofWriter writer(path, AppendFsync::Always, aofHeader());
+        writer.append("first");
+        CHECK(AofWriter::syncThreadWrites());
+
+        int fd = findFd(path);
+        CHECK(fd >= 0);
+        int saved = ::dup(fd);
+        int full = ::open("/dev/full", O_WRONLY | O_CLOEXEC);
+        CHECK(saved >= 0 && full >= 0);
+        CHECK(::dup2(full, fd) == fd);
+        ::close(full);
+
+        writer.append("second");
+        CHECK(!AofWriter::syncThreadWrites());
+        std::string err;
+        CHECK(writer.writeError(err) && !err.empty());
+        CHECK(!writer.flush());
+        CHECK(readFile(path) == aofHeader() + "first");
+
+        CHECK(::dup2(saved, fd) == fd);
+        ::close(saved);
+        CHECK(writer.flush());
+        CHECK(!writer.writeError(err));
+        CHECK(readFile(path) == aofHeader() + "firstsecond");
+        return true;
+    }
+
+    bool failedWritesAreKeptBlocking(const std::string &dir)
+    {
+        IoBackend backend = ioBackend();
+        setIoBackend(IoBackend::Blocking);
+        bool ok = failedWritesAreKept(dir);
+        setIoBackend(backend);
+        return ok;
+    }
+
+    // A record that could not be sealed is never appended; the writer
+    // refuses writes until its next round and fails the thread that lost
+    // it, whatever the policy.
+    bool lostRecordFailsTheClient(const std::string &dir)
+    {
+        std::string path = dir + "/aof.log";
+        AofWriter writer(path, AppendFsync::EverySec, aofHeader());
+        writer.recordLost("could not seal an AOF record");
+        std::string err;
+        CHECK(writer.writeError(err) && err == "could not seal an AOF record");
+        CHECK(!AofWriter::syncThreadWrites());
+        CHECK(AofWriter::syncThreadWrites());
+        CHECK(readFile(path) == aofHeader());
+
+        // The flusher's next round (within a second) lifts the refusal.
+        for (int i = 0; i < 30 && writer.writeError(err); ++i)
+            ::usleep(100000);
+        CHECK(!writer.writeError(err));
+        return true;
+    }
+
+    // Logs k0..k<n-1> (values v0...) through a cache in `dir` and returns
+    // the file offset at which each record ends.
+    std::vector<uint64_t> writeKeys(const std::string &dir, int n)
+    {
+        {
+            LRUCache cache(0, dir + "/snapshot.rdb", dir + "/aof.log");
+            for (int i = 0; i < n; ++i)
+                cache.set("k" + std::to_string(i), "v" + std::to_string(i));
+            cache.flushAOF();
+        }
+        std::vector<uint64_t> ends;
+        AofReader reader(dir + "/aof.log");
+        char op;
+        std::string_view sealed;
+        while (reader.next(op, sealed))
+            ends.push_back(reader.goodEnd());
+        return ends;
+    }
+
+    // Reopens the cache in `dir`: exactly k0..k<n-1> must be there, and the
+    // log must have been cut back to `size` bytes.
+    bool reloadsKeys(const std::string &dir, int n, uint64_t size)
+    {
+        LRUCache cache(0, dir + "/snapshot.rdb", dir + "/aof.log");
+        CHECK(cache.size() == static_cast<size_t>(n));
+        std::string value;
+        for (int i = 0; i < n; ++i)
+            CHECK(cache.get("k" + std::to_string(i), value) && value == "v" + std::to_string(i));
+        CHECK(std::filesystem::file_size(dir + "/aof.log") == size);
+        return true;
+    }
+
+    // A crash in the middle of appending leaves the last record torn.
+    bool tornFinalRecordIsDropped(const std::string &dir)
+    {
+        std::vector<uint64_t> ends = writeKeys(dir, 5);
+        CHECK(ends.size() == 5);
+        std::filesystem::resize_file(dir + "/aof.log", ends[4] - 3);
+        CHECK(reloadsKeys(dir, 4, ends[3]));
+
+        // Appends go on from the cut.
+        {
+            LRUCache cache(0, dir + "/snapshot.rdb", dir + "/aof.log");
+            CHECK(cache.set("k4", "v4"));
+            cache.flushAOF();
+        }
+        CHECK(reloadsKeys(dir, 5, ends[4]));
+        return true;
+    }
+
+    // A record damaged on disk ends the log there: the records before it
+    // are kept, and nothing after it is trusted.
+    bool badChecksumCutsTheLog(const std::string &dir)
+    {
+        std::vector<uint64_t> ends = writeKeys(dir, 5);
+        CHECK(ends.size() == 5);
+        std::string data = readFile(dir + "/aof.log");
+        data[ends[1] + 5] ^= 0x40; // the CRC of the third record
+        writeFile(dir + "/aof.log", data);
+        CHECK(reloadsKeys(dir, 2, ends[1]));
+        return true;
+    }
+
+    bool trailingGarbageIsDropped(const std::string &dir)
+    {
+        std::vector<uint64_t> ends = writeKeys(dir, 5);
+        CHECK(ends.size() == 5);
+        writeFile(dir + "/aof.log", readFile(dir + "/aof.log") + "\x01garbage that is no record at all");
+        CHECK(reloadsKeys(dir, 5, ends[4]));
+        return true;
+    }
+
+    // A frame whose checksum is right but whose payload fails
+    // authentication was not torn by a crash: it was forged, or the key is
+    // wrong. Startup stops and leaves the file as it is.
+    bool forgedRecordStopsStartup(const std::string &dir)
+    {
+        std::vector<uint64_t> ends = writeKeys(dir, 3);
+        CHECK(ends.size() == 3);
+        std::string forged(AOF_FRAME_BYTES + RecordCipher::sealedSize(16), 'x');
+        sealAofFrame(forged, 's');
+        std::string data = readFile(dir + "/aof.log") + forged;
+        writeFile(dir + "/aof.log", data);
+
+        bool stopped = false;
+        try
+        {
+            LRUCache cache(0, dir + "/snapshot.rdb", dir + "/aof.log");
+        }
+        catch (const std::runtime_error &)
+        {
+            stopped = true;
+        }
+        CHECK(stopped);
+        CHECK(readFile(dir + "/aof.log") == data);
+        return true;
+    }
+
+    // An MSET across several keys is one BATCH_RECORD, replayed all or
+    // nothing: cut anywhere inside it, a restart loads none of the batch.
+    // A batch of one change is logged as that change's own record.
+    bool batchReplaysAtomically(const std::string &dir)
+    {
+        std::string aof = dir + "/aof.log";
+        {
+            LRUCache cache(0, dir + "/snapshot.rdb", aof);
+            CHECK(cache.set("k0", "v0"));
+            CHECK(cache.set("k1", "v1"));
+            cache.beginBatch();
+            for (int i = 0; i < 3; ++i)
+                CHECK(cache.set("m" + std::to_string(i), "batched"));
+            cache.commitBatch();
+            cache.beginBatch();
+            CHECK(cache.set("single", "one"));
+            cache.commitBatch();
+            cache.flushAOF();
+        }
+
+        std::string ops;
+        std::vector<uint64_t> ends;
+        {
+            AofReader reader(aof);
+            char op;
+            std::string_view sealed;
+            while (reader.next(op, sealed))
+            {
+                ops += op;
+                ends.push_back(reader.goodEnd());
+            }
+        }
+        CHECK(ops == "ssms");
+
+        std::string data = readFile(aof);
+        for (uint64_t cut : {ends[1] + AOF_FRAME_BYTES / 2, (ends[1] + ends[2]) / 2, ends[2] - 1})
+        {
+            writeFile(aof, data.substr(0, cut));
+            CHECK(reloadsKeys(dir, 2, ends[1]));
+        }
+
+        writeFile(aof, data);
+        LRUCache cache(0, dir + "/snapshot.rdb", aof);
+        std::string value;
+        CHECK(cache.size() == 6);
+        CHECK(cache.get("m2", value) && value == "batched");
+        CHECK(cache.get("single", value) && value == "one");
+        return true;
+    }
+
+    const TestCase CASES[] = {
+        {"rewrite_nonces_are_unique", rewriteNoncesAreUnique},
+        {"failed_writes_are_kept", failedWritesAreKept},
+        {"failed_writes_are_kept_blocking", failedWritesAreKeptBlocking},
+        {"lost_record_fails_the_client", lostRecordFailsTheClient},
+        {"torn_final_record_is_dropped", tornFinalRecordIsDropped},
+        {"bad_checksum_cuts_the_log", badChecksumCutsTheLog},
+        {"trailing_garbage_is_dropped", trailingGarbageIsDropped},
+        {"forged_record_stops_startup", forgedRecordStopsStartup},
+        {"batch_replays_atomically", batchReplaysAtomically},
+    };
+}
+
+int main()
+{
+    return runTests(CASES);
+}
@@ -0,0 +1,163 @@
+// Keyspace index checks, run by ctest: the incremental rehash and SCAN.
+#include "cache.h"
+#include "sharded_cache.h"
+#include "test.h"
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace
+{
+    // The cache must agree with `model` on every key it ever held.
+    bool matchesModel(LRUCache &cache, const std::map<std::string, std::string> &model, int keys)
+    {
+        CHECK(cache.size() == model.size());
+        std::string value;
+        for (int i = 0; i < keys; ++i)
+        {
+            std::string key = "key:" + std::to_string(i);
+            auto it = model.find(key);
+            bool found = cache.get(key, value);
+            CHECK(found == (it != model.end()));
+            CHECK(!found || value == it->second);
+        }
+        return true;
+    }
+
+    // Lookups, deletes and overwrites while old_index_ still holds entries
+    // next to MOVED markers, across many doublings, checked op by op
+    // against a std::map. A delete there moves the entry into index_ and
+    // backward-shifts it out; a slip would lose some other key silently.
+    bool rehashKeepsEveryKey(const std::string &)
+    {
+        LRUCache cache(0, "", "");
+        std::map<std::string, std::string> model;
+        std::mt19937 rng(20240601);
+        const int KEYS = 40000;
+        size_t during_rehash = 0;
+        std::string value;
+        for (int op = 0; op < 200000; ++op)
+        {
+            std::string key = "key:" + std::to_string(rng() % KEYS);
+            during_rehash += cache.rehashing();
+            switch (rng() % 4)
+            {
+            case 0:
+            case 1:
+            {
+                std::string v = "v" + std::to_string(op);
+                CHECK(cache.set(key, v));
+                model[key] = v;
+                break;
+            }
+            case 2:
+                CHECK(cache.del(key) == (model.erase(key) == 1));
+                break;
+            default:
+            {
+                auto it = model.find(key);
+                bool found = cache.get(key, value);
+                CHECK(found == (it != model.end()));
+                CHECK(!found || value == it->second);
+            }
+            }
+        }
+        // The walk must actually have spent time mid-rehash.
+        CHECK(during_rehash > 1000);
+        return matchesModel(cache, model, KEYS);
+    }
+
+    // Deleting every key in the middle of a rehash, oldest first, leaves an
+    // empty index that still takes new keys.
+    bool rehashSurvivesDeletingEverything(const std::string &)
+    {
+        LRUCache cache(0, "", "");
+        int n = 0;
+        while (n < 100 || !cache.rehashing())
+            CHECK(cache.set("key:" + std::to_string(n++), "v"));
+        for (int i = 0; i < n; ++i)
+            CHECK(cache.del("key:" + std::to_string(i)));
+        CHECK(cache.size() == 0);
+        std::string value;
+        for (int i = 0; i < n; ++i)
+            CHECK(!cache.get("key:" + std::to_string(i), value));
+        CHECK(cache.set("again", "1") && cache.get("again", value) && value == "1");
+        return true;
+    }
+
+    // A shard that goes quiet mid-rehash is finished by activeRehash()
+    // alone; no keyed operation is needed to move the rest.
+    bool activeRehashFinishesQuietShard(const std::string &)
+    {
+        ShardedCache cache(2, 0, "", "");
+        int n = 0;
+        for (; n < 1000 || cache.rehashingShards() == 0; ++n)
+            CHECK(cache.set("key:" + std::to_string(n), "v" + std::to_string(n)));
+        for (int round = 0; round < 100 && cache.rehashingShards() > 0; ++round)
+            cache.activeRehash(std::chrono::microseconds(1000));
+        CHECK(cache.rehashingShards() == 0);
+        std::string value;
+        for (int i = 0; i < n; ++i)
+            CHECK(cache.get("key:" + std::to_string(i), value) && value == "v" + std::to_string(i));
+        return true;
+    }
+
+    // Walks the keyspace with SCAN while inserting other keys between
+    // calls, enough to double the index several times over; every one of
+    // the `base` keys, present for the whole walk, must come back at least
+    // once, and some calls must have landed mid-rehash.
+    template <typename Cache, typename Rehashing>
+    bool scanSeesBaseKeys(Cache &cache, Rehashing rehashing)
+    {
+        const int BASE = 2000;
+        for (int i = 0; i < BASE; ++i)
+            CHECK(cache.set("key:" + std::to_string(i), "v"));
+        std::set<std::string> seen;
+        std::vector<std::string> keys;
+        size_t calls_mid_rehash = 0;
+        int added = 0;
+        uint64_t cursor = 0;
+        do
+        {
+            calls_mid_rehash += rehashing();
+            keys.clear();
+            cursor = cache.scan(cursor, 10, keys);
+            seen.insert(keys.begin(), keys.end());
+            for (int i = 0; i < 100; ++i, ++added)
+                CHECK(cache.set("new:" + std::to_string(added), "v"));
+        } while (cursor != 0);
+        CHECK(added >= 8 * BASE);
+        CHECK(calls_mid_rehash > 0);
+        for (int i = 0; i < BASE; ++i)
+            CHECK(seen.count("key:" + std::to_string(i)) == 1);
+        return true;
+    }
+
+    bool scanSurvivesResizes(const std::string &)
+    {
+        LRUCache cache(0, "", "");
+        return scanSeesBaseKeys(cache, [&] { return cache.rehashing(); });
+    }
+
+    bool shardedScanSurvivesResizes(const std::string &)
+    {
+        ShardedCache cache(4, 0, "", "");
+        return scanSeesBaseKeys(cache, [&] { return cache.rehashingShards() > 0; });
+    }
+
+    const TestCase CASES[] = {
+        {"rehash_keeps_every_key", rehashKeepsEveryKey},
+        {"rehash_survives_deleting_everything", rehashSurvivesDeletingEverything},
+        {"active_rehash_finishes_quiet_shard", activeRehashFinishesQuietShard},
+        {"scan_survives_resizes", scanSurvivesResizes},
+        {"sharded_scan_survives_resizes", shardedScanSurvivesResizes},
+    };
+}
+
+int main()
+{
+    return runTests(CASES);
+}
@@ -0,0 +1,443 @@
+// Replication checks, run by ctest: a master and a replica as two server
+// processes on loopback. The replica reaches the master through a small
+// proxy in this process, which can drop the link and sees what the master
+// answers to PSYNC. Usage: redis-lite-replication-test <redis-lite binary>
+#include "test.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    std::string g_server; // path of the redis-lite binary
+
+    int listenLoopback(uint16_t port)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || ::listen(fd, 16) < 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    uint16_t boundPort(int fd)
+    {
+        sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len);
+        return ntohs(addr.sin_port);
+    }
+
+    // A port nobody listens on right now, for a server to take.
+    uint16_t freePort()
+    {
+        int fd = listenLoopback(0);
+        uint16_t port = boundPort(fd);
+        ::close(fd);
+        return port;
+    }
+
+    int connectLoopback(uint16_t port)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    bool waitFor(const std::function<bool()> &ready, int seconds = 10)
+    {
+        auto until = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+        while (!ready())
+        {
+            if (std::chrono::steady_clock::now() >= until)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return true;
+    }
+
+    // A server process in its own directory, logging to server.log there.
+    class ServerProcess
+    {
+    public:
+        ~ServerProcess()
+        {
+            if (pid_ > 0)
+            {
+                ::kill(pid_, SIGKILL);
+                ::waitpid(pid_, nullptr, 0);
+            }
+        }
+
+        bool start(const std::string &dir, uint16_t port, std::vector<std::string> extra = {})
+        {
+            std::filesystem::create_directories(dir);
+            std::vector<std::string> args = {g_server, "0", "--port", std::to_string(port)};
+            args.insert(args.end(), extra.begin(), extra.end());
+            pid_ = ::fork();
+            if (pid_ < 0)
+                return false;
+            if (pid_ == 0)
+            {
+                int log = ::open((dir + "/server.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (::chdir(dir.c_str()) < 0 || log < 0)
+                    ::_exit(127);
+                ::dup2(log, 1);
+                ::dup2(log, 2);
+                std::vector<char *> argv;
+                for (std::string &a : args)
+                    argv.push_back(&a[0]);
+                argv.push_back(nullptr);
+                ::execv(argv[0], argv.data());
+                ::_exit(127);
+            }
+            return true;
+        }
+
+    private:
+        pid_t pid_ = -1;
+    };
+
+    // Just enough of a RESP client: one command at a time, and a reply is
+    // returned as its first line ("+OK", "-ERR ...", ":1") or, for a bulk
+    // string, its contents ("(nil)" for a missing one).
+    class Client
+    {
+    public:
+        ~Client()
+        {
+            if (fd_ >= 0)
+                ::close(fd_);
+        }
+
+        bool connect(uint16_t port)
+        {
+            return waitFor([&]
+                           { return (fd_ = connectLoopback(port)) >= 0; });
+        }
+
+        std::string command(std::initializer_list<std::string> argv)
+        {
+            std::string out = "*" + std::to_string(argv.size()) + "\r\n";
+            for (const std::string &arg : argv)
+                out += "$" + std::to_string(arg.size()) + "\r\n" + arg + "\r\n";
+            if (::send(fd_, out.data(), out.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(out.size()))
+                return "(error)";
+            std::string line;
+            if (!readLine(line))
+                return "(error)";
+            if (line[0] != '$')
+                return line;
+            long long len = std::stoll(line.substr(1));
+            if (len < 0)
+                return "(nil)";
+            while (buf_.size() < static_cast<size_t>(len) + 2)
+                if (!fill())
+                    return "(error)";
+            std::string value = buf_.substr(0, static_cast<size_t>(len));
+            buf_.erase(0, static_cast<size_t>(len) + 2);
+            return value;
+        }
+
+    private:
+        int fd_ = -1;
+        std::string buf_;
+
+        bool fill()
+        {
+            char chunk[4096];
+            ssize_t n = ::recv(fd_, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return false;
+            buf_.append(chunk, static_cast<size_t>(n));
+            return true;
+        }
+
+        bool readLine(std::string &line)
+        {
+            size_t eol;
+            while ((eol = buf_.find("\r\n")) == std::string::npos)
+                if (!fill())
+                    return false;
+            line = buf_.substr(0, eol);
+            buf_.erase(0, eol + 2);
+            return !line.empty();
+        }
+    };
+
+    // Forwards connections from its own port to `target`, keeping a copy of
+    // everything the target sent. dropLinks() cuts every open connection.
+    class Proxy
+    {
+    public:
+        explicit Proxy(uint16_t target) : target_(target)
+        {
+            listen_fd_ = listenLoopback(0);
+            port_ = boundPort(listen_fd_);
+            thread_ = std::thread([this]
+                                  { run(); });
+        }
+
+        ~Proxy()
+        {
+            stop_ = true;
+            thread_.join();
+            closeLinks();
+            ::close(listen_fd_);
+        }
+
+        uint16_t port() const noexcept { return port_; }
+        void dropLinks() { drop_ = true; }
+
+        // How often `what` occurs in what the target sent so far.
+        size_t seen(const std::string &what)
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            size_t n = 0;
+            for (size_t pos = 0; (pos = from_target_.find(what, pos)) != std::string::npos; pos += what.size())
+                ++n;
+            return n;
+        }
+
+    private:
+        uint16_t target_;
+        uint16_t port_ = 0;
+        int listen_fd_ = -1;
+        std::vector<std::pair<int, int>> links_; // client side, target side
+        std::atomic<bool> stop_{false};
+        std::atomic<bool> drop_{false};
+        std::mutex mu_;
+        std::string from_target_;
+        std::thread thread_;
+
+        void closeLinks()
+        {
+            for (auto &link : links_)
+            {
+                ::close(link.first);
+                ::close(link.second);
+            }
+            links_.clear();
+        }
+
+        // Copies what `from` has to `to`; false once either side is gone.
+        bool pump(int from, int to, bool from_target)
+        {
+            char chunk[65536];
+            ssize_t n = ::recv(from, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return false;
+            if (from_target)
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                from_target_.append(chunk, static_cast<size_t>(n));
+            }
+            for (ssize_t sent = 0; sent < n;)
+            {
+                ssize_t w = ::send(to, chunk + sent, static_cast<size_t>(n - sent), MSG_NOSIGNAL);
+                if (w <= 0)
+                    return false;
+                sent += w;
+            }
+            return true;
+        }
+
+        void run()
+        {
+            while (!stop_)
+            {
+                if (drop_.exchange(false))
+                    closeLinks();
+                std::vector<pollfd> fds = {{listen_fd_, POLLIN, 0}};
+                for (auto &link : links_)
+                {
+                    fds.push_back({link.first, POLLIN, 0});
+                    fds.push_back({link.second, POLLIN, 0});
+                }
+                if (::poll(fds.data(), fds.size(), 50) <= 0)
+                    continue;
+                if (fds[0].revents & POLLIN)
+                {
+                    int client = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+                    int target = client >= 0 ? connectLoopback(target_) : -1;
+                    if (target >= 0)
+                        links_.emplace_back(client, target);
+                    else if (client >= 0)
+                        ::close(client);
+                }
+                for (size_t i = 0; i < links_.size(); ++i)
+                {
+                    short in = fds[1 + 2 * i].revents, out = fds[2 + 2 * i].revents;
+                    bool ok = true;
+                    if (in & (POLLIN | POLLHUP | POLLERR))
+                        ok = pump(links_[i].first, links_[i].second, false);
+                    if (ok && (out & (POLLIN | POLLHUP | POLLERR)))
+                        ok = pump(links_[i].second, links_[i].first, true);
+                    if (!ok)
+                    {
+                        ::close(links_[i].first);
+                        ::close(links_[i].second);
+                        links_[i].first = links_[i].second = -1;
+                    }
+                }
+                for (size_t i = links_.size(); i-- > 0;)
+                    if (links_[i].first < 0)
+                        links_.erase(links_.begin() + static_cast<long>(i));
+            }
+        }
+    };
+
+    std::string infoField(Client &client, const std::string &section, const std::string &field)
+    {
+        std::string info = client.command({"INFO", section});
+        size_t at = info.find(field + ":");
+        if (at == std::string::npos)
+            return "";
+        size_t start = at + field.size() + 1;
+        return info.substr(start, info.find("\r\n", start) - start);
+    }
+
+    // A master with keys already in it, and a replica started after them
+    // behind a proxy; both connected to.
+    struct Pair
+    {
+        uint16_t master_port = freePort();
+        uint16_t replica_port = freePort();
+        ServerProcess master_process;
+        ServerProcess replica_process;
+        Client master;
+        Client replica;
+        std::unique_ptr<Proxy> proxy;
+
+        bool start(const std::string &dir, size_t preloaded, std::vector<std::string> replica_args = {})
+        {
+            CHECK(master_process.start(dir + "/master", master_port));
+            CHECK(master.connect(master_port));
+            for (size_t i = 0; i < preloaded; ++i)
+                CHECK(master.command({"SET", "pre" + std::to_string(i), "v" + std::to_string(i)}) == "+OK");
+            proxy = std::make_unique<Proxy>(master_port);
+            replica_args.insert(replica_args.end(), {"--replicaof", "127.0.0.1", std::to_string(proxy->port())});
+            CHECK(replica_process.start(dir + "/replica", replica_port, replica_args));
+            CHECK(replica.connect(replica_port));
+            CHECK(waitFor([&]
+                          { return infoField(replica, "replication", "master_link_status") == "up" &&
+                                   infoField(replica, "replication", "master_sync_in_progress") == "0"; }));
+            return true;
+        }
+    };
+
+    // The snapshot of what the master held brings the replica up to date,
+    // later writes follow as a stream, and the replica's own clients may
+    // only read.
+    bool fullSyncThenStream(const std::string &dir)
+    {
+        Pair pair;
+        CHECK(pair.start(dir, 500));
+        CHECK(pair.proxy->seen("+FULLRESYNC") == 1);
+        for (size_t i = 0; i < 500; i += 37)
+            CHECK(pair.replica.command({"GET", "pre" + std::to_string(i)}) == "v" + std::to_string(i));
+
+        CHECK(pair.master.command({"SET", "live", "1"}) == "+OK");
+        CHECK(pair.master.command({"DEL", "pre0"}) == ":1");
+        CHECK(waitFor([&]
+                      { return pair.replica.command({"GET", "live"}) == "1"; }));
+        CHECK(waitFor([&]
+                      { return pair.replica.command({"GET", "pre0"}) == "(nil)"; }));
+
+        std::string reply = pair.replica.command({"SET", "mine", "x"});
+        CHECK(reply.compare(0, 9, "-READONLY") == 0);
+        CHECK(pair.replica.command({"GET", "mine"}) == "(nil)");
+        CHECK(pair.master.command({"GET", "mine"}) == "(nil)");
+        return true;
+    }
+
+    // A replica that loses its link while the backlog still holds what it
+    // missed is sent only that: +CONTINUE, no second snapshot.
+    bool resumeAfterLinkDrop(const std::string &dir)
+    {
+        Pair pair;
+        CHECK(pair.start(dir, 10));
+        CHECK(pair.master.command({"SET", "before", "1"}) == "+OK");
+        CHECK(waitFor([&]
+                      { return pair.replica.command({"GET", "before"}) == "1"; }));
+
+        pair.proxy->dropLinks();
+        CHECK(waitFor([&]
+                      { return infoField(pair.replica, "replication", "master_link_status") == "down"; }));
+        CHECK(pair.master.command({"SET", "missed", "2"}) == "+OK");
+
+        CHECK(waitFor([&]
+                      { return pair.proxy->seen("+CONTINUE") == 1; }));
+        CHECK(waitFor([&]
+                      { return pair.replica.command({"GET", "missed"}) == "2"; }));
+        CHECK(pair.proxy->seen("+FULLRESYNC") == 1);
+        CHECK(pair.replica.command({"GET", "pre3"}) == "v3");
+        return true;
+    }
+
+    // A replica with less memory than the master still holds all of the
+    // master's keys: what goes is the master's call.
+    bool replicaDoesNotEvict(const std::string &dir)
+    {
+        Pair pair;
+        CHECK(pair.start(dir, 0, {"--maxmemory", "100000"}));
+        std::string value(200, 'v');
+        for (int i = 0; i < 2000; ++i)
+            CHECK(pair.master.command({"SET", "k" + std::to_string(i), value}) == "+OK");
+        CHECK(waitFor([&]
+                      { return pair.replica.command({"GET", "k1999"}) == value; }));
+        for (int i = 0; i < 2000; i += 97)
+            CHECK(pair.replica.command({"GET", "k" + std::to_string(i)}) == value);
+        CHECK(infoField(pair.replica, "stats", "evicted_keys") == "0");
+        return true;
+    }
+
+    const TestCase CASES[] = {
+        {"full_sync_then_stream", fullSyncThenStream},
+        {"resume_after_link_drop", resumeAfterLinkDrop},
+        {"replica_does_not_evict", replicaDoesNotEvict},
+    };
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr, "usage: %s <redis-lite binary>\n", argv[0]);
+        return 2;
+    }
+    g_server = std::filesystem::absolute(argv[1]).string();
+    return runTests(CASES);
+}
@@ -0,0 +1,80 @@
+// RESP parser checks, run by ctest.
+#include "resp.h"
+#include "test.h"
+#include <string_view>
+#include <vector>
+
+namespace
+{
+    bool pipelinedCommands(const std::string &)
+    {
+        RespParser parser;
+        std::vector<std::string_view> argv;
+        std::string_view buf = "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$5\r\nvalue\r\n*2\r\n$3\r\nGET\r\n$1\r\nk\r\n";
+        size_t pos = 0;
+        CHECK(parser.parse(buf, pos, argv) == RespParser::Status::Complete);
+        CHECK(argv.size() == 3 && argv[0] == "SET" && argv[1] == "k" && argv[2] == "value");
+        CHECK(parser.parse(buf, pos, argv) == RespParser::Status::Complete);
+        CHECK(argv.size() == 2 && argv[0] == "GET" && argv[1] == "k");
+        CHECK(pos == buf.size());
+        CHECK(parser.parse(buf, pos, argv) == RespParser::Status::Incomplete);
+        return true;
+    }
+
+    // Fed a byte at a time, the command completes once and only at its end.
+    bool tricklingCommand(const std::string &)
+    {
+        RespParser parser;
+        std::vector<std::string_view> argv;
+        std::string_view full = "*2\r\n$4\r\nECHO\r\n$11\r\nhello world\r\n";
+        for (size_t n = 1; n < full.size(); ++n)
+        {
+            size_t pos = 0;
+            CHECK(parser.parse(full.substr(0, n), pos, argv) == RespParser::Status::Incomplete);
+            CHECK(pos == 0);
+        }
+        size_t pos = 0;
+        CHECK(parser.parse(full, pos, argv) == RespParser::Status::Complete);
+        CHECK(argv.size() == 2 && argv[1] == "hello world");
+        return true;
+    }
+
+    // A length prefix that does not match the data is an error, whether it
+    // is too short or too long.
+    bool wrongBulkLength(const std::string &)
+    {
+        RespParser parser;
+        std::vector<std::string_view> argv;
+        size_t pos = 0;
+        CHECK(parser.parse("*1\r\n$2\r\nPING\r\n", pos, argv) == RespParser::Status::Error);
+        pos = 0;
+        CHECK(parser.parse("*2\r\n$4\r\nPI\r\n$1\r\nx\r\n", pos, argv) == RespParser::Status::Error);
+        // The parser starts over cleanly afterwards.
+        pos = 0;
+        CHECK(parser.parse("*1\r\n$4\r\nPING\r\n", pos, argv) == RespParser::Status::Complete);
+        CHECK(argv.size() == 1 && argv[0] == "PING");
+        return true;
+    }
+
+    bool inlineCommand(const std::string &)
+    {
+        RespParser parser;
+        std::vector<std::string_view> argv;
+        size_t pos = 0;
+        CHECK(parser.parse("SET  k\tv\r\n", pos, argv) == RespParser::Status::Complete);
+        CHECK(argv.size() == 3 && argv[0] == "SET" && argv[2] == "v");
+        return true;
+    }
+
+    const TestCase CASES[] = {
+        {"pipelined_commands", pipelinedCommands},
+        {"trickling_command", tricklingCommand},
+        {"wrong_bulk_length", wrongBulkLength},
+        {"inline_command", inlineCommand},
+    };
+}
+
+int main()
+{
+    return runTests(CASES);
+}
@@ -0,0 +1,66 @@
+// test.h — the little the ctest programs share: CHECK, a scratch
+// directory per case and a runner that reports each case.
+#pragma once
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unistd.h>
+
+// Fails the enclosing case (a function returning bool) and says where.
+#define CHECK(cond)                                                                       \
+    do                                                                                    \
+    {                                                                                     \
+        if (!(cond))                                                                      \
+        {                                                                                 \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            return false;                                                                 \
+        }                                                                                 \
+    } while (0)
+
+struct TestCase
+{
+    const char *name;
+    bool (*run)(const std::string &dir);
+};
+
+inline std::string makeTempDir()
+{
+    char tmpl[] = "/tmp/redis-lite-test.XXXXXX";
+    const char *dir = ::mkdtemp(tmpl);
+    return dir ? dir : "";
+}
+
+inline std::string readFile(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+inline void writeFile(const std::string &path, const std::string &data)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << data;
+}
+
+// Runs every case in a fresh temporary directory, removed afterwards.
+// Returns the exit status for main().
+template <size_t N>
+int runTests(const TestCase (&cases)[N])
+{
+    int failed = 0;
+    for (const TestCase &c : cases)
+    {
+        std::string dir = makeTempDir();
+        bool ok = !dir.empty() && c.run(dir);
+        std::printf("%-40s %s\n", c.name, ok ? "ok" : "FAILED");
+        std::fflush(stdout);
+        failed += ok ? 0 : 1;
+        if (!dir.empty())
+            std::filesystem::remove_all(dir);
+    }
+    return failed == 0 ? 0 : 1;
+}